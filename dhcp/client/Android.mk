@@ -5,11 +5,14 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := \
 	dhcpclient.cpp \
 	interface.cpp \
+	lease_cache.cpp \
 	main.cpp \
 	router.cpp \
 	timer.cpp \
 	../common/message.cpp \
+	../common/packet_builder.cpp \
 	../common/socket.cpp \
+	../common/utils.cpp \
 
 
 LOCAL_CPPFLAGS += -Werror -Wno-error=implicit-fallthrough
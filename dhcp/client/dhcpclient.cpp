@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <linux/if_ether.h>
 #include <poll.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cutils/properties.h>
@@ -31,6 +32,12 @@
 
 // The initial retry timeout for DHCP is 4000 milliseconds
 static const uint32_t kInitialTimeout = 4000;
+// The initial retry timeout when fast retransmission is enabled
+static const uint32_t kFastInitialTimeout = 500;
+// When trying to reuse a cached lease, stop trying and start over with a
+// discovery once the retry timeout has grown to this many milliseconds. The
+// server is either not there or it has forgotten about us.
+static const uint32_t kMaxRebootTimeout = 4000;
 // The maximum retry timeout for DHCP is 64000 milliseconds
 static const uint32_t kMaxTimeout = 64000;
 // A specific value that indicates that no timeout should happen and that
@@ -50,12 +57,16 @@ static std::string addrToStr(in_addr_t address) {
     return inet_ntop(AF_INET, &addr, buffer, sizeof(buffer));
 }
 
-DhcpClient::DhcpClient()
+DhcpClient::DhcpClient(uint32_t options, const char* leaseFile)
     : mRandomEngine(std::random_device()()),
       mRandomDistribution(-kTimeoutSpan, kTimeoutSpan),
-      mState(State::Init),
-      mNextTimeout(kInitialTimeout),
-      mFuzzNextTimeout(true) {
+      mState(State::InitReboot),
+      mFuzzNextTimeout(true),
+      mOptions(options),
+      mInitialTimeout((options & kOptionFastRetransmit) ? kFastInitialTimeout
+                                                         : kInitialTimeout),
+      mLeaseCache(leaseFile) {
+    mNextTimeout = mInitialTimeout;
 }
 
 Result DhcpClient::init(const char* interfaceName) {
@@ -105,10 +116,31 @@ Result DhcpClient::run() {
         // also lead to instant state changes without any polling. The new state
         // will then be evaluated instead, most likely leading to polling.
         switch (mState) {
+            case State::InitReboot:
+                // The starting state. If the client remembers a lease that
+                // is still valid it asks for that address again, skipping
+                // the discovery. Otherwise it starts from scratch.
+                if (mLeaseCache.load(&mRequestAddress)) {
+                    setNextState(State::Rebooting);
+                } else {
+                    setNextState(State::Init);
+                }
+                break;
+            case State::Rebooting:
+                // In the rebooting state the client broadcasts a request for
+                // its previous address without naming a server. Any server
+                // that knows about the lease can acknowledge it. If nobody
+                // answers within a few attempts the client starts over.
+                if (mNextTimeout >= kMaxRebootTimeout) {
+                    setNextState(State::Init);
+                } else {
+                    sendDhcpRequest(INADDR_ANY);
+                    increaseTimeout();
+                }
+                break;
             case State::Init:
-                // The starting state. This is the state the client is in when
-                // it first starts. It's also the state that the client returns
-                // to when things go wrong in other states.
+                // This is the state that the client returns to when things go
+                // wrong in other states or when there is no previous lease.
                 setNextState(State::Selecting);
                 break;
             case State::Selecting:
@@ -192,6 +224,10 @@ const char* DhcpClient::stateToStr(State state) {
     switch (state) {
         case State::Init:
             return "Init";
+        case State::InitReboot:
+            return "InitReboot";
+        case State::Rebooting:
+            return "Rebooting";
         case State::Selecting:
             return "Selecting";
         case State::Requesting:
@@ -240,7 +276,15 @@ void DhcpClient::waitAndReceive(const sigset_t& pollSignalMask) {
                 uint8_t msgType = msg.type();
                 switch (mState) {
                     case State::Selecting:
-                        if (msgType == DHCPOFFER) {
+                        if (msgType == DHCPACK &&
+                            (mOptions & kOptionRapidCommit) &&
+                            msg.hasRapidCommit()) {
+                            // The server committed to a lease right away,
+                            // there is no need to request it.
+                            if (bind(msg)) {
+                                return;
+                            }
+                        } else if (msgType == DHCPOFFER) {
                             // Received an offer, move to the Requesting state
                             // to request it.
                             mServerAddress = msg.serverId();
@@ -249,6 +293,7 @@ void DhcpClient::waitAndReceive(const sigset_t& pollSignalMask) {
                             return;
                         }
                         break;
+                    case State::Rebooting:
                     case State::Requesting:
                     case State::Renewing:
                     case State::Rebinding:
@@ -256,9 +301,7 @@ void DhcpClient::waitAndReceive(const sigset_t& pollSignalMask) {
                         // now waiting for an ACK so the behavior is the same.
                         if (msgType == DHCPACK) {
                             // Request approved
-                            if (configureDhcp(msg)) {
-                                // Successfully configured DHCP, move to Bound
-                                setNextState(State::Bound);
+                            if (bind(msg)) {
                                 return;
                             }
                             // Unable to configure DHCP, keep sending requests.
@@ -268,6 +311,7 @@ void DhcpClient::waitAndReceive(const sigset_t& pollSignalMask) {
                             // the issue but at least the client keeps trying.
                         } else if (msgType == DHCPNAK) {
                             // Request denied, halt network and start over
+                            mLeaseCache.clear();
                             haltNetwork();
                             setNextState(State::Init);
                             return;
@@ -456,6 +500,30 @@ bool DhcpClient::configureDhcp(const Message& msg) {
     return true;
 }
 
+bool DhcpClient::bind(const Message& msg) {
+    if (!configureDhcp(msg)) {
+        return false;
+    }
+    // An ack received while rebooting or through rapid commit is the first
+    // message from the server, renewals should go to the server that sent it.
+    in_addr_t serverId = msg.serverId();
+    if (serverId != INADDR_ANY) {
+        mServerAddress = serverId;
+    }
+    mRequestAddress = mDhcpInfo.offeredAddress;
+
+    Result res = mLeaseCache.store(mDhcpInfo.offeredAddress,
+                                   ::time(nullptr) + mDhcpInfo.leaseTime);
+    if (!res) {
+        // Not fatal, the next start just has to do a full discovery
+        ALOGW("Unable to cache lease: %s", res.c_str());
+    }
+
+    // Successfully configured DHCP, move to Bound
+    setNextState(State::Bound);
+    return true;
+}
+
 void DhcpClient::haltNetwork() {
     Result res = mInterface.setAddress(0);
     if (!res) {
@@ -484,6 +552,12 @@ uint32_t DhcpClient::calculateTimeoutMillis() {
         return mNextTimeout;
     }
     int adjustment = mRandomDistribution(mRandomEngine);
+    if (mNextTimeout < kInitialTimeout) {
+        // Shorter timeouts than the standard ones only happen with fast
+        // retransmission, scale the variation down with them.
+        adjustment = static_cast<int>(
+            static_cast<int64_t>(adjustment) * mNextTimeout / kInitialTimeout);
+    }
     if (adjustment < 0 && static_cast<uint32_t>(-adjustment) > mNextTimeout) {
         // Underflow, return a timeout of zero milliseconds
         return 0;
@@ -493,7 +567,7 @@ uint32_t DhcpClient::calculateTimeoutMillis() {
 
 void DhcpClient::increaseTimeout() {
     if (mNextTimeout == kNoTimeout) {
-        mNextTimeout = kInitialTimeout;
+        mNextTimeout = mInitialTimeout;
     } else {
         if (mNextTimeout < kMaxTimeout) {
             mNextTimeout *= 2;
@@ -522,7 +596,8 @@ void DhcpClient::sendDhcpRequest(in_addr_t destination) {
 
 void DhcpClient::sendDhcpDiscover() {
     if (kDebug) ALOGD("Sending DHCPDISCOVER");
-    mLastMsg = Message::discover(mInterface.getMacAddress());
+    mLastMsg = Message::discover(mInterface.getMacAddress(),
+                                 (mOptions & kOptionRapidCommit) != 0);
     sendMessage(mLastMsg);
 }
 
@@ -16,6 +16,7 @@
 #pragma once
 
 #include "interface.h"
+#include "lease_cache.h"
 #include "message.h"
 #include "result.h"
 #include "router.h"
@@ -27,10 +28,20 @@
 
 #include <random>
 
+// Options for the DHCP client, combine them with bitwise or
+// Ask servers to skip the offer and acknowledge a discovery right away
+static const uint32_t kOptionRapidCommit = 1 << 0;
+// Retransmit quickly, for virtual links where replies arrive within
+// milliseconds and waiting the full retransmission timeout only delays
+// getting the network up.
+static const uint32_t kOptionFastRetransmit = 1 << 1;
 
 class DhcpClient {
 public:
-    DhcpClient();
+    // Construct a DHCP client with |options| from the list above. The most
+    // recent lease is kept in |leaseFile| so that the client can ask for the
+    // same address when it's restarted, this may be null to not keep it.
+    DhcpClient(uint32_t options, const char* leaseFile);
 
     // Initialize the DHCP client to listen on |interfaceName|.
     Result init(const char* interfaceName);
@@ -38,6 +49,8 @@ public:
 private:
     enum class State {
         Init,
+        InitReboot,
+        Rebooting,
         Selecting,
         Requesting,
         Bound,
@@ -57,6 +70,9 @@ private:
     void setNextState(State state);
     // Configure network interface based on the DHCP configuration in |msg|.
     bool configureDhcp(const Message& msg);
+    // Apply the configuration in |msg| and move to the Bound state, returns
+    // false if the configuration could not be applied.
+    bool bind(const Message& msg);
     // Halt network operations on the network interface for when configuration
     // is not possible and the protocol demands it.
     void haltNetwork();
@@ -95,6 +111,9 @@ private:
     State mState;
     uint32_t mNextTimeout;
     bool mFuzzNextTimeout;
+    uint32_t mOptions;
+    uint32_t mInitialTimeout;
+    LeaseCache mLeaseCache;
 
     in_addr_t mRequestAddress; // Address we'd like to use in requests
     in_addr_t mServerAddress;  // Server to send request to
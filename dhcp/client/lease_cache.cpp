@@ -0,0 +1,85 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lease_cache.h"
+
+#include "log.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+LeaseCache::LeaseCache(const char* path) : mPath(path ? path : "") {
+}
+
+bool LeaseCache::load(in_addr_t* address) const {
+    if (mPath.empty()) {
+        return false;
+    }
+    FILE* file = ::fopen(mPath.c_str(), "re");
+    if (file == nullptr) {
+        if (errno != ENOENT) {
+            ALOGW("Unable to open lease cache '%s': %s",
+                  mPath.c_str(), strerror(errno));
+        }
+        return false;
+    }
+    char addressString[INET_ADDRSTRLEN];
+    int64_t expiry = 0;
+    int fields = ::fscanf(file, "%15s %" SCNd64, addressString, &expiry);
+    ::fclose(file);
+
+    struct in_addr addr;
+    if (fields != 2 || ::inet_pton(AF_INET, addressString, &addr) != 1) {
+        ALOGW("Ignoring malformed lease cache '%s'", mPath.c_str());
+        return false;
+    }
+    if (expiry <= static_cast<int64_t>(::time(nullptr))) {
+        return false;
+    }
+    *address = addr.s_addr;
+    return true;
+}
+
+Result LeaseCache::store(in_addr_t address, time_t expiry) const {
+    if (mPath.empty()) {
+        return Result::success();
+    }
+    char addressString[INET_ADDRSTRLEN];
+    struct in_addr addr = { address };
+    ::inet_ntop(AF_INET, &addr, addressString, sizeof(addressString));
+    char contents[64];
+    int length = snprintf(contents, sizeof(contents), "%s %" PRId64 "\n",
+                          addressString, static_cast<int64_t>(expiry));
+
+    // Write a new file and rename it over the old one so that a crash never
+    // leaves a partially written lease behind.
+    return replaceFile(mPath, std::string(contents, length), "lease cache");
+}
+
+void LeaseCache::clear() const {
+    if (mPath.empty()) {
+        return;
+    }
+    if (::unlink(mPath.c_str()) != 0 && errno != ENOENT) {
+        ALOGW("Unable to remove lease cache '%s': %s",
+              mPath.c_str(), strerror(errno));
+    }
+}
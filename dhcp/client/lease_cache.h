@@ -0,0 +1,47 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "result.h"
+
+#include <netinet/in.h>
+#include <time.h>
+
+#include <string>
+
+// The address of the most recent lease, stored in a file so that it survives
+// restarts of the client and reboots. A client that finds an unexpired lease
+// here can ask for the same address again instead of starting over with a
+// discovery.
+class LeaseCache {
+public:
+    // Store the lease in the file at |path|. If |path| is null or empty
+    // nothing is stored and no lease is ever found.
+    explicit LeaseCache(const char* path);
+
+    // Get the cached lease |address| if there is one that has not expired
+    // yet. Returns false if there is no usable lease.
+    bool load(in_addr_t* address) const;
+    // Replace the cached lease with |address| which expires at the wall clock
+    // time |expiry|.
+    Result store(in_addr_t address, time_t expiry) const;
+    // Forget the cached lease, for example when the server rejected it.
+    void clear() const;
+
+private:
+    std::string mPath;
+};
@@ -18,7 +18,8 @@
 #include "log.h"
 
 static void usage(const char* program) {
-    ALOGE("Usage: %s -i <interface>", program);
+    ALOGE("Usage: %s -i <interface> [--lease-file <path>] [--rapid-commit] "
+          "[--fast-retransmit]", program);
 }
 
 int main(int argc, char* argv[]) {
@@ -27,6 +28,8 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     const char* interfaceName = nullptr;
+    const char* leaseFile = nullptr;
+    uint32_t options = 0;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-i") == 0) {
@@ -37,6 +40,18 @@ int main(int argc, char* argv[]) {
                 usage(argv[0]);
                 return 1;
             }
+        } else if (strcmp(argv[i], "--lease-file") == 0) {
+            if (i + 1 < argc) {
+                leaseFile = argv[++i];
+            } else {
+                ALOGE("ERROR: --lease-file parameter needs an argument");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--rapid-commit") == 0) {
+            options |= kOptionRapidCommit;
+        } else if (strcmp(argv[i], "--fast-retransmit") == 0) {
+            options |= kOptionFastRetransmit;
         } else {
             ALOGE("ERROR: unknown parameters %s", argv[i]);
             usage(argv[0]);
@@ -49,7 +64,7 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    DhcpClient client;
+    DhcpClient client(options, leaseFile);
     Result res = client.init(interfaceName);
     if (!res) {
         ALOGE("Failed to initialize DHCP client: %s\n", res.c_str());
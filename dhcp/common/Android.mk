@@ -0,0 +1,30 @@
+LOCAL_PATH := $(call my-dir)
+
+# Checks packet_builder.cpp against the byte-pair checksum loop it replaced
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	packet_builder.cpp \
+	tests/packet_builder_test.cpp \
+
+
+LOCAL_CPPFLAGS += -Werror
+LOCAL_MODULE := dhcp-packet-builder-tests
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_NATIVE_TEST)
+
+
+# Measures the same, see tests/checksum_benchmark.cpp
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	packet_builder.cpp \
+	tests/checksum_benchmark.cpp \
+
+
+LOCAL_CPPFLAGS += -Werror
+LOCAL_MODULE := dhcp-checksum-benchmark
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -57,6 +57,7 @@
 #define OPT_T2               59    // 4 <rebinding time value>
 #define OPT_CLASS_ID         60    // n <opaque>
 #define OPT_CLIENT_ID        61    // n <opaque>
+#define OPT_RAPID_COMMIT     80    // 0 - see RFC 4039
 #define OPT_END              255
 
 // DHCP message types
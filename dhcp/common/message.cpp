@@ -25,9 +25,6 @@ static uint32_t sNextTransactionId = 1;
 
 static const ptrdiff_t kOptionOffset = 7;
 
-// The default lease time in seconds
-static const uint32_t kDefaultLeaseTime = 10 * 60;
-
 // The parameters that the client would like to receive from the server
 static const uint8_t kRequestParameters[] = { OPT_SUBNET_MASK,
                                               OPT_GATEWAY,
@@ -53,12 +50,16 @@ Message::Message(const uint8_t* data, size_t size) {
     }
 }
 
-Message Message::discover(const uint8_t (&sourceMac)[ETH_ALEN]) {
+Message Message::discover(const uint8_t (&sourceMac)[ETH_ALEN],
+                          bool rapidCommit) {
     Message message(OP_BOOTREQUEST,
                     sourceMac,
                     static_cast<uint8_t>(DHCPDISCOVER));
 
     message.addOption(OPT_PARAMETER_LIST, kRequestParameters);
+    if (rapidCommit) {
+        message.addOption(OPT_RAPID_COMMIT, nullptr, 0);
+    }
     message.endOptions();
 
     return message;
@@ -74,7 +75,9 @@ Message Message::request(const uint8_t (&sourceMac)[ETH_ALEN],
 
     message.addOption(OPT_PARAMETER_LIST, kRequestParameters);
     message.addOption(OPT_REQUESTED_IP, requestAddress);
-    message.addOption(OPT_SERVER_ID, serverAddress);
+    if (serverAddress != INADDR_ANY) {
+        message.addOption(OPT_SERVER_ID, serverAddress);
+    }
     message.endOptions();
 
     return message;
@@ -226,6 +229,11 @@ in_addr_t Message::serverId() const {
     return 0;
 }
 
+bool Message::hasRapidCommit() const {
+    uint8_t length = 0;
+    return getOption(OPT_RAPID_COMMIT, &length) != nullptr;
+}
+
 in_addr_t Message::requestedIp() const {
     uint8_t length = 0;
     const uint8_t* opt = getOption(OPT_REQUESTED_IP, &length);
@@ -270,8 +278,10 @@ void Message::addOption(uint8_t type, const void* data, uint8_t size) {
 
     *opts++ = type;
     *opts++ = size;
-    memcpy(opts, data, size);
-    opts += size;
+    if (size > 0) {
+        memcpy(opts, data, size);
+        opts += size;
+    }
 
     updateSize(opts);
 }
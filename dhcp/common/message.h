@@ -18,15 +18,24 @@
 #include <linux/if_ether.h>
 #include <netinet/in.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <initializer_list>
 
+// The default lease time in seconds
+static const uint32_t kDefaultLeaseTime = 10 * 60;
+
 class Message {
 public:
     Message();
     Message(const uint8_t* data, size_t size);
-    static Message discover(const uint8_t (&sourceMac)[ETH_ALEN]);
+    // Create a discover message, if |rapidCommit| is true the message asks
+    // the server to reply with an ack right away instead of an offer.
+    static Message discover(const uint8_t (&sourceMac)[ETH_ALEN],
+                            bool rapidCommit = false);
+    // Create a request message. If |serverAddress| is INADDR_ANY the server
+    // ID is left out, as required when the client is rebooting.
     static Message request(const uint8_t (&sourceMac)[ETH_ALEN],
                            in_addr_t requestAddress,
                            in_addr_t serverAddress);
@@ -69,6 +78,8 @@ public:
     uint8_t type() const;
     // Get the DHCP server ID
     in_addr_t serverId() const;
+    // Returns true if the message has the rapid commit option
+    bool hasRapidCommit() const;
     // Get the requested IP
     in_addr_t requestedIp() const;
 
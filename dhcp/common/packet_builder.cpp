@@ -0,0 +1,150 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "packet_builder.h"
+
+#include <string.h>
+
+// Fold a checksum accumulated in more than 16 bits down to 16 bits by adding
+// the carries back in.
+static uint32_t foldChecksum(uint64_t sum) {
+    // msw is the most significant word, everything above the lower 16 bits
+    for (uint64_t msw = sum >> 16; msw != 0; msw = sum >> 16) {
+        sum = (sum & 0xFFFF) + msw;
+    }
+    return static_cast<uint32_t>(sum);
+}
+
+uint32_t addChecksum(const void* data, size_t size, uint32_t checksum) {
+    // The one's complement sum doesn't depend on the word size as long as the
+    // carries are added back in. Summing 32-bit words into a 64-bit
+    // accumulator handles eight bytes per iteration and can't overflow for any
+    // packet size we will see, the carries are folded in once at the end.
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t sum = checksum;
+    while (size >= sizeof(uint64_t)) {
+        uint64_t words;
+        memcpy(&words, bytes, sizeof(words));
+        sum += (words & 0xFFFFFFFF) + (words >> 32);
+        bytes += sizeof(words);
+        size -= sizeof(words);
+    }
+    if (size >= sizeof(uint32_t)) {
+        uint32_t word;
+        memcpy(&word, bytes, sizeof(word));
+        sum += word;
+        bytes += sizeof(word);
+        size -= sizeof(word);
+    }
+    if (size >= sizeof(uint16_t)) {
+        uint16_t word;
+        memcpy(&word, bytes, sizeof(word));
+        sum += word;
+        bytes += sizeof(word);
+        size -= sizeof(word);
+    }
+    if (size > 0) {
+        // Odd size, the last byte is padded with a zero byte
+        uint16_t word = 0;
+        memcpy(&word, bytes, 1);
+        sum += word;
+    }
+    return foldChecksum(sum);
+}
+
+uint16_t finishChecksum(uint32_t checksum) {
+    return ~checksum & 0xFFFF;
+}
+
+uint16_t updateChecksum(uint16_t checksum,
+                        uint16_t oldValue,
+                        uint16_t newValue) {
+    // HC' = ~(~HC + ~m + m')
+    uint32_t sum = static_cast<uint16_t>(~checksum);
+    sum += static_cast<uint16_t>(~oldValue);
+    sum += newValue;
+    return finishChecksum(foldChecksum(sum));
+}
+
+UdpPacketBuilder::UdpPacketBuilder()
+    : mHasEndpoints(false), mIpChecksum(0), mUdpChecksum(0) {
+    memset(&mHeaders, 0, sizeof(mHeaders));
+}
+
+void UdpPacketBuilder::setEndpoints(in_addr_t source,
+                                    uint16_t sourcePort,
+                                    in_addr_t destination,
+                                    uint16_t destinationPort) {
+    if (mHasEndpoints &&
+        mHeaders.ip.saddr == source &&
+        mHeaders.udp.source == htons(sourcePort) &&
+        mHeaders.ip.daddr == destination &&
+        mHeaders.udp.dest == htons(destinationPort)) {
+        return;
+    }
+
+    struct iphdr& ip = mHeaders.ip;
+    ip.version = IPVERSION;
+    ip.ihl = sizeof(ip) >> 2;
+    ip.tos = 0;
+    ip.tot_len = htons(sizeof(mHeaders));
+    ip.id = 0;
+    ip.frag_off = 0;
+    ip.ttl = IPDEFTTL;
+    ip.protocol = IPPROTO_UDP;
+    ip.check = 0;
+    ip.saddr = source;
+    ip.daddr = destination;
+    mIpChecksum = finishChecksum(addChecksum(ip, 0));
+
+    struct udphdr& udp = mHeaders.udp;
+    udp.source = htons(sourcePort);
+    udp.dest = htons(destinationPort);
+    udp.len = 0;
+    udp.check = 0;
+
+    // The UDP length appears in both the pseudo header and the UDP header,
+    // it's added for each datagram.
+    uint32_t checksum = 0;
+    checksum = addChecksum(ip.saddr, checksum);
+    checksum = addChecksum(ip.daddr, checksum);
+    checksum = addChecksum(htons(IPPROTO_UDP), checksum);
+    checksum = addChecksum(udp, checksum);
+    mUdpChecksum = checksum;
+
+    mHasEndpoints = true;
+}
+
+const UdpPacketBuilder::Headers& UdpPacketBuilder::build(const void* payload,
+                                                         size_t size) {
+    struct iphdr& ip = mHeaders.ip;
+    uint16_t headerLength = htons(sizeof(mHeaders));
+    ip.tot_len = htons(sizeof(mHeaders) + size);
+    ip.check = updateChecksum(mIpChecksum, headerLength, ip.tot_len);
+
+    struct udphdr& udp = mHeaders.udp;
+    udp.len = htons(sizeof(udp) + size);
+    uint32_t checksum = mUdpChecksum;
+    checksum = addChecksum(udp.len, checksum);
+    checksum = addChecksum(udp.len, checksum);
+    checksum = addChecksum(payload, size, checksum);
+    udp.check = finishChecksum(checksum);
+    if (udp.check == 0) {
+        // A zero checksum means no checksum for UDP, send all ones instead
+        udp.check = 0xFFFF;
+    }
+    return mHeaders;
+}
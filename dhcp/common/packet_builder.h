@@ -0,0 +1,80 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Add the one's complement sum of |size| bytes at |data| to |checksum|. The
+// result is a partial sum folded to 16 bits that can be passed back in to
+// continue the calculation or finished with finishChecksum. This is used for
+// checksum calculations for IP and UDP.
+uint32_t addChecksum(const void* data, size_t size, uint32_t checksum);
+
+// Convenience template function for checksum calculation
+template<typename T>
+uint32_t addChecksum(const T& data, uint32_t checksum) {
+    return addChecksum(&data, sizeof(T), checksum);
+}
+
+// Finalize the IP or UDP |checksum| by inverting and truncating it.
+uint16_t finishChecksum(uint32_t checksum);
+
+// Update a finished |checksum| after a 16-bit field covered by it changed
+// from |oldValue| to |newValue|, as described in RFC 1624.
+uint16_t updateChecksum(uint16_t checksum, uint16_t oldValue, uint16_t newValue);
+
+// Prebuilt IP and UDP headers for sending UDP datagrams on a raw socket. The
+// parts of the headers that don't depend on the payload, including their
+// share of the checksums, are computed once when the addresses and ports
+// change. Building the headers for a payload then only updates the lengths
+// and adds the payload to the UDP checksum.
+class UdpPacketBuilder {
+public:
+    struct Headers {
+        struct iphdr ip;
+        struct udphdr udp;
+    };
+    static_assert(sizeof(Headers) == sizeof(struct iphdr) +
+                                     sizeof(struct udphdr),
+                  "IP and UDP headers must be contiguous");
+
+    UdpPacketBuilder();
+
+    // Prepare headers for datagrams from |source|:|sourcePort| to
+    // |destination|:|destinationPort|. Does nothing if the headers already
+    // use these values.
+    void setEndpoints(in_addr_t source,
+                      uint16_t sourcePort,
+                      in_addr_t destination,
+                      uint16_t destinationPort);
+
+    // Fill in lengths and checksums for a datagram carrying |size| bytes of
+    // |payload|. The returned headers are valid until the next call.
+    const Headers& build(const void* payload, size_t size);
+
+private:
+    bool mHasEndpoints;
+    Headers mHeaders;
+    // The IP header checksum for a datagram without payload
+    uint16_t mIpChecksum;
+    // The sum of the fixed fields of the pseudo header and UDP header
+    uint32_t mUdpChecksum;
+};
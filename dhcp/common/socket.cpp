@@ -29,36 +29,80 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
-// Combine the checksum of |buffer| with |size| bytes with |checksum|. This is
-// used for checksum calculations for IP and UDP.
-static uint32_t addChecksum(const uint8_t* buffer,
-                            size_t size,
-                            uint32_t checksum) {
-    const uint16_t* data = reinterpret_cast<const uint16_t*>(buffer);
-    while (size > 1) {
-        checksum += *data++;
-        size -= 2;
-    }
-    if (size > 0) {
-        // Odd size, add the last byte
-        checksum += *reinterpret_cast<const uint8_t*>(data);
-    }
-    // msw is the most significant word, the upper 16 bits of the checksum
-    for (uint32_t msw = checksum >> 16; msw != 0; msw = checksum >> 16) {
-        checksum = (checksum & 0xFFFF) + msw;
-    }
-    return checksum;
+#include <algorithm>
+
+// The largest number of messages sent or received in one system call
+static const size_t kMaxBatchSize = 32;
+
+// Everything besides the message itself that is needed to send or receive a
+// message along with the interface it's sent on or received from. Kept in one
+// place so that arrays of these can be used for batches.
+struct PacketInfoStorage {
+    struct sockaddr_in addr;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+};
+
+static void preparePacketInfoSend(PacketInfoStorage* storage,
+                                  struct msghdr* header,
+                                  unsigned int interfaceIndex,
+                                  in_addr_t destinationAddress,
+                                  uint16_t destinationPort,
+                                  const Message& message) {
+    memset(storage, 0, sizeof(*storage));
+    storage->addr.sin_family = AF_INET;
+    storage->addr.sin_port = htons(destinationPort);
+    storage->addr.sin_addr.s_addr = destinationAddress;
+
+    memset(header, 0, sizeof(*header));
+    // The struct member is non-const since it's used for receiving but it's
+    // safe to cast away const for sending.
+    storage->iov.iov_base = const_cast<uint8_t*>(message.data());
+    storage->iov.iov_len = message.size();
+    header->msg_name = &storage->addr;
+    header->msg_namelen = sizeof(storage->addr);
+    header->msg_iov = &storage->iov;
+    header->msg_iovlen = 1;
+    header->msg_control = storage->control;
+    header->msg_controllen = sizeof(storage->control);
+
+    struct cmsghdr* controlHeader = CMSG_FIRSTHDR(header);
+    controlHeader->cmsg_level = IPPROTO_IP;
+    controlHeader->cmsg_type = IP_PKTINFO;
+    controlHeader->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    auto packetInfo =
+        reinterpret_cast<struct in_pktinfo*>(CMSG_DATA(controlHeader));
+    memset(packetInfo, 0, sizeof(*packetInfo));
+    packetInfo->ipi_ifindex = interfaceIndex;
 }
 
-// Convenienct template function for checksum calculation
-template<typename T>
-static uint32_t addChecksum(const T& data, uint32_t checksum) {
-    return addChecksum(reinterpret_cast<const uint8_t*>(&data), sizeof(T), checksum);
+static void preparePacketInfoReceive(PacketInfoStorage* storage,
+                                     struct msghdr* header,
+                                     Message* message) {
+    memset(header, 0, sizeof(*header));
+    storage->iov.iov_base = message->data();
+    storage->iov.iov_len = message->capacity();
+    header->msg_iov = &storage->iov;
+    header->msg_iovlen = 1;
+    header->msg_control = storage->control;
+    header->msg_controllen = sizeof(storage->control);
 }
 
-// Finalize the IP or UDP |checksum| by inverting and truncating it.
-static uint32_t finishChecksum(uint32_t checksum) {
-    return ~checksum & 0xFFFF;
+static void getPacketInfoInterface(struct msghdr* header,
+                                   unsigned int* interfaceIndex) {
+    if (header->msg_controllen < sizeof(struct cmsghdr)) {
+        return;
+    }
+    for (struct cmsghdr* ctrl = CMSG_FIRSTHDR(header);
+         ctrl;
+         ctrl = CMSG_NXTHDR(header, ctrl)) {
+        if (ctrl->cmsg_level == SOL_IP &&
+            ctrl->cmsg_type == IP_PKTINFO) {
+            auto packetInfo =
+                reinterpret_cast<struct in_pktinfo*>(CMSG_DATA(ctrl));
+            *interfaceIndex = packetInfo->ipi_ifindex;
+        }
+    }
 }
 
 Socket::Socket() : mSocketFd(-1) {
@@ -126,35 +170,10 @@ Result Socket::sendOnInterface(unsigned int interfaceIndex,
         return Result::error("Socket not open");
     }
 
-    char controlData[CMSG_SPACE(sizeof(struct in_pktinfo))] = { 0 };
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(destinationPort);
-    addr.sin_addr.s_addr = destinationAddress;
-
+    PacketInfoStorage storage;
     struct msghdr header;
-    memset(&header, 0, sizeof(header));
-    struct iovec iov;
-    // The struct member is non-const since it's used for receiving but it's
-    // safe to cast away const for sending.
-    iov.iov_base = const_cast<uint8_t*>(message.data());
-    iov.iov_len = message.size();
-    header.msg_name = &addr;
-    header.msg_namelen = sizeof(addr);
-    header.msg_iov = &iov;
-    header.msg_iovlen = 1;
-    header.msg_control = &controlData;
-    header.msg_controllen = sizeof(controlData);
-
-    struct cmsghdr* controlHeader = CMSG_FIRSTHDR(&header);
-    controlHeader->cmsg_level = IPPROTO_IP;
-    controlHeader->cmsg_type = IP_PKTINFO;
-    controlHeader->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
-    auto packetInfo =
-        reinterpret_cast<struct in_pktinfo*>(CMSG_DATA(controlHeader));
-    memset(packetInfo, 0, sizeof(*packetInfo));
-    packetInfo->ipi_ifindex = interfaceIndex;
+    preparePacketInfoSend(&storage, &header, interfaceIndex,
+                          destinationAddress, destinationPort, message);
 
     ssize_t status = ::sendmsg(mSocketFd, &header, 0);
     if (status <= 0) {
@@ -163,51 +182,66 @@ Result Socket::sendOnInterface(unsigned int interfaceIndex,
     return Result::success();
 }
 
+Result Socket::sendOnInterfaces(const unsigned int* interfaceIndices,
+                                in_addr_t destinationAddress,
+                                uint16_t destinationPort,
+                                const Message* messages,
+                                size_t count) {
+    if (mSocketFd == -1) {
+        return Result::error("Socket not open");
+    }
+
+    PacketInfoStorage storage[kMaxBatchSize];
+    struct mmsghdr headers[kMaxBatchSize];
+    size_t failed = 0;
+    int lastError = 0;
+    while (count > 0) {
+        size_t batch = std::min(count, kMaxBatchSize);
+        for (size_t i = 0; i < batch; ++i) {
+            memset(&headers[i], 0, sizeof(headers[i]));
+            preparePacketInfoSend(&storage[i], &headers[i].msg_hdr,
+                                  interfaceIndices[i], destinationAddress,
+                                  destinationPort, messages[i]);
+        }
+        int sent = ::sendmmsg(mSocketFd, headers, batch, 0);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            // The first message in the batch could not be sent, skip it and
+            // keep going with the rest.
+            lastError = errno;
+            ++failed;
+            sent = 1;
+        }
+        interfaceIndices += sent;
+        messages += sent;
+        count -= sent;
+    }
+    if (failed > 0) {
+        return Result::error("Failed to send %zu packets: %s",
+                             failed, strerror(lastError));
+    }
+    return Result::success();
+}
+
 Result Socket::sendRawUdp(in_addr_t source,
                           uint16_t sourcePort,
                           in_addr_t destination,
                           uint16_t destinationPort,
                           unsigned int interfaceIndex,
                           const Message& message) {
-    struct iphdr ip;
-    struct udphdr udp;
+    mUdpBuilder.setEndpoints(source, sourcePort, destination, destinationPort);
+    const UdpPacketBuilder::Headers& headers =
+        mUdpBuilder.build(message.data(), message.size());
 
-    ip.version = IPVERSION;
-    ip.ihl = sizeof(ip) >> 2;
-    ip.tos = 0;
-    ip.tot_len = htons(sizeof(ip) + sizeof(udp) + message.size());
-    ip.id = 0;
-    ip.frag_off = 0;
-    ip.ttl = IPDEFTTL;
-    ip.protocol = IPPROTO_UDP;
-    ip.check = 0;
-    ip.saddr = source;
-    ip.daddr = destination;
-    ip.check = finishChecksum(addChecksum(ip, 0));
-
-    udp.source = htons(sourcePort);
-    udp.dest = htons(destinationPort);
-    udp.len = htons(sizeof(udp) + message.size());
-    udp.check = 0;
-
-    uint32_t udpChecksum = 0;
-    udpChecksum = addChecksum(ip.saddr, udpChecksum);
-    udpChecksum = addChecksum(ip.daddr, udpChecksum);
-    udpChecksum = addChecksum(htons(IPPROTO_UDP), udpChecksum);
-    udpChecksum = addChecksum(udp.len, udpChecksum);
-    udpChecksum = addChecksum(udp, udpChecksum);
-    udpChecksum = addChecksum(message.data(), message.size(), udpChecksum);
-    udp.check = finishChecksum(udpChecksum);
+    struct iovec iov[2];
 
-    struct iovec iov[3];
-
-    iov[0].iov_base = static_cast<void*>(&ip);
-    iov[0].iov_len = sizeof(ip);
-    iov[1].iov_base = static_cast<void*>(&udp);
-    iov[1].iov_len = sizeof(udp);
     // sendmsg requires these to be non-const but for sending won't modify them
-    iov[2].iov_base = static_cast<void*>(const_cast<uint8_t*>(message.data()));
-    iov[2].iov_len = message.size();
+    iov[0].iov_base = const_cast<UdpPacketBuilder::Headers*>(&headers);
+    iov[0].iov_len = sizeof(headers);
+    iov[1].iov_base = static_cast<void*>(const_cast<uint8_t*>(message.data()));
+    iov[1].iov_len = message.size();
 
     struct sockaddr_ll dest;
     memset(&dest, 0, sizeof(dest));
@@ -233,34 +267,51 @@ Result Socket::sendRawUdp(in_addr_t source,
 
 Result Socket::receiveFromInterface(Message* message,
                                     unsigned int* interfaceIndex) {
-    char controlData[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    PacketInfoStorage storage;
     struct msghdr header;
-    memset(&header, 0, sizeof(header));
-    struct iovec iov;
-    iov.iov_base = message->data();
-    iov.iov_len = message->capacity();
-    header.msg_iov = &iov;
-    header.msg_iovlen = 1;
-    header.msg_control = &controlData;
-    header.msg_controllen = sizeof(controlData);
+    preparePacketInfoReceive(&storage, &header, message);
 
     ssize_t bytesRead = ::recvmsg(mSocketFd, &header, 0);
     if (bytesRead < 0) {
         return Result::error("Error receiving on socket: %s", strerror(errno));
     }
     message->setSize(static_cast<size_t>(bytesRead));
-    if (header.msg_controllen >= sizeof(struct cmsghdr)) {
-        for (struct cmsghdr* ctrl = CMSG_FIRSTHDR(&header);
-             ctrl;
-             ctrl = CMSG_NXTHDR(&header, ctrl)) {
-            if (ctrl->cmsg_level == SOL_IP &&
-                ctrl->cmsg_type == IP_PKTINFO) {
-                auto packetInfo =
-                    reinterpret_cast<struct in_pktinfo*>(CMSG_DATA(ctrl));
-                *interfaceIndex = packetInfo->ipi_ifindex;
-            }
+    getPacketInfoInterface(&header, interfaceIndex);
+    return Result::success();
+}
+
+Result Socket::receiveFromInterfaces(Message* messages,
+                                     unsigned int* interfaceIndices,
+                                     size_t count,
+                                     size_t* received) {
+    *received = 0;
+    count = std::min(count, kMaxBatchSize);
+
+    PacketInfoStorage storage[kMaxBatchSize];
+    struct mmsghdr headers[kMaxBatchSize];
+    for (size_t i = 0; i < count; ++i) {
+        memset(&headers[i], 0, sizeof(headers[i]));
+        preparePacketInfoReceive(&storage[i], &headers[i].msg_hdr,
+                                 &messages[i]);
+    }
+
+    int status;
+    do {
+        status = ::recvmmsg(mSocketFd, headers, count, MSG_DONTWAIT, nullptr);
+    } while (status < 0 && errno == EINTR);
+    if (status < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return Result::success();
         }
+        return Result::error("Error receiving on socket: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < status; ++i) {
+        messages[i].setSize(headers[i].msg_len);
+        interfaceIndices[i] = 0;
+        getPacketInfoInterface(&headers[i].msg_hdr, &interfaceIndices[i]);
     }
+    *received = static_cast<size_t>(status);
     return Result::success();
 }
 
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include "packet_builder.h"
 #include "result.h"
 
 #include <arpa/inet.h>
@@ -47,6 +48,16 @@ public:
                            in_addr_t destinationAddress,
                            uint16_t destinationPort,
                            const Message& message);
+    // Same as sendOnInterface but for |count| messages at once, each message
+    // in |messages| egresses on the interface in the same position in
+    // |interfaceIndices|. Messages are sent in batches with a single system
+    // call for each batch. If some messages fail to send the rest are still
+    // sent and an error is returned.
+    Result sendOnInterfaces(const unsigned int* interfaceIndices,
+                            in_addr_t destinationAddress,
+                            uint16_t destinationPort,
+                            const Message* messages,
+                            size_t count);
     // Send |message| as a UDP datagram on a raw socket. The source address of
     // the message will be |source|:|sourcePort| and the destination will be
     // |destination|:|destinationPort|. The message will be sent on the
@@ -60,6 +71,16 @@ public:
     // Receive data on the socket and indicate which interface the data was
     // received on in |interfaceIndex|. The received data is placed in |message|
     Result receiveFromInterface(Message* message, unsigned int* interfaceIndex);
+    // Receive up to |count| messages in a single system call without waiting
+    // for data. Each message is placed in |messages| and the interface it was
+    // received on in the same position in |interfaceIndices|. The number of
+    // messages received is placed in |received|, this is zero if there was no
+    // data available. The number of messages per call is limited so
+    // |received| may be smaller than |count| even if more data is available.
+    Result receiveFromInterfaces(Message* messages,
+                                 unsigned int* interfaceIndices,
+                                 size_t count,
+                                 size_t* received);
     // Receive UDP data on a raw socket. Expect that the protocol in the IP
     // header is UDP and that the port in the UDP header is |expectedPort|. If
     // the received data is valid then |isValid| will be set to true, otherwise
@@ -74,5 +95,8 @@ public:
     Result enableOption(int level, int optionName);
 private:
     int mSocketFd;
+    // Headers for sendRawUdp, a raw socket is bound to a single interface and
+    // keeps sending between the same addresses so these are rarely rebuilt.
+    UdpPacketBuilder mUdpBuilder;
 };
 
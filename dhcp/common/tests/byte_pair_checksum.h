@@ -0,0 +1,49 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The byte-pair checksum loop socket.cpp used before packet_builder.cpp
+// replaced it, kept as the reference the new code is tested and measured
+// against. Sums |size| bytes at |buffer| into |checksum| and folds the result
+// to 16 bits.
+inline uint32_t bytePairChecksum(const uint8_t* buffer,
+                                 size_t size,
+                                 uint32_t checksum) {
+    const uint16_t* data = reinterpret_cast<const uint16_t*>(buffer);
+    while (size > 1) {
+        checksum += *data++;
+        size -= 2;
+    }
+    if (size > 0) {
+        // Odd size, add the last byte
+        checksum += *reinterpret_cast<const uint8_t*>(data);
+    }
+    // msw is the most significant word, the upper 16 bits of the checksum
+    for (uint32_t msw = checksum >> 16; msw != 0; msw = checksum >> 16) {
+        checksum = (checksum & 0xFFFF) + msw;
+    }
+    return checksum;
+}
+
+template<typename T>
+uint32_t bytePairChecksum(const T& data, uint32_t checksum) {
+    return bytePairChecksum(reinterpret_cast<const uint8_t*>(&data),
+                            sizeof(T), checksum);
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "../packet_builder.h"
+#include "byte_pair_checksum.h"
+
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+static const int kRandomCases = 200000;
+// Larger than any datagram the DHCP code sends
+static const size_t kMaxSize = 1500;
+// Payloads start at every offset into a word to cover unaligned loads
+static const size_t kMaxOffset = 8;
+
+class PacketBuilderTest : public ::testing::Test {
+protected:
+    PacketBuilderTest() : mRandom(0x44484350), mBuffer(kMaxSize + kMaxOffset) {
+    }
+
+    void randomize() {
+        std::uniform_int_distribution<int> byte(0, 0xFF);
+        for (auto& b : mBuffer) {
+            b = static_cast<uint8_t>(byte(mRandom));
+        }
+    }
+
+    size_t random(size_t max) {
+        return std::uniform_int_distribution<size_t>(0, max)(mRandom);
+    }
+
+    std::mt19937 mRandom;
+    std::vector<uint8_t> mBuffer;
+};
+
+TEST_F(PacketBuilderTest, AddChecksumMatchesBytePairLoop) {
+    for (int i = 0; i < kRandomCases; ++i) {
+        // Refill only now and then, new offsets and sizes give enough variety
+        if (i % 64 == 0) {
+            randomize();
+        }
+        size_t offset = random(kMaxOffset - 1);
+        size_t size = random(kMaxSize);
+        uint32_t checksum = static_cast<uint32_t>(random(0xFFFF));
+        const uint8_t* data = mBuffer.data() + offset;
+
+        ASSERT_EQ(bytePairChecksum(data, size, checksum),
+                  addChecksum(data, size, checksum))
+            << "offset " << offset << ", size " << size
+            << ", checksum " << checksum;
+    }
+}
+
+TEST_F(PacketBuilderTest, AddChecksumEdgeCases) {
+    memset(mBuffer.data(), 0xFF, mBuffer.size());
+    for (size_t size = 0; size <= 2 * kMaxOffset + 1; ++size) {
+        for (uint32_t checksum : { 0x0000u, 0x0001u, 0xFFFEu, 0xFFFFu }) {
+            EXPECT_EQ(bytePairChecksum(mBuffer.data(), size, checksum),
+                      addChecksum(mBuffer.data(), size, checksum))
+                << "size " << size << ", checksum " << checksum;
+        }
+    }
+    // All ones for the largest buffer has the most carries to fold
+    EXPECT_EQ(bytePairChecksum(mBuffer.data(), mBuffer.size(), 0xFFFF),
+              addChecksum(mBuffer.data(), mBuffer.size(), 0xFFFF));
+}
+
+TEST_F(PacketBuilderTest, UpdateChecksumMatchesRecalculation) {
+    for (int i = 0; i < kRandomCases; ++i) {
+        uint16_t words[10];
+        for (auto& word : words) {
+            word = static_cast<uint16_t>(random(0xFFFF));
+        }
+        uint16_t checksum = finishChecksum(addChecksum(words, 0));
+
+        size_t index = random(9);
+        uint16_t oldValue = words[index];
+        words[index] = static_cast<uint16_t>(random(0xFFFF));
+
+        ASSERT_EQ(finishChecksum(addChecksum(words, 0)),
+                  updateChecksum(checksum, oldValue, words[index]))
+            << "old " << oldValue << ", new " << words[index];
+    }
+}
+
+TEST_F(PacketBuilderTest, BuildMatchesPerPacketHeaders) {
+    UdpPacketBuilder builder;
+    for (int i = 0; i < kRandomCases; ++i) {
+        // Change the endpoints now and then, build keeps using the old ones
+        if (i % 16 == 0) {
+            randomize();
+        }
+        in_addr_t source;
+        in_addr_t destination;
+        memcpy(&source, mBuffer.data(), sizeof(source));
+        memcpy(&destination, mBuffer.data() + sizeof(source),
+               sizeof(destination));
+        uint16_t sourcePort = mBuffer[8] | (mBuffer[9] << 8);
+        uint16_t destinationPort = mBuffer[10] | (mBuffer[11] << 8);
+        builder.setEndpoints(source, sourcePort, destination, destinationPort);
+
+        size_t offset = random(kMaxOffset - 1);
+        size_t size = random(kMaxSize - sizeof(UdpPacketBuilder::Headers));
+        const uint8_t* payload = mBuffer.data() + offset;
+        const UdpPacketBuilder::Headers& headers = builder.build(payload, size);
+
+        // The headers the way sendRawUdp built them for every packet
+        struct iphdr ip;
+        struct udphdr udp;
+        ip.version = IPVERSION;
+        ip.ihl = sizeof(ip) >> 2;
+        ip.tos = 0;
+        ip.tot_len = htons(sizeof(ip) + sizeof(udp) + size);
+        ip.id = 0;
+        ip.frag_off = 0;
+        ip.ttl = IPDEFTTL;
+        ip.protocol = IPPROTO_UDP;
+        ip.check = 0;
+        ip.saddr = source;
+        ip.daddr = destination;
+        ip.check = finishChecksum(bytePairChecksum(ip, 0));
+
+        udp.source = htons(sourcePort);
+        udp.dest = htons(destinationPort);
+        udp.len = htons(sizeof(udp) + size);
+        udp.check = 0;
+
+        uint32_t udpChecksum = 0;
+        udpChecksum = bytePairChecksum(ip.saddr, udpChecksum);
+        udpChecksum = bytePairChecksum(ip.daddr, udpChecksum);
+        udpChecksum = bytePairChecksum(htons(IPPROTO_UDP), udpChecksum);
+        udpChecksum = bytePairChecksum(udp.len, udpChecksum);
+        udpChecksum = bytePairChecksum(udp, udpChecksum);
+        udpChecksum = bytePairChecksum(payload, size, udpChecksum);
+        udp.check = finishChecksum(udpChecksum);
+        if (udp.check == 0) {
+            // The old code sent zero here, which means no checksum
+            udp.check = 0xFFFF;
+        }
+
+        ASSERT_EQ(0, memcmp(&ip, &headers.ip, sizeof(ip))) << "size " << size;
+        ASSERT_EQ(0, memcmp(&udp, &headers.udp, sizeof(udp)))
+            << "size " << size;
+    }
+}
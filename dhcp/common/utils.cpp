@@ -16,6 +16,14 @@
 
 #include "utils.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
 std::string addrToStr(in_addr_t address) {
     char buffer[INET_ADDRSTRLEN];
     if (::inet_ntop(AF_INET, &address, buffer, sizeof(buffer)) == nullptr) {
@@ -24,3 +32,53 @@ std::string addrToStr(in_addr_t address) {
     return buffer;
 }
 
+
+Result replaceFile(const std::string& path,
+                   const std::string& contents,
+                   const char* description) {
+    std::string tempPath = path + ".tmp";
+    int fd = ::open(tempPath.c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return Result::error("Unable to create %s '%s': %s", description,
+                             tempPath.c_str(), strerror(errno));
+    }
+    const char* data = contents.data();
+    size_t size = contents.size();
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        data += written;
+        size -= written;
+    }
+    if (size > 0 || ::fsync(fd) != 0) {
+        Result res = Result::error("Unable to write %s '%s': %s", description,
+                                   tempPath.c_str(), strerror(errno));
+        ::close(fd);
+        ::unlink(tempPath.c_str());
+        return res;
+    }
+    ::close(fd);
+
+    // The rename is atomic, sync the directory to make sure it sticks
+    if (::rename(tempPath.c_str(), path.c_str()) != 0) {
+        Result res = Result::error("Unable to replace %s: %s", description,
+                                   strerror(errno));
+        ::unlink(tempPath.c_str());
+        return res;
+    }
+    std::vector<char> directory(path.begin(), path.end());
+    directory.push_back('\0');
+    int dirFd = ::open(::dirname(directory.data()),
+                       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd != -1) {
+        ::fsync(dirFd);
+        ::close(dirFd);
+    }
+    return Result::success();
+}
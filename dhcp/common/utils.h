@@ -16,9 +16,18 @@
 
 #pragma once
 
+#include "result.h"
+
 #include <arpa/inet.h>
 
 #include <string>
 
 std::string addrToStr(in_addr_t address);
 
+// Replace the file at |path| with |contents| so that after a crash either the
+// old or the new contents are in place, never a partial write. |description|
+// names the file in error messages.
+Result replaceFile(const std::string& path,
+                   const std::string& contents,
+                   const char* description);
+
@@ -3,9 +3,13 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	address_pool.cpp \
 	dhcpserver.cpp \
+	interface_table.cpp \
+	lease_journal.cpp \
 	main.cpp \
 	../common/message.cpp \
+	../common/packet_builder.cpp \
 	../common/socket.cpp \
 	../common/utils.cpp \
 
@@ -20,3 +24,26 @@ LOCAL_MODULE_CLASS := EXECUTABLES
 
 include $(BUILD_EXECUTABLE)
 
+
+# Replays DISCOVER/REQUEST storms against the server, see storm_benchmark.cpp
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	address_pool.cpp \
+	dhcpserver.cpp \
+	interface_table.cpp \
+	lease_journal.cpp \
+	storm_benchmark.cpp \
+	../common/message.cpp \
+	../common/packet_builder.cpp \
+	../common/socket.cpp \
+	../common/utils.cpp \
+
+
+LOCAL_CPPFLAGS += -Werror
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../common
+LOCAL_SHARED_LIBRARIES := libcutils liblog
+LOCAL_MODULE := dhcpserver-storm-benchmark
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "address_pool.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+
+static const uint32_t kBitsPerWord = 64;
+// Limit the size of the bitmap for very large subnets, there will never be
+// this many clients anyway. This is 2 MiB worth of bits.
+static const uint32_t kMaxPoolSize = 1 << 24;
+
+AddressPool::AddressPool(in_addr_t interfaceAddress, in_addr_t netmask)
+    : mInterfaceAddress(interfaceAddress),
+      mNetmask(netmask),
+      mNetwork(ntohl(interfaceAddress) & ntohl(netmask)),
+      mSize(std::min<uint64_t>(static_cast<uint64_t>(~ntohl(netmask)) + 1,
+                               kMaxPoolSize)),
+      mUsed((mSize + kBitsPerWord - 1) / kBitsPerWord, 0),
+      mFirstFreeWord(0) {
+    // If the bits outside of the netmask are all zero it's a network address
+    // and if they are all set it's a broadcast address, don't use those. And
+    // don't assign the interface address to a host either.
+    markUsed(0);
+    if (static_cast<uint64_t>(~ntohl(netmask)) + 1 == mSize) {
+        markUsed(mSize - 1);
+    }
+    uint32_t offset = 0;
+    if (getOffset(interfaceAddress, &offset)) {
+        markUsed(offset);
+    }
+    // The bits past the end of the last word are not addresses
+    for (uint32_t bit = mSize; bit < mUsed.size() * kBitsPerWord; ++bit) {
+        markUsed(bit);
+    }
+}
+
+bool AddressPool::matches(in_addr_t interfaceAddress, in_addr_t netmask) const {
+    return interfaceAddress == mInterfaceAddress && netmask == mNetmask;
+}
+
+bool AddressPool::allocate(in_addr_t* address) {
+    for (size_t word = mFirstFreeWord; word < mUsed.size(); ++word) {
+        uint64_t available = ~mUsed[word];
+        if (available == 0) {
+            // Every address in this word is in use, keep looking
+            continue;
+        }
+        uint32_t offset = word * kBitsPerWord + __builtin_ctzll(available);
+        markUsed(offset);
+        mFirstFreeWord = word;
+        *address = htonl(mNetwork + offset);
+        return true;
+    }
+    mFirstFreeWord = mUsed.size();
+    return false;
+}
+
+bool AddressPool::reserve(in_addr_t address) {
+    uint32_t offset = 0;
+    if (!getOffset(address, &offset)) {
+        return false;
+    }
+    if (mUsed[offset / kBitsPerWord] & (1ULL << (offset % kBitsPerWord))) {
+        return false;
+    }
+    markUsed(offset);
+    return true;
+}
+
+void AddressPool::release(in_addr_t address) {
+    uint32_t offset = 0;
+    if (!getOffset(address, &offset) || address == mInterfaceAddress ||
+        offset == 0 || offset == static_cast<uint32_t>(~ntohl(mNetmask))) {
+        // Not an address that can be handed out
+        return;
+    }
+    size_t word = offset / kBitsPerWord;
+    mUsed[word] &= ~(1ULL << (offset % kBitsPerWord));
+    mFirstFreeWord = std::min(mFirstFreeWord, word);
+}
+
+bool AddressPool::getOffset(in_addr_t address, uint32_t* offset) const {
+    uint32_t hostAddress = ntohl(address);
+    if ((hostAddress & ntohl(mNetmask)) != mNetwork) {
+        return false;
+    }
+    *offset = hostAddress - mNetwork;
+    return *offset < mSize;
+}
+
+void AddressPool::markUsed(uint32_t offset) {
+    mUsed[offset / kBitsPerWord] |= 1ULL << (offset % kBitsPerWord);
+}
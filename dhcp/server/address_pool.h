@@ -0,0 +1,56 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <vector>
+
+// The addresses that can be handed out on a single interface, as determined by
+// the address and netmask of the interface. The network, broadcast and
+// interface addresses are never handed out. Allocation always picks the
+// lowest free address using a bitmap with one bit per address in the subnet.
+class AddressPool {
+public:
+    // |interfaceAddress| and |netmask| are in network byte order, as are all
+    // addresses passed to and returned from the pool.
+    AddressPool(in_addr_t interfaceAddress, in_addr_t netmask);
+
+    // Returns true if the pool was created for this interface configuration.
+    bool matches(in_addr_t interfaceAddress, in_addr_t netmask) const;
+
+    // Allocate the lowest free address, returns false if there is none left.
+    bool allocate(in_addr_t* address);
+    // Mark a specific address as used, returns false if the address is not
+    // part of the pool or is already in use.
+    bool reserve(in_addr_t address);
+    void release(in_addr_t address);
+
+private:
+    bool getOffset(in_addr_t address, uint32_t* offset) const;
+    void markUsed(uint32_t offset);
+
+    in_addr_t mInterfaceAddress;
+    in_addr_t mNetmask;
+    // In host byte order
+    uint32_t mNetwork;
+    uint32_t mSize;
+    std::vector<uint64_t> mUsed;
+    // All words before this index in mUsed are known to be full
+    size_t mFirstFreeWord;
+};
@@ -34,8 +34,13 @@
 #include <cutils/properties.h>
 
 static const int kMaxDnsServers = 4;
+// How long to hold on to an offered address if the client doesn't request it
+static const time_t kOfferHoldTime = 60;
+// The most requests read from the socket and answered in one pass
+static const size_t kMaxRequestBatch = 16;
 
-DhcpServer::DhcpServer(unsigned int excludeInterface) :
+DhcpServer::DhcpServer(unsigned int excludeInterface, const char* leaseFile) :
+    mJournal(leaseFile),
     mExcludeInterface(excludeInterface)
 {
 }
@@ -59,6 +64,21 @@ Result DhcpServer::init() {
         return res;
     }
 
+    res = mInterfaces.init();
+    if (!res) {
+        return res;
+    }
+
+    // Not being able to restore leases is not fatal, clients will just have
+    // to get new leases.
+    res = mJournal.load(&mLeases);
+    if (!res) {
+        ALOGE("Failed to load leases: %s", res.c_str());
+    }
+    for (const auto& lease : mLeases) {
+        scheduleExpiry(lease.first, lease.second.expiry);
+    }
+
     return Result::success();
 }
 
@@ -79,59 +99,107 @@ Result DhcpServer::run() {
         return Result::error("Unable to set signal mask: %s", strerror(errno));
     }
 
-    struct pollfd fds;
-    fds.fd = mSocket.get();
-    fds.events = POLLIN;
-    Message message;
-    while ((status = ::ppoll(&fds, 1, nullptr, &originalMask)) >= 0) {
-        if (status == 0) {
-            // Timeout
+    struct pollfd fds[2];
+    fds[0].fd = mSocket.get();
+    fds[0].events = POLLIN;
+    fds[1].fd = mInterfaces.fd();
+    fds[1].events = POLLIN;
+    Message messages[kMaxRequestBatch];
+    unsigned int interfaceIndices[kMaxRequestBatch];
+    while (true) {
+        expireLeases();
+
+        struct timespec timeout;
+        status = ::ppoll(fds, 2, getExpiryTimeout(&timeout), &originalMask);
+        if (status < 0) {
+            break;
+        } else if (status == 0) {
+            // Timeout, a lease is due to expire
             continue;
         }
 
-        unsigned int interfaceIndex = 0;
-        Result res = mSocket.receiveFromInterface(&message,
-                                                  &interfaceIndex);
-        if (!res) {
-            ALOGE("Failed to recieve on socket: %s", res.c_str());
-            continue;
+        // Apply address changes first so that requests are answered using
+        // the current interface configuration.
+        if (fds[1].revents & POLLIN) {
+            mInterfaces.onReadable();
         }
-        if (interfaceIndex == 0 || mExcludeInterface == interfaceIndex) {
-            // Received packet on unknown or unwanted interface, drop it
+        if ((fds[0].revents & POLLIN) == 0) {
             continue;
         }
-        if (!message.isValidDhcpMessage(OP_BOOTREQUEST)) {
-            // Not a DHCP request, drop it
+
+        size_t received = 0;
+        Result res = mSocket.receiveFromInterfaces(messages,
+                                                   interfaceIndices,
+                                                   kMaxRequestBatch,
+                                                   &received);
+        if (!res) {
+            ALOGE("Failed to recieve on socket: %s", res.c_str());
             continue;
         }
-        switch (message.type()) {
-            case DHCPDISCOVER:
-                // Someone is trying to find us, let them know we exist
-                sendDhcpOffer(message, interfaceIndex);
-                break;
-            case DHCPREQUEST:
-                // Someone wants a lease based on an offer
-                if (isValidDhcpRequest(message, interfaceIndex)) {
-                    // The request matches our offer, acknowledge it
-                    sendAck(message, interfaceIndex);
-                } else {
-                    // Request for something other than we offered, denied
-                    sendNack(message, interfaceIndex);
-                }
-                break;
+        for (size_t i = 0; i < received; ++i) {
+            handleRequest(messages[i], interfaceIndices[i]);
         }
+        flushReplies();
     }
     // Polling failed, exit
     return Result::error("Polling failed: %s", strerror(errno));
 }
 
+void DhcpServer::handleRequest(const Message& message,
+                               unsigned int interfaceIndex) {
+    if (interfaceIndex == 0 || mExcludeInterface == interfaceIndex) {
+        // Received packet on unknown or unwanted interface, drop it
+        return;
+    }
+    if (!message.isValidDhcpMessage(OP_BOOTREQUEST)) {
+        // Not a DHCP request, drop it
+        return;
+    }
+    switch (message.type()) {
+        case DHCPDISCOVER:
+            // Someone is trying to find us, let them know we exist
+            sendDhcpOffer(message, interfaceIndex);
+            break;
+        case DHCPREQUEST:
+            // Someone wants a lease based on an offer
+            if (isValidDhcpRequest(message, interfaceIndex)) {
+                // The request matches our offer, acknowledge it
+                sendAck(message, interfaceIndex);
+            } else {
+                // Request for something other than we offered, denied
+                sendNack(message, interfaceIndex);
+            }
+            break;
+        case DHCPRELEASE:
+            // The client is done with its address, make it available
+            releaseLease(Lease(interfaceIndex, message.dhcpData.chaddr),
+                         message.dhcpData.ciaddr);
+            break;
+    }
+}
+
 Result DhcpServer::sendMessage(unsigned int interfaceIndex,
                                in_addr_t /*sourceAddress*/,
                                const Message& message) {
-    return mSocket.sendOnInterface(interfaceIndex,
-                                   INADDR_BROADCAST,
-                                   PORT_BOOTP_CLIENT,
-                                   message);
+    mReplies.push_back(message);
+    mReplyInterfaces.push_back(interfaceIndex);
+    return Result::success();
+}
+
+void DhcpServer::flushReplies() {
+    if (mReplies.empty()) {
+        return;
+    }
+    Result res = mSocket.sendOnInterfaces(mReplyInterfaces.data(),
+                                          INADDR_BROADCAST,
+                                          PORT_BOOTP_CLIENT,
+                                          mReplies.data(),
+                                          mReplies.size());
+    if (!res) {
+        ALOGE("Failed to send DHCP replies: %s", res.c_str());
+    }
+    mReplies.clear();
+    mReplyInterfaces.clear();
 }
 
 void DhcpServer::sendDhcpOffer(const Message& message,
@@ -191,6 +259,7 @@ void DhcpServer::sendAck(const Message& message, unsigned int interfaceIndex) {
               interfaceIndex, res.c_str());
         return;
     }
+    bindLease(Lease(interfaceIndex, message.dhcpData.chaddr));
     Message ack = Message::ack(message,
                                serverAddress,
                                offerAddress,
@@ -277,6 +346,10 @@ Result DhcpServer::getInterfaceData(unsigned int interfaceIndex,
 
 Result DhcpServer::getInterfaceAddress(unsigned int interfaceIndex,
                                        in_addr_t* address) {
+    in_addr_t netmask;
+    if (mInterfaces.getAddress(interfaceIndex, address, &netmask)) {
+        return Result::success();
+    }
     struct ifreq data;
     Result res = getInterfaceData(interfaceIndex, SIOCGIFADDR, &data);
     if (res.isSuccess()) {
@@ -288,6 +361,10 @@ Result DhcpServer::getInterfaceAddress(unsigned int interfaceIndex,
 
 Result DhcpServer::getInterfaceNetmask(unsigned int interfaceIndex,
                                        in_addr_t* address) {
+    in_addr_t interfaceAddress;
+    if (mInterfaces.getAddress(interfaceIndex, &interfaceAddress, address)) {
+        return Result::success();
+    }
     struct ifreq data;
     Result res = getInterfaceData(interfaceIndex, SIOCGIFNETMASK, &data);
     if (res.isSuccess()) {
@@ -297,33 +374,6 @@ Result DhcpServer::getInterfaceNetmask(unsigned int interfaceIndex,
     return res;
 }
 
-static bool isValidHost(const in_addr_t address,
-                        const in_addr_t interfaceAddress,
-                        const in_addr_t netmask) {
-    // If the bits outside of the netmask are all zero it's a network address,
-    // don't use this.
-    bool isNetworkAddress = (address & ~netmask) == 0;
-    // If all bits outside of the netmask are set then it's a broadcast address,
-    // don't use this either.
-    bool isBroadcastAddress = (address & ~netmask) == ~netmask;
-    // Don't assign the interface address to a host
-    bool isInterfaceAddress = address == interfaceAddress;
-
-    return !isNetworkAddress && !isBroadcastAddress && !isInterfaceAddress;
-}
-
-static bool addressInRange(const in_addr_t address,
-                           const in_addr_t interfaceAddress,
-                           const in_addr_t netmask) {
-    if (address <= (interfaceAddress & netmask)) {
-        return false;
-    }
-    if (address >= (interfaceAddress | ~netmask)) {
-        return false;
-    }
-    return true;
-}
-
 Result DhcpServer::getOfferAddress(unsigned int interfaceIndex,
                                    const uint8_t* macAddress,
                                    in_addr_t* address,
@@ -348,43 +398,136 @@ Result DhcpServer::getOfferAddress(unsigned int interfaceIndex,
     *gateway = interfaceAddress;
     *netmask = mask;
 
+    AddressPool& pool = getPool(interfaceIndex, interfaceAddress, mask);
+
     Lease key(interfaceIndex, macAddress);
+    auto lease = mLeases.find(key);
+    if (lease == mLeases.end()) {
+        in_addr_t nextAddress = 0;
+        if (!pool.allocate(&nextAddress)) {
+            // Ran out of addresses
+            return Result::error("DHCP server is out of addresses");
+        }
+        // Hold on to the address for a while, if the client requests it the
+        // lease is extended to the full lease time.
+        time_t expiry = ::time(nullptr) + kOfferHoldTime;
+        lease = mLeases.emplace(key, LeaseBinding{nextAddress, expiry, false}).first;
+        scheduleExpiry(key, expiry);
+    }
+    *address = lease->second.address;
+    return Result::success();
+}
 
-    // Find or create entry, if it's created it will be zero and we update it
-    in_addr_t& value = mLeases[key];
-    if (value == 0) {
-        // Addresses are stored in network byte order so when doing math on them
-        // they have to be converted to host byte order
-        interfaceAddress = ntohl(interfaceAddress);
-        mask = ntohl(mask);
-        // Get a reference to the offset so we can use it and increase it at the
-        // same time. If the entry does not exist it will be created with a
-        // value of zero.
-        in_addr_t& offset = mNextAddressOffsets[interfaceIndex];
-        if (offset == 0) {
-            // Increase if zero to avoid assigning network address
-            ++offset;
+AddressPool& DhcpServer::getPool(unsigned int interfaceIndex,
+                                 in_addr_t interfaceAddress,
+                                 in_addr_t netmask) {
+    auto pool = mPools.find(interfaceIndex);
+    if (pool != mPools.end() && pool->second.matches(interfaceAddress,
+                                                     netmask)) {
+        return pool->second;
+    }
+
+    // Either this is the first time we see the interface or its address has
+    // changed. Build a new pool and put the leases on the interface that are
+    // still valid in it. Leases from a journal are restored this way too.
+    if (pool != mPools.end()) {
+        mPools.erase(pool);
+    }
+    pool = mPools.emplace(interfaceIndex,
+                          AddressPool(interfaceAddress, netmask)).first;
+    for (auto lease = mLeases.begin(); lease != mLeases.end(); ) {
+        auto current = lease++;
+        if (current->first.InterfaceIndex != interfaceIndex) {
+            continue;
         }
-        // Start out at the first address in the range as determined by netmask
-        in_addr_t nextAddress = (interfaceAddress & mask) + offset;
-
-        // Ensure the address is valid
-        while (!isValidHost(nextAddress, interfaceAddress, mask) &&
-               addressInRange(nextAddress, interfaceAddress, mask)) {
-            ++nextAddress;
-            ++offset;
+        if (!pool->second.reserve(current->second.address)) {
+            // The address is no longer part of the subnet on this interface
+            // or it conflicts with another lease.
+            removeLease(current);
         }
+    }
+    return pool->second;
+}
 
-        if (addressInRange(nextAddress, interfaceAddress, mask)) {
-            // Convert back to network byte order
-            value = htonl(nextAddress);
-            ++offset;
-        } else {
-            // Ran out of addresses
-            return Result::error("DHCP server is out of addresses");
+void DhcpServer::bindLease(const Lease& lease) {
+    auto binding = mLeases.find(lease);
+    if (binding == mLeases.end()) {
+        return;
+    }
+    binding->second.expiry = ::time(nullptr) + kDefaultLeaseTime;
+    binding->second.bound = true;
+    scheduleExpiry(lease, binding->second.expiry);
+
+    Result res = mJournal.recordBinding(lease, binding->second);
+    if (!res) {
+        ALOGE("Failed to record lease: %s", res.c_str());
+    }
+    // Renewals keep adding to the journal even if the leases stay the same
+    res = mJournal.compactIfNeeded(mLeases);
+    if (!res) {
+        ALOGE("Failed to compact lease journal: %s", res.c_str());
+    }
+}
+
+void DhcpServer::releaseLease(const Lease& lease, in_addr_t address) {
+    auto binding = mLeases.find(lease);
+    if (binding == mLeases.end() || binding->second.address != address) {
+        // Not a lease we know about, ignore it
+        return;
+    }
+    removeLease(binding);
+}
+
+void DhcpServer::removeLease(
+        std::unordered_map<Lease, LeaseBinding>::iterator lease) {
+    auto pool = mPools.find(lease->first.InterfaceIndex);
+    if (pool != mPools.end()) {
+        pool->second.release(lease->second.address);
+    }
+    if (lease->second.bound) {
+        // Offers never made it to the journal, no need to sync a release
+        Result res = mJournal.recordRelease(lease->first);
+        if (!res) {
+            ALOGE("Failed to record lease release: %s", res.c_str());
         }
     }
-    *address = value;
-    return Result::success();
+    mLeases.erase(lease);
+}
+
+void DhcpServer::scheduleExpiry(const Lease& lease, time_t expiry) {
+    mExpiries.emplace(expiry, lease);
 }
 
+void DhcpServer::expireLeases() {
+    time_t now = ::time(nullptr);
+    bool removed = false;
+    while (!mExpiries.empty() && mExpiries.top().first <= now) {
+        Expiry expiry = mExpiries.top();
+        mExpiries.pop();
+        auto lease = mLeases.find(expiry.second);
+        if (lease == mLeases.end() || lease->second.expiry > now) {
+            // Already gone or renewed since this entry was added
+            continue;
+        }
+        removeLease(lease);
+        removed = true;
+    }
+    if (removed) {
+        Result res = mJournal.compactIfNeeded(mLeases);
+        if (!res) {
+            ALOGE("Failed to compact lease journal: %s", res.c_str());
+        }
+    }
+}
+
+const struct timespec* DhcpServer::getExpiryTimeout(
+        struct timespec* timeout) const {
+    if (mExpiries.empty()) {
+        // Nothing to expire, wait for as long as it takes
+        return nullptr;
+    }
+    time_t remaining = mExpiries.top().first - ::time(nullptr);
+    timeout->tv_sec = remaining > 0 ? remaining : 0;
+    timeout->tv_nsec = 0;
+    return timeout;
+}
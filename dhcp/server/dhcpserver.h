@@ -16,31 +16,42 @@
 
 #pragma once
 
+#include "address_pool.h"
+#include "interface_table.h"
 #include "lease.h"
+#include "lease_journal.h"
+#include "message.h"
 #include "result.h"
 #include "socket.h"
 
 #include <netinet/in.h>
 #include <stdint.h>
+#include <time.h>
 
+#include <functional>
+#include <queue>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
-class Message;
-
 class DhcpServer {
 public:
     // Construct a DHCP server. Ignore any requests and discoveries coming on
-    // the network interface identified by |excludeInterface|.
-    explicit DhcpServer(unsigned int excludeInterface);
+    // the network interface identified by |excludeInterface|. Leases are
+    // stored in the journal at |leaseFile| so that they survive restarts.
+    DhcpServer(unsigned int excludeInterface, const char* leaseFile);
 
     Result init();
     Result run();
 
 private:
+    void handleRequest(const Message& message, unsigned int interfaceIndex);
+    // Queue |message| to be sent on |interfaceIndex|, queued messages are
+    // sent in a single batch by flushReplies.
     Result sendMessage(unsigned int interfaceIndex,
                        in_addr_t sourceAddress,
                        const Message& message);
+    void flushReplies();
 
     void sendDhcpOffer(const Message& message, unsigned int interfaceIndex);
     void sendAck(const Message& message, unsigned int interfaceIndex);
@@ -49,6 +60,8 @@ private:
     bool isValidDhcpRequest(const Message& message,
                             unsigned int interfaceIndex);
     void updateDnsServers();
+    // Interface addresses are looked up in mInterfaces, these only query
+    // the kernel directly for interfaces that are missing from it.
     Result getInterfaceData(unsigned int interfaceIndex,
                             unsigned long type,
                             struct ifreq* response);
@@ -61,15 +74,38 @@ private:
                            in_addr_t* address,
                            in_addr_t* netmask,
                            in_addr_t* gateway);
+    AddressPool& getPool(unsigned int interfaceIndex,
+                         in_addr_t interfaceAddress,
+                         in_addr_t netmask);
+    void bindLease(const Lease& lease);
+    void releaseLease(const Lease& lease, in_addr_t address);
+    void removeLease(std::unordered_map<Lease, LeaseBinding>::iterator lease);
+    void scheduleExpiry(const Lease& lease, time_t expiry);
+    void expireLeases();
+    const struct timespec* getExpiryTimeout(struct timespec* timeout) const;
+
+    using Expiry = std::pair<time_t, Lease>;
+    struct ExpiryLater {
+        bool operator()(const Expiry& left, const Expiry& right) const {
+            return left.first > right.first;
+        }
+    };
 
     Socket mSocket;
-    // This is the next address offset. This will be added to whatever the base
-    // address of the DHCP address range is. For each new MAC address seen this
-    // value will increase by one.
+    InterfaceTable mInterfaces;
+    // Replies waiting to be sent and the interface to send each one on
+    std::vector<Message> mReplies;
+    std::vector<unsigned int> mReplyInterfaces;
     std::vector<in_addr_t> mDnsServers;
-    // Map a lease to an IP address for that lease
-    std::unordered_map<Lease, in_addr_t> mLeases;
-    std::unordered_map<unsigned int, in_addr_t> mNextAddressOffsets;
+    // Map a lease to the IP address for that lease and its expiry
+    std::unordered_map<Lease, LeaseBinding> mLeases;
+    // The addresses available on each interface
+    std::unordered_map<unsigned int, AddressPool> mPools;
+    // When each lease expires, earliest first. Renewing a lease adds a new
+    // entry instead of updating the old one, entries that no longer match
+    // the expiry of their lease are skipped.
+    std::priority_queue<Expiry, std::vector<Expiry>, ExpiryLater> mExpiries;
+    LeaseJournal mJournal;
     unsigned int mExcludeInterface;
 };
 
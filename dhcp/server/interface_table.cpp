@@ -0,0 +1,228 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "interface_table.h"
+
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+InterfaceTable::InterfaceTable()
+    : mSocketFd(-1),
+      mSequence(0),
+      mDumpInProgress(false),
+      mDumpNeeded(false) {
+}
+
+InterfaceTable::~InterfaceTable() {
+    if (mSocketFd != -1) {
+        ::close(mSocketFd);
+        mSocketFd = -1;
+    }
+}
+
+Result InterfaceTable::init() {
+    mSocketFd = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                         NETLINK_ROUTE);
+    if (mSocketFd == -1) {
+        return Result::error("Failed to open netlink socket: %s",
+                             strerror(errno));
+    }
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_IPV4_IFADDR;
+    if (::bind(mSocketFd, reinterpret_cast<struct sockaddr*>(&addr),
+               sizeof(addr)) == -1) {
+        return Result::error("Failed to bind netlink socket: %s",
+                             strerror(errno));
+    }
+
+    Result res = requestDump();
+    if (!res) {
+        return res;
+    }
+    // Read the initial state before returning so that the first requests can
+    // be answered without falling back to querying the kernel.
+    bool dumpDone = false;
+    while (!dumpDone) {
+        res = receive(0, &dumpDone);
+        if (!res) {
+            return res;
+        }
+    }
+    if (mDumpNeeded) {
+        return requestDump();
+    }
+    return Result::success();
+}
+
+void InterfaceTable::onReadable() {
+    // The socket is polled with level triggering, anything left after this
+    // read will be handled on the next pass through the poll loop.
+    bool dumpDone = false;
+    Result res = receive(MSG_DONTWAIT, &dumpDone);
+    if (res.isSuccess() && dumpDone && mDumpNeeded) {
+        res = requestDump();
+    }
+    if (!res) {
+        ALOGE("%s", res.c_str());
+    }
+}
+
+bool InterfaceTable::getAddress(unsigned int interfaceIndex,
+                                in_addr_t* address,
+                                in_addr_t* netmask) const {
+    auto entry = mAddresses.find(interfaceIndex);
+    if (entry == mAddresses.end()) {
+        return false;
+    }
+    *address = entry->second.address;
+    *netmask = entry->second.netmask;
+    return true;
+}
+
+Result InterfaceTable::requestDump() {
+    if (mDumpInProgress) {
+        mDumpNeeded = true;
+        return Result::success();
+    }
+
+    struct {
+        struct nlmsghdr header;
+        struct ifaddrmsg data;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(request.data));
+    request.header.nlmsg_type = RTM_GETADDR;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = ++mSequence;
+    request.data.ifa_family = AF_INET;
+
+    if (::send(mSocketFd, &request, request.header.nlmsg_len, 0) == -1) {
+        return Result::error("Failed to request interface addresses: %s",
+                             strerror(errno));
+    }
+    mDumpInProgress = true;
+    mDumpNeeded = false;
+    return Result::success();
+}
+
+Result InterfaceTable::receive(int flags, bool* dumpDone) {
+    char buffer[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t length = ::recv(mSocketFd, buffer, sizeof(buffer), flags);
+    if (length == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return Result::success();
+        } else if (errno == ENOBUFS) {
+            // Address changes were dropped, start over with a fresh copy.
+            // Interfaces missing until the dump arrives are looked up the
+            // slow way.
+            ALOGW("Address changes lost, reloading interface addresses");
+            mAddresses.clear();
+            mDumpInProgress = false;
+            return requestDump();
+        }
+        return Result::error("Failed to receive address changes: %s",
+                             strerror(errno));
+    }
+
+    auto header = reinterpret_cast<const struct nlmsghdr*>(buffer);
+    size_t remaining = static_cast<size_t>(length);
+    for (; NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining)) {
+        if (header->nlmsg_type == NLMSG_DONE ||
+            header->nlmsg_type == NLMSG_ERROR) {
+            if (header->nlmsg_seq == mSequence) {
+                mDumpInProgress = false;
+                *dumpDone = true;
+            }
+            continue;
+        }
+        handleMessage(header);
+    }
+    return Result::success();
+}
+
+void InterfaceTable::handleMessage(const struct nlmsghdr* header) {
+    if (header->nlmsg_type != RTM_NEWADDR &&
+        header->nlmsg_type != RTM_DELADDR) {
+        return;
+    }
+    if (header->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifaddrmsg))) {
+        return;
+    }
+    auto data = reinterpret_cast<const struct ifaddrmsg*>(NLMSG_DATA(header));
+    if (data->ifa_family != AF_INET || data->ifa_prefixlen > 32) {
+        return;
+    }
+
+    // IFA_LOCAL is the address of the interface itself, IFA_ADDRESS is the
+    // peer address for point-to-point links and equal to IFA_LOCAL otherwise.
+    bool hasAddress = false;
+    in_addr_t address = 0;
+    uint32_t flags = data->ifa_flags;
+    auto attr = reinterpret_cast<const struct rtattr*>(IFA_RTA(data));
+    int attrLength = IFA_PAYLOAD(header);
+    for (; RTA_OK(attr, attrLength); attr = RTA_NEXT(attr, attrLength)) {
+        if (attr->rta_type == IFA_LOCAL &&
+            RTA_PAYLOAD(attr) >= sizeof(address)) {
+            memcpy(&address, RTA_DATA(attr), sizeof(address));
+            hasAddress = true;
+        } else if (attr->rta_type == IFA_ADDRESS && !hasAddress &&
+                   RTA_PAYLOAD(attr) >= sizeof(address)) {
+            memcpy(&address, RTA_DATA(attr), sizeof(address));
+        } else if (attr->rta_type == IFA_FLAGS &&
+                   RTA_PAYLOAD(attr) >= sizeof(flags)) {
+            memcpy(&flags, RTA_DATA(attr), sizeof(flags));
+        }
+    }
+    if (address == 0 || (flags & IFA_F_SECONDARY)) {
+        // Secondary addresses are never used as the server address
+        return;
+    }
+
+    unsigned int interfaceIndex = data->ifa_index;
+    auto entry = mAddresses.find(interfaceIndex);
+    if (header->nlmsg_type == RTM_DELADDR) {
+        if (entry != mAddresses.end() && entry->second.address == address) {
+            // If the interface has other primary addresses one of them will
+            // be used instead, the dump will find it.
+            mAddresses.erase(entry);
+            Result res = requestDump();
+            if (!res) {
+                ALOGE("%s", res.c_str());
+            }
+        }
+        return;
+    }
+
+    in_addr_t netmask = data->ifa_prefixlen == 0
+        ? 0 : htonl(~0u << (32 - data->ifa_prefixlen));
+    if (entry == mAddresses.end()) {
+        mAddresses[interfaceIndex] = Address{address, netmask};
+    } else if (entry->second.address == address) {
+        entry->second.netmask = netmask;
+    }
+    // Otherwise this is an additional primary address, the kernel reports
+    // the first one as the interface address so keep that.
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "result.h"
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <unordered_map>
+
+struct nlmsghdr;
+
+// The primary IPv4 address and netmask of each interface, kept current by
+// listening for address changes on a netlink socket. This avoids having to
+// query the kernel for every request the server answers.
+class InterfaceTable {
+public:
+    InterfaceTable();
+    ~InterfaceTable();
+
+    // Open the netlink socket, subscribe to address changes and load the
+    // addresses that are already configured.
+    Result init();
+    int fd() const { return mSocketFd; }
+    // Process pending address changes, call this when fd() is readable.
+    void onReadable();
+
+    // Get the address and netmask, in network byte order, of the interface
+    // identified by |interfaceIndex|. Returns false if the interface has no
+    // known IPv4 address.
+    bool getAddress(unsigned int interfaceIndex,
+                    in_addr_t* address,
+                    in_addr_t* netmask) const;
+
+private:
+    struct Address {
+        in_addr_t address;
+        in_addr_t netmask;
+    };
+
+    Result requestDump();
+    Result receive(int flags, bool* dumpDone);
+    void handleMessage(const struct nlmsghdr* header);
+
+    int mSocketFd;
+    uint32_t mSequence;
+    // The kernel only allows one dump at a time, if another one is needed
+    // while a dump is in progress it's requested once the current one is done.
+    bool mDumpInProgress;
+    bool mDumpNeeded;
+    std::unordered_map<unsigned int, Address> mAddresses;
+};
@@ -17,7 +17,10 @@
 #pragma once
 
 #include <linux/if_ether.h>
+#include <netinet/in.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
 
 #include <functional>
 
@@ -65,3 +68,13 @@ inline bool operator==(const Lease& left, const Lease& right) {
     return left.InterfaceIndex == right.InterfaceIndex &&
         memcmp(left.MacAddress, right.MacAddress, sizeof(left.MacAddress)) == 0;
 }
+
+// The address given out for a lease and when the lease expires. The expiry is
+// wall clock time so that it remains meaningful when leases are restored
+// after a restart. Only bound leases are journaled, an address that was
+// offered but not yet requested is just held for a short while.
+struct LeaseBinding {
+    in_addr_t address;
+    time_t expiry;
+    bool bound;
+};
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lease_journal.h"
+
+#include "log.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <vector>
+
+// Don't bother compacting journals smaller than this
+static const size_t kMinCompactRecords = 64;
+// Compact once there are this many records for each active lease
+static const size_t kCompactRatio = 4;
+
+static const char kBindRecord[] = "bind";
+static const char kReleaseRecord[] = "release";
+
+// Long enough for any record, including the newline
+static const size_t kMaxRecordLength = 128;
+
+static int formatBinding(char* buffer, size_t size, const Lease& lease,
+                         const LeaseBinding& binding) {
+    char address[INET_ADDRSTRLEN];
+    struct in_addr addr = { binding.address };
+    inet_ntop(AF_INET, &addr, address, sizeof(address));
+    const uint8_t* mac = lease.MacAddress;
+    return snprintf(buffer, size,
+                    "%s %u %02x:%02x:%02x:%02x:%02x:%02x %s %" PRId64 "\n",
+                    kBindRecord, lease.InterfaceIndex,
+                    mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+                    address, static_cast<int64_t>(binding.expiry));
+}
+
+static int formatRelease(char* buffer, size_t size, const Lease& lease) {
+    const uint8_t* mac = lease.MacAddress;
+    return snprintf(buffer, size,
+                    "%s %u %02x:%02x:%02x:%02x:%02x:%02x\n",
+                    kReleaseRecord, lease.InterfaceIndex,
+                    mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+static bool writeFully(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Parse a single record, |line| is null-terminated without the newline.
+static bool applyRecord(const char* line,
+                        std::unordered_map<Lease, LeaseBinding>* leases) {
+    char type[16];
+    unsigned int interfaceIndex = 0;
+    uint8_t mac[ETH_ALEN];
+    char address[INET_ADDRSTRLEN];
+    int64_t expiry = 0;
+
+    int fields = sscanf(line,
+                        "%15s %u %2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx %15s %" SCNd64,
+                        type, &interfaceIndex,
+                        &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5],
+                        address, &expiry);
+    if (fields == 10 && strcmp(type, kBindRecord) == 0) {
+        struct in_addr addr;
+        if (::inet_pton(AF_INET, address, &addr) != 1) {
+            return false;
+        }
+        (*leases)[Lease(interfaceIndex, mac)] =
+            LeaseBinding{ addr.s_addr, static_cast<time_t>(expiry), true };
+        return true;
+    } else if (fields == 8 && strcmp(type, kReleaseRecord) == 0) {
+        leases->erase(Lease(interfaceIndex, mac));
+        return true;
+    }
+    return false;
+}
+
+LeaseJournal::LeaseJournal(const char* path)
+    : mPath(path), mFd(-1), mRecords(0) {
+}
+
+LeaseJournal::~LeaseJournal() {
+    if (mFd != -1) {
+        ::close(mFd);
+        mFd = -1;
+    }
+}
+
+Result LeaseJournal::load(std::unordered_map<Lease, LeaseBinding>* leases) {
+    mRecords = 0;
+    int fd = ::open(mPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            // No leases have been recorded yet
+            return openForAppend();
+        }
+        return Result::error("Unable to open lease journal '%s': %s",
+                             mPath.c_str(), strerror(errno));
+    }
+
+    std::vector<char> data;
+    char buffer[4096];
+    while (true) {
+        ssize_t bytes = ::read(fd, buffer, sizeof(buffer));
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Result res = Result::error("Unable to read lease journal: %s",
+                                       strerror(errno));
+            ::close(fd);
+            return res;
+        } else if (bytes == 0) {
+            break;
+        }
+        data.insert(data.end(), buffer, buffer + bytes);
+    }
+    ::close(fd);
+
+    size_t lineStart = 0;
+    for (size_t i = 0; i < data.size(); ++i) {
+        if (data[i] != '\n') {
+            continue;
+        }
+        data[i] = '\0';
+        if (applyRecord(&data[lineStart], leases)) {
+            ++mRecords;
+        } else {
+            ALOGW("Ignoring invalid lease journal record '%s'",
+                  &data[lineStart]);
+        }
+        lineStart = i + 1;
+    }
+
+    if (lineStart < data.size()) {
+        // The last record was only partially written, get rid of it so that
+        // the next record starts on a line of its own.
+        ALOGW("Discarding incomplete lease journal record");
+        if (::truncate(mPath.c_str(), lineStart) != 0) {
+            return Result::error("Unable to truncate lease journal: %s",
+                                 strerror(errno));
+        }
+    }
+    return openForAppend();
+}
+
+Result LeaseJournal::recordBinding(const Lease& lease,
+                                   const LeaseBinding& binding) {
+    char line[kMaxRecordLength];
+    int length = formatBinding(line, sizeof(line), lease, binding);
+    return append(line, length);
+}
+
+Result LeaseJournal::recordRelease(const Lease& lease) {
+    char line[kMaxRecordLength];
+    int length = formatRelease(line, sizeof(line), lease);
+    return append(line, length);
+}
+
+Result LeaseJournal::compactIfNeeded(
+        const std::unordered_map<Lease, LeaseBinding>& leases) {
+    if (mRecords < kMinCompactRecords ||
+        mRecords < kCompactRatio * leases.size()) {
+        return Result::success();
+    }
+
+    std::string contents;
+    char line[kMaxRecordLength];
+    size_t records = 0;
+    for (const auto& lease : leases) {
+        if (!lease.second.bound) {
+            continue;
+        }
+        int length = formatBinding(line, sizeof(line), lease.first,
+                                   lease.second);
+        contents.append(line, length);
+        ++records;
+    }
+    // After a crash either the old or the new journal is in place
+    Result res = replaceFile(mPath, contents, "lease journal");
+    if (!res) {
+        return res;
+    }
+
+    ::close(mFd);
+    mFd = -1;
+    mRecords = records;
+    return openForAppend();
+}
+
+Result LeaseJournal::append(const char* line, size_t length) {
+    if (mFd == -1) {
+        return Result::error("Lease journal is not open");
+    }
+    // A single write for the entire record, with O_APPEND this either ends up
+    // in the file in its entirety or, after a crash, partially at the end
+    // where load will discard it.
+    if (!writeFully(mFd, line, length)) {
+        return Result::error("Unable to write lease journal: %s",
+                             strerror(errno));
+    }
+    if (::fdatasync(mFd) != 0) {
+        return Result::error("Unable to sync lease journal: %s",
+                             strerror(errno));
+    }
+    ++mRecords;
+    return Result::success();
+}
+
+Result LeaseJournal::openForAppend() {
+    mFd = ::open(mPath.c_str(),
+                 O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (mFd == -1) {
+        return Result::error("Unable to open lease journal '%s': %s",
+                             mPath.c_str(), strerror(errno));
+    }
+    return Result::success();
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2017, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "lease.h"
+#include "result.h"
+
+#include <string>
+#include <unordered_map>
+
+// An append-only file of lease changes that allows leases to survive a
+// restart of the DHCP server. Every change is a single line that is written
+// with one write call and synced before the change takes effect. A line that
+// was only partially written when the server went down is ignored when the
+// journal is loaded. Once the journal contains a lot more changes than there
+// are leases it is compacted by writing the current leases to a new file and
+// renaming it over the old one.
+class LeaseJournal {
+public:
+    explicit LeaseJournal(const char* path);
+    ~LeaseJournal();
+
+    // Replay the journal into |leases| and open it for appending. A journal
+    // that doesn't exist yet is not an error.
+    Result load(std::unordered_map<Lease, LeaseBinding>* leases);
+
+    Result recordBinding(const Lease& lease, const LeaseBinding& binding);
+    Result recordRelease(const Lease& lease);
+
+    // Rewrite the journal so that it only contains |leases| if enough of it
+    // is outdated.
+    Result compactIfNeeded(const std::unordered_map<Lease,
+                                                    LeaseBinding>& leases);
+
+private:
+    Result append(const char* line, size_t length);
+    Result openForAppend();
+
+    std::string mPath;
+    int mFd;
+    // The number of records in the journal
+    size_t mRecords;
+};
@@ -21,13 +21,17 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 
+static const char kDefaultLeaseFile[] = "/data/vendor/dhcpserver/leases";
+
 static void usage(const char* program) {
-    ALOGE("Usage: %s -i <interface> -r <", program);
+    ALOGE("Usage: %s [--exclude-interface <interface>] "
+          "[--lease-file <path>]", program);
 }
 
 int main(int argc, char* argv[]) {
     char* excludeInterfaceName = nullptr;
     unsigned int excludeInterfaceIndex = 0;
+    const char* leaseFile = kDefaultLeaseFile;
     for (int i = 1; i < argc; ++i) {
         if (strcmp("--exclude-interface", argv[i]) == 0) {
             if (i + 1 >= argc) {
@@ -44,10 +48,17 @@ int main(int argc, char* argv[]) {
                 usage(argv[0]);
                 return 1;
             }
+        } else if (strcmp("--lease-file", argv[i]) == 0) {
+            if (i + 1 >= argc) {
+                ALOGE("ERROR: Missing argument to --lease-file parameter");
+                usage(argv[0]);
+                return 1;
+            }
+            leaseFile = argv[i + 1];
         }
     }
 
-    DhcpServer server(excludeInterfaceIndex);
+    DhcpServer server(excludeInterfaceIndex, leaseFile);
     Result res = server.init();
     if (!res) {
         ALOGE("Failed to initialize DHCP server: %s\n", res.c_str());
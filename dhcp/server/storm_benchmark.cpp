@@ -0,0 +1,417 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays the DHCP storm caused by many emulated clients rebooting at once and
+// reports how quickly the server answers it. Every simulated client sends a
+// DISCOVER and then a REQUEST for the address it was offered, retransmitting
+// if it gets no reply. At most --window clients wait for a reply at any time.
+//
+//   dhcpserver-storm-benchmark --interface <client if> [--clients <n>]
+//                              [--window <n>] [--run-server]
+//
+// With --run-server a DhcpServer is started in the same process, serving every
+// interface but the client one, otherwise a server has to be running already.
+// On a host this can be run in a network namespace of its own:
+//
+//   unshare -rn sh -c 'ip link add srv type veth peer name cli &&
+//       ip addr add 192.168.232.1/22 dev srv &&
+//       ip link set srv up && ip link set cli up &&
+//       dhcpserver-storm-benchmark --interface cli --run-server'
+
+#include "dhcpserver.h"
+
+#include "dhcp.h"
+#include "message.h"
+#include "socket.h"
+
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::duration_cast;
+
+static const size_t kDefaultClients = 1000;
+static const size_t kDefaultWindow = 64;
+// Real clients start retransmitting after 4 seconds, the benchmark is less
+// patient so that lost packets don't dominate the results.
+static const std::chrono::milliseconds kRetransmitTimeout(500);
+static const std::chrono::seconds kGiveUpTimeout(60);
+static const int kReceiveBufferSize = 4 * 1024 * 1024;
+
+namespace {
+
+enum class State { Discovering, Requesting, Bound };
+
+struct Client {
+    uint8_t mac[ETH_ALEN];
+    State state;
+    in_addr_t offeredAddress;
+    in_addr_t serverAddress;
+    // When the current message was first sent and last (re)transmitted
+    Clock::time_point started;
+    Clock::time_point sent;
+    bool waiting;
+};
+
+struct Stats {
+    std::vector<double> latenciesUs;
+    size_t sent = 0;
+    size_t retransmits = 0;
+};
+
+class StormBenchmark {
+public:
+    StormBenchmark(unsigned int interfaceIndex, size_t clients, size_t window);
+
+    Result init();
+    Result run();
+    void report() const;
+
+private:
+    Result send(size_t index, bool retransmit);
+    Result receiveReplies();
+    void handleReply(const Message& message, Clock::time_point now);
+    Result retransmitExpired(Clock::time_point now);
+    Result fillWindow();
+
+    unsigned int mInterfaceIndex;
+    size_t mWindow;
+    Socket mSocket;
+    std::vector<Client> mClients;
+    // Clients that have something to send but are outside of the window
+    std::deque<size_t> mPending;
+    size_t mWaiting;
+    size_t mBound;
+    size_t mNaks;
+    Stats mDiscover;
+    Stats mRequest;
+    double mElapsedMs;
+};
+
+}  // namespace
+
+StormBenchmark::StormBenchmark(unsigned int interfaceIndex,
+                               size_t clients,
+                               size_t window)
+    : mInterfaceIndex(interfaceIndex),
+      mWindow(window),
+      mClients(clients),
+      mWaiting(0),
+      mBound(0),
+      mNaks(0),
+      mElapsedMs(0) {
+    for (size_t i = 0; i < clients; ++i) {
+        // Locally administered addresses that encode the client index
+        Client& client = mClients[i];
+        uint8_t mac[ETH_ALEN] = { 0x02, 0x00, 0x00,
+                                  static_cast<uint8_t>(i >> 16),
+                                  static_cast<uint8_t>(i >> 8),
+                                  static_cast<uint8_t>(i) };
+        memcpy(client.mac, mac, sizeof(mac));
+        client.state = State::Discovering;
+        client.offeredAddress = INADDR_ANY;
+        client.serverAddress = INADDR_ANY;
+        client.waiting = false;
+        mPending.push_back(i);
+    }
+}
+
+Result StormBenchmark::init() {
+    Result res = mSocket.open(PF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+    if (!res) {
+        return res;
+    }
+    res = mSocket.bindRaw(mInterfaceIndex);
+    if (!res) {
+        return res;
+    }
+    // Replies to a full window can arrive faster than they are read
+    int size = kReceiveBufferSize;
+    ::setsockopt(mSocket.get(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return Result::success();
+}
+
+Result StormBenchmark::run() {
+    Clock::time_point start = Clock::now();
+    while (mBound < mClients.size()) {
+        Clock::time_point now = Clock::now();
+        if (now - start > kGiveUpTimeout) {
+            return Result::error("Gave up with %zu of %zu clients bound",
+                                 mBound, mClients.size());
+        }
+        Result res = retransmitExpired(now);
+        if (!res) {
+            return res;
+        }
+        res = fillWindow();
+        if (!res) {
+            return res;
+        }
+
+        struct pollfd fd = { mSocket.get(), POLLIN, 0 };
+        int status = ::poll(&fd, 1, 10);
+        if (status < 0 && errno != EINTR) {
+            return Result::error("Unable to poll socket: %s", strerror(errno));
+        } else if (status > 0) {
+            res = receiveReplies();
+            if (!res) {
+                return res;
+            }
+        }
+    }
+    mElapsedMs = duration_cast<std::chrono::microseconds>(
+            Clock::now() - start).count() / 1000.0;
+    return Result::success();
+}
+
+Result StormBenchmark::send(size_t index, bool retransmit) {
+    Client& client = mClients[index];
+    Stats& stats = client.state == State::Discovering ? mDiscover : mRequest;
+    Message message = client.state == State::Discovering
+        ? Message::discover(client.mac)
+        : Message::request(client.mac, client.offeredAddress,
+                           client.serverAddress);
+    Result res = mSocket.sendRawUdp(INADDR_ANY, PORT_BOOTP_CLIENT,
+                                    INADDR_BROADCAST, PORT_BOOTP_SERVER,
+                                    mInterfaceIndex, message);
+    if (!res) {
+        return res;
+    }
+    ++stats.sent;
+    client.sent = Clock::now();
+    if (retransmit) {
+        ++stats.retransmits;
+    } else {
+        // Latency includes retransmits, like a client would experience it
+        client.started = client.sent;
+    }
+    if (!client.waiting) {
+        client.waiting = true;
+        ++mWaiting;
+    }
+    return Result::success();
+}
+
+Result StormBenchmark::receiveReplies() {
+    Message message;
+    while (true) {
+        struct pollfd fd = { mSocket.get(), POLLIN, 0 };
+        if (::poll(&fd, 1, 0) <= 0) {
+            return Result::success();
+        }
+        bool isValid = false;
+        Result res = mSocket.receiveRawUdp(PORT_BOOTP_CLIENT, &message,
+                                           &isValid);
+        if (!res) {
+            return res;
+        }
+        if (isValid && message.isValidDhcpMessage(OP_BOOTREPLY)) {
+            handleReply(message, Clock::now());
+        }
+    }
+}
+
+void StormBenchmark::handleReply(const Message& message,
+                                 Clock::time_point now) {
+    const uint8_t* mac = message.dhcpData.chaddr;
+    size_t index = (mac[3] << 16) | (mac[4] << 8) | mac[5];
+    if (mac[0] != 0x02 || index >= mClients.size()) {
+        return;
+    }
+    Client& client = mClients[index];
+    if (!client.waiting) {
+        // A reply to a retransmission that was already answered
+        return;
+    }
+
+    uint8_t type = message.type();
+    double latencyUs = duration_cast<std::chrono::microseconds>(
+            now - client.started).count();
+    if (client.state == State::Discovering && type == DHCPOFFER) {
+        mDiscover.latenciesUs.push_back(latencyUs);
+        client.offeredAddress = message.dhcpData.yiaddr;
+        client.serverAddress = message.serverId();
+        client.state = State::Requesting;
+    } else if (client.state == State::Requesting && type == DHCPACK) {
+        mRequest.latenciesUs.push_back(latencyUs);
+        client.state = State::Bound;
+        ++mBound;
+    } else if (client.state == State::Requesting && type == DHCPNAK) {
+        ++mNaks;
+        client.state = State::Discovering;
+    } else {
+        return;
+    }
+    client.waiting = false;
+    --mWaiting;
+    if (client.state != State::Bound) {
+        mPending.push_back(index);
+    }
+}
+
+Result StormBenchmark::retransmitExpired(Clock::time_point now) {
+    for (size_t i = 0; i < mClients.size(); ++i) {
+        const Client& client = mClients[i];
+        if (client.waiting && now - client.sent > kRetransmitTimeout) {
+            Result res = send(i, true);
+            if (!res) {
+                return res;
+            }
+        }
+    }
+    return Result::success();
+}
+
+Result StormBenchmark::fillWindow() {
+    while (mWaiting < mWindow && !mPending.empty()) {
+        size_t index = mPending.front();
+        mPending.pop_front();
+        Result res = send(index, false);
+        if (!res) {
+            return res;
+        }
+    }
+    return Result::success();
+}
+
+static void reportStats(const char* name, Stats stats) {
+    std::vector<double>& latencies = stats.latenciesUs;
+    if (latencies.empty()) {
+        printf("%-9s no replies\n", name);
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (double latency : latencies) {
+        sum += latency;
+    }
+    printf("%-9s %zu sent, %zu retransmitted, latency mean %.0f us, "
+           "p50 %.0f us, p99 %.0f us, max %.0f us\n",
+           name, stats.sent, stats.retransmits, sum / latencies.size(),
+           latencies[latencies.size() / 2],
+           latencies[latencies.size() * 99 / 100],
+           latencies.back());
+}
+
+void StormBenchmark::report() const {
+    printf("%zu clients bound in %.1f ms, %.0f leases/s, %zu naks\n",
+           mBound, mElapsedMs, mBound * 1000.0 / mElapsedMs, mNaks);
+    reportStats("DISCOVER", mDiscover);
+    reportStats("REQUEST", mRequest);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s --interface <interface> [--clients <n>] "
+            "[--window <n>] [--run-server]\n", program);
+}
+
+static bool parseCount(const char* value, size_t* count) {
+    char* end = nullptr;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || parsed == 0 || parsed > 0xFFFFFF) {
+        return false;
+    }
+    *count = parsed;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    const char* interfaceName = nullptr;
+    size_t clients = kDefaultClients;
+    size_t window = kDefaultWindow;
+    bool runServer = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp("--interface", argv[i]) == 0 && i + 1 < argc) {
+            interfaceName = argv[++i];
+        } else if (strcmp("--clients", argv[i]) == 0 && i + 1 < argc) {
+            if (!parseCount(argv[++i], &clients)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp("--window", argv[i]) == 0 && i + 1 < argc) {
+            if (!parseCount(argv[++i], &window)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp("--run-server", argv[i]) == 0) {
+            runServer = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (interfaceName == nullptr) {
+        usage(argv[0]);
+        return 1;
+    }
+    unsigned int interfaceIndex = if_nametoindex(interfaceName);
+    if (interfaceIndex == 0) {
+        fprintf(stderr, "Unknown interface '%s'\n", interfaceName);
+        return 1;
+    }
+
+    std::string leaseFile;
+    if (runServer) {
+        char leaseDir[] = "/tmp/dhcpserver-storm-XXXXXX";
+        if (::mkdtemp(leaseDir) == nullptr) {
+            fprintf(stderr, "Unable to create lease directory: %s\n",
+                    strerror(errno));
+            return 1;
+        }
+        leaseFile = std::string(leaseDir) + "/leases";
+        // The server runs until the process exits
+        auto server = new DhcpServer(interfaceIndex, leaseFile.c_str());
+        Result res = server->init();
+        if (!res) {
+            fprintf(stderr, "Unable to start server: %s\n", res.c_str());
+            return 1;
+        }
+        std::thread([server]() {
+            Result res = server->run();
+            fprintf(stderr, "Server stopped: %s\n", res.c_str());
+        }).detach();
+    }
+
+    StormBenchmark benchmark(interfaceIndex, clients, window);
+    Result res = benchmark.init();
+    if (res.isSuccess()) {
+        res = benchmark.run();
+    }
+    benchmark.report();
+    if (!leaseFile.empty()) {
+        ::unlink(leaseFile.c_str());
+        ::rmdir(leaseFile.substr(0, leaseFile.rfind('/')).c_str());
+    }
+    if (!res) {
+        fprintf(stderr, "%s\n", res.c_str());
+        return 1;
+    }
+    return 0;
+}
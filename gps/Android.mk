@@ -49,3 +49,32 @@ LOCAL_SRC_FILES := gps_qemu.c
 LOCAL_MODULE := gps.ranchu
 
 include $(BUILD_SHARED_LIBRARY)
+
+
+# FLP module handing out the batching implemented by the GPS HAL, stored in
+# hw/<FUSED_LOCATION_HARDWARE_MODULE_ID>.<ro.hardware>.so
+include $(CLEAR_VARS)
+
+LOCAL_VENDOR_MODULE := true
+LOCAL_MODULE_RELATIVE_PATH := hw
+LOCAL_CFLAGS += -DQEMU_HARDWARE
+LOCAL_SHARED_LIBRARIES := liblog libhardware
+LOCAL_SRC_FILES := flp_qemu.c
+ifeq ($(TARGET_PRODUCT),vbox_x86)
+LOCAL_MODULE := flp.vbox_x86
+else
+LOCAL_MODULE := flp.goldfish
+endif
+include $(BUILD_SHARED_LIBRARY)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_VENDOR_MODULE := true
+LOCAL_MODULE_RELATIVE_PATH := hw
+LOCAL_CFLAGS += -DQEMU_HARDWARE
+LOCAL_SHARED_LIBRARIES := liblog libhardware
+LOCAL_SRC_FILES := flp_qemu.c
+LOCAL_MODULE := flp.ranchu
+
+include $(BUILD_SHARED_LIBRARY)
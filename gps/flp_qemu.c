@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* this implements the fused location (FLP) hardware library for the
+ * Android emulator. it is placed into /vendor/lib/hw/flp.goldfish.so and
+ * loaded by the GNSS HAL to back IGnssBatching.
+ *
+ * batching needs the fixes read by the GPS HAL, so there is no state
+ * here: the GPS HAL module is looked up in the same process and its
+ * batching extension is handed out as the FlpLocationInterface.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define  LOG_TAG  "flp_qemu"
+#include <log/log.h>
+#include <hardware/fused_location.h>
+#include <hardware/gps.h>
+#include "qemu_flp.h"
+
+static const FlpLocationInterface*
+flp__get_flp_interface(struct flp_device_t* __unused dev)
+{
+    const struct hw_module_t*  module;
+    struct hw_device_t*        device;
+    struct gps_device_t*       gps;
+    const GpsInterface*        iface;
+    const FlpLocationInterface*  flp = NULL;
+
+    if (hw_get_module(GPS_HARDWARE_MODULE_ID, &module) != 0 ||
+        module->methods->open(module, GPS_HARDWARE_MODULE_ID, &device) != 0) {
+        ALOGE("%s: could not open the GPS HAL", __FUNCTION__);
+        return NULL;
+    }
+
+    gps   = (struct gps_device_t*)device;
+    iface = gps->get_gps_interface(gps);
+    if (iface && iface->get_extension)
+        flp = iface->get_extension(QEMU_FLP_BATCHING_INTERFACE);
+    if (flp == NULL)
+        ALOGE("%s: the GPS HAL does not support batching", __FUNCTION__);
+
+    /* the interface lives in the GPS HAL library, which stays loaded */
+    if (device->close)
+        device->close(device);
+    else
+        free(device);
+    return flp;
+}
+
+static int close_flp(struct hw_device_t* device)
+{
+    free(device);
+    return 0;
+}
+
+static int open_flp(const struct hw_module_t* module,
+                    char const* __unused name,
+                    struct hw_device_t** device)
+{
+    struct flp_device_t *dev = malloc(sizeof(struct flp_device_t));
+    if (dev == NULL)
+        return -ENOMEM;
+    memset(dev, 0, sizeof(*dev));
+
+    dev->common.tag = HARDWARE_DEVICE_TAG;
+    dev->common.version = 0;
+    dev->common.module = (struct hw_module_t*)module;
+    dev->common.close = close_flp;
+    dev->get_flp_interface = flp__get_flp_interface;
+
+    *device = (struct hw_device_t*)dev;
+    return 0;
+}
+
+
+static struct hw_module_methods_t flp_module_methods = {
+    .open = open_flp
+};
+
+struct hw_module_t HAL_MODULE_INFO_SYM = {
+    .tag = HARDWARE_MODULE_TAG,
+    .version_major = 1,
+    .version_minor = 0,
+    .id = FUSED_LOCATION_HARDWARE_MODULE_ID,
+    .name = "Goldfish FLP Module",
+    .author = "The Android Open Source Project",
+    .methods = &flp_module_methods,
+};
@@ -28,6 +28,10 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <math.h>
 #include <time.h>
 
@@ -35,7 +39,9 @@
 #include <log/log.h>
 #include <cutils/sockets.h>
 #include <cutils/properties.h>
+#include <hardware/fused_location.h>
 #include <hardware/gps.h>
+#include "qemu_flp.h"
 #include "qemu_pipe.h"
 
 /* the name of the qemu-controlled pipe */
@@ -70,6 +76,30 @@ typedef struct {
     Token   tokens[ MAX_NMEA_TOKENS ];
 } NmeaTokenizer;
 
+/* maximum number of fixes kept while batching */
+#define  GPS_BATCH_SIZE  128
+
+/* this is the in-HAL ring of batched fixes, it is filled by the gps thread
+ * and drained through the FLP location callback */
+typedef struct {
+    int          id;              /* id of the batching session, -1 if none */
+    uint32_t     flags;           /* FLP_BATCH_xxx flags of the session */
+    int64_t      period_ms;       /* minimum interval between two batched fixes */
+    GpsUtcTime   last_timestamp;  /* timestamp of the last batched fix */
+    int          head;            /* index of the oldest fix */
+    int          count;
+    FlpLocation  fixes[ GPS_BATCH_SIZE ];
+} GpsBatch;
+
+/* a recorded log replayed in place of the qemu pipe */
+typedef struct {
+    const char*  data;      /* mmap()-ed recording, NULL if not replaying */
+    size_t       size;
+    int          fd;        /* write end of the socket pair read by the gps thread */
+    int          speed;     /* replay speed, 1 is real time */
+    pthread_t    thread;
+} GpsReplay;
+
 /* this is the state of our connection to the qemu_gpsd daemon */
 typedef struct {
     int                     init;
@@ -82,6 +112,9 @@ typedef struct {
                                                          accessed by main and child threads */
     bool                    gnss_enabled; /* set by ro.kernel.qemu.gps.gnss_enabled=1 */
     bool                    fix_provided_by_gnss; /* set by ro.kernel.qemu.gps.fix_by_gnss=1 */
+    FlpCallbacks*           flp_callbacks; /* protected by lock */
+    GpsBatch                batch;         /* protected by lock */
+    GpsReplay               replay;
 } GpsState;
 
 static GpsState  _gps_state[1];
@@ -198,11 +231,61 @@ str2int( const char*  p, const char*  end )
     return str2int64(p, end);
 }
 
+/* powers of ten that are exactly representable as a double */
+static const double  kPow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+};
+
+#define  MAX_FAST_DIGITS  15
+
+/* parse a plain decimal number of the form [-]ddd[.ddd] without going
+ * through strtod(). returns 0 on success, or -1 if the input has another
+ * shape (exponent, too many digits, ...) and needs the slow path */
+static int
+str2float_fast( const char*  p, const char*  end, double*  result )
+{
+    int64_t  mantissa = 0;
+    int      digits = 0, decimals = 0, seen_dot = 0;
+    bool     is_negative = false;
+
+    if (p < end && *p == '-') {
+        is_negative = true;
+        ++p;
+    }
+    if (p >= end)
+        return -1;
+
+    for ( ; p < end; p++ ) {
+        int  c = *p - '0';
+
+        if ((unsigned)c < 10) {
+            if (++digits > MAX_FAST_DIGITS)
+                return -1;
+            mantissa = mantissa*10 + c;
+            decimals += seen_dot;
+        } else if (*p == '.' && !seen_dot) {
+            seen_dot = 1;
+        } else {
+            return -1;
+        }
+    }
+
+    *result = (double)mantissa / kPow10[decimals];
+    if (is_negative)
+        *result = -*result;
+    return 0;
+}
+
 static double
 str2float( const char*  p, const char*  end )
 {
-    int   len    = end - p;
-    char  temp[64];
+    int     len    = end - p;
+    char    temp[64];
+    double  result;
+
+    if (str2float_fast(p, end, &result) == 0)
+        return result;
 
     if (len >= (int)sizeof(temp)) {
         ALOGE("%s %d input is too long: '%.*s'", __func__, __LINE__, end-p, p);
@@ -214,6 +297,501 @@ str2float( const char*  p, const char*  end )
     return strtod( temp, NULL );
 }
 
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       B A T C H I N G                                 *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+static void
+gps_batch_reset( GpsBatch*  b )
+{
+    b->id             = -1;
+    b->flags          = 0;
+    b->period_ms      = 0;
+    b->last_timestamp = 0;
+    b->head           = 0;
+    b->count          = 0;
+}
+
+/* copy the last 'last_n' batched fixes (all of them if last_n <= 0) out of
+ * the ring, and empty it if 'drain' is set. must be called with s->lock held.
+ * returns the number of fixes copied into 'out' */
+static int
+gps_batch_copy_locked( GpsState*  s, FlpLocation*  out, int  last_n, int  drain )
+{
+    GpsBatch*  b = &s->batch;
+    int        n = b->count;
+    int        i;
+
+    if (last_n > 0 && last_n < n)
+        n = last_n;
+
+    for (i = 0; i < n; i++) {
+        int  idx = (b->head + b->count - n + i) % GPS_BATCH_SIZE;
+        out[i] = b->fixes[idx];
+    }
+
+    if (drain) {
+        b->head  = 0;
+        b->count = 0;
+    }
+    return n;
+}
+
+/* send batched fixes to the framework. the callback is invoked without
+ * holding s->lock so that it may call back into the FLP interface. the
+ * fixes are kept if there is nobody to deliver them to */
+static void
+gps_batch_deliver( GpsState*  s, int  last_n, int  drain )
+{
+    FlpLocation    fixes[ GPS_BATCH_SIZE ];
+    FlpLocation*   ptrs[ GPS_BATCH_SIZE ];
+    FlpCallbacks*  cb;
+    int            n, i;
+
+    pthread_mutex_lock(&s->lock);
+    cb = s->flp_callbacks;
+    if (cb == NULL || cb->location_cb == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    n  = gps_batch_copy_locked(s, fixes, last_n, drain);
+    pthread_mutex_unlock(&s->lock);
+
+    if (n == 0)
+        return;
+
+    for (i = 0; i < n; i++)
+        ptrs[i] = &fixes[i];
+
+    D("%s: delivering %d batched fixes", __FUNCTION__, n);
+    cb->location_cb(n, ptrs);
+}
+
+/* record a new fix if a batching session is running. this runs in the gps
+ * thread. returns 1 if the fix was consumed by the batch, 0 otherwise */
+static int
+gps_batch_add_fix( GpsState*  s, const GpsLocation*  fix )
+{
+    GpsBatch*      b = &s->batch;
+    FlpCallbacks*  cb;
+    FlpLocation*   loc;
+    int            wakeup = 0, per_fix = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (b->id < 0) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    if (b->count > 0 && b->period_ms > 0 &&
+        fix->timestamp - b->last_timestamp < b->period_ms) {
+        /* too early for this session, drop it */
+        pthread_mutex_unlock(&s->lock);
+        return 1;
+    }
+
+    if (b->count == GPS_BATCH_SIZE) {
+        /* the session doesn't want the AP woken up, or there was nobody to
+         * hand the full batch over to: overwrite the oldest fix */
+        b->head = (b->head + 1) % GPS_BATCH_SIZE;
+        b->count -= 1;
+    }
+
+    loc = &b->fixes[ (b->head + b->count) % GPS_BATCH_SIZE ];
+    memset(loc, 0, sizeof(*loc));
+    loc->size         = sizeof(*loc);
+    loc->flags        = fix->flags;   /* FLP_LOCATION_HAS_xxx match GPS_LOCATION_HAS_xxx */
+    loc->latitude     = fix->latitude;
+    loc->longitude    = fix->longitude;
+    loc->altitude     = fix->altitude;
+    loc->speed        = fix->speed;
+    loc->bearing      = fix->bearing;
+    loc->accuracy     = fix->accuracy;
+    loc->timestamp    = fix->timestamp;
+    loc->sources_used = FLP_TECH_MASK_GNSS;
+    b->count         += 1;
+    b->last_timestamp = fix->timestamp;
+    per_fix = (b->flags & FLP_BATCH_CALLBACK_ON_LOCATION_FIX) != 0;
+    wakeup  = b->count == GPS_BATCH_SIZE &&
+              (b->flags & FLP_BATCH_WAKEUP_ON_FIFO_FULL) != 0;
+    cb = s->flp_callbacks;
+    pthread_mutex_unlock(&s->lock);
+
+    if (wakeup) {
+        /* the ring just filled up: wake the AP up and hand over everything
+         * we have before the next fix would have to overwrite one */
+        D("%s: batch full, waking up", __FUNCTION__);
+        if (cb && cb->acquire_wakelock_cb)
+            cb->acquire_wakelock_cb();
+        gps_batch_deliver(s, 0, 1);
+        if (cb && cb->release_wakelock_cb)
+            cb->release_wakelock_cb();
+    } else if (per_fix) {
+        gps_batch_deliver(s, 1, 0);
+    }
+
+    return 1;
+}
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       G E O F E N C I N G                             *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* circular geofences are indexed by a uniform grid of lat/long cells: a
+ * fence is linked into every cell its bounding box overlaps, so that a fix
+ * only needs to look at the fences of its own cell, plus the fences the
+ * device is not known to be outside of (to detect exits), plus the fences
+ * too large for the grid. fences are also hashed by id for the framework
+ * calls.
+ *
+ * a fix within the hysteresis margin of a fence boundary doesn't change its
+ * state, and a new state is only reported once it held on consecutive fixes
+ * for the dwell time. a fence whose state stays undecided for the unknown
+ * timer of the framework becomes uncertain.
+ */
+
+#define  GPS_GEOFENCE_MAX        1024
+#define  GPS_GEOFENCE_MAX_CELLS  16      /* larger fences are always checked */
+#define  GPS_GEOFENCE_BUCKETS    1024    /* must be a power of 2 */
+#define  GPS_GEOFENCE_CELL_DEG   0.01    /* about 1.1km of latitude */
+#define  GPS_GEOFENCE_MARGIN_M   10.0    /* hysteresis for fixes without accuracy */
+#define  GPS_GEOFENCE_DWELL_MS   1000    /* two fixes at the emulator rate */
+
+#define  EARTH_RADIUS_METERS     6371000.0
+#define  METERS_PER_DEGREE       111320.0
+
+typedef struct {
+    int          used;
+    int32_t      id;
+    double       latitude;
+    double       longitude;
+    double       radius;
+    int          paused;
+    int          state;          /* GPS_GEOFENCE_ENTERED, _EXITED or _UNCERTAIN */
+    int          monitor;        /* transitions reported to the framework */
+    int          unknown_ms;     /* undecided time before becoming uncertain */
+    int          pending;        /* state waiting for the dwell time, 0 if none */
+    GpsUtcTime   pending_since;
+    GpsUtcTime   decided;        /* last fix outside the hysteresis margin */
+    uint32_t     visit;          /* last fix this fence was checked against */
+    int          ncells;
+    uint64_t     cells[ GPS_GEOFENCE_MAX_CELLS ];
+} GpsGeofence;
+
+/* lists and links store an index + 1, so that 0 means "none" */
+typedef struct {
+    pthread_mutex_t        lock;
+    GpsGeofenceCallbacks*  callbacks;
+    uint32_t               visit;
+    int                    buckets[ GPS_GEOFENCE_BUCKETS ];
+    int                    links[ GPS_GEOFENCE_MAX * GPS_GEOFENCE_MAX_CELLS ];
+    int                    id_buckets[ GPS_GEOFENCE_BUCKETS ];
+    int                    id_links[ GPS_GEOFENCE_MAX ];
+    int                    free[ GPS_GEOFENCE_MAX ];   /* removed fence slots */
+    int                    free_count;
+    int                    unused;     /* slots from here on were never used */
+    int                    watch[ GPS_GEOFENCE_MAX ];  /* fences not known to be outside */
+    int                    watch_count;
+    int                    watch_pos[ GPS_GEOFENCE_MAX ];
+    int                    wide[ GPS_GEOFENCE_MAX ];   /* fences not in the grid */
+    int                    wide_count;
+    int                    wide_pos[ GPS_GEOFENCE_MAX ];
+    GpsGeofence            fences[ GPS_GEOFENCE_MAX ];
+} GpsGeofences;
+
+/* this can be used before the gps state is initialized */
+static GpsGeofences  _gps_geofences[1] = { { .lock = PTHREAD_MUTEX_INITIALIZER } };
+
+typedef struct {
+    int32_t  id;
+    int32_t  transition;
+} GpsGeofenceEvent;
+
+static uint64_t
+geofence_cell_key( int32_t  lat_cell, int32_t  lon_cell )
+{
+    return ((uint64_t)(uint32_t)lat_cell << 32) | (uint32_t)lon_cell;
+}
+
+static int
+geofence_bucket( uint64_t  key )
+{
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (int)(key >> 32) & (GPS_GEOFENCE_BUCKETS - 1);
+}
+
+static void
+geofence_list_add( int*  list, int*  count, int*  pos, int  idx )
+{
+    if (pos[idx])
+        return;
+    list[*count] = idx + 1;
+    *count += 1;
+    pos[idx] = *count;
+}
+
+static void
+geofence_list_remove( int*  list, int*  count, int*  pos, int  idx )
+{
+    int  at = pos[idx] - 1;
+    int  last;
+
+    if (at < 0)
+        return;
+    *count -= 1;
+    last = list[*count];
+    list[at] = last;
+    pos[last - 1] = at + 1;
+    pos[idx] = 0;
+}
+
+/* link the fence 'idx' into the cells covering its bounding box (with room
+ * for the hysteresis), or into the wide list if it covers too many cells */
+static void
+geofence_index( GpsGeofences*  g, int  idx )
+{
+    GpsGeofence*  f = &g->fences[idx];
+    double        dlat = f->radius * 1.5 / METERS_PER_DEGREE;
+    double        coslat = cos(f->latitude * M_PI / 180.0);
+    double        dlon;
+    int32_t       lat0, lat1, lon0, lon1, la, lo;
+
+    f->ncells = 0;
+    if (coslat < 0.01)
+        goto Wide;
+
+    dlon = dlat / coslat;
+    if (f->longitude - dlon < -180.0 || f->longitude + dlon > 180.0)
+        goto Wide;
+
+    lat0 = (int32_t)floor((f->latitude  - dlat) / GPS_GEOFENCE_CELL_DEG);
+    lat1 = (int32_t)floor((f->latitude  + dlat) / GPS_GEOFENCE_CELL_DEG);
+    lon0 = (int32_t)floor((f->longitude - dlon) / GPS_GEOFENCE_CELL_DEG);
+    lon1 = (int32_t)floor((f->longitude + dlon) / GPS_GEOFENCE_CELL_DEG);
+    if ((int64_t)(lat1 - lat0 + 1) * (lon1 - lon0 + 1) > GPS_GEOFENCE_MAX_CELLS)
+        goto Wide;
+
+    for (la = lat0; la <= lat1; la++) {
+        for (lo = lon0; lo <= lon1; lo++) {
+            uint64_t  key  = geofence_cell_key(la, lo);
+            int       node = idx * GPS_GEOFENCE_MAX_CELLS + f->ncells;
+            int       b    = geofence_bucket(key);
+
+            f->cells[f->ncells++] = key;
+            g->links[node] = g->buckets[b];
+            g->buckets[b]  = node + 1;
+        }
+    }
+    return;
+
+Wide:
+    geofence_list_add(g->wide, &g->wide_count, g->wide_pos, idx);
+}
+
+static void
+geofence_unindex( GpsGeofences*  g, int  idx )
+{
+    GpsGeofence*  f = &g->fences[idx];
+    int           n;
+
+    for (n = 0; n < f->ncells; n++) {
+        int   node = idx * GPS_GEOFENCE_MAX_CELLS + n;
+        int*  link = &g->buckets[ geofence_bucket(f->cells[n]) ];
+
+        while (*link && *link != node + 1)
+            link = &g->links[*link - 1];
+        if (*link)
+            *link = g->links[node];
+    }
+    f->ncells = 0;
+    geofence_list_remove(g->wide, &g->wide_count, g->wide_pos, idx);
+}
+
+static int
+geofence_id_bucket( int32_t  id )
+{
+    return geofence_bucket((uint64_t)(uint32_t)id);
+}
+
+static int
+geofence_find( GpsGeofences*  g, int32_t  id )
+{
+    int  node;
+    for (node = g->id_buckets[ geofence_id_bucket(id) ]; node; node = g->id_links[node - 1]) {
+        if (g->fences[node - 1].id == id)
+            return node - 1;
+    }
+    return -1;
+}
+
+/* take a free fence slot and link it under 'id', returns -1 if all of
+ * them are used */
+static int
+geofence_alloc( GpsGeofences*  g, int32_t  id )
+{
+    int  idx, b;
+
+    if (g->free_count > 0)
+        idx = g->free[--g->free_count];
+    else if (g->unused < GPS_GEOFENCE_MAX)
+        idx = g->unused++;
+    else
+        return -1;
+
+    b = geofence_id_bucket(id);
+    g->id_links[idx] = g->id_buckets[b];
+    g->id_buckets[b] = idx + 1;
+    return idx;
+}
+
+static void
+geofence_free( GpsGeofences*  g, int  idx )
+{
+    int*  link = &g->id_buckets[ geofence_id_bucket(g->fences[idx].id) ];
+
+    while (*link && *link != idx + 1)
+        link = &g->id_links[*link - 1];
+    if (*link)
+        *link = g->id_links[idx];
+    g->fences[idx].used = 0;
+    g->free[g->free_count++] = idx;
+}
+
+static double
+geofence_distance( double  lat1, double  lon1, double  lat2, double  lon2 )
+{
+    double  dlat = (lat2 - lat1) * M_PI / 180.0;
+    double  dlon = (lon2 - lon1) * M_PI / 180.0;
+    double  a    = sin(dlat/2) * sin(dlat/2) +
+                   cos(lat1 * M_PI / 180.0) * cos(lat2 * M_PI / 180.0) *
+                   sin(dlon/2) * sin(dlon/2);
+    return 2 * EARTH_RADIUS_METERS * atan2(sqrt(a), sqrt(1 - a));
+}
+
+/* check one fence against a fix, and record a transition in 'events' once
+ * the new state held for the dwell time. returns the new number of events.
+ * must be called with g->lock held */
+static int
+geofence_check( GpsGeofences*  g, int  idx, const GpsLocation*  fix,
+                GpsGeofenceEvent*  events, int  count )
+{
+    GpsGeofence*  f = &g->fences[idx];
+    double        margin, d;
+    int           target = 0;
+
+    if (f->visit == g->visit || f->paused)
+        return count;
+    /* a pending state only counts if it was seen on the previous fix too,
+     * a fence that wasn't checked since may have been left in between */
+    if (f->visit != g->visit - 1)
+        f->pending = 0;
+    f->visit = g->visit;
+
+    /* only trust a transition when the fix uncertainty cannot undo it */
+    margin = (fix->flags & GPS_LOCATION_HAS_ACCURACY) ? fix->accuracy : 0;
+    if (margin < GPS_GEOFENCE_MARGIN_M)
+        margin = GPS_GEOFENCE_MARGIN_M;
+    if (margin > f->radius / 2)
+        margin = f->radius / 2;
+
+    d = geofence_distance(fix->latitude, fix->longitude, f->latitude, f->longitude);
+    if (d <= f->radius - margin)
+        target = GPS_GEOFENCE_ENTERED;
+    else if (d > f->radius + margin)
+        target = GPS_GEOFENCE_EXITED;
+
+    if (target != 0) {
+        f->decided = fix->timestamp;
+    } else if (f->unknown_ms > 0 && fix->timestamp - f->decided >= f->unknown_ms) {
+        /* the fixes stayed within the margin for the unknown timer, that
+         * already took longer than the dwell time */
+        target = GPS_GEOFENCE_UNCERTAIN;
+    }
+
+    if (target == 0 || target == f->state) {
+        f->pending = 0;
+        return count;
+    }
+
+    if (target != GPS_GEOFENCE_UNCERTAIN) {
+        if (f->pending != target) {
+            f->pending       = target;
+            f->pending_since = fix->timestamp;
+        }
+        if (fix->timestamp - f->pending_since < GPS_GEOFENCE_DWELL_MS)
+            return count;
+    }
+
+    f->state   = target;
+    f->pending = 0;
+    if (target == GPS_GEOFENCE_EXITED)
+        geofence_list_remove(g->watch, &g->watch_count, g->watch_pos, idx);
+    else
+        geofence_list_add(g->watch, &g->watch_count, g->watch_pos, idx);
+
+    if (f->monitor & target) {
+        events[count].id         = f->id;
+        events[count].transition = target;
+        count++;
+    }
+    return count;
+}
+
+/* evaluate all the relevant geofences against a new fix. this runs in the
+ * gps thread, transitions are reported in one batch once the lock is
+ * released */
+static void
+gps_geofence_update( const GpsLocation*  fix )
+{
+    GpsGeofences*          g = _gps_geofences;
+    GpsGeofenceCallbacks*  cb;
+    GpsGeofenceEvent       events[ GPS_GEOFENCE_MAX ];
+    GpsLocation            location = *fix;
+    int                    count = 0, n, node;
+    uint64_t               key;
+
+    if (!(fix->flags & GPS_LOCATION_HAS_LAT_LONG))
+        return;
+
+    pthread_mutex_lock(&g->lock);
+    cb = g->callbacks;
+    if (cb == NULL) {
+        pthread_mutex_unlock(&g->lock);
+        return;
+    }
+    g->visit++;
+
+    /* fences that may be exited, or whose state is still unknown */
+    for (n = g->watch_count - 1; n >= 0; n--)
+        count = geofence_check(g, g->watch[n] - 1, fix, events, count);
+
+    for (n = g->wide_count - 1; n >= 0; n--)
+        count = geofence_check(g, g->wide[n] - 1, fix, events, count);
+
+    key = geofence_cell_key((int32_t)floor(fix->latitude  / GPS_GEOFENCE_CELL_DEG),
+                            (int32_t)floor(fix->longitude / GPS_GEOFENCE_CELL_DEG));
+    for (node = g->buckets[ geofence_bucket(key) ]; node; node = g->links[node - 1]) {
+        int  idx = (node - 1) / GPS_GEOFENCE_MAX_CELLS;
+        if (g->fences[idx].cells[ (node - 1) % GPS_GEOFENCE_MAX_CELLS ] == key)
+            count = geofence_check(g, idx, fix, events, count);
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    for (n = 0; n < count; n++) {
+        D("%s: geofence %d transition %d", __FUNCTION__, events[n].id, events[n].transition);
+        cb->geofence_transition_callback(events[n].id, &location,
+                                         events[n].transition, location.timestamp);
+    }
+}
+
 /*****************************************************************/
 /*****************************************************************/
 /*****                                                       *****/
@@ -222,10 +800,11 @@ str2float( const char*  p, const char*  end )
 /*****************************************************************/
 /*****************************************************************/
 
-#define  NMEA_MAX_SIZE  1024
+#define  NMEA_MAX_SIZE   1024
+#define  NMEA_READ_SIZE  4096
 
 typedef struct {
-    int     pos;
+    int     pos;        /* number of bytes of the pending partial sentence */
     int     overflow;
     int     utc_year;
     int     utc_mon;
@@ -235,9 +814,23 @@ typedef struct {
     GnssData    gnss_data;
     int         gnss_count;
 
-    char    in[ NMEA_MAX_SIZE+1 ];
+    /* a partial sentence of at most NMEA_MAX_SIZE bytes, followed by
+     * room for one full read from the gps pipe */
+    char    in[ NMEA_MAX_SIZE + NMEA_READ_SIZE ];
     bool    gnss_enabled; /* passed in from _gps_state */
     bool    fix_provided_by_gnss; /* passed in from _gps_state */
+
+    /* when replaying a recording, fix times are rebased so that the first
+     * one received maps to the current time, and the following ones advance
+     * 'replay_speed' times slower than the recorded ones. GNSS clocks are
+     * reported as recorded: time_ns, full_bias_ns and the measurements'
+     * received_sv_time_in_ns only make sense together, so changing any of
+     * them would corrupt every pseudorange */
+    bool     rebase_time;
+    int      replay_speed;
+    bool     fix_base_valid;
+    int64_t  fix_first_ms;      /* first recorded fix time */
+    int64_t  fix_start_ms;      /* current time when it was received */
 } NmeaReader;
 
 static void
@@ -256,7 +849,8 @@ nmea_reader_init( NmeaReader*  r )
     GpsState*  s = _gps_state;
     r->gnss_enabled = s->gnss_enabled;
     r->fix_provided_by_gnss = s->fix_provided_by_gnss;
-
+    r->rebase_time = s->replay.data != NULL;
+    r->replay_speed = s->replay.speed > 1 ? s->replay.speed : 1;
 }
 
 
@@ -294,6 +888,16 @@ nmea_reader_update_time( NmeaReader*  r, Token  tok )
 
     fix_time = timegm( &tm );
     r->fix.timestamp = (long long)fix_time * 1000;
+
+    if (r->rebase_time) {
+        if (!r->fix_base_valid) {
+            r->fix_first_ms   = r->fix.timestamp;
+            r->fix_start_ms   = (int64_t)time(NULL) * 1000;
+            r->fix_base_valid = true;
+        }
+        r->fix.timestamp = r->fix_start_ms +
+                           (r->fix.timestamp - r->fix_first_ms) / r->replay_speed;
+    }
     return 0;
 }
 
@@ -324,14 +928,42 @@ nmea_reader_update_date( NmeaReader*  r, Token  date, Token  time )
 }
 
 
+/* number of decimals of the minutes kept by convert_from_hhmm() */
+#define  MINUTES_DECIMALS  7
+
+/* convert a 'dddmm.mmmm' coordinate to degrees. the minutes are
+ * accumulated as a fixed-point integer, so there is a single floating
+ * point division per coordinate */
 static double
 convert_from_hhmm( Token  tok )
 {
-    double  val     = str2float(tok.p, tok.end);
-    int     degrees = (int)(floor(val) / 100);
-    double  minutes = val - degrees*100.;
-    double  dcoord  = degrees + minutes / 60.0;
-    return dcoord;
+    const char*  p = tok.p;
+    int64_t      whole = 0, minutes;
+    int          decimals = 0;
+
+    for ( ; p < tok.end && (unsigned)(*p - '0') < 10; p++ )
+        whole = whole*10 + (*p - '0');
+
+    minutes = (whole % 100);
+    if (p < tok.end && *p == '.') {
+        for (p++; p < tok.end && (unsigned)(*p - '0') < 10; p++) {
+            if (decimals < MINUTES_DECIMALS) {
+                minutes = minutes*10 + (*p - '0');
+                decimals++;
+            }
+        }
+    }
+    for ( ; decimals < MINUTES_DECIMALS; decimals++ )
+        minutes *= 10;
+
+    if (p != tok.end) {
+        /* not the usual shape, use the generic parser */
+        double  val     = str2float(tok.p, tok.end);
+        int     degrees = (int)(floor(val) / 100);
+        return degrees + (val - degrees*100.) / 60.0;
+    }
+
+    return (double)(whole / 100) + minutes / (60.0 * kPow10[MINUTES_DECIMALS]);
 }
 
 
@@ -472,7 +1104,7 @@ nmea_reader_set_callback( NmeaReader*  r, gps_location_callback  cb )
 }
 
 static void
-nmea_reader_parse( NmeaReader*  r )
+nmea_reader_parse( NmeaReader*  r, const char*  p, const char*  end )
 {
    /* we received a complete sentence, now parse it to generate
     * a new GPS fix...
@@ -480,13 +1112,13 @@ nmea_reader_parse( NmeaReader*  r )
     NmeaTokenizer  tzer[1];
     Token          tok;
 
-    D("Received: '%.*s'", r->pos, r->in);
-    if (r->pos < 9) {
+    D("Received: '%.*s'", (int)(end - p), p);
+    if (end - p < 9) {
         D("Too short. discarded.");
         return;
     }
 
-    nmea_tokenizer_init(tzer, r->in, r->in + r->pos);
+    nmea_tokenizer_init(tzer, p, end);
 #if GPS_DEBUG
     {
         int  n;
@@ -609,12 +1241,20 @@ nmea_reader_parse( NmeaReader*  r )
         gmtime_r( (time_t*) &timestamp, &utc );
         p += snprintf(p, end-p, " time=%s", asctime( &utc ) );
 #endif
+        gps_geofence_update( &r->fix );
+
+        int  batched = gps_batch_add_fix( _gps_state, &r->fix );
+
         if (r->callback) {
             D("%s", temp);
             r->callback( &r->fix );
             /* we have sent a complete fix, now prepare for next complete fix */
             r->fix.flags = 0;
         }
+        else if (batched) {
+            /* the fix is kept in the batch, prepare for next complete fix */
+            r->fix.flags = 0;
+        }
         else {
             D("no callback, keeping data until needed !");
         }
@@ -637,29 +1277,285 @@ nmea_reader_parse( NmeaReader*  r )
 }
 
 
-static void
-nmea_reader_addc( NmeaReader*  r, int  c )
+/* read as much as possible from 'fd' right after the pending partial
+ * sentence, and parse every complete sentence in place. returns the
+ * result of read() */
+static int
+nmea_reader_read( NmeaReader*  r, int  fd )
 {
-    if (r->overflow) {
-        r->overflow = (c != '\n');
-        return;
+    char*        start = r->in;
+    const char*  scan  = r->in + r->pos;
+    const char*  end;
+    const char*  eol;
+    int          ret, len;
+
+    do {
+        ret = read( fd, r->in + r->pos, sizeof(r->in) - r->pos );
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0)
+        return ret;
+
+    D("received %d bytes: %.*s", ret, ret, r->in + r->pos);
+    end = r->in + r->pos + ret;
+
+    while ((eol = memchr(scan, '\n', end - scan)) != NULL) {
+        if (r->overflow) {
+            /* end of a sentence that was too long, drop it */
+            r->overflow = 0;
+        } else {
+            nmea_reader_parse( r, start, eol + 1 );
+        }
+        start = (char*)eol + 1;
+        scan  = start;
     }
 
-    if (r->pos >= (int) sizeof(r->in)-1 ) {
+    len = end - start;
+    if (r->overflow || len > NMEA_MAX_SIZE) {
+        /* ignore everything up to the next newline */
         r->overflow = 1;
-        r->pos      = 0;
-        return;
+        len = 0;
+    }
+
+    /* only the tail of an incomplete sentence is ever moved */
+    if (len > 0 && start != r->in)
+        memmove( r->in, start, len );
+    r->pos = len;
+    return ret;
+}
+
+
+/*****************************************************************/
+/*****************************************************************/
+/*****                                                       *****/
+/*****       R E P L A Y                                     *****/
+/*****                                                       *****/
+/*****************************************************************/
+/*****************************************************************/
+
+/* a recording is a text file with one sentence per line, each prefixed
+ * by the time in milliseconds at which it was received, e.g.:
+ *
+ *   1000 $GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47
+ *   1000 $GPGNSSv1,...
+ *
+ * lines without a time prefix are sent together with the previous ones.
+ * recordings are expected under /data/vendor/gps, which the GNSS HAL may
+ * read. the recording is mapped in memory and streamed to the gps thread through
+ * a socket pair, so a slow reader blocks the replay instead of dropping
+ * sentences.
+ */
+
+/* the path of the recording to replay instead of the qemu pipe */
+#define  GPS_REPLAY_PROPERTY        "ro.kernel.qemu.gps.replay"
+/* replay speed, as a multiplier of the recorded time */
+#define  GPS_REPLAY_SPEED_PROPERTY  "ro.kernel.qemu.gps.replay_speed"
+
+/* max number of sentences sent with a single sendmsg() */
+#define  GPS_REPLAY_MAX_IOV  64
+
+static int64_t
+gps_replay_now_ms( void )
+{
+    struct timespec  now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* wait until 'deadline_ms', or until the gps thread's end of the socket
+ * pair is shut down. returns 0 on timeout, -1 when asked to quit */
+static int
+gps_replay_wait( GpsReplay*  rp, int64_t  deadline_ms )
+{
+    struct pollfd  pfd;
+    int64_t        delay;
+
+    pfd.fd     = rp->fd;
+    pfd.events = POLLIN;   /* becomes readable (EOF) on shutdown */
+
+    while ((delay = deadline_ms - gps_replay_now_ms()) > 0) {
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, delay > INT32_MAX ? INT32_MAX : (int)delay);
+        if (ret > 0)
+            return -1;
+        if (ret < 0 && errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+gps_replay_send( GpsReplay*  rp, struct iovec*  iov, int  count )
+{
+    struct msghdr  msg;
+
+    memset(&msg, 0, sizeof(msg));
+    while (count > 0) {
+        ssize_t  ret;
+
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = count;
+        ret = sendmsg(rp->fd, &msg, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* skip what was written, the socket may accept a partial batch */
+        while (count > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+static void*
+gps_replay_thread( void*  arg )
+{
+    GpsReplay*    rp  = (GpsReplay*) arg;
+    const char*   p   = rp->data;
+    const char*   end = rp->data + rp->size;
+    int64_t       start_ms = gps_replay_now_ms();
+    int64_t       first_ms = -1;
+    struct iovec  iov[ GPS_REPLAY_MAX_IOV ];
+
+    D("gps replay thread running, %zu bytes at %dx", rp->size, rp->speed);
+
+    while (p < end) {
+        int      count = 0;
+        int64_t  stamp = -1;
+
+        /* collect the sentences sharing the same time stamp */
+        while (p < end && count < GPS_REPLAY_MAX_IOV) {
+            const char*  eol = memchr(p, '\n', end - p);
+            const char*  q   = p;
+            int64_t      t   = 0;
+
+            eol = eol ? eol + 1 : end;
+            while (q < eol && (unsigned)(*q - '0') < 10)
+                t = t*10 + (*q++ - '0');
+
+            if (q > p) {
+                if (count > 0 && t != stamp)
+                    break;
+                stamp = t;
+                while (q < eol && *q == ' ')
+                    q++;
+            }
+
+            if (q < eol) {
+                iov[count].iov_base = (void*)q;
+                iov[count].iov_len  = eol - q;
+                count++;
+            }
+            p = eol;
+        }
+
+        if (stamp >= 0) {
+            if (first_ms < 0)
+                first_ms = stamp;
+            if (gps_replay_wait(rp, start_ms + (stamp - first_ms) / rp->speed) < 0)
+                break;
+        }
+
+        if (count > 0 && gps_replay_send(rp, iov, count) < 0) {
+            D("gps replay stopped: %s", strerror(errno));
+            break;
+        }
     }
 
-    r->in[r->pos] = (char)c;
-    r->pos       += 1;
+    D("gps replay thread done");
+    return NULL;
+}
+
+/* map the recording named by GPS_REPLAY_PROPERTY and start streaming it.
+ * returns the fd the gps thread must read from, or -1 if there is no
+ * recording to replay */
+static int
+gps_replay_open( GpsReplay*  rp )
+{
+    char         path[PROPERTY_VALUE_MAX];
+    char         speed[PROPERTY_VALUE_MAX];
+    struct stat  st;
+    int          sv[2] = { -1, -1 };
+    int          fd;
+    void*        data;
+
+    rp->data = NULL;
+    rp->fd   = -1;
 
-    if (c == '\n') {
-        nmea_reader_parse( r );
-        r->pos = 0;
+    if (property_get(GPS_REPLAY_PROPERTY, path, "") <= 0 || path[0] == 0)
+        return -1;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("could not open gps recording '%s': %s", path, strerror(errno));
+        return -1;
     }
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        ALOGE("could not use gps recording '%s'", path);
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        ALOGE("could not map gps recording '%s': %s", path, strerror(errno));
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    if ( socketpair( AF_LOCAL, SOCK_STREAM, 0, sv ) < 0 ) {
+        ALOGE("could not create gps replay socket pair: %s", strerror(errno));
+        munmap(data, st.st_size);
+        return -1;
+    }
+
+    property_get(GPS_REPLAY_SPEED_PROPERTY, speed, "1");
+    rp->speed = atoi(speed);
+    if (rp->speed < 1)
+        rp->speed = 1;
+
+    rp->data = data;
+    rp->size = st.st_size;
+    rp->fd   = sv[1];
+
+    if (pthread_create(&rp->thread, NULL, gps_replay_thread, rp) != 0) {
+        ALOGE("could not create gps replay thread: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        munmap(data, st.st_size);
+        rp->data = NULL;
+        rp->fd   = -1;
+        return -1;
+    }
+
+    D("gps emulation will replay '%s'", path);
+    return sv[0];
 }
 
+/* stop the replay. 'reader_fd' is the gps thread's end of the socket pair */
+static void
+gps_replay_close( GpsReplay*  rp, int  reader_fd )
+{
+    if (rp->data == NULL)
+        return;
+
+    /* wakes the replay thread up, whether it sleeps or is blocked writing */
+    shutdown(reader_fd, SHUT_RDWR);
+    pthread_join(rp->thread, NULL);
+
+    close(rp->fd);
+    munmap((void*)rp->data, rp->size);
+    rp->fd   = -1;
+    rp->data = NULL;
+}
 
 /*****************************************************************/
 /*****************************************************************/
@@ -689,6 +1585,9 @@ gps_state_done( GpsState*  s )
 
     pthread_mutex_destroy(&s->lock);
 
+    // stop replaying a recording, if any
+    gps_replay_close( &s->replay, s->fd );
+
     // close the control socket pair
     close( s->control[0] ); s->control[0] = -1;
     close( s->control[1] ); s->control[1] = -1;
@@ -858,22 +1757,16 @@ gps_state_thread( void*  arg )
                 }
                 else if (fd == gps_fd)
                 {
-                    char  buff[32];
                     D("gps fd event");
                     for (;;) {
-                        int  nn, ret;
-
-                        ret = read( fd, buff, sizeof(buff) );
+                        int  ret = nmea_reader_read( reader, fd );
                         if (ret < 0) {
-                            if (errno == EINTR)
-                                continue;
                             if (errno != EWOULDBLOCK)
                                 ALOGE("error while reading from gps daemon socket: %s:", strerror(errno));
                             break;
                         }
-                        D("received %d bytes: %.*s", ret, ret, buff);
-                        for (nn = 0; nn < ret; nn++)
-                            nmea_reader_addc( reader, buff[nn] );
+                        if (ret == 0)
+                            break;
                     }
                     D("gps fd event end");
                 }
@@ -906,15 +1799,21 @@ gps_state_init( GpsState*  state, GpsCallbacks* callbacks )
     state->control[0] = -1;
     state->control[1] = -1;
     state->fd         = -1;
+    gps_batch_reset(&state->batch);
 
-    state->fd = qemu_pipe_open(QEMU_CHANNEL_NAME);
+    // a local recording replaces the qemu pipe
+    state->fd = gps_replay_open(&state->replay);
+
+    if (state->fd < 0)
+        state->fd = qemu_pipe_open(QEMU_CHANNEL_NAME);
 
     if (state->fd < 0) {
         D("no gps emulation detected");
         return;
     }
 
-    D("gps emulation will read from '%s' qemu pipe", QEMU_CHANNEL_NAME );
+    D("gps emulation will read from '%s'",
+      state->replay.data ? "recording" : QEMU_CHANNEL_NAME );
 
     if ( socketpair( AF_LOCAL, SOCK_STREAM, 0, state->control ) < 0 ) {
         ALOGE("could not create thread control socket pair: %s", strerror(errno));
@@ -937,7 +1836,7 @@ gps_state_init( GpsState*  state, GpsCallbacks* callbacks )
     state->callbacks = *callbacks;
 
     // Explicitly initialize capabilities
-    state->callbacks.set_capabilities_cb(0);
+    state->callbacks.set_capabilities_cb(GPS_CAPABILITY_GEOFENCING);
 
 
 
@@ -949,7 +1848,8 @@ gps_state_init( GpsState*  state, GpsCallbacks* callbacks )
     state->callbacks.set_system_info_cb(&sysinfo);
     if (state->gnss_enabled) {
         D("enabling GPS_CAPABILITY_MEASUREMENTS");
-        state->callbacks.set_capabilities_cb(GPS_CAPABILITY_MEASUREMENTS);
+        state->callbacks.set_capabilities_cb(GPS_CAPABILITY_GEOFENCING |
+                                             GPS_CAPABILITY_MEASUREMENTS);
     }
 
     D("gps state initialized");
@@ -1082,6 +1982,248 @@ static const GpsMeasurementInterface qemuGpsMeasurementInterface  = {
     qemu_gps_measurement_close,
 };
 
+static int qemu_flp_init(FlpCallbacks* callbacks) {
+    /* this runs in main thread */
+    D("calling %s with input %p", __func__, callbacks);
+    GpsState*  s = _gps_state;
+    if (!s->init)
+        return FLP_RESULT_ERROR;
+
+    pthread_mutex_lock(&s->lock);
+    s->flp_callbacks = callbacks;
+    pthread_mutex_unlock(&s->lock);
+
+    if (callbacks && callbacks->flp_capabilities_cb)
+        callbacks->flp_capabilities_cb(CAPABILITY_GNSS);
+    return FLP_RESULT_SUCCESS;
+}
+
+static int qemu_flp_get_batch_size() {
+    return GPS_BATCH_SIZE;
+}
+
+static int qemu_flp_update_batching_options(int id, FlpBatchOptions* options) {
+    GpsState*  s = _gps_state;
+    GpsBatch*  b = &s->batch;
+    int        ret = FLP_RESULT_SUCCESS;
+
+    if (!s->init || options == NULL)
+        return FLP_RESULT_ERROR;
+
+    pthread_mutex_lock(&s->lock);
+    if (b->id != id) {
+        ret = FLP_RESULT_ID_UNKNOWN;
+    } else {
+        b->flags     = options->flags;
+        b->period_ms = options->period_ns / 1000000;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static int qemu_flp_start_batching(int id, FlpBatchOptions* options) {
+    /* only one batching session is supported, a new one replaces it */
+    GpsState*  s = _gps_state;
+    D("%s: id=%d period_ns=%" PRId64, __func__, id, options ? options->period_ns : 0);
+    if (!s->init || options == NULL)
+        return FLP_RESULT_ERROR;
+
+    pthread_mutex_lock(&s->lock);
+    s->batch.id = id;
+    pthread_mutex_unlock(&s->lock);
+    return qemu_flp_update_batching_options(id, options);
+}
+
+static int qemu_flp_stop_batching(int id) {
+    GpsState*  s = _gps_state;
+    int        ret = FLP_RESULT_SUCCESS;
+
+    if (!s->init)
+        return FLP_RESULT_ERROR;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->batch.id != id)
+        ret = FLP_RESULT_ID_UNKNOWN;
+    else
+        s->batch.id = -1;   /* batched fixes stay available until flushed */
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static void qemu_flp_cleanup() {
+    GpsState*  s = _gps_state;
+    if (!s->init)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    gps_batch_reset(&s->batch);
+    s->flp_callbacks = NULL;
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void qemu_flp_get_batched_location(int last_n_locations) {
+    /* fixes are not removed from the batch, see fused_location.h */
+    if (_gps_state->init)
+        gps_batch_deliver(_gps_state, last_n_locations, 0);
+}
+
+static int qemu_flp_inject_location(FlpLocation* __unused location) {
+    return FLP_RESULT_SUCCESS;
+}
+
+static const void* qemu_flp_get_extension(const char* __unused name) {
+    return NULL;
+}
+
+static void qemu_flp_flush_batched_locations() {
+    if (_gps_state->init)
+        gps_batch_deliver(_gps_state, 0, 1);
+}
+
+static const FlpLocationInterface qemuFlpLocationInterface = {
+    sizeof(FlpLocationInterface),
+    qemu_flp_init,
+    qemu_flp_get_batch_size,
+    qemu_flp_start_batching,
+    qemu_flp_update_batching_options,
+    qemu_flp_stop_batching,
+    qemu_flp_cleanup,
+    qemu_flp_get_batched_location,
+    qemu_flp_inject_location,
+    qemu_flp_get_extension,
+    qemu_flp_flush_batched_locations,
+};
+
+static void qemu_gps_geofence_init(GpsGeofenceCallbacks* callbacks) {
+    /* this runs in main thread */
+    D("calling %s with input %p", __func__, callbacks);
+    GpsGeofences*  g = _gps_geofences;
+    pthread_mutex_lock(&g->lock);
+    g->callbacks = callbacks;
+    pthread_mutex_unlock(&g->lock);
+
+    if (callbacks && callbacks->geofence_status_callback)
+        callbacks->geofence_status_callback(GPS_GEOFENCE_AVAILABLE, NULL);
+}
+
+static void qemu_gps_add_geofence_area(int32_t geofence_id,
+                                       double latitude,
+                                       double longitude,
+                                       double radius_meters,
+                                       int last_transition,
+                                       int monitor_transitions,
+                                       int __unused notification_responsiveness_ms,
+                                       int unknown_timer_ms) {
+    GpsGeofences*          g = _gps_geofences;
+    GpsGeofenceCallbacks*  cb;
+    int                    status = GPS_GEOFENCE_OPERATION_SUCCESS;
+    int                    idx;
+
+    pthread_mutex_lock(&g->lock);
+    cb = g->callbacks;
+    if (radius_meters <= 0) {
+        status = GPS_GEOFENCE_ERROR_GENERIC;
+    } else if (geofence_find(g, geofence_id) >= 0) {
+        status = GPS_GEOFENCE_ERROR_ID_EXISTS;
+    } else if (last_transition != GPS_GEOFENCE_ENTERED &&
+               last_transition != GPS_GEOFENCE_EXITED &&
+               last_transition != GPS_GEOFENCE_UNCERTAIN) {
+        status = GPS_GEOFENCE_ERROR_INVALID_TRANSITION;
+    } else {
+        idx = geofence_alloc(g, geofence_id);
+        if (idx < 0) {
+            status = GPS_GEOFENCE_ERROR_TOO_MANY_GEOFENCES;
+        } else {
+            GpsGeofence*  f = &g->fences[idx];
+            memset(f, 0, sizeof(*f));
+            f->used       = 1;
+            f->id         = geofence_id;
+            f->latitude   = latitude;
+            f->longitude  = longitude;
+            f->radius     = radius_meters;
+            f->state      = last_transition;
+            f->monitor    = monitor_transitions;
+            f->unknown_ms = unknown_timer_ms > 0 ? unknown_timer_ms : 0;
+            f->decided    = (GpsUtcTime)time(NULL) * 1000;
+            f->visit      = g->visit;
+            geofence_index(g, idx);
+            if (f->state != GPS_GEOFENCE_EXITED)
+                geofence_list_add(g->watch, &g->watch_count, g->watch_pos, idx);
+        }
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    D("%s: id=%d status=%d", __func__, geofence_id, status);
+    if (cb && cb->geofence_add_callback)
+        cb->geofence_add_callback(geofence_id, status);
+}
+
+static void qemu_gps_pause_geofence(int32_t geofence_id) {
+    GpsGeofences*          g = _gps_geofences;
+    GpsGeofenceCallbacks*  cb;
+    int                    idx;
+
+    pthread_mutex_lock(&g->lock);
+    cb  = g->callbacks;
+    idx = geofence_find(g, geofence_id);
+    if (idx >= 0)
+        g->fences[idx].paused = 1;
+    pthread_mutex_unlock(&g->lock);
+
+    if (cb && cb->geofence_pause_callback)
+        cb->geofence_pause_callback(geofence_id, idx >= 0 ? GPS_GEOFENCE_OPERATION_SUCCESS
+                                                          : GPS_GEOFENCE_ERROR_ID_UNKNOWN);
+}
+
+static void qemu_gps_resume_geofence(int32_t geofence_id, int monitor_transitions) {
+    GpsGeofences*          g = _gps_geofences;
+    GpsGeofenceCallbacks*  cb;
+    int                    idx;
+
+    pthread_mutex_lock(&g->lock);
+    cb  = g->callbacks;
+    idx = geofence_find(g, geofence_id);
+    if (idx >= 0) {
+        g->fences[idx].paused  = 0;
+        g->fences[idx].monitor = monitor_transitions;
+        g->fences[idx].decided = (GpsUtcTime)time(NULL) * 1000;
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    if (cb && cb->geofence_resume_callback)
+        cb->geofence_resume_callback(geofence_id, idx >= 0 ? GPS_GEOFENCE_OPERATION_SUCCESS
+                                                           : GPS_GEOFENCE_ERROR_ID_UNKNOWN);
+}
+
+static void qemu_gps_remove_geofence_area(int32_t geofence_id) {
+    GpsGeofences*          g = _gps_geofences;
+    GpsGeofenceCallbacks*  cb;
+    int                    idx;
+
+    pthread_mutex_lock(&g->lock);
+    cb  = g->callbacks;
+    idx = geofence_find(g, geofence_id);
+    if (idx >= 0) {
+        geofence_unindex(g, idx);
+        geofence_list_remove(g->watch, &g->watch_count, g->watch_pos, idx);
+        geofence_free(g, idx);
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    if (cb && cb->geofence_remove_callback)
+        cb->geofence_remove_callback(geofence_id, idx >= 0 ? GPS_GEOFENCE_OPERATION_SUCCESS
+                                                           : GPS_GEOFENCE_ERROR_ID_UNKNOWN);
+}
+
+static const GpsGeofencingInterface qemuGpsGeofencingInterface = {
+    sizeof(GpsGeofencingInterface),
+    qemu_gps_geofence_init,
+    qemu_gps_add_geofence_area,
+    qemu_gps_pause_geofence,
+    qemu_gps_resume_geofence,
+    qemu_gps_remove_geofence_area,
+};
+
 static const void*
 qemu_gps_get_extension(const char* name)
 {
@@ -1093,6 +2235,14 @@ qemu_gps_get_extension(const char* name)
             return &qemuGpsMeasurementInterface;
         }
     }
+    if(name && strcmp(name, GPS_GEOFENCING_INTERFACE) == 0) {
+        return &qemuGpsGeofencingInterface;
+    }
+    if(name && strcmp(name, QEMU_FLP_BATCHING_INTERFACE) == 0) {
+        /* batching shares the fix stream of the gps thread, the FLP
+         * module (flp_qemu.c) forwards this to the framework */
+        return &qemuFlpLocationInterface;
+    }
     return NULL;
 }
 
@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _QEMU_FLP_H
+#define _QEMU_FLP_H
+
+/* name of the GPS HAL extension returning its FlpLocationInterface
+ * (batching), looked up by the FLP HAL module in flp_qemu.c */
+#define  QEMU_FLP_BATCHING_INTERFACE  "qemu-flp-batching"
+
+#endif /* _QEMU_FLP_H */
@@ -18,42 +18,185 @@
 
 #include "log.h"
 
+#include <arpa/inet.h>
 #include <errno.h>
-#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+
+// Address changes are sent in datagrams of at most this size. Each change is
+// less than a hundred bytes so this fits plenty of them while staying well
+// below the default socket send buffer size.
+static const size_t kMaxBatchSize = 8192;
+static const size_t kBitsPerWord = 64;
+
+static void appendAttribute(std::vector<char>* batch,
+                            uint16_t type,
+                            const void* data,
+                            size_t size) {
+    size_t offset = batch->size();
+    batch->resize(offset + RTA_SPACE(size), 0);
+    auto attr = reinterpret_cast<struct rtattr*>(batch->data() + offset);
+    attr->rta_type = type;
+    attr->rta_len = RTA_LENGTH(size);
+    memcpy(RTA_DATA(attr), data, size);
+}
+
 AddressAssigner::AddressAssigner(const char* interfacePrefix,
                                  in_addr_t baseAddress,
                                  uint32_t maskLength) :
     mInterfacePrefix(interfacePrefix),
     mPrefixLength(strlen(interfacePrefix)),
     mBaseAddress(baseAddress),
-    mMaskLength(maskLength) {
+    mMaskLength(maskLength),
+    mSubnetCount(0),
+    mFirstFreeWord(0),
+    mSocketFd(-1),
+    mSequence(0),
+    mFlushDeadline(Pollable::Timestamp::max()) {
+    if (mMaskLength <= 30) {
+        // Only count the subnets that fit entirely in the address space, the
+        // same subnet size math as in assignAddress applies here.
+        uint64_t increment = 1ULL << (32 - mMaskLength);
+        mSubnetCount = ((1ULL << 32) - ntohl(mBaseAddress)) / increment;
+    }
+}
 
+AddressAssigner::~AddressAssigner() {
+    closeSocket();
 }
 
-void AddressAssigner::onInterfaceState(unsigned int /*index*/,
+Result AddressAssigner::init() {
+    return openSocket();
+}
+
+void AddressAssigner::onInterfaceState(unsigned int index,
                                        const char* name,
                                        InterfaceState state) {
-    if (strncmp(name, mInterfacePrefix, mPrefixLength) != 0) {
-        // The interface does not match the prefix, ignore this change
-        return;
-    }
-
     switch (state) {
         case InterfaceState::Up:
-            assignAddress(name);
+            if (strncmp(name, mInterfacePrefix, mPrefixLength) != 0) {
+                // The interface does not match the prefix, ignore this change
+                return;
+            }
+            assignAddress(index, name);
             break;
         case InterfaceState::Down:
-            freeAddress(name);
+            // The interface may already be gone in which case it no longer
+            // has a name, only interfaces we assigned an address to are
+            // affected so there is no need to check the prefix.
+            freeAddress(index, name);
             break;
     }
 }
 
-void AddressAssigner::assignAddress(const char* interfaceName) {
+void AddressAssigner::getPollData(std::vector<pollfd>* fds) const {
+    if (mSocketFd != -1) {
+        fds->push_back(pollfd{mSocketFd, POLLIN, 0});
+    }
+}
+
+Pollable::Timestamp AddressAssigner::getTimeout() const {
+    return mFlushDeadline;
+}
+
+bool AddressAssigner::onReadAvailable(int /*fd*/, int* /*status*/) {
+    char buffer[32768];
+    while (true) {
+        ssize_t received = ::recv(mSocketFd, buffer, sizeof(buffer),
+                                  MSG_DONTWAIT);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Nothing to receive, everything is fine
+                return true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOBUFS) {
+                // Acks were dropped, there is no way of knowing which ones so
+                // stop waiting for any of them.
+                LOGE("AddressAssigner lost %zu address change acks",
+                     mAwaitingAck.size());
+                mAwaitingAck.clear();
+                continue;
+            }
+            LOGE("AddressAssigner receive failed: %s", strerror(errno));
+            return true;
+        }
+
+        size_t length = static_cast<size_t>(received);
+        auto hdr = reinterpret_cast<const struct nlmsghdr*>(buffer);
+        for (; NLMSG_OK(hdr, length); hdr = NLMSG_NEXT(hdr, length)) {
+            if (hdr->nlmsg_type == NLMSG_ERROR) {
+                handleAck(hdr);
+            }
+        }
+    }
+}
+
+bool AddressAssigner::onClose(int /*fd*/, int* status) {
+    // Socket was closed from the other end, close it from our end and re-open
+    closeSocket();
+    mAwaitingAck.clear();
+    Result res = openSocket();
+    if (!res) {
+        LOGE("%s", res.c_str());
+        *status = 1;
+        return false;
+    }
+    return true;
+}
+
+bool AddressAssigner::onTimeout(int* /*status*/) {
+    flushChanges();
+    return true;
+}
+
+Result AddressAssigner::openSocket() {
+    if (mSocketFd != -1) {
+        return Result::error("AddressAssigner already initialized");
+    }
+
+    mSocketFd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (mSocketFd == -1) {
+        return Result::error("AddressAssigner failed to open socket: %s",
+                             strerror(errno));
+    }
+
+#ifdef NETLINK_CAP_ACK
+    // Only the header of a request is needed to match up an ack, don't have
+    // the kernel copy the entire request back.
+    int one = 1;
+    ::setsockopt(mSocketFd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#endif
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+
+    struct sockaddr* sa = reinterpret_cast<struct sockaddr*>(&addr);
+    if (::bind(mSocketFd, sa, sizeof(addr)) != 0) {
+        Result res = Result::error("AddressAssigner failed to bind socket: %s",
+                                   strerror(errno));
+        closeSocket();
+        return res;
+    }
+    return Result::success();
+}
+
+void AddressAssigner::closeSocket() {
+    if (mSocketFd != -1) {
+        ::close(mSocketFd);
+        mSocketFd = -1;
+    }
+}
+
+void AddressAssigner::assignAddress(unsigned int index,
+                                    const char* interfaceName) {
     if (mMaskLength > 30) {
         // The mask length is too long, we can't assign enough IP addresses from
         // this. A maximum of 30 bits is supported, leaving 4 remaining
@@ -61,91 +204,206 @@ void AddressAssigner::assignAddress(const char* interfaceName) {
         // client.
         return;
     }
+
+    auto assigned = mInterfaceSubnets.find(index);
+    if (assigned != mInterfaceSubnets.end()) {
+        // The interface already has a subnet, make sure the address is still
+        // there in case it was removed while the interface was up.
+        queueChange(RTM_NEWADDR, index, interfaceName,
+                    subnetToAddress(assigned->second));
+        return;
+    }
+
+    uint32_t subnet = 0;
+    if (!allocateSubnet(&subnet)) {
+        LOGE("AddressAssigner has no free subnet left for %s", interfaceName);
+        return;
+    }
+    mInterfaceSubnets[index] = subnet;
+    queueChange(RTM_NEWADDR, index, interfaceName, subnetToAddress(subnet));
+}
+
+void AddressAssigner::freeAddress(unsigned int index,
+                                  const char* interfaceName) {
+    auto assigned = mInterfaceSubnets.find(index);
+    if (assigned == mInterfaceSubnets.end()) {
+        return;
+    }
+    // Remove the address so that it doesn't linger on the interface in case
+    // it comes back up and is assigned a different subnet.
+    queueChange(RTM_DELADDR, index, interfaceName,
+                subnetToAddress(assigned->second));
+    releaseSubnet(assigned->second);
+    mInterfaceSubnets.erase(assigned);
+}
+
+bool AddressAssigner::allocateSubnet(uint32_t* subnet) {
+    for (size_t word = mFirstFreeWord; true; ++word) {
+        uint64_t first = static_cast<uint64_t>(word) * kBitsPerWord;
+        if (first >= mSubnetCount) {
+            return false;
+        }
+        if (word == mUsedSubnets.size()) {
+            mUsedSubnets.push_back(0);
+        }
+        uint64_t available = ~mUsedSubnets[word];
+        if (available == 0) {
+            // Every subnet in this word is in use, keep looking
+            continue;
+        }
+        unsigned int bit = __builtin_ctzll(available);
+        if (first + bit >= mSubnetCount) {
+            return false;
+        }
+        mUsedSubnets[word] |= 1ULL << bit;
+        mFirstFreeWord = word;
+        *subnet = static_cast<uint32_t>(first + bit);
+        return true;
+    }
+}
+
+void AddressAssigner::releaseSubnet(uint32_t subnet) {
+    size_t word = subnet / kBitsPerWord;
+    mUsedSubnets[word] &= ~(1ULL << (subnet % kBitsPerWord));
+    mFirstFreeWord = std::min(mFirstFreeWord, word);
+}
+
+in_addr_t AddressAssigner::subnetToAddress(uint32_t subnet) const {
     // Each subnet will have an amount of bits available to it that equals
     // 32-bits - <mask length>, so if mask length is 29 there will be 3
     // remaining bits for each subnet. Then the distance between each subnet
     // is 2 to the power of this number, in our example 2^3 = 8 so to get to the
-    // next subnet we add 8 to the network address.
+    // next subnet we add 8 to the network address. Do the math in host
+    // byte-order and convert back to network byte-order.
     in_addr_t increment = 1 << (32 - mMaskLength);
+    return htonl(ntohl(mBaseAddress) + subnet * increment);
+}
 
-    // Convert the address to host byte-order first so we can do math on it.
-    for (in_addr_t addr = ntohl(mBaseAddress); true; addr += increment) {
-        // Take the reference of this lookup, that way we can assign a name to
-        // it if needed.
-        auto& usedName = mUsedIpAddresses[addr];
-        if (usedName.empty()) {
-            // This address is not in use, let's use it
-            usedName = interfaceName;
-            // Make sure we convert back to network byte-order when setting it.
-            setIpAddress(interfaceName, htonl(addr));
-            break;
-        }
+void AddressAssigner::queueChange(uint16_t type,
+                                  unsigned int index,
+                                  const char* interfaceName,
+                                  in_addr_t address) {
+    if (mPendingChanges.empty()) {
+        // Flush as soon as the poller is done handling the current events,
+        // any other interface changes that are part of the same burst will
+        // have been queued by then.
+        mFlushDeadline = Pollable::Clock::now();
     }
+    mPendingChanges.push_back(AddressChange{type, index, interfaceName,
+                                            address});
 }
 
-void AddressAssigner::setIpAddress(const char* interfaceName,
-                                   in_addr_t address) {
-    int sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (sock == -1) {
-        LOGE("AddressAssigner unable to open IP socket: %s", strerror(errno));
+void AddressAssigner::flushChanges() {
+    mFlushDeadline = Pollable::Timestamp::max();
+    if (mSocketFd == -1) {
+        LOGE("AddressAssigner dropping %zu address changes, no socket",
+             mPendingChanges.size());
+        mPendingChanges.clear();
         return;
     }
-    if (!setAddress(sock, SIOCSIFADDR, interfaceName, address)) {
-        LOGE("AddressAssigner unable to set interface address: %s",
-             strerror(errno));
-        ::close(sock);
-        return;
+
+    std::vector<char> batch;
+    batch.reserve(kMaxBatchSize);
+    for (const auto& change : mPendingChanges) {
+        size_t before = batch.size();
+        appendChange(change, &batch);
+        if (batch.size() > kMaxBatchSize && before > 0) {
+            // This change didn't fit, send everything before it and start a
+            // new batch with it.
+            std::vector<char> next(batch.begin() + before, batch.end());
+            batch.resize(before);
+            sendBatch(batch);
+            batch.swap(next);
+        }
     }
+    if (!batch.empty()) {
+        sendBatch(batch);
+    }
+    mPendingChanges.clear();
+}
 
-    // The netmask is the inverted maximum value of the lower bits. That is if
-    // the mask length is 29 then the the largest value of the 3 (32-29) lowest
-    // bits is 7 (2^3 - 1) (111 binary). Inverting this value gives the netmask
-    // because it excludes those three bits and sets every other bit.
-    in_addr_t netmask = htonl(~((1 << (32 - mMaskLength)) - 1));
+void AddressAssigner::appendChange(const AddressChange& change,
+                                   std::vector<char>* batch) {
+    size_t offset = batch->size();
+    batch->resize(offset + NLMSG_SPACE(sizeof(struct ifaddrmsg)), 0);
 
-    if (!setAddress(sock, SIOCSIFNETMASK, interfaceName, netmask)) {
-        LOGE("AddressAssigner unable to set interface netmask: %s",
-             strerror(errno));
-        ::close(sock);
-        return;
+    auto hdr = reinterpret_cast<struct nlmsghdr*>(batch->data() + offset);
+    hdr->nlmsg_type = change.type;
+    hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    if (change.type == RTM_NEWADDR) {
+        hdr->nlmsg_flags |= NLM_F_CREATE | NLM_F_REPLACE;
     }
+    hdr->nlmsg_seq = ++mSequence;
 
-    // The broadcast address is just the assigned address with all bits outside
-    // of the netmask set to one.
-    in_addr_t broadcast = address | ~netmask;
+    auto msg = reinterpret_cast<struct ifaddrmsg*>(NLMSG_DATA(hdr));
+    msg->ifa_family = AF_INET;
+    msg->ifa_prefixlen = mMaskLength;
+    msg->ifa_scope = RT_SCOPE_UNIVERSE;
+    msg->ifa_index = change.index;
 
-    if (!setAddress(sock, SIOCSIFBRDADDR, interfaceName, broadcast)) {
-        LOGE("AddressAssigner unable to set interface broadcast: %s",
-             strerror(errno));
-        ::close(sock);
-        return;
+    appendAttribute(batch, IFA_LOCAL, &change.address, sizeof(change.address));
+    appendAttribute(batch, IFA_ADDRESS, &change.address,
+                    sizeof(change.address));
+    if (change.type == RTM_NEWADDR) {
+        // The broadcast address is just the assigned address with all bits
+        // outside of the netmask set to one.
+        in_addr_t netmask = htonl(~((1 << (32 - mMaskLength)) - 1));
+        in_addr_t broadcast = change.address | ~netmask;
+        appendAttribute(batch, IFA_BROADCAST, &broadcast, sizeof(broadcast));
     }
-    ::close(sock);
+
+    // The attributes may have reallocated the batch
+    hdr = reinterpret_cast<struct nlmsghdr*>(batch->data() + offset);
+    hdr->nlmsg_len = batch->size() - offset;
+    mAwaitingAck[hdr->nlmsg_seq] = change;
 }
 
-bool AddressAssigner::setAddress(int sock,
-                                 int type,
-                                 const char* interfaceName,
-                                 in_addr_t address) {
-    struct ifreq request;
-    memset(&request, 0, sizeof(request));
-    strlcpy(request.ifr_name, interfaceName, sizeof(request.ifr_name));
-    auto addr = reinterpret_cast<struct sockaddr_in*>(&request.ifr_addr);
-    addr->sin_family = AF_INET;
-    addr->sin_addr.s_addr = address;
+void AddressAssigner::sendBatch(const std::vector<char>& batch) {
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
 
-    if (::ioctl(sock, type, &request) != 0) {
-        return false;
+    while (true) {
+        ssize_t sent = ::sendto(mSocketFd, batch.data(), batch.size(), 0,
+                                reinterpret_cast<struct sockaddr*>(&kernel),
+                                sizeof(kernel));
+        if (sent >= 0) {
+            return;
+        }
+        if (errno != EINTR) {
+            break;
+        }
+    }
+    LOGE("AddressAssigner unable to send address changes: %s",
+         strerror(errno));
+
+    // None of the changes in this batch will be acknowledged
+    size_t length = batch.size();
+    auto hdr = reinterpret_cast<const struct nlmsghdr*>(batch.data());
+    for (; NLMSG_OK(hdr, length); hdr = NLMSG_NEXT(hdr, length)) {
+        mAwaitingAck.erase(hdr->nlmsg_seq);
     }
-    return true;
 }
 
-void AddressAssigner::freeAddress(const char* interfaceName) {
-    for (auto& ipName : mUsedIpAddresses) {
-        if (ipName.second == interfaceName) {
-            // This is the one, free it up for future use
-            mUsedIpAddresses.erase(ipName.first);
+void AddressAssigner::handleAck(const struct nlmsghdr* hdr) {
+    auto change = mAwaitingAck.find(hdr->nlmsg_seq);
+    if (change == mAwaitingAck.end()) {
+        return;
+    }
+    if (hdr->nlmsg_len >= NLMSG_LENGTH(sizeof(struct nlmsgerr))) {
+        auto err = reinterpret_cast<const struct nlmsgerr*>(NLMSG_DATA(hdr));
+        // Removing an address from an interface that has already been
+        // deleted or that no longer has the address is not a problem.
+        bool ignore = change->second.type == RTM_DELADDR &&
+                      (err->error == -ENODEV || err->error == -EADDRNOTAVAIL);
+        if (err->error != 0 && !ignore) {
+            char address[INET_ADDRSTRLEN];
+            struct in_addr addr = { change->second.address };
+            inet_ntop(AF_INET, &addr, address, sizeof(address));
+            LOGE("AddressAssigner unable to %s address %s on %s: %s",
+                 change->second.type == RTM_NEWADDR ? "set" : "remove",
+                 address, change->second.name.c_str(), strerror(-err->error));
         }
     }
+    mAwaitingAck.erase(change);
 }
-
@@ -17,38 +17,88 @@
 #pragma once
 
 #include "interface_state.h"
+#include "pollable.h"
+#include "result.h"
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <netinet/in.h>
 #include <stdint.h>
 
-class AddressAssigner {
+/** Assign a subnet to each interface matching a prefix as it comes up and
+ *  release it as it goes down. Address changes are not applied immediately,
+ *  they are collected and sent to the kernel as a single netlink batch once
+ *  the current burst of interface events has been handled. The kernel
+ *  acknowledges each change asynchronously on the same socket.
+ */
+class AddressAssigner : public Pollable {
 public:
     AddressAssigner(const char* interfacePrefix,
                     in_addr_t baseAddress,
                     uint32_t maskLength);
+    ~AddressAssigner();
+
+    Result init();
 
     void onInterfaceState(unsigned int index,
                           const char* name,
                           InterfaceState state);
 
+    // Pollable interface
+    void getPollData(std::vector<pollfd>* fds) const override;
+    Timestamp getTimeout() const override;
+    bool onReadAvailable(int fd, int* status) override;
+    bool onClose(int fd, int* status) override;
+    bool onTimeout(int* status) override;
+
 private:
-    void assignAddress(const char* interfaceName);
-    void freeAddress(const char* interfaceName);
+    struct AddressChange {
+        uint16_t type;  // RTM_NEWADDR or RTM_DELADDR
+        unsigned int index;
+        std::string name;
+        in_addr_t address;
+    };
+
+    Result openSocket();
+    void closeSocket();
 
-    void setIpAddress(const char* interfaceName, in_addr_t address);
-    bool setAddress(int socket,
-                    int type,
-                    const char* interfaceName,
-                    in_addr_t address);
-    void removeIpAddress(const char* interfaceName, in_addr_t address);
+    void assignAddress(unsigned int index, const char* interfaceName);
+    void freeAddress(unsigned int index, const char* interfaceName);
+
+    bool allocateSubnet(uint32_t* subnet);
+    void releaseSubnet(uint32_t subnet);
+    in_addr_t subnetToAddress(uint32_t subnet) const;
+
+    void queueChange(uint16_t type,
+                     unsigned int index,
+                     const char* interfaceName,
+                     in_addr_t address);
+    void flushChanges();
+    void appendChange(const AddressChange& change, std::vector<char>* batch);
+    void sendBatch(const std::vector<char>& batch);
+    void handleAck(const struct nlmsghdr* hdr);
 
     const char* mInterfacePrefix;
     size_t mPrefixLength;
     in_addr_t mBaseAddress;
     uint32_t mMaskLength;
-    std::unordered_map<in_addr_t, std::string> mUsedIpAddresses;
-};
+    // The number of subnets that fit between the base address and the end of
+    // the address space.
+    uint64_t mSubnetCount;
+    // One bit per subnet, set if the subnet is assigned to an interface.
+    std::vector<uint64_t> mUsedSubnets;
+    // All words before this index in mUsedSubnets are known to be full.
+    size_t mFirstFreeWord;
+    // Interface index to assigned subnet
+    std::unordered_map<unsigned int, uint32_t> mInterfaceSubnets;
 
+    int mSocketFd;
+    uint32_t mSequence;
+    std::vector<AddressChange> mPendingChanges;
+    Pollable::Timestamp mFlushDeadline;
+    // Changes sent to the kernel that have not been acknowledged yet, keyed
+    // on the sequence number of their request.
+    std::unordered_map<uint32_t, AddressChange> mAwaitingAck;
+};
@@ -19,14 +19,24 @@
 #include "commands/command.h"
 #include "log.h"
 
+#include <endian.h>
 #include <errno.h>
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-function"
 #include <qemu_pipe.h>
 #pragma clang diagnostic pop
+#include <pthread.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <thread>
 
 static const char kQemuPipeName[] = "qemud:network";
 
@@ -35,19 +45,113 @@ static const size_t kReceiveSpace = 1024;
 // The maximum amount of bytes to keep in the receive buffer for a single
 // command before dropping data.
 static const size_t kMaxReceiveBufferSize = 65536;
+// The largest payload a command frame can have, it has to fit in the receive
+// buffer along with its header.
+static const size_t kMaxFrameLength =
+    kMaxReceiveBufferSize - kReceiveSpace - sizeof(CommandFrameHeader);
+
+// Runs the requests for a single command in order on a thread of its own.
+class Commander::Worker {
+public:
+    struct Request {
+        uint32_t connection;
+        bool framed;
+        uint32_t requestId;
+        std::string name;
+        std::string args;
+        bool hasArgs;
+    };
+
+    Worker(Commander* commander, Command* command)
+        : mCommander(commander), mCommand(command), mStopping(false),
+          mThread(&Worker::run, this) {
+    }
+
+    ~Worker() {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mCondition.notify_one();
+        mThread.join();
+    }
+
+    void post(Request request) {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mRequests.push_back(std::move(request));
+        }
+        mCondition.notify_one();
+    }
+
+private:
+    void run() {
+        // Leave signal handling to the poller thread, it unblocks signals
+        // while waiting for events.
+        sigset_t blockMask;
+        ::sigfillset(&blockMask);
+        ::pthread_sigmask(SIG_SETMASK, &blockMask, nullptr);
+
+        while (true) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this] {
+                    return mStopping || !mRequests.empty();
+                });
+                if (mStopping) {
+                    return;
+                }
+                request = std::move(mRequests.front());
+                mRequests.pop_front();
+            }
+
+            Result result = mCommand->onCommand(
+                    request.name.c_str(),
+                    request.hasArgs ? request.args.c_str() : nullptr);
+            mCommander->postReply(Reply(request.connection,
+                                        request.framed,
+                                        request.requestId,
+                                        std::move(request.name),
+                                        std::move(result)));
+        }
+    }
+
+    Commander* mCommander;
+    Command* mCommand;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<Request> mRequests;
+    bool mStopping;
+    // Declared last so that everything above is initialized before the
+    // thread starts running.
+    std::thread mThread;
+};
 
-Commander::Commander() : mPipeFd(-1) {
+Commander::Commander() : mPipeFd(-1), mConnection(0), mWakeFd(-1) {
 }
 
 Commander::~Commander() {
+    // Stop the workers before anything they might use goes away
+    mWorkers.clear();
     closePipe();
+    if (mWakeFd != -1) {
+        ::close(mWakeFd);
+        mWakeFd = -1;
+    }
 }
 
 Result Commander::init() {
-    if (mPipeFd != -1) {
+    if (mPipeFd != -1 || mWakeFd != -1) {
         return Result::error("Commander already initialized");
     }
 
+    mWakeFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (mWakeFd == -1) {
+        return Result::error("Commander unable to create eventfd: %s",
+                             strerror(errno));
+    }
+
     openPipe();
 
     return Result::success();
@@ -55,81 +159,42 @@ Result Commander::init() {
 
 void Commander::registerCommand(const char* commandStr, Command* command) {
     mCommands[commandStr] = command;
+    auto& worker = mWorkers[command];
+    if (!worker) {
+        worker.reset(new Worker(this, command));
+    }
 }
 
 void Commander::getPollData(std::vector<pollfd>* fds) const {
     if (mPipeFd != -1) {
         fds->push_back(pollfd{mPipeFd, POLLIN, 0});
     }
+    if (mWakeFd != -1) {
+        fds->push_back(pollfd{mWakeFd, POLLIN, 0});
+    }
 }
 
 Pollable::Timestamp Commander::getTimeout() const {
     return mDeadline;
 }
 
-bool Commander::onReadAvailable(int /*fd*/, int* /*status*/) {
-    size_t offset = mReceiveBuffer.size();
-    mReceiveBuffer.resize(offset + kReceiveSpace);
-    if (mReceiveBuffer.size() > kMaxReceiveBufferSize) {
-        // We have buffered too much data, this should never happen but as a
-        // seurity measure let's just drop everything we have and keep 
-        // receiving. Maybe the situation will improve.
-        mReceiveBuffer.resize(kReceiveSpace);
-        offset = 0;
-    }
-    while (true) {
-        int status = ::read(mPipeFd, &mReceiveBuffer[offset], kReceiveSpace);
-
-        if (status < 0) {
-            if (errno == EINTR) {
-                // We got an interrupt, try again
-                continue;
-            }
-            LOGE("Commander failed to receive on pipe: %s", strerror(errno));
-            // Don't exit the looper because of this, keep trying
-            return true;
-        }
-        size_t length = static_cast<size_t>(status);
-        mReceiveBuffer.resize(offset + length);
-
-        while (true) {
-            auto endline = std::find(mReceiveBuffer.begin(),
-                                     mReceiveBuffer.end(),
-                                     '\n');
-            if (endline == mReceiveBuffer.end()) {
-                // No endline in sight, keep waiting and buffering
-                return true;
-            }
-
-            *endline = '\0';
-
-            char* args = ::strchr(mReceiveBuffer.data(), ' ');
-            if (args) {
-                *args++ = '\0';
-            }
-            auto command = mCommands.find(mReceiveBuffer.data());
-
-            if (command != mCommands.end()) {
-                command->second->onCommand(mReceiveBuffer.data(), args);
-            }
-            // Now that we have processed this line let's remove it from the
-            // receive buffer
-            ++endline;
-            if (endline == mReceiveBuffer.end()) {
-                mReceiveBuffer.clear();
-                // There can be nothing left, just return
-                return true;
-            } else {
-                mReceiveBuffer.erase(mReceiveBuffer.begin(), endline + 1);
-                // There may be another line in there so keep looping and look
-                // for more
-            }
+bool Commander::onReadAvailable(int fd, int* /*status*/) {
+    if (fd == mWakeFd) {
+        uint64_t count = 0;
+        while (::read(mWakeFd, &count, sizeof(count)) < 0 && errno == EINTR) {
         }
-        return true;
+        sendReplies();
+    } else {
+        receiveFromPipe();
     }
+    return true;
 }
 
-bool Commander::onClose(int /*fd*/, int* /*status*/) {
+bool Commander::onClose(int fd, int* /*status*/) {
+    if (fd == mWakeFd) {
+        // This should never happen, we own both ends of the eventfd
+        return true;
+    }
     // Pipe was closed from the other end, close it on our side and re-open
     closePipe();
     openPipe();
@@ -152,6 +217,8 @@ void Commander::openPipe() {
         // Try again in the future
         mDeadline = Pollable::Clock::now() + std::chrono::minutes(1);
     } else {
+        ++mConnection;
+        mReceiveBuffer.clear();
         mDeadline = Pollable::Timestamp::max();
     }
 }
@@ -162,3 +229,153 @@ void Commander::closePipe() {
         mPipeFd = -1;
     }
 }
+
+void Commander::receiveFromPipe() {
+    size_t offset = mReceiveBuffer.size();
+    mReceiveBuffer.resize(offset + kReceiveSpace);
+    if (mReceiveBuffer.size() > kMaxReceiveBufferSize) {
+        // We have buffered too much data, this should never happen but as a
+        // seurity measure let's just drop everything we have and keep
+        // receiving. Maybe the situation will improve.
+        mReceiveBuffer.resize(kReceiveSpace);
+        offset = 0;
+    }
+
+    int status = 0;
+    do {
+        status = ::read(mPipeFd, &mReceiveBuffer[offset], kReceiveSpace);
+    } while (status < 0 && errno == EINTR);
+    if (status < 0) {
+        LOGE("Commander failed to receive on pipe: %s", strerror(errno));
+        mReceiveBuffer.resize(offset);
+        // Don't exit the looper because of this, keep trying
+        return;
+    }
+    mReceiveBuffer.resize(offset + static_cast<size_t>(status));
+
+    // Process every complete command in the buffer, each parse call removes
+    // what it has processed and returns false if it needs more data.
+    const uint32_t le32magic = htole32(kCommandFrameMagic);
+    while (!mReceiveBuffer.empty()) {
+        size_t compare = std::min(mReceiveBuffer.size(), sizeof(le32magic));
+        bool isFrame = memcmp(mReceiveBuffer.data(), &le32magic, compare) == 0;
+        if (!(isFrame ? parseFrame() : parseLine())) {
+            break;
+        }
+    }
+}
+
+bool Commander::parseFrame() {
+    CommandFrameHeader header;
+    if (mReceiveBuffer.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, mReceiveBuffer.data(), sizeof(header));
+    uint32_t length = le32toh(header.length);
+    if (length > kMaxFrameLength) {
+        // There is no way to recover from this, there is nothing to indicate
+        // where the next command starts so drop everything.
+        LOGE("Commander received frame of %u bytes, dropping data", length);
+        mReceiveBuffer.clear();
+        return false;
+    }
+    size_t frameSize = sizeof(header) + length;
+    if (mReceiveBuffer.size() < frameSize) {
+        return false;
+    }
+    dispatch(mReceiveBuffer.data() + sizeof(header), length, true,
+             le32toh(header.requestId));
+    mReceiveBuffer.erase(mReceiveBuffer.begin(),
+                         mReceiveBuffer.begin() + frameSize);
+    return true;
+}
+
+bool Commander::parseLine() {
+    auto endline = std::find(mReceiveBuffer.begin(),
+                             mReceiveBuffer.end(),
+                             '\n');
+    if (endline == mReceiveBuffer.end()) {
+        // No endline in sight, keep waiting and buffering
+        return false;
+    }
+    dispatch(mReceiveBuffer.data(), endline - mReceiveBuffer.begin(), false, 0);
+    // Now that we have processed this line let's remove it from the receive
+    // buffer, including the endline.
+    mReceiveBuffer.erase(mReceiveBuffer.begin(), endline + 1);
+    return true;
+}
+
+void Commander::dispatch(const char* data, size_t size, bool framed,
+                         uint32_t requestId) {
+    Worker::Request request;
+    request.connection = mConnection;
+    request.framed = framed;
+    request.requestId = requestId;
+
+    const char* end = data + size;
+    const char* space = std::find(data, end, ' ');
+    request.name.assign(data, space);
+    request.hasArgs = space != end;
+    if (request.hasArgs) {
+        request.args.assign(space + 1, end);
+    }
+
+    auto command = mCommands.find(request.name);
+    if (command == mCommands.end()) {
+        if (framed) {
+            postReply(Reply(mConnection, framed, requestId, request.name,
+                            Result::error("Unknown command '%s'",
+                                          request.name.c_str())));
+        }
+        return;
+    }
+    mWorkers[command->second]->post(std::move(request));
+}
+
+void Commander::postReply(Reply reply) {
+    {
+        std::lock_guard<std::mutex> lock(mReplyMutex);
+        mReplies.push_back(std::move(reply));
+    }
+    uint64_t one = 1;
+    while (::write(mWakeFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+void Commander::sendReplies() {
+    std::vector<Reply> replies;
+    {
+        std::lock_guard<std::mutex> lock(mReplyMutex);
+        replies.swap(mReplies);
+    }
+
+    std::vector<char> frame;
+    for (const auto& reply : replies) {
+        if (!reply.framed) {
+            // The text protocol has no replies, at least leave a trace
+            if (!reply.result) {
+                LOGE("Command '%s' failed: %s",
+                     reply.name.c_str(), reply.result.c_str());
+            }
+            continue;
+        }
+        if (reply.connection != mConnection || mPipeFd == -1) {
+            // Whoever sent the request is no longer listening
+            continue;
+        }
+
+        std::string payload = reply.result.isSuccess() ?
+            std::string("OK") : std::string("ERROR ") + reply.result.c_str();
+        CommandFrameHeader header;
+        header.magic = htole32(kReplyFrameMagic);
+        header.requestId = htole32(reply.requestId);
+        header.length = htole32(static_cast<uint32_t>(payload.size()));
+
+        frame.resize(sizeof(header) + payload.size());
+        memcpy(frame.data(), &header, sizeof(header));
+        memcpy(frame.data() + sizeof(header), payload.data(), payload.size());
+        if (!WriteFully(mPipeFd, frame.data(), frame.size())) {
+            LOGE("Commander failed to send reply: %s", strerror(errno));
+        }
+    }
+}
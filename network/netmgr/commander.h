@@ -19,11 +19,44 @@
 #include "pollable.h"
 #include "result.h"
 
+#include <memory>
+#include <mutex>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <stdint.h>
+
 class Command;
 
+// Frames are little-endian, the first byte of each magic is not valid in a
+// text command so the two framings can be told apart.
+static const uint32_t kCommandFrameMagic = 0xA1B2C3F0;
+static const uint32_t kReplyFrameMagic = 0xA1B2C3F1;
+
+struct CommandFrameHeader {
+    uint32_t magic;
+    uint32_t requestId;
+    uint32_t length;
+} __attribute__((__packed__));
+
+/** Receive commands from the host over a QEMU pipe and dispatch them to the
+ *  registered commands. Two framings are supported on the same pipe:
+ *
+ *  - Text: a command name followed by its arguments and a newline. This is
+ *    the original protocol, no reply is sent.
+ *  - Binary: a CommandFrameHeader with kCommandFrameMagic, a request ID chosen
+ *    by the host and the length of the payload that follows. The payload is
+ *    the same as a text command without the newline. A reply frame with
+ *    kReplyFrameMagic and the same request ID is sent when the command
+ *    completes, its payload is either "OK" or "ERROR <message>".
+ *
+ *  Each registered command runs on a worker thread of its own so that slow
+ *  commands do not hold up the poller. Requests for the same command are
+ *  handled in order but requests for different commands run in parallel and
+ *  replies are sent as soon as each request completes. The host should use
+ *  request IDs to match replies to requests.
+ */
 class Commander : public Pollable {
 public:
     Commander();
@@ -39,11 +72,42 @@ public:
     bool onClose(int fd, int* status) override;
     bool onTimeout(int* status) override;
 private:
+    class Worker;
+    struct Reply {
+        Reply(uint32_t connection, bool framed, uint32_t requestId,
+              std::string name, Result result)
+            : connection(connection), framed(framed), requestId(requestId),
+              name(std::move(name)), result(std::move(result)) {}
+        uint32_t connection;
+        bool framed;
+        uint32_t requestId;
+        std::string name;
+        Result result;
+    };
+
     void openPipe();
     void closePipe();
 
+    void receiveFromPipe();
+    bool parseFrame();
+    bool parseLine();
+    void dispatch(const char* data, size_t size, bool framed,
+                  uint32_t requestId);
+    void postReply(Reply reply);
+    void sendReplies();
+
     int mPipeFd;
+    // Incremented every time the pipe is opened, replies for requests that
+    // came in on an earlier connection are dropped.
+    uint32_t mConnection;
     Pollable::Timestamp mDeadline;
     std::vector<char> mReceiveBuffer;
     std::unordered_map<std::string, Command*> mCommands;
+    std::unordered_map<Command*, std::unique_ptr<Worker>> mWorkers;
+
+    // Workers post replies here and signal mWakeFd so that the replies are
+    // written to the pipe from the poller thread.
+    int mWakeFd;
+    std::mutex mReplyMutex;
+    std::vector<Reply> mReplies;
 };
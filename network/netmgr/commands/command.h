@@ -30,7 +30,10 @@ public:
     // report the result to the user. If the result indicates success the user
     // will see an "OK" response, on failure the error message in the result
     // will be presented to the user. This means that the result error string
-    // should be fairly user-friendly.
+    // should be fairly user-friendly. This is called on a worker thread
+    // owned by the Commander, calls to the same instance never overlap but
+    // they do run concurrently with the rest of netmgr. |args| is null if
+    // the command had no arguments.
     virtual Result onCommand(const char* command, const char* args) = 0;
 
 };
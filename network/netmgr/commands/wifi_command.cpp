@@ -16,7 +16,6 @@
 
 #include "wifi_command.h"
 
-#include "../fork.h"
 #include "log.h"
 
 #include <cutils/properties.h>
@@ -30,8 +29,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <utility>
+
 static const char kHostApdStubFile[] = "/vendor/etc/simulated_hostapd.conf";
 static const char kHostApdConfFile[] = "/data/vendor/wifi/hostapd/hostapd.conf";
+// Each protected access point reads its passphrase from <ifName>.psk in here
+static const char kHostApdPskDir[] = "/data/vendor/wifi/hostapd";
+// Must match ctrl_interface in the hostapd config template
+static const char kHostApdCtrlDir[] = "/data/vendor/wifi/hostapd/sockets";
+static const char kHostApdClientSocket[] = "/data/vendor/wifi/hostapd/netmgr_ctrl";
 
 static const char kControlRestartProperty[] = "ctl.restart";
 static const char kHostApdServiceName[] = "emu_hostapd";
@@ -87,11 +93,16 @@ std::vector<std::string> explode(const char* str) {
     return result;
 }
 
-WifiCommand::WifiCommand() : mLowestInterfaceNumber(1) {
+WifiCommand::WifiCommand()
+    : mHostapd(kHostApdCtrlDir, kHostApdClientSocket),
+      mLowestInterfaceNumber(1) {
     readConfig();
 }
 
 Result WifiCommand::onCommand(const char* /*command*/, const char* args) {
+    if (args == nullptr) {
+        return Result::error("Missing wifi command");
+    }
     const char* divider = ::strchr(args, ' ');
     if (divider == nullptr) {
         // Unknown command, every command needs an argument
@@ -157,72 +168,105 @@ Result WifiCommand::writeConfig() {
         fprintf(out.get(), "bss=%s\n", ap.second.ifName.c_str());
         fprintf(out.get(), "ssid=%s\n", ap.second.ssid.c_str());
         if (!ap.second.password.empty()) {
+            Result res = writePskFile(ap.second);
+            if (!res) {
+                return res;
+            }
             fprintf(out.get(), "wpa=2\n");
             fprintf(out.get(), "wpa_key_mgmt=WPA-PSK\n");
             fprintf(out.get(), "rsn_pairwise=CCMP\n");
-            fprintf(out.get(), "wpa_passphrase=%s\n", ap.second.password.c_str());
+            fprintf(out.get(), "wpa_psk_file=%s\n",
+                    pskFilePath(ap.second).c_str());
         }
         fprintf(out.get(), "\n");
     }
     return Result::success();
 }
 
+std::string WifiCommand::pskFilePath(const AccessPoint& ap) const {
+    return std::string(kHostApdPskDir) + "/" + ap.ifName + ".psk";
+}
+
+Result WifiCommand::writePskFile(const AccessPoint& ap) {
+    std::string path = pskFilePath(ap);
+    File out(fopen(path.c_str(), "w"));
+    if (!out) {
+        return Result::error("Config failure: could not open '%s': %s",
+                             path.c_str(), strerror(errno));
+    }
+    // The all zero address makes the passphrase valid for every station
+    fprintf(out.get(), "00:00:00:00:00:00 %s\n", ap.password.c_str());
+    if (ferror(out.get())) {
+        return Result::error("Config failure: Error writing '%s': %s",
+                             path.c_str(), strerror(errno));
+    }
+    return Result::success();
+}
+
+void WifiCommand::reconfigure(const AccessPoint& ap, bool securityChanged) {
+    std::vector<std::string> commands;
+    if (!securityChanged) {
+        // Only the passphrase changed and writeConfig already wrote it to the
+        // PSK file of this access point. RELOAD_WPA_PSK has the BSS re-read
+        // that file, only stations on this BSS that used the old passphrase
+        // are disconnected.
+        commands.push_back("RELOAD_WPA_PSK");
+    } else {
+        // Switching between an open and a protected network changes the
+        // beacon and the authenticator. hostapd can only set those up again by
+        // disabling and enabling the interface, which restarts every access
+        // point on the radio. It still avoids restarting hostapd and
+        // re-reading the config.
+        if (ap.password.empty()) {
+            commands.push_back("SET wpa 0");
+        } else {
+            commands.push_back("SET wpa 2");
+            commands.push_back("SET wpa_key_mgmt WPA-PSK");
+            commands.push_back("SET rsn_pairwise CCMP");
+            commands.push_back("SET wpa_psk_file " + pskFilePath(ap));
+        }
+        commands.push_back("DISABLE");
+        commands.push_back("ENABLE");
+    }
+
+    // The config file is already up to date, if hostapd can't be reconfigured
+    // restarting it applies the change as well.
+    std::string ssid = ap.ssid;
+    mHostapd.submit(ap.ifName, std::move(commands),
+                    [this, ssid](const Result& res) {
+        if (!res) {
+            LOGW("Unable to reconfigure '%s', restarting hostapd: %s",
+                 ssid.c_str(), res.c_str());
+            triggerHostApd();
+        }
+    });
+}
+
 Result WifiCommand::triggerHostApd() {
     property_set(kControlRestartProperty, kHostApdServiceName);
     return Result::success();
 }
 
-static const char* sSetForwardRule[] = {"/system/bin/iptables",
-                                        "-w",    // Wait for iptables lock if
-                                        "-W",    // needed. This prevents
-                                        "50000", // spurious failures.
-                                        "<AddOrDelete>", // To be replaced
-                                        "FORWARD",
-                                        "-i",
-                                        "<InInterface>", // To be replaced
-                                        "-o",
-                                        "<OutInterface>", // To be replaced
-                                        "-j",
-                                        "DROP",
-                                        nullptr };
-
-static const char kIpTables[] = "/system/bin/iptables";
-static const char kIp6Tables[] = "/system/bin/ip6tables";
-static const char kAddRule[] = "-A";
-static const char kDeleteRule[] = "-D";
-static const size_t kIpTablesIndex = 0;
-static const size_t kActionIndex = 4;
-static const size_t kInInterfaceIndex = 7;
-static const size_t kOutInterfaceIndex = 9;
-
+static const char kUpstreamInterface[] = "eth0";
 
 Result WifiCommand::setBlocked(const char* ifName, bool blocked) {
-    // Blocking means adding block rules, unblocking means removing them
-    sSetForwardRule[kActionIndex] = blocked ? kAddRule : kDeleteRule;
-
-    // Do this for both IPv4 and IPv6 to ensure all traffic is blocked/unblocked
-    for (const auto& iptables : { kIpTables, kIp6Tables }) {
-        // Block traffic coming in from the outside world to this wlan
-        sSetForwardRule[kIpTablesIndex] = iptables;
-        sSetForwardRule[kInInterfaceIndex] = "eth0";
-        sSetForwardRule[kOutInterfaceIndex] = ifName;
-        if (!forkAndExec(sSetForwardRule)) {
-            return Result::error("Internal error: Unable to %s network",
-                                 blocked ? "block" : "unblock");
-        }
-        // Block traffic going from the wlan to the outside world
-        sSetForwardRule[kInInterfaceIndex] = ifName;
-        sSetForwardRule[kOutInterfaceIndex] = "eth0";
-        if (!forkAndExec(sSetForwardRule)) {
-            return Result::error("Internal error: Unable to %s network",
-                                 blocked ? "block" : "unblock");
-        }
+    // Blocking means adding block rules, unblocking means removing them. The
+    // firewall applies the rules for both IPv4 and IPv6 to ensure all traffic
+    // is blocked/unblocked.
+    mFirewall.setForwardBlocked(ifName, kUpstreamInterface, blocked);
+    Result res = mFirewall.commit();
+    if (!res) {
+        LOGE("%s", res.c_str());
+        return Result::error("Internal error: Unable to %s network",
+                             blocked ? "block" : "unblock");
     }
     return Result::success();
 }
 
 Result WifiCommand::onAdd(const std::vector<std::string>& arguments) {
     AccessPoint& ap = mAccessPoints[arguments[0]];
+    bool isNew = ap.ifName.empty();
+    std::string oldPassword = ap.password;
     ap.ssid = arguments[0];
     if (arguments.size() > 1) {
         ap.password = arguments[1];
@@ -246,11 +290,22 @@ Result WifiCommand::onAdd(const std::vector<std::string>& arguments) {
             ++mLowestInterfaceNumber;
         }
     }
+    // The config file is always updated so that the access points are
+    // restored if hostapd is restarted for any reason.
     Result res = writeConfig();
     if (!res) {
         return res;
     }
-    return triggerHostApd();
+    if (isNew) {
+        // hostapd only creates new BSSes when it reads its config file
+        return triggerHostApd();
+    }
+    if (ap.password == oldPassword) {
+        // Nothing changed, leave the stations on this access point alone
+        return Result::success();
+    }
+    reconfigure(ap, oldPassword.empty() != ap.password.empty());
+    return Result::success();
 }
 
 Result WifiCommand::onBlock(const std::vector<std::string>& arguments) {
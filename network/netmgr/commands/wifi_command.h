@@ -17,6 +17,8 @@
 #pragma once
 
 #include "command.h"
+#include "../firewall.h"
+#include "../hostapd_client.h"
 #include "result.h"
 
 #include <string>
@@ -30,6 +32,10 @@ public:
     virtual ~WifiCommand() = default;
 
     Result onCommand(const char* command, const char* args) override;
+
+    // The control interface client has to be added to the poller, that's
+    // where changes to existing access points are applied.
+    HostapdClient& hostapdClient() { return mHostapd; }
 private:
     void readConfig();
     Result writeConfig();
@@ -48,8 +54,14 @@ private:
         bool blocked;
     };
 
+    std::string pskFilePath(const AccessPoint& ap) const;
+    Result writePskFile(const AccessPoint& ap);
+    void reconfigure(const AccessPoint& ap, bool securityChanged);
+
     std::unordered_map<std::string, AccessPoint> mAccessPoints;
     std::unordered_set<std::string> mUsedInterfaces;
+    Firewall mFirewall;
+    HostapdClient mHostapd;
     int mLowestInterfaceNumber;
 };
 
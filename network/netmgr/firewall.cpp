@@ -0,0 +1,150 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "firewall.h"
+
+#include "fork.h"
+#include "log.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+static const char kForwardChain[] = "FORWARD";
+
+static std::string forwardDropRule(const std::string& inInterface,
+                                   const std::string& outInterface) {
+    return std::string(kForwardChain) + " -i " + inInterface +
+           " -o " + outInterface + " -j DROP";
+}
+
+void Firewall::setForwardBlocked(const std::string& ifName,
+                                 const std::string& upstream,
+                                 bool blocked) {
+    // Block traffic coming in from the outside world to this interface and
+    // traffic going from this interface to the outside world.
+    for (const auto& rule : { forwardDropRule(upstream, ifName),
+                              forwardDropRule(ifName, upstream) }) {
+        if (blocked) {
+            mDesiredRules.insert(rule);
+        } else {
+            mDesiredRules.erase(rule);
+        }
+    }
+}
+
+Result Firewall::commit() {
+    // Attempt both families even if the first fails, they are independent and
+    // the one that succeeds should not have to be redone.
+    Result result = Result::success();
+    for (auto& family : mFamilies) {
+        Result res = commitFamily(family);
+        if (!res && result.isSuccess()) {
+            result = res;
+        }
+    }
+    return result;
+}
+
+Result Firewall::commitFamily(Family& family) {
+    if (applyChanges(family)) {
+        return Result::success();
+    }
+    // Rules can be changed outside of netmgr. Deleting one of our rules that
+    // no longer exists fails the entire transaction, and so would every later
+    // one. Find out which of our rules are actually there and try again.
+    if (!syncAppliedRules(family)) {
+        return Result::error("Unable to read firewall rules using %s",
+                             family.saveCommand);
+    }
+    if (!applyChanges(family)) {
+        return Result::error("Unable to apply firewall rules using %s",
+                             family.restoreCommand);
+    }
+    return Result::success();
+}
+
+bool Firewall::applyChanges(Family& family) {
+    std::vector<std::string> removed;
+    std::set_difference(family.appliedRules.begin(),
+                        family.appliedRules.end(),
+                        mDesiredRules.begin(),
+                        mDesiredRules.end(),
+                        std::back_inserter(removed));
+    std::vector<std::string> added;
+    std::set_difference(mDesiredRules.begin(),
+                        mDesiredRules.end(),
+                        family.appliedRules.begin(),
+                        family.appliedRules.end(),
+                        std::back_inserter(added));
+    if (removed.empty() && added.empty()) {
+        return true;
+    }
+
+    // Everything between *filter and COMMIT is applied atomically, either all
+    // of the changes take effect or none of them do. --noflush makes sure that
+    // rules not managed by us are preserved.
+    std::string input = "*filter\n";
+    for (const auto& rule : removed) {
+        input += "-D " + rule + "\n";
+    }
+    for (const auto& rule : added) {
+        input += "-A " + rule + "\n";
+    }
+    input += "COMMIT\n";
+
+    const char* argv[] = { family.restoreCommand,
+                           "--noflush",
+                           "-w",    // Wait for the xtables lock if needed
+                           nullptr };
+    if (!forkAndExecWithInput(argv, input)) {
+        return false;
+    }
+    family.appliedRules = mDesiredRules;
+    return true;
+}
+
+bool Firewall::syncAppliedRules(Family& family) {
+    const char* argv[] = { family.saveCommand, "-t", "filter", nullptr };
+    std::string output;
+    if (!forkAndExecWithOutput(argv, &output)) {
+        return false;
+    }
+
+    // Only keep track of the rules that we manage, iptables-save lists the
+    // rules in the same form as they were added, e.g.
+    // -A FORWARD -i wlan1 -o eth0 -j DROP
+    std::set<std::string> present;
+    size_t lineStart = 0;
+    while (lineStart < output.size()) {
+        size_t lineEnd = output.find('\n', lineStart);
+        if (lineEnd == std::string::npos) {
+            lineEnd = output.size();
+        }
+        if (output.compare(lineStart, 3, "-A ") == 0) {
+            std::string rule = output.substr(lineStart + 3,
+                                             lineEnd - lineStart - 3);
+            if (family.appliedRules.count(rule) > 0 ||
+                mDesiredRules.count(rule) > 0) {
+                present.insert(rule);
+            }
+        }
+        lineStart = lineEnd + 1;
+    }
+    family.appliedRules = std::move(present);
+    return true;
+}
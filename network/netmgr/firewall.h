@@ -0,0 +1,60 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "result.h"
+
+#include <set>
+#include <string>
+
+// Maintains the firewall rules that netmgr is responsible for. Rules are
+// collected in memory and then applied in a single atomic iptables-restore
+// transaction per address family. Only the difference between the desired
+// rules and the rules applied by the previous transaction is sent, rules that
+// have not changed are left alone. If a transaction fails, for example because
+// one of our rules was deleted by someone else, the applied rules are re-read
+// using iptables-save and the transaction is attempted once more.
+class Firewall {
+public:
+    // Add or remove rules that drop all forwarded traffic between |ifName| and
+    // |upstream| in both directions. Nothing is applied until commit is called.
+    void setForwardBlocked(const std::string& ifName,
+                           const std::string& upstream,
+                           bool blocked);
+
+    // Apply all changes made since the last successful commit. If a family
+    // fails to apply, none of its rules are changed and the next commit will
+    // attempt the same changes again.
+    Result commit();
+
+private:
+    struct Family {
+        const char* restoreCommand;
+        const char* saveCommand;
+        std::set<std::string> appliedRules;
+    };
+
+    Result commitFamily(Family& family);
+    bool applyChanges(Family& family);
+    bool syncAppliedRules(Family& family);
+
+    std::set<std::string> mDesiredRules;
+    Family mFamilies[2] = {
+        { "/system/bin/iptables-restore", "/system/bin/iptables-save", {} },
+        { "/system/bin/ip6tables-restore", "/system/bin/ip6tables-save", {} },
+    };
+};
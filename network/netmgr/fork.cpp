@@ -19,12 +19,65 @@
 #include "log.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+// The exit code of a child that failed to execute its program, like a shell
+static const int kExecFailedCode = 127;
+
+// netmgr runs several threads, a lock held by any of them when fork() is
+// called stays locked in the child. Everything that might take a lock, such
+// as logging or allocating memory, is done in the parent and the child only
+// calls async-signal-safe functions before exec.
+static void logCommand(const char* argv[]) {
+    char buffer[32768];
+    size_t offset = 0;
+    for (size_t i = 0; argv[i] && offset < sizeof(buffer); ++i) {
+        offset += snprintf(buffer + offset, sizeof(buffer) - offset,
+                           "%s ", argv[i]);
+    }
+    LOGE("Running '%s'", buffer);
+}
+
+static bool waitForChild(pid_t pid, const char* name) {
+    int status = 0;
+    do {
+        if (::waitpid(pid, &status, 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("waitpid() failed: %s", strerror(errno));
+            return false;
+        }
+        if (WIFEXITED(status)) {
+            int exitStatus = WEXITSTATUS(status);
+            if (exitStatus == 0) {
+                return true;
+            } else if (exitStatus == kExecFailedCode) {
+                LOGE("Error: '%s' could not be run", name);
+            } else {
+                LOGE("Error: '%s' exited with code: %d", name, exitStatus);
+            }
+        } else if (WIFSIGNALED(status)) {
+            LOGE("Error: '%s' terminated with signal: %d",
+                 name, WTERMSIG(status));
+        }
+        // Other possibilities include being stopped and continued as part
+        // of a trace but we don't really care about that. The important
+        // part is that unless the process explicitly exited or was killed
+        // by a signal we have to keep waiting.
+    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    return false;
+}
+
 bool forkAndExec(const char* argv[]) {
+    logCommand(argv);
     pid_t pid = ::fork();
     if (pid < 0) {
         // Failed to fork
@@ -32,36 +85,125 @@ bool forkAndExec(const char* argv[]) {
         return false;
     } else if (pid == 0) {
         // Child
-        char buffer[32768];
-        size_t offset = 0;
-        for (size_t i = 0; argv[i]; ++i) {
-            offset += snprintf(buffer + offset, sizeof(buffer) - offset,
-                               "%s ", argv[i]);
+        execvp(argv[0], const_cast<char* const*>(argv));
+        _exit(kExecFailedCode);
+    }
+    // Parent
+    return waitForChild(pid, argv[0]);
+}
+
+bool forkAndExecWithInput(const char* argv[], const std::string& input) {
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC) != 0) {
+        LOGE("pipe2() failed: %s", strerror(errno));
+        return false;
+    }
+
+    logCommand(argv);
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        // Failed to fork
+        LOGE("fork() failed: %s", strerror(errno));
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return false;
+    } else if (pid == 0) {
+        // Child, dup2 clears the close-on-exec flag of the new descriptor
+        if (::dup2(fds[0], STDIN_FILENO) == -1) {
+            _exit(kExecFailedCode);
         }
-        LOGE("Running '%s'", buffer);
         execvp(argv[0], const_cast<char* const*>(argv));
-        LOGE("Failed to run '%s': %s", argv[0], strerror(errno));
-        _exit(1);
-    } else {
-        // Parent
-        int status = 0;
-        do {
-            ::waitpid(pid, &status, 0);
-            if (WIFEXITED(status)) {
-                int exitStatus = WEXITSTATUS(status);
-                if (exitStatus == 0) {
-                    return true;
-                }
-                LOGE("Error: '%s' exited with code: %d", argv[0], exitStatus);
-            } else if (WIFSIGNALED(status)) {
-                LOGE("Error: '%s' terminated with signal: %d",
-                     argv[0], WTERMSIG(status));
+        _exit(kExecFailedCode);
+    }
+
+    // Parent, block SIGPIPE while writing so that a child exiting before
+    // reading all of its input shows up as EPIPE instead of killing us.
+    ::close(fds[0]);
+    sigset_t pipeSet, oldSet;
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    ::pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+
+    bool written = true;
+    size_t offset = 0;
+    while (offset < input.size()) {
+        ssize_t bytes = ::write(fds[1], input.data() + offset,
+                                input.size() - offset);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            // Other possibilities include being stopped and continued as part
-            // of a trace but we don't really care about that. The important
-            // part is that unless the process explicitly exited or was killed
-            // by a signal we have to keep waiting.
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+            // The child most likely exited early, its exit status will
+            // tell us more so keep going and wait for it.
+            LOGE("Failed to write input to '%s': %s",
+                 argv[0], strerror(errno));
+            written = false;
+            break;
+        }
+        offset += static_cast<size_t>(bytes);
+    }
+    ::close(fds[1]);
+
+    if (!written) {
+        // Discard the SIGPIPE our failed write generated, otherwise it would
+        // be delivered as soon as it's unblocked, here or in the poller.
+        struct timespec noWait = { 0, 0 };
+        while (::sigtimedwait(&pipeSet, nullptr, &noWait) == -1 &&
+               errno == EINTR) {
+        }
+    }
+    ::pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+
+    bool exited = waitForChild(pid, argv[0]);
+    return written && exited;
+}
+
+bool forkAndExecWithOutput(const char* argv[], std::string* output) {
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC) != 0) {
+        LOGE("pipe2() failed: %s", strerror(errno));
+        return false;
+    }
+
+    logCommand(argv);
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        // Failed to fork
+        LOGE("fork() failed: %s", strerror(errno));
+        ::close(fds[0]);
+        ::close(fds[1]);
         return false;
+    } else if (pid == 0) {
+        // Child, dup2 clears the close-on-exec flag of the new descriptor
+        if (::dup2(fds[1], STDOUT_FILENO) == -1) {
+            _exit(kExecFailedCode);
+        }
+        execvp(argv[0], const_cast<char* const*>(argv));
+        _exit(kExecFailedCode);
+    }
+
+    // Parent, read until the child closes its end of the pipe
+    ::close(fds[1]);
+    output->clear();
+    bool readAll = true;
+    char buffer[4096];
+    while (true) {
+        ssize_t bytes = ::read(fds[0], buffer, sizeof(buffer));
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to read output of '%s': %s",
+                 argv[0], strerror(errno));
+            readAll = false;
+            break;
+        } else if (bytes == 0) {
+            break;
+        }
+        output->append(buffer, static_cast<size_t>(bytes));
     }
+    ::close(fds[0]);
+
+    bool exited = waitForChild(pid, argv[0]);
+    return readAll && exited;
 }
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <string>
+
 // Fork and run the provided program with arguments and wait until the program
 // exits. The list of arguments in |argv| has to be terminated by a NULL
 // pointer (e.g. { "ls", "-l", "/", nullptr } to run 'ls -l /'
@@ -24,3 +26,13 @@
 // code that is not 0.
 bool forkAndExec(const char* argv[]);
 
+// Same as forkAndExec but the contents of |input| are written to the standard
+// input of the program, which is closed once all of |input| has been written.
+// This allows programs such as iptables-restore to be handed a complete batch
+// of work in a single invocation.
+bool forkAndExecWithInput(const char* argv[], const std::string& input);
+
+// Same as forkAndExec but everything the program writes to its standard output
+// is collected in |output|. This allows reading the state of programs such as
+// iptables-save.
+bool forkAndExecWithOutput(const char* argv[], std::string* output);
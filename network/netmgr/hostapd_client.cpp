@@ -0,0 +1,276 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hostapd_client.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <utility>
+
+// hostapd replies immediately to everything we send, if it doesn't it's most
+// likely busy restarting and the caller is better off falling back to that.
+static const std::chrono::milliseconds kReplyTimeout(1000);
+static const size_t kMaxReplySize = 4096;
+
+static bool setSocketPath(sockaddr_un* addr, const std::string& path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+HostapdClient::HostapdClient(const char* ctrlDir, const char* clientPath)
+    : mCtrlDir(ctrlDir),
+      mClientPath(clientPath),
+      mSocket(-1),
+      mWakeFd(-1),
+      mActive(false),
+      mDeadline(Pollable::Timestamp::max()) {
+}
+
+HostapdClient::~HostapdClient() {
+    close();
+    if (mWakeFd != -1) {
+        ::close(mWakeFd);
+        mWakeFd = -1;
+    }
+}
+
+Result HostapdClient::init() {
+    if (mWakeFd != -1) {
+        return Result::error("HostapdClient already initialized");
+    }
+    mWakeFd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (mWakeFd == -1) {
+        return Result::error("HostapdClient unable to create eventfd: %s",
+                             strerror(errno));
+    }
+    return Result::success();
+}
+
+void HostapdClient::submit(const std::string& ifName,
+                           std::vector<std::string> commands,
+                           OnDoneCallback onDone) {
+    {
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        mQueue.push_back(Request{ifName, std::move(commands), 0,
+                                 std::move(onDone)});
+    }
+    uint64_t one = 1;
+    while (::write(mWakeFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+void HostapdClient::getPollData(std::vector<pollfd>* fds) const {
+    if (mWakeFd != -1) {
+        fds->push_back(pollfd{mWakeFd, POLLIN, 0});
+    }
+    if (mSocket != -1) {
+        fds->push_back(pollfd{mSocket, POLLIN, 0});
+    }
+}
+
+Pollable::Timestamp HostapdClient::getTimeout() const {
+    return mDeadline;
+}
+
+bool HostapdClient::onReadAvailable(int fd, int* /*status*/) {
+    if (fd == mWakeFd) {
+        uint64_t count = 0;
+        while (::read(mWakeFd, &count, sizeof(count)) < 0 && errno == EINTR) {
+        }
+    } else {
+        receiveReplies();
+    }
+    startRequests();
+    return true;
+}
+
+bool HostapdClient::onClose(int fd, int* /*status*/) {
+    if (fd == mWakeFd) {
+        // This should never happen, we own both ends of the eventfd
+        return true;
+    }
+    close();
+    if (mActive) {
+        finish(Result::error("Control socket for hostapd on '%s' closed",
+                             mCurrent.ifName.c_str()));
+    }
+    startRequests();
+    return true;
+}
+
+bool HostapdClient::onTimeout(int* /*status*/) {
+    if (mActive) {
+        finish(Result::error("Timed out waiting for hostapd on '%s'",
+                             mCurrent.ifName.c_str()));
+    }
+    startRequests();
+    return true;
+}
+
+Result HostapdClient::open() {
+    if (mSocket != -1) {
+        return Result::success();
+    }
+
+    sockaddr_un addr;
+    if (!setSocketPath(&addr, mClientPath)) {
+        return Result::error("Client socket path '%s' is too long",
+                             mClientPath.c_str());
+    }
+    mSocket = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (mSocket == -1) {
+        return Result::error("Unable to create control socket: %s",
+                             strerror(errno));
+    }
+    // A previous instance of netmgr may have left its socket behind
+    ::unlink(mClientPath.c_str());
+    if (::bind(mSocket, reinterpret_cast<const sockaddr*>(&addr),
+               sizeof(addr)) != 0) {
+        Result res = Result::error("Unable to bind control socket to '%s': %s",
+                                   mClientPath.c_str(), strerror(errno));
+        close();
+        return res;
+    }
+    return Result::success();
+}
+
+void HostapdClient::close() {
+    if (mSocket != -1) {
+        ::close(mSocket);
+        mSocket = -1;
+        ::unlink(mClientPath.c_str());
+    }
+}
+
+void HostapdClient::discardPendingReplies() {
+    // A reply to an earlier request that timed out may still arrive after the
+    // timeout. Get rid of those so they aren't mistaken for the next reply.
+    char buffer[kMaxReplySize];
+    while (::recv(mSocket, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0) {
+    }
+}
+
+void HostapdClient::startRequests() {
+    while (!mActive) {
+        {
+            std::lock_guard<std::mutex> lock(mQueueMutex);
+            if (mQueue.empty()) {
+                return;
+            }
+            mCurrent = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+        mActive = true;
+        Result res = mCurrent.commands.empty() ? Result::success()
+                                               : sendCommand();
+        if (!res || mCurrent.commands.empty()) {
+            finish(res);
+        }
+    }
+}
+
+Result HostapdClient::sendCommand() {
+    Result res = open();
+    if (!res) {
+        return res;
+    }
+
+    sockaddr_un addr;
+    if (!setSocketPath(&addr, mCtrlDir + "/" + mCurrent.ifName)) {
+        return Result::error("Control socket path for '%s' is too long",
+                             mCurrent.ifName.c_str());
+    }
+
+    discardPendingReplies();
+    const std::string& command = mCurrent.commands[mCurrent.next];
+    ssize_t sent = ::sendto(mSocket, command.data(), command.size(), 0,
+                            reinterpret_cast<const sockaddr*>(&addr),
+                            sizeof(addr));
+    if (sent < 0) {
+        return Result::error("Unable to send to hostapd on '%s': %s",
+                             mCurrent.ifName.c_str(), strerror(errno));
+    }
+    mDeadline = Pollable::Clock::now() + kReplyTimeout;
+    return Result::success();
+}
+
+void HostapdClient::receiveReplies() {
+    char buffer[kMaxReplySize];
+    while (mSocket != -1) {
+        ssize_t received = ::recv(mSocket, buffer, sizeof(buffer),
+                                  MSG_DONTWAIT);
+        if (received < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGE("Unable to receive hostapd reply: %s", strerror(errno));
+            }
+            return;
+        }
+        if (!mActive || (received > 0 && buffer[0] == '<')) {
+            // A late reply to a request that timed out, or an unsolicited
+            // event message which starts with a priority level.
+            continue;
+        }
+
+        std::string reply(buffer, received);
+        while (!reply.empty() &&
+               (reply.back() == '\n' || reply.back() == '\r')) {
+            reply.pop_back();
+        }
+        if (reply != "OK") {
+            // Only log the command name, the arguments may contain a
+            // passphrase
+            const std::string& command = mCurrent.commands[mCurrent.next];
+            std::string name = command.substr(0, command.find(' '));
+            finish(Result::error("hostapd on '%s' rejected '%s': %s",
+                                 mCurrent.ifName.c_str(), name.c_str(),
+                                 reply.c_str()));
+            continue;
+        }
+        if (++mCurrent.next == mCurrent.commands.size()) {
+            finish(Result::success());
+            continue;
+        }
+        Result res = sendCommand();
+        if (!res) {
+            finish(res);
+        }
+    }
+}
+
+void HostapdClient::finish(const Result& result) {
+    mActive = false;
+    mDeadline = Pollable::Timestamp::max();
+    OnDoneCallback onDone = std::move(mCurrent.onDone);
+    mCurrent = Request();
+    if (onDone) {
+        onDone(result);
+    }
+}
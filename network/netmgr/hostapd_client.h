@@ -0,0 +1,93 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "pollable.h"
+#include "result.h"
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A client for the hostapd control interface. hostapd creates one UNIX
+// datagram socket per BSS in its ctrl_interface directory, named after the
+// interface of the BSS. Commands sent to such a socket only affect that BSS
+// which allows reconfiguring a single access point without restarting hostapd
+// and disconnecting every station on every access point.
+//
+// Requests can be submitted from any thread. They are handled one at a time by
+// the poller, which sends each command once hostapd has replied to the
+// previous one and gives up if hostapd doesn't reply in time, so nothing ever
+// blocks waiting for hostapd.
+class HostapdClient : public Pollable {
+public:
+    using OnDoneCallback = std::function<void (const Result& result)>;
+
+    // |ctrlDir| is the ctrl_interface directory configured in hostapd.conf and
+    // |clientPath| is the path that replies from hostapd will be sent to.
+    HostapdClient(const char* ctrlDir, const char* clientPath);
+    ~HostapdClient();
+
+    Result init();
+
+    // Send |commands| in order to the BSS on interface |ifName|, each of them
+    // has to be replied to with OK. |onDone| is called from the poller thread
+    // once all of them succeeded or with the first failure, which happens if
+    // hostapd is not running, has no control interface for |ifName|, rejects
+    // a command or does not reply in time.
+    void submit(const std::string& ifName,
+                std::vector<std::string> commands,
+                OnDoneCallback onDone);
+
+    // Pollable interface
+    void getPollData(std::vector<pollfd>* fds) const override;
+    Timestamp getTimeout() const override;
+    bool onReadAvailable(int fd, int* status) override;
+    bool onClose(int fd, int* status) override;
+    bool onTimeout(int* status) override;
+
+private:
+    struct Request {
+        std::string ifName;
+        std::vector<std::string> commands;
+        size_t next;
+        OnDoneCallback onDone;
+    };
+
+    Result open();
+    void close();
+    void discardPendingReplies();
+    void startRequests();
+    Result sendCommand();
+    void receiveReplies();
+    void finish(const Result& result);
+
+    std::string mCtrlDir;
+    std::string mClientPath;
+    int mSocket;
+    int mWakeFd;
+
+    std::mutex mQueueMutex;
+    std::deque<Request> mQueue;
+
+    // Only used by the poller thread
+    bool mActive;
+    Request mCurrent;
+    Pollable::Timestamp mDeadline;
+};
@@ -25,18 +25,22 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
-#include <functional>
-
 static const char kWifiMonitorInterface[] = "hwsim0";
+// Interfaces often go up and down several times as they are set up, wait for
+// this long after a change before reporting it.
+static const unsigned int kDefaultLinkDebounceMs = 250;
 
 static void usage(const char* name) {
-    LOGE("Usage: %s --if-prefix <prefix> --network <ip/mask>", name);
+    LOGE("Usage: %s --if-prefix <prefix> --network <ip/mask> "
+         "[--link-debounce <ms>]", name);
     LOGE("  <prefix> indicates the name of network interfaces to configure.");
     LOGE("  <ip/mask> is the base IP address to assign to the first interface");
     LOGE("  and mask indicates the netmask and broadcast to set.");
     LOGE("  Additionally mask is used to determine the address");
     LOGE("  for the second interface by skipping ahead one subnet");
     LOGE("  and the size of the subnet is indicated by <mask>");
+    LOGE("  <ms> is how long to collect interface state changes before");
+    LOGE("  acting on them, defaults to %u.", kDefaultLinkDebounceMs);
 }
 
 static bool parseNetwork(const char* network,
@@ -79,12 +83,20 @@ static bool parseNetwork(const char* network,
 int main(int argc, char* argv[]) {
     const char* interfacePrefix = nullptr;
     const char* network = nullptr;
+    unsigned int linkDebounceMs = kDefaultLinkDebounceMs;
 
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--if-prefix") == 0 && i + 1 < argc) {
             interfacePrefix = argv[++i];
         } else if (strcmp(argv[i], "--network") == 0 && i + 1 < argc) {
             network = argv[++i];
+        } else if (strcmp(argv[i], "--link-debounce") == 0 && i + 1 < argc) {
+            char dummy = 0;
+            if (sscanf(argv[++i], "%u%c", &linkDebounceMs, &dummy) != 1) {
+                LOGE("Invalid link debounce '%s'", argv[i]);
+                usage(argv[0]);
+                return 1;
+            }
         } else {
             LOGE("Unknown parameter '%s'", argv[i]);
             usage(argv[0]);
@@ -109,16 +121,32 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    AddressAssigner assigner(interfacePrefix, address, mask);
-    Monitor monitor;
+    Poller poller;
+    Result res = poller.init();
+    if (!res) {
+        LOGE("%s", res.c_str());
+        return 1;
+    }
 
-    monitor.setOnInterfaceState(std::bind(&AddressAssigner::onInterfaceState,
-                                          &assigner,
-                                          std::placeholders::_1,
-                                          std::placeholders::_2,
-                                          std::placeholders::_3));
+    AddressAssigner assigner(interfacePrefix, address, mask);
+    res = assigner.init();
+    if (!res) {
+        LOGE("%s", res.c_str());
+        return 1;
+    }
 
-    Result res = monitor.init();
+    std::chrono::milliseconds linkDebounce(linkDebounceMs);
+    Monitor monitor(linkDebounce);
+    monitor.setOnInterfaceState([&assigner, &poller](unsigned int index,
+                                                     const char* name,
+                                                     InterfaceState state) {
+        assigner.onInterfaceState(index, name, state);
+        // The assigner schedules a flush of its address changes, this happens
+        // during a monitor callback so the poller has to be told about it.
+        poller.updatePollable(&assigner);
+    });
+
+    res = monitor.init();
     if (!res) {
         LOGE("%s", res.c_str());
         return 1;
@@ -132,6 +160,11 @@ int main(int argc, char* argv[]) {
     }
 
     WifiCommand wifiCommand;
+    res = wifiCommand.hostapdClient().init();
+    if (!res) {
+        LOGE("%s", res.c_str());
+        return 1;
+    }
     commander.registerCommand("wifi", &wifiCommand);
 
     WifiForwarder forwarder(kWifiMonitorInterface);
@@ -141,10 +174,11 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    Poller poller;
+    poller.addPollable(&assigner);
     poller.addPollable(&monitor);
     poller.addPollable(&commander);
     poller.addPollable(&forwarder);
+    poller.addPollable(&wifiCommand.hostapdClient());
     return poller.run();
 }
 
@@ -28,7 +28,16 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-Monitor::Monitor() : mSocketFd(-1) {
+#include <algorithm>
+#include <vector>
+
+Monitor::Monitor(std::chrono::milliseconds debounce)
+    : mDebounce(debounce),
+      mSocketFd(-1),
+      mSequence(0),
+      mDumpPending(false),
+      mDumpNeeded(false),
+      mDeadline(Pollable::Timestamp::max()) {
 
 }
 
@@ -37,7 +46,11 @@ Monitor::~Monitor() {
 }
 
 Result Monitor::init() {
-    return openSocket();
+    Result res = openSocket();
+    if (!res) {
+        return res;
+    }
+    return requestDump();
 }
 
 void Monitor::setOnInterfaceState(OnInterfaceStateCallback callback) {
@@ -62,12 +75,24 @@ bool Monitor::onReadAvailable(int /*fd*/, int* /*status*/) {
                 return true;
             } else if (errno == EINTR) {
                 continue;
+            } else if (errno == ENOBUFS) {
+                // The kernel dropped messages, our view of the interfaces
+                // can no longer be trusted so take a new snapshot.
+                LOGW("Monitor lost messages, requesting new snapshot");
+                if (mDumpPending) {
+                    mDumpNeeded = true;
+                } else {
+                    Result res = requestDump();
+                    if (!res) {
+                        LOGE("%s", res.c_str());
+                    }
+                }
+                continue;
             }
             LOGE("Monitor receive failed: %s", strerror(errno));
             // An error occurred but let's keep trying
             return true;
-        } else if (addrSize < 0 ||
-                   static_cast<size_t>(addrSize) != sizeof(struct sockaddr_nl)) {
+        } else if (static_cast<size_t>(addrSize) != sizeof(struct sockaddr_nl)) {
             LOGE("Monitor received invalid address size");
             // It's an error but no need to exit, let's keep polling
             return true;
@@ -76,15 +101,34 @@ bool Monitor::onReadAvailable(int /*fd*/, int* /*status*/) {
         size_t length = static_cast<size_t>(status);
 
         auto hdr = reinterpret_cast<struct nlmsghdr*>(buffer);
-        while (NLMSG_OK(hdr, length) && hdr->nlmsg_type != NLMSG_DONE) {
+        for (; NLMSG_OK(hdr, length); hdr = NLMSG_NEXT(hdr, length)) {
             switch (hdr->nlmsg_type) {
                 case RTM_NEWLINK:
-                    handleNewLink(hdr);
+                case RTM_DELLINK:
+                    handleLink(hdr);
+                    break;
+                case NLMSG_DONE:
+                case NLMSG_ERROR:
+                    // The end of a dump, or a dump request that failed
+                    if (hdr->nlmsg_type == NLMSG_ERROR) {
+                        LOGE("Monitor interface snapshot failed");
+                    } else if (!mDumpNeeded) {
+                        // A complete snapshot, anything it didn't contain
+                        // was removed while messages were being dropped.
+                        removeUnseen();
+                    }
+                    mDumpPending = false;
+                    if (mDumpNeeded) {
+                        mDumpNeeded = false;
+                        Result res = requestDump();
+                        if (!res) {
+                            LOGE("%s", res.c_str());
+                        }
+                    }
                     break;
                 default:
                     break;
             }
-            NLMSG_NEXT(hdr, length);
         }
     }
 }
@@ -93,6 +137,9 @@ bool Monitor::onClose(int /*fd*/, int* status) {
     // Socket was closed from the other end, close it from our end and re-open
     closeSocket();
     Result res = openSocket();
+    if (res.isSuccess()) {
+        res = requestDump();
+    }
     if (!res) {
         LOGE("%s", res.c_str());
         *status = 1;
@@ -102,6 +149,7 @@ bool Monitor::onClose(int /*fd*/, int* status) {
 }
 
 bool Monitor::onTimeout(int* /*status*/) {
+    reportChanges();
     return true;
 }
 
@@ -112,7 +160,7 @@ void Monitor::getPollData(std::vector<pollfd>* fds) const {
 }
 
 Pollable::Timestamp Monitor::getTimeout() const {
-    return Pollable::Timestamp::max();
+    return mDeadline;
 }
 
 Result Monitor::openSocket() {
@@ -129,7 +177,7 @@ Result Monitor::openSocket() {
     struct sockaddr_nl addr;
     memset(&addr, 0, sizeof(addr));
     addr.nl_family = AF_NETLINK;
-    addr.nl_groups = RTNLGRP_LINK | RTNLGRP_IPV4_IFADDR | RTNLGRP_IPV6_IFADDR;
+    addr.nl_groups = RTMGRP_LINK;
 
     struct sockaddr* sa = reinterpret_cast<struct sockaddr*>(&addr);
     if (::bind(mSocketFd, sa, sizeof(addr)) != 0) {
@@ -137,6 +185,8 @@ Result Monitor::openSocket() {
                              strerror(errno));
     }
 
+    mDumpPending = false;
+    mDumpNeeded = false;
     return Result::success();
 }
 
@@ -147,21 +197,139 @@ void Monitor::closeSocket() {
     }
 }
 
-void Monitor::handleNewLink(const struct nlmsghdr* hdr) {
-    if (!mOnInterfaceStateCallback) {
-        return;
+Result Monitor::requestDump() {
+    struct {
+        struct nlmsghdr hdr;
+        struct ifinfomsg msg;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(request.msg));
+    request.hdr.nlmsg_type = RTM_GETLINK;
+    request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.hdr.nlmsg_seq = ++mSequence;
+    request.msg.ifi_family = AF_UNSPEC;
+
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    ssize_t sent;
+    do {
+        sent = ::sendto(mSocketFd, &request, request.hdr.nlmsg_len, 0,
+                        reinterpret_cast<struct sockaddr*>(&kernel),
+                        sizeof(kernel));
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        return Result::error("Monitor failed to request interfaces: %s",
+                             strerror(errno));
+    }
+    for (auto& interface : mInterfaces) {
+        interface.second.seen = false;
     }
+    mDumpPending = true;
+    return Result::success();
+}
 
+void Monitor::handleLink(const struct nlmsghdr* hdr) {
+    if (hdr->nlmsg_len < NLMSG_LENGTH(sizeof(struct ifinfomsg))) {
+        return;
+    }
     auto msg = reinterpret_cast<const struct ifinfomsg*>(NLMSG_DATA(hdr));
 
-    if (msg->ifi_change & IFF_UP) {
-        // The interface up/down flag changed, send a notification
-        char name[IF_NAMESIZE + 1] = { 0 };
-        if_indextoname(msg->ifi_index, name);
+    // Use the name in the message, the interface may no longer exist by the
+    // time this is handled so looking it up may fail.
+    char name[IF_NAMESIZE + 1] = { 0 };
+    int length = IFLA_PAYLOAD(hdr);
+    for (auto attr = IFLA_RTA(msg); RTA_OK(attr, length);
+         attr = RTA_NEXT(attr, length)) {
+        if (attr->rta_type == IFLA_IFNAME) {
+            size_t nameLength = std::min<size_t>(RTA_PAYLOAD(attr), IF_NAMESIZE);
+            memcpy(name, RTA_DATA(attr), nameLength);
+            name[nameLength] = '\0';
+            break;
+        }
+    }
+
+    bool removed = hdr->nlmsg_type == RTM_DELLINK;
+    InterfaceState state = (!removed && (msg->ifi_flags & IFF_UP)) ?
+        InterfaceState::Up : InterfaceState::Down;
+    updateInterface(msg->ifi_index, name, state, removed);
+}
+
+void Monitor::removeUnseen() {
+    std::vector<unsigned int> gone;
+    for (const auto& interface : mInterfaces) {
+        if (!interface.second.seen && !interface.second.removed) {
+            gone.push_back(interface.first);
+        }
+    }
+    for (unsigned int index : gone) {
+        updateInterface(index, "", InterfaceState::Down, true);
+    }
+}
+
+void Monitor::updateInterface(unsigned int index,
+                              const char* name,
+                              InterfaceState state,
+                              bool removed) {
+    auto found = mInterfaces.find(index);
+    if (found == mInterfaces.end()) {
+        if (removed) {
+            // Never seen and already gone, nothing to report
+            return;
+        }
+        found = mInterfaces.emplace(index, Interface{name,
+                                                     state,
+                                                     InterfaceState::Down,
+                                                     false,
+                                                     false}).first;
+    }
+    Interface& interface = found->second;
+    if (name[0] != '\0') {
+        interface.name = name;
+    }
+    interface.state = state;
+    interface.removed = removed;
+    interface.seen = !removed;
 
-        InterfaceState state = (msg->ifi_flags & IFF_UP) ? InterfaceState::Up :
-                                                           InterfaceState::Down;
-        mOnInterfaceStateCallback(msg->ifi_index, name, state);
+    if ((interface.state != interface.reportedState || interface.removed) &&
+        mDeadline == Pollable::Timestamp::max()) {
+        // Open a window for changes, anything that happens before it closes
+        // is reported together when it does.
+        mDeadline = Pollable::Clock::now() + mDebounce;
     }
 }
 
+void Monitor::reportChanges() {
+    mDeadline = Pollable::Timestamp::max();
+
+    // Collect the changes first, the callback might end up modifying the
+    // interface table.
+    struct Change {
+        unsigned int index;
+        std::string name;
+        InterfaceState state;
+    };
+    std::vector<Change> changes;
+    for (auto it = mInterfaces.begin(); it != mInterfaces.end(); ) {
+        Interface& interface = it->second;
+        if (interface.state != interface.reportedState) {
+            changes.push_back(Change{it->first, interface.name,
+                                     interface.state});
+            interface.reportedState = interface.state;
+        }
+        if (interface.removed) {
+            it = mInterfaces.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    if (!mOnInterfaceStateCallback) {
+        return;
+    }
+    for (const auto& change : changes) {
+        mOnInterfaceStateCallback(change.index, change.name.c_str(),
+                                  change.state);
+    }
+}
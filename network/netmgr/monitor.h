@@ -20,17 +20,27 @@
 #include "pollable.h"
 #include "result.h"
 
+#include <chrono>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
 const char* interfaceStateToStr(InterfaceState state);
 
 /** Monitor network interfaces and provide notifications of changes to those
- *  interfaces.
+ *  interfaces. The monitor starts out with a snapshot of all existing
+ *  interfaces and then tracks the state of each of them. Changes are not
+ *  reported right away, all changes within a debounce window are collected
+ *  and only interfaces whose state differs from what was last reported are
+ *  reported at the end of the window. An interface that goes down and comes
+ *  back up within the window is not reported at all.
  */
 class Monitor : public Pollable {
 public:
     using OnInterfaceStateCallback = std::function<void (unsigned int index,
                                                          const char* name,
                                                          InterfaceState state)>;
-    Monitor();
+    explicit Monitor(std::chrono::milliseconds debounce);
     ~Monitor();
 
     Result init();
@@ -45,11 +55,37 @@ public:
     bool onTimeout(int* status) override;
 
 private:
+    struct Interface {
+        std::string name;
+        InterfaceState state;
+        // The state last passed to the callback, interfaces start out as
+        // being down so that interfaces that are up are reported.
+        InterfaceState reportedState;
+        // Set when the interface has been removed, it's forgotten once that
+        // has been reported.
+        bool removed;
+        // Set when the interface shows up in a snapshot, or in a message
+        // received after the snapshot was requested.
+        bool seen;
+    };
+
     Result openSocket();
     void closeSocket();
-    void handleNewLink(const struct nlmsghdr* hdr);
+    Result requestDump();
+    void handleLink(const struct nlmsghdr* hdr);
+    void removeUnseen();
+    void updateInterface(unsigned int index,
+                         const char* name,
+                         InterfaceState state,
+                         bool removed);
+    void reportChanges();
 
+    std::chrono::milliseconds mDebounce;
     int mSocketFd;
+    uint32_t mSequence;
+    bool mDumpPending;
+    bool mDumpNeeded;
+    Pollable::Timestamp mDeadline;
+    std::unordered_map<unsigned int, Interface> mInterfaces;
     OnInterfaceStateCallback mOnInterfaceStateCallback;
 };
-
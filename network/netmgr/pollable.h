@@ -29,18 +29,20 @@ public:
     using Timestamp = Clock::time_point;
     virtual ~Pollable() = default;
 
-    /* Get the poll data for the next poll loop. The implementation can place
-     * as many fds as needed in |fds|.
+    /* Get the poll data for the pollable. The implementation can place as
+     * many fds as needed in |fds|. The poller calls this when the pollable is
+     * added and after each of its callbacks and keeps the fds registered in
+     * between, so the result should only change as a result of a callback.
      */
     virtual void getPollData(std::vector<pollfd>* fds) const = 0;
-    /* Get the timeout for the next poll loop. This should be a timestamp
-     * indicating when the timeout should be triggered. Note that this may
-     * be called at any time and any number of times for a poll loop so the
-     * deadline should not be adjusted in this call, a set deadline should
-     * just be returned. Note specifically that if a call to onReadAvailable
-     * modifies the deadline the timeout for the previous timestamp might not
-     * fire as the poller will check the timestamp AFTER onReadAvailable is
-     * called.
+    /* Get the timeout for the pollable. This should be a timestamp
+     * indicating when the timeout should be triggered. Like getPollData this
+     * is read when the pollable is added and after each of its callbacks.
+     * Note that this may be called any number of times so the deadline
+     * should not be adjusted in this call, a set deadline should just be
+     * returned. Note specifically that if a call to onReadAvailable modifies
+     * the deadline the timeout for the previous timestamp will not fire as
+     * the poller reads the timestamp AFTER onReadAvailable is called.
      */
     virtual Timestamp getTimeout() const = 0;
     /* Called when there is data available to read on an fd associated with
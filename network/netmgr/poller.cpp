@@ -19,55 +19,184 @@
 #include "log.h"
 
 #include <errno.h>
-#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 
-#include <unordered_map>
-#include <vector>
+#include <algorithm>
+#include <limits>
 
 using std::chrono::duration_cast;
 
-static struct timespec* calculateTimeout(Pollable::Timestamp deadline,
-                                         struct timespec* ts) {
+// The maximum number of events to handle for each call to epoll_pwait
+static const int kMaxEvents = 32;
+
+static int calculateTimeout(Pollable::Timestamp deadline) {
     Pollable::Timestamp now = Pollable::Clock::now();
     if (deadline < Pollable::Timestamp::max()) {
         if (deadline <= now) {
-            LOGE("Poller found past due deadline, setting to zero");
-            ts->tv_sec = 0;
-            ts->tv_nsec = 0;
-            return ts;
+            // Pollables may ask to be called back as soon as possible, for
+            // example to handle work that was queued by another pollable.
+            return 0;
         }
 
-        auto timeout = deadline - now;
-        // Convert and round down to seconds
-        auto seconds = duration_cast<std::chrono::seconds>(timeout);
-        // Then subtract the seconds from the timeout and convert the remainder
-        auto nanos = duration_cast<std::chrono::nanoseconds>(timeout - seconds);
+        // Round up so that we never wake up just before the deadline
+        auto timeout = deadline - now + std::chrono::milliseconds(1) -
+                       std::chrono::nanoseconds(1);
+        auto millis = duration_cast<std::chrono::milliseconds>(timeout);
+        return static_cast<int>(std::min<decltype(millis.count())>(
+                millis.count(), std::numeric_limits<int>::max()));
+    }
+    return -1;
+}
+
+static uint32_t pollToEpollEvents(short events) {
+    uint32_t epollEvents = 0;
+    if (events & POLLIN) {
+        epollEvents |= EPOLLIN;
+    }
+    if (events & POLLOUT) {
+        epollEvents |= EPOLLOUT;
+    }
+    return epollEvents;
+}
+
+static uint64_t eventData(int fd, uint32_t generation) {
+    return (static_cast<uint64_t>(generation) << 32) |
+           static_cast<uint32_t>(fd);
+}
 
-        ts->tv_sec = seconds.count();
-        ts->tv_nsec = nanos.count();
+Poller::Poller() : mEpollFd(-1), mGeneration(0) {
+}
 
-        return ts;
+Poller::~Poller() {
+    if (mEpollFd != -1) {
+        ::close(mEpollFd);
+        mEpollFd = -1;
     }
-    return nullptr;
 }
 
-Poller::Poller() {
+Result Poller::init() {
+    if (mEpollFd != -1) {
+        return Result::error("Poller already initialized");
+    }
+    mEpollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFd == -1) {
+        return Result::error("Poller unable to create epoll fd: %s",
+                             strerror(errno));
+    }
+    return Result::success();
 }
 
 void Poller::addPollable(Pollable* pollable) {
-    mPollables.push_back(pollable);
+    mPollables[pollable].deadline = Pollable::Timestamp::max();
+    updatePollable(pollable);
+}
+
+void Poller::updatePollable(Pollable* pollable) {
+    refreshPollable(pollable, true);
+}
+
+void Poller::refreshPollable(Pollable* pollable, bool reregister) {
+    auto state = mPollables.find(pollable);
+    if (state == mPollables.end()) {
+        LOGE("Poller asked to update unknown pollable");
+        return;
+    }
+
+    std::vector<pollfd> fds;
+    pollable->getPollData(&fds);
+
+    for (const auto& old : state->second.fds) {
+        auto match = [&old](const pollfd& fd) { return fd.fd == old.fd; };
+        if (std::find_if(fds.begin(), fds.end(), match) == fds.end()) {
+            unregisterFd(old.fd);
+        }
+    }
+    // Only fds that are new or wait for different events need a system
+    // call, unless the pollable may have closed and re-opened them in which
+    // case they are no longer in epoll.
+    std::vector<pollfd> registered;
+    registered.reserve(fds.size());
+    for (const auto& fd : fds) {
+        auto match = [&fd](const pollfd& old) { return old.fd == fd.fd; };
+        auto old = std::find_if(state->second.fds.begin(),
+                                state->second.fds.end(), match);
+        bool changed = old == state->second.fds.end() ||
+                       old->events != fd.events;
+        // An fd that failed to register is left out, it's retried next time
+        if (!reregister && !changed) {
+            registered.push_back(fd);
+        } else if (registerFd(pollable, fd)) {
+            registered.push_back(fd);
+        }
+    }
+    state->second.fds = std::move(registered);
+
+    Pollable::Timestamp deadline = pollable->getTimeout();
+    if (deadline != state->second.deadline) {
+        mDeadlines.erase(std::make_pair(state->second.deadline, pollable));
+        if (deadline < Pollable::Timestamp::max()) {
+            mDeadlines.emplace(deadline, pollable);
+        }
+        state->second.deadline = deadline;
+    }
+}
+
+bool Poller::registerFd(Pollable* pollable, const pollfd& fd) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = pollToEpollEvents(fd.events);
+
+    auto registration = mFds.find(fd.fd);
+    if (registration != mFds.end() &&
+        registration->second.pollable == pollable) {
+        event.data.u64 = eventData(fd.fd, registration->second.generation);
+        if (::epoll_ctl(mEpollFd, EPOLL_CTL_MOD, fd.fd, &event) == 0) {
+            return true;
+        }
+        if (errno != ENOENT) {
+            LOGE("Poller unable to modify fd %d: %s", fd.fd, strerror(errno));
+            return false;
+        }
+        // The fd was closed and re-opened, add it back
+    }
+
+    uint32_t generation = ++mGeneration;
+    event.data.u64 = eventData(fd.fd, generation);
+    if (::epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd.fd, &event) != 0) {
+        if (errno != EEXIST ||
+            ::epoll_ctl(mEpollFd, EPOLL_CTL_MOD, fd.fd, &event) != 0) {
+            LOGE("Poller unable to add fd %d: %s", fd.fd, strerror(errno));
+            return false;
+        }
+    }
+    mFds[fd.fd] = Registration{pollable, generation};
+    return true;
+}
+
+void Poller::unregisterFd(int fd) {
+    mFds.erase(fd);
+    // This fails if the fd has already been closed, which also removes it
+    // from epoll so there is nothing to do in that case.
+    ::epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
 }
 
 int Poller::run() {
+    if (mEpollFd == -1) {
+        LOGE("Poller not initialized");
+        return EINVAL;
+    }
+
     // Block all signals while we're running. This way we don't have to deal
-    // with things like EINTR. We then uses ppoll to set the original mask while
-    // polling. This way polling can be interrupted but socket writing, reading
-    // and ioctl remain interrupt free. If a signal arrives while we're blocking
-    // it it will be placed in the signal queue and handled once ppoll sets the
-    // original mask. This way no signals are lost.
+    // with things like EINTR. We then uses epoll_pwait to set the original
+    // mask while polling. This way polling can be interrupted but socket
+    // writing, reading and ioctl remain interrupt free. If a signal arrives
+    // while we're blocking it it will be placed in the signal queue and
+    // handled once epoll_pwait sets the original mask. This way no signals
+    // are lost.
     sigset_t blockMask, mask;
     int status = ::sigfillset(&blockMask);
     if (status != 0) {
@@ -80,28 +209,14 @@ int Poller::run() {
         return errno;
     }
 
-    std::vector<struct pollfd> fds;
-    std::unordered_map<int, Pollable*> pollables;
+    struct epoll_event events[kMaxEvents];
+    std::vector<Pollable*> expired;
     while (true) {
-        fds.clear();
-        pollables.clear();
-        Pollable::Timestamp deadline = Pollable::Timestamp::max();
-        for (auto& pollable : mPollables) {
-            size_t start = fds.size();
-            pollable->getPollData(&fds);
-            Pollable::Timestamp pollableDeadline = pollable->getTimeout();
-            // Create a map from each fd to the pollable
-            for (size_t i = start; i < fds.size(); ++i) {
-                pollables[fds[i].fd] = pollable;
-            }
-            if (pollableDeadline < deadline) {
-                deadline = pollableDeadline;
-            }
-        }
+        Pollable::Timestamp deadline = mDeadlines.empty() ?
+            Pollable::Timestamp::max() : mDeadlines.begin()->first;
 
-        struct timespec ts = { 0, 0 };
-        struct timespec* tsPtr = calculateTimeout(deadline, &ts);
-        status = ::ppoll(fds.data(), fds.size(), tsPtr, &mask);
+        status = ::epoll_pwait(mEpollFd, events, kMaxEvents,
+                               calculateTimeout(deadline), &mask);
         if (status < 0) {
             if (errno == EINTR) {
                 // Interrupted, just keep going
@@ -110,47 +225,62 @@ int Poller::run() {
             // Actual error, time to quit
             LOGE("Polling failed: %s", strerror(errno));
             return errno;
-        } else if (status > 0) {
-            // Check for read or close events
-            for (const auto& fd : fds) {
-                if ((fd.revents & (POLLIN | POLLHUP)) == 0) {
-                    // Neither POLLIN nor POLLHUP, not interested
-                    continue;
-                }
-                auto pollable = pollables.find(fd.fd);
-                if (pollable == pollables.end()) {
-                    // No matching fd, weird and unexpected
-                    LOGE("Poller could not find fd matching %d", fd.fd);
-                    continue;
-                }
-                if (fd.revents & POLLIN) {
-                    // This pollable has data available for reading
-                    int status = 0;
-                    if (!pollable->second->onReadAvailable(fd.fd, &status)) {
-                        // The onReadAvailable handler signaled an exit
-                        return status;
-                    }
-                }
-                if (fd.revents & POLLHUP) {
-                    // The fd was closed from the other end
-                    int status = 0;
-                    if (!pollable->second->onClose(fd.fd, &status)) {
-                        // The onClose handler signaled an exit
-                        return status;
-                    }
+        }
+
+        for (int i = 0; i < status; ++i) {
+            const struct epoll_event& event = events[i];
+            if ((event.events & (EPOLLIN | EPOLLHUP)) == 0) {
+                // Neither EPOLLIN nor EPOLLHUP, not interested
+                continue;
+            }
+            int fd = static_cast<int>(event.data.u64 & 0xFFFFFFFF);
+            uint32_t generation = static_cast<uint32_t>(event.data.u64 >> 32);
+            auto registration = mFds.find(fd);
+            if (registration == mFds.end() ||
+                registration->second.generation != generation) {
+                // An earlier callback in this wakeup closed the fd
+                continue;
+            }
+            Pollable* pollable = registration->second.pollable;
+            bool closed = false;
+            if (event.events & EPOLLIN) {
+                // This pollable has data available for reading
+                int status = 0;
+                if (!pollable->onReadAvailable(fd, &status)) {
+                    // The onReadAvailable handler signaled an exit
+                    return status;
                 }
             }
-        }
-        // Check for timeouts
-        Pollable::Timestamp now = Pollable::Clock::now();
-        for (const auto& pollable : mPollables) {
-            if (pollable->getTimeout() <= now) {
+            if (event.events & EPOLLHUP) {
+                // The fd was closed from the other end, pollables re-open
+                // it and may get the same fd number back
                 int status = 0;
-                if (!pollable->onTimeout(&status)) {
-                    // The onTimeout handler signaled an exit
+                if (!pollable->onClose(fd, &status)) {
+                    // The onClose handler signaled an exit
                     return status;
                 }
+                closed = true;
+            }
+            refreshPollable(pollable, closed);
+        }
+
+        // Check for timeouts, collect them first since the handlers will
+        // reschedule their deadlines
+        Pollable::Timestamp now = Pollable::Clock::now();
+        expired.clear();
+        for (const auto& entry : mDeadlines) {
+            if (entry.first > now) {
+                break;
+            }
+            expired.push_back(entry.second);
+        }
+        for (Pollable* pollable : expired) {
+            int status = 0;
+            if (!pollable->onTimeout(&status)) {
+                // The onTimeout handler signaled an exit
+                return status;
             }
+            refreshPollable(pollable, false);
         }
     }
 
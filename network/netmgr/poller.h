@@ -16,19 +16,61 @@
 
 #pragma once
 
+#include <set>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "pollable.h"
+#include "result.h"
 
+/* Runs an epoll loop for a set of pollables. The fds of a pollable are
+ * registered with epoll when it is added and are only updated after one of
+ * its callbacks has run, so the cost of a wakeup does not depend on how many
+ * pollables there are. An fd is only modified in epoll when the events it
+ * waits for change.
+ */
 class Poller {
 public:
     Poller();
+    ~Poller();
+
+    Result init();
 
     void addPollable(Pollable* pollable);
+    /* Re-read the poll data and timeout of |pollable| and register all of
+     * its fds again. The poll data is re-read automatically after each of its
+     * callbacks, call this if its fds or deadline change at any other time.
+     * Pollables that close and re-open an fd outside of onClose have to call
+     * this as the new fd may get the same number.
+     */
+    void updatePollable(Pollable* pollable);
 
     int run();
 
 private:
-    std::vector<Pollable*> mPollables;
-};
+    struct Registration {
+        Pollable* pollable;
+        uint32_t generation;
+    };
+    struct PollableState {
+        // The fds and events registered in epoll
+        std::vector<pollfd> fds;
+        Pollable::Timestamp deadline;
+    };
 
+    // Re-read the poll data and timeout of |pollable|. Only fds that are new
+    // or wait for different events are updated in epoll, unless |reregister|
+    // is true.
+    void refreshPollable(Pollable* pollable, bool reregister);
+    bool registerFd(Pollable* pollable, const pollfd& fd);
+    void unregisterFd(int fd);
+
+    int mEpollFd;
+    // Incremented for each fd registration so that events for an fd that
+    // was closed and reused during the same wakeup can be told apart
+    uint32_t mGeneration;
+    std::unordered_map<int, Registration> mFds;
+    std::unordered_map<Pollable*, PollableState> mPollables;
+    std::set<std::pair<Pollable::Timestamp, Pollable*>> mDeadlines;
+};
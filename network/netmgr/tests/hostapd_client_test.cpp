@@ -0,0 +1,183 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "../hostapd_client.h"
+#include "mock_hostapd.h"
+
+#include <gtest/gtest.h>
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::chrono::duration_cast;
+
+static const char kIfName[] = "wlan1_1";
+
+class HostapdClientTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        char dir[] = "/tmp/netmgr_hostapd_XXXXXX";
+        ASSERT_NE(nullptr, ::mkdtemp(dir));
+        mCtrlDir = dir;
+        mClientPath = mCtrlDir + "/netmgr_ctrl";
+        mClient.reset(new HostapdClient(mCtrlDir.c_str(), mClientPath.c_str()));
+        ASSERT_TRUE(mClient->init().isSuccess());
+    }
+
+    void TearDown() override {
+        mClient.reset();
+        ::rmdir(mCtrlDir.c_str());
+    }
+
+    // Submit |commands| and run the client the way the poller would until it
+    // reports the outcome.
+    Result run(std::vector<std::string> commands) {
+        bool done = false;
+        Result result = Result::success();
+        mClient->submit(kIfName, std::move(commands),
+                        [&done, &result](const Result& res) {
+            done = true;
+            result = res;
+        });
+        pump(&done);
+        return result;
+    }
+
+    void pump(const bool* done) {
+        auto giveUp = Pollable::Clock::now() + std::chrono::seconds(5);
+        int status = 0;
+        while (!*done && Pollable::Clock::now() < giveUp) {
+            std::vector<pollfd> fds;
+            mClient->getPollData(&fds);
+            Pollable::Timestamp deadline = mClient->getTimeout();
+            int timeout = 100;
+            if (deadline != Pollable::Timestamp::max()) {
+                auto left = duration_cast<std::chrono::milliseconds>(
+                        deadline - Pollable::Clock::now()).count();
+                timeout = left > 0 ? static_cast<int>(left) : 0;
+            }
+            ::poll(fds.data(), fds.size(), timeout);
+            for (const auto& fd : fds) {
+                if (fd.revents & POLLIN) {
+                    mClient->onReadAvailable(fd.fd, &status);
+                }
+            }
+            if (mClient->getTimeout() <= Pollable::Clock::now()) {
+                mClient->onTimeout(&status);
+            }
+        }
+    }
+
+    std::string mCtrlDir;
+    std::string mClientPath;
+    std::unique_ptr<HostapdClient> mClient;
+};
+
+TEST_F(HostapdClientTest, SendsCommandsInOrder) {
+    MockHostapd hostapd(mCtrlDir, kIfName);
+    ASSERT_TRUE(hostapd.start());
+
+    Result res = run({ "SET wpa_passphrase secret", "RELOAD" });
+    EXPECT_TRUE(res.isSuccess()) << res.c_str();
+    EXPECT_EQ(std::vector<std::string>({ "SET wpa_passphrase secret",
+                                         "RELOAD" }),
+              hostapd.commands());
+}
+
+TEST_F(HostapdClientTest, StopsAtRejectedCommand) {
+    MockHostapd hostapd(mCtrlDir, kIfName);
+    ASSERT_TRUE(hostapd.start());
+    hostapd.setReply("DISABLE", "FAIL\n");
+
+    Result res = run({ "SET wpa 0", "DISABLE", "ENABLE" });
+    ASSERT_FALSE(res.isSuccess());
+    EXPECT_NE(nullptr, strstr(res.c_str(), "'DISABLE'")) << res.c_str();
+    EXPECT_EQ(std::vector<std::string>({ "SET wpa 0", "DISABLE" }),
+              hostapd.commands());
+}
+
+TEST_F(HostapdClientTest, RejectionDoesNotLogPassphrase) {
+    MockHostapd hostapd(mCtrlDir, kIfName);
+    ASSERT_TRUE(hostapd.start());
+    hostapd.setReply("SET", "FAIL\n");
+
+    Result res = run({ "SET wpa_passphrase secret" });
+    ASSERT_FALSE(res.isSuccess());
+    EXPECT_EQ(nullptr, strstr(res.c_str(), "secret")) << res.c_str();
+}
+
+TEST_F(HostapdClientTest, IgnoresEventMessages) {
+    MockHostapd hostapd(mCtrlDir, kIfName);
+    ASSERT_TRUE(hostapd.start());
+    hostapd.setSendEvents(true);
+
+    Result res = run({ "SET wpa_passphrase secret", "RELOAD" });
+    EXPECT_TRUE(res.isSuccess()) << res.c_str();
+    EXPECT_EQ(2u, hostapd.commands().size());
+}
+
+TEST_F(HostapdClientTest, TimesOutWithoutReply) {
+    MockHostapd hostapd(mCtrlDir, kIfName);
+    ASSERT_TRUE(hostapd.start());
+    hostapd.setReply("RELOAD", "");
+
+    Result res = run({ "RELOAD" });
+    ASSERT_FALSE(res.isSuccess());
+    EXPECT_NE(nullptr, strstr(res.c_str(), "Timed out")) << res.c_str();
+
+    // The next request is not held up by the one that timed out
+    res = run({ "ENABLE" });
+    EXPECT_TRUE(res.isSuccess()) << res.c_str();
+}
+
+TEST_F(HostapdClientTest, FailsWithoutControlSocket) {
+    Result res = run({ "RELOAD" });
+    EXPECT_FALSE(res.isSuccess());
+}
+
+TEST_F(HostapdClientTest, HandlesRequestsFromOtherThreads) {
+    MockHostapd hostapd(mCtrlDir, kIfName);
+    ASSERT_TRUE(hostapd.start());
+
+    const int kRequests = 20;
+    int completed = 0;
+    bool done = false;
+    std::thread submitter([&]() {
+        for (int i = 0; i < kRequests; ++i) {
+            mClient->submit(kIfName, { "SET ssid net" + std::to_string(i) },
+                            [&, i](const Result& res) {
+                EXPECT_TRUE(res.isSuccess()) << res.c_str();
+                EXPECT_EQ(completed, i);
+                if (++completed == kRequests) {
+                    done = true;
+                }
+            });
+        }
+    });
+    pump(&done);
+    submitter.join();
+    EXPECT_EQ(kRequests, completed);
+    ASSERT_EQ(static_cast<size_t>(kRequests), hostapd.commands().size());
+    EXPECT_EQ("SET ssid net19", hostapd.commands().back());
+}
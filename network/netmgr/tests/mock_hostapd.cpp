@@ -0,0 +1,129 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mock_hostapd.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+MockHostapd::MockHostapd(const std::string& ctrlDir, const std::string& ifName)
+    : mPath(ctrlDir + "/" + ifName),
+      mSocket(-1),
+      mStopFd(-1),
+      mSendEvents(false) {
+}
+
+MockHostapd::~MockHostapd() {
+    if (mThread.joinable()) {
+        uint64_t one = 1;
+        while (::write(mStopFd, &one, sizeof(one)) < 0 && errno == EINTR) {
+        }
+        mThread.join();
+    }
+    if (mSocket != -1) {
+        ::close(mSocket);
+        ::unlink(mPath.c_str());
+    }
+    if (mStopFd != -1) {
+        ::close(mStopFd);
+    }
+}
+
+bool MockHostapd::start() {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (mPath.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, mPath.c_str(), mPath.size() + 1);
+
+    mSocket = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    mStopFd = ::eventfd(0, EFD_CLOEXEC);
+    if (mSocket == -1 || mStopFd == -1) {
+        return false;
+    }
+    ::unlink(mPath.c_str());
+    if (::bind(mSocket, reinterpret_cast<const sockaddr*>(&addr),
+               sizeof(addr)) != 0) {
+        return false;
+    }
+    mThread = std::thread(&MockHostapd::run, this);
+    return true;
+}
+
+void MockHostapd::setReply(const std::string& name, const std::string& reply) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mReplies[name] = reply;
+}
+
+std::vector<std::string> MockHostapd::commands() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mCommands;
+}
+
+void MockHostapd::run() {
+    char buffer[4096];
+    while (true) {
+        struct pollfd fds[] = {
+            { mSocket, POLLIN, 0 },
+            { mStopFd, POLLIN, 0 },
+        };
+        if (::poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+
+        sockaddr_un from;
+        socklen_t fromLength = sizeof(from);
+        ssize_t received = ::recvfrom(mSocket, buffer, sizeof(buffer), 0,
+                                      reinterpret_cast<sockaddr*>(&from),
+                                      &fromLength);
+        if (received < 0) {
+            continue;
+        }
+        std::string command(buffer, received);
+        std::string reply = "OK\n";
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mCommands.push_back(command);
+            auto custom = mReplies.find(command.substr(0, command.find(' ')));
+            if (custom != mReplies.end()) {
+                reply = custom->second;
+            }
+        }
+        if (reply.empty()) {
+            continue;
+        }
+
+        const sockaddr* to = reinterpret_cast<const sockaddr*>(&from);
+        if (mSendEvents) {
+            static const char kEvent[] = "<3>AP-STA-CONNECTED 02:00:00:00:01:00";
+            ::sendto(mSocket, kEvent, sizeof(kEvent) - 1, 0, to, fromLength);
+        }
+        ::sendto(mSocket, reply.data(), reply.size(), 0, to, fromLength);
+    }
+}
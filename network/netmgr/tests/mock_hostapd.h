@@ -0,0 +1,55 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// A stand-in for the control interface hostapd creates for a BSS. It binds a
+// UNIX datagram socket named |ifName| in |ctrlDir|, records every command it
+// receives and replies with OK unless told otherwise.
+class MockHostapd {
+public:
+    MockHostapd(const std::string& ctrlDir, const std::string& ifName);
+    ~MockHostapd();
+
+    bool start();
+
+    // Reply to commands starting with |name| with |reply| instead of OK. An
+    // empty |reply| means no reply at all, like a hostapd that is stuck.
+    void setReply(const std::string& name, const std::string& reply);
+    // Send an unsolicited event message before each reply
+    void setSendEvents(bool sendEvents) { mSendEvents = sendEvents; }
+
+    std::vector<std::string> commands();
+
+private:
+    void run();
+
+    std::string mPath;
+    int mSocket;
+    int mStopFd;
+    std::atomic<bool> mSendEvents;
+    std::thread mThread;
+    std::mutex mMutex;
+    std::unordered_map<std::string, std::string> mReplies;
+    std::vector<std::string> mCommands;
+};
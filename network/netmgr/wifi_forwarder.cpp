@@ -21,6 +21,7 @@
 #include <inttypes.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <linux/if_packet.h>
 #include <linux/kernel.h>
 // Ignore warning about unused static qemu pipe function
@@ -31,18 +32,40 @@
 #include <string.h>
 #include <net/ethernet.h>
 #include <net/if.h>
+#include <net/if_arp.h>
 #include <pcap/pcap.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <new>
+
 static const char kQemuPipeName[] = "qemud:wififorward";
 
 // The largest packet size to capture with pcap on the monitor interface
 static const int kPcapSnapLength = 65536;
 
-static const size_t kForwardBufferIncrement = 32768;
-static const size_t kForwardBufferMaxSize = 1 << 20;
+// The receive ring used instead of pcap when available. Each wakeup walks
+// every block the kernel has handed over, a block is retired to user space
+// when it's full or when kRingBlockTimeoutMs has passed since its first frame.
+static const unsigned int kRingBlockSize = 1 << 18;
+static const unsigned int kRingBlockCount = 8;
+static const unsigned int kRingFrameSize = 2048;
+static const unsigned int kRingBlockTimeoutMs = 2;
+
+// The size of the circular buffer holding data from the pipe until it forms
+// complete frames, and the largest number of frames injected in one call.
+static const size_t kInjectBufferSize = 1 << 20;
+static const size_t kInjectBatchSize = 32;
+// How long to wait before retrying when the packet socket can't take more
+// frames. The frames stay in the buffer and the pipe isn't read until then.
+static const auto kInjectRetryDelay = std::chrono::milliseconds(5);
+
+static const size_t kNoMagic = static_cast<size_t>(-1);
 
 static const uint32_t kWifiForwardMagic = 0xD5C4B3A2;
 
@@ -111,11 +134,47 @@ static const uint32_t kMinimumIeee80211Size = sizeof(uint16_t) +
                                               sizeof(uint16_t) +
                                               sizeof(MacAddress);
 
+// Write all of |iov| to |fd|, retrying partial writes.
+static bool WritevFully(int fd, struct iovec* iov, size_t count) {
+    while (count > 0) {
+        int batch = static_cast<int>(std::min<size_t>(count, IOV_MAX));
+        ssize_t n = TEMP_FAILURE_RETRY(::writev(fd, iov, batch));
+        if (n == -1) {
+            return false;
+        }
+        size_t written = static_cast<size_t>(n);
+        // Skip everything that was fully written
+        while (count > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            // And adjust the partially written one
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
 WifiForwarder::WifiForwarder(const char* monitorInterfaceName)
     : mInterfaceName(monitorInterfaceName),
       mDeadline(Pollable::Timestamp::max()),
       mMonitorPcap(nullptr),
-      mPipeFd(-1) {
+      mPipeFd(-1),
+      mPacketFd(-1),
+      mRing(nullptr),
+      mRingSize(0),
+      mRingBlock(0),
+      mInjectBuffer(kInjectBufferSize),
+      mInjectHead(0),
+      mInjectSize(0),
+      mInjectMessages(kInjectBatchSize),
+      mInjectIovecs(kInjectBatchSize * 2),
+      mInjectOffsets(kInjectBatchSize),
+      mInjectCount(0),
+      mInjectRetry(Pollable::Timestamp::max()) {
 }
 
 WifiForwarder::~WifiForwarder() {
@@ -123,7 +182,7 @@ WifiForwarder::~WifiForwarder() {
 }
 
 Result WifiForwarder::init() {
-    if (mMonitorPcap || mPipeFd != -1) {
+    if (mMonitorPcap || mPipeFd != -1 || mPacketFd != -1) {
         return Result::error("WifiForwarder already initialized");
     }
 
@@ -137,6 +196,115 @@ Result WifiForwarder::init() {
         return Result::success();
     }
 
+    Result res = openRing();
+    if (res.isSuccess()) {
+        return res;
+    }
+    LOGW("WifiForwarder falling back to pcap: %s", res.c_str());
+    return openPcap();
+}
+
+Result WifiForwarder::openRing() {
+    unsigned int ifIndex = if_nametoindex(mInterfaceName.c_str());
+    if (ifIndex == 0) {
+        return Result::error("WifiForwarder unable to find interface '%s': %s",
+                             mInterfaceName.c_str(), strerror(errno));
+    }
+
+    mPacketFd = ::socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                         htons(ETH_P_ALL));
+    if (mPacketFd == -1) {
+        return Result::error("WifiForwarder unable to open packet socket: %s",
+                             strerror(errno));
+    }
+
+    struct ifreq request;
+    memset(&request, 0, sizeof(request));
+    strlcpy(request.ifr_name, mInterfaceName.c_str(), sizeof(request.ifr_name));
+    if (::ioctl(mPacketFd, SIOCGIFHWADDR, &request) != 0) {
+        closeRing();
+        return Result::error("WifiForwarder unable to get link type: %s",
+                             strerror(errno));
+    }
+    if (request.ifr_hwaddr.sa_family != ARPHRD_IEEE80211_RADIOTAP) {
+        closeRing();
+        return Result::error("WifiForwarder detected incompatible link type: %d",
+                             request.ifr_hwaddr.sa_family);
+    }
+
+    int version = TPACKET_V3;
+    if (::setsockopt(mPacketFd, SOL_PACKET, PACKET_VERSION,
+                     &version, sizeof(version)) != 0) {
+        closeRing();
+        return Result::error("WifiForwarder unable to use TPACKET_V3: %s",
+                             strerror(errno));
+    }
+
+    struct tpacket_req3 ringRequest;
+    memset(&ringRequest, 0, sizeof(ringRequest));
+    ringRequest.tp_block_size = kRingBlockSize;
+    ringRequest.tp_block_nr = kRingBlockCount;
+    ringRequest.tp_frame_size = kRingFrameSize;
+    ringRequest.tp_frame_nr = (kRingBlockSize * kRingBlockCount) /
+                              kRingFrameSize;
+    ringRequest.tp_retire_blk_tov = kRingBlockTimeoutMs;
+    if (::setsockopt(mPacketFd, SOL_PACKET, PACKET_RX_RING,
+                     &ringRequest, sizeof(ringRequest)) != 0) {
+        closeRing();
+        return Result::error("WifiForwarder unable to set up receive ring: %s",
+                             strerror(errno));
+    }
+
+    mRingSize = static_cast<size_t>(kRingBlockSize) * kRingBlockCount;
+    void* ring = ::mmap(nullptr, mRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, mPacketFd, 0);
+    if (ring == MAP_FAILED) {
+        closeRing();
+        return Result::error("WifiForwarder unable to map receive ring: %s",
+                             strerror(errno));
+    }
+    mRing = static_cast<uint8_t*>(ring);
+    mRingBlock = 0;
+
+    struct packet_mreq membership;
+    memset(&membership, 0, sizeof(membership));
+    membership.mr_ifindex = ifIndex;
+    membership.mr_type = PACKET_MR_PROMISC;
+    if (::setsockopt(mPacketFd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                     &membership, sizeof(membership)) != 0) {
+        closeRing();
+        return Result::error("WifiForwarder unable to set promisc mode: %s",
+                             strerror(errno));
+    }
+
+    struct sockaddr_ll address;
+    memset(&address, 0, sizeof(address));
+    address.sll_family = AF_PACKET;
+    address.sll_protocol = htons(ETH_P_ALL);
+    address.sll_ifindex = ifIndex;
+    if (::bind(mPacketFd, reinterpret_cast<struct sockaddr*>(&address),
+               sizeof(address)) != 0) {
+        closeRing();
+        return Result::error("WifiForwarder unable to bind packet socket: %s",
+                             strerror(errno));
+    }
+
+    return Result::success();
+}
+
+void WifiForwarder::closeRing() {
+    if (mRing) {
+        ::munmap(mRing, mRingSize);
+        mRing = nullptr;
+        mRingSize = 0;
+    }
+    if (mPacketFd != -1) {
+        ::close(mPacketFd);
+        mPacketFd = -1;
+    }
+}
+
+Result WifiForwarder::openPcap() {
     char errorMsg[PCAP_ERRBUF_SIZE];
     memset(errorMsg, 0, sizeof(errorMsg));
     mMonitorPcap = pcap_create(mInterfaceName.c_str(), errorMsg);
@@ -188,6 +356,19 @@ void WifiForwarder::getPollData(std::vector<pollfd>* fds) const {
     if (mPipeFd == -1) {
         return;
     }
+    if (mPacketFd != -1) {
+        fds->push_back(pollfd{mPacketFd, POLLIN, 0});
+        if (mInjectRetry == Pollable::Timestamp::max()) {
+            // Only read more from the pipe once queued frames are injected
+            fds->push_back(pollfd{mPipeFd, POLLIN, 0});
+        }
+        return;
+    }
+    if (mMonitorPcap == nullptr) {
+        // Neither capture path could be set up, only inject
+        fds->push_back(pollfd{mPipeFd, POLLIN, 0});
+        return;
+    }
     int pcapFd = pcap_get_selectable_fd(mMonitorPcap);
     if (pcapFd != -1) {
         fds->push_back(pollfd{pcapFd, POLLIN, 0});
@@ -200,161 +381,275 @@ void WifiForwarder::getPollData(std::vector<pollfd>* fds) const {
 }
 
 Pollable::Timestamp WifiForwarder::getTimeout() const {
-    // If there is no pipe return the deadline, we're going to retry, otherwise
-    // use an infinite timeout.
-    return mPipeFd == -1 ? mDeadline : Pollable::Timestamp::max();
+    // If there is no pipe return the deadline, we're going to retry. If
+    // injection is waiting for the packet socket return when to try again,
+    // otherwise use an infinite timeout.
+    return mPipeFd == -1 ? mDeadline : mInjectRetry;
 }
 
 bool WifiForwarder::onReadAvailable(int fd, int* /*status*/) {
     if (fd == mPipeFd) {
         injectFromPipe();
+    } else if (fd == mPacketFd) {
+        forwardFromRing();
     } else {
         forwardFromPcap();
     }
     return true;
 }
 
-void WifiForwarder::forwardFromPcap() {
-    struct pcap_pkthdr* header = nullptr;
-    const u_char* data = nullptr;
-    int result = pcap_next_ex(mMonitorPcap, &header, &data);
-    if (result == 0) {
-        // Timeout, nothing to do
-        return;
-    } else if (result < 0) {
-        LOGE("WifiForwarder failed to read from pcap: %s",
-             pcap_geterr(mMonitorPcap));
-        return;
-    }
-    if (header->caplen < header->len) {
+// Check that a captured frame can be forwarded and find the length of its
+// radiotap header.
+bool WifiForwarder::getCaptureRadioLength(const uint8_t* data,
+                                          uint32_t captureLength,
+                                          uint32_t packetLength,
+                                          uint32_t* radioLength) const {
+    if (captureLength < packetLength) {
         LOGE("WifiForwarder received packet exceeding capture length: %u < %u",
-             header->caplen, header->len);
-        return;
-    }
-
-    if (mPipeFd == -1) {
-        LOGE("WifiForwarder unable to forward data, pipe not open");
-        return;
+             captureLength, packetLength);
+        return false;
     }
 
-    if (header->caplen < sizeof(RadioTapHeader)) {
+    if (captureLength < sizeof(RadioTapHeader)) {
         // This packet is too small to be a valid radiotap packet, drop it
         LOGE("WifiForwarder captured packet that is too small: %u",
-             header->caplen);
-        return;
+             captureLength);
+        return false;
     }
 
     auto radiotap = reinterpret_cast<const RadioTapHeader*>(data);
-    uint32_t radioLen = __le16_to_cpu(radiotap->it_len);
-    if (header->caplen < radioLen + kMinimumIeee80211Size) {
+    *radioLength = __le16_to_cpu(radiotap->it_len);
+    if (captureLength < *radioLength + kMinimumIeee80211Size) {
         // This packet is too small to contain a valid IEEE 802.11 frame
         LOGE("WifiForwarder captured packet that is too small: %u < %u",
-             header->caplen, radioLen + kMinimumIeee80211Size);
-        return;
+             captureLength, *radioLength + kMinimumIeee80211Size);
+        return false;
     }
+    return true;
+}
+
+void WifiForwarder::forwardFromRing() {
+    while (true) {
+        auto block = reinterpret_cast<struct tpacket_block_desc*>(
+                mRing + static_cast<size_t>(mRingBlock) * kRingBlockSize);
+        if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+            // The kernel has not handed over this block yet, we're done
+            return;
+        }
+        // Don't read the frames before the status says they're ready
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        const uint32_t numFrames = block->hdr.bh1.num_pkts;
+        // Size the header storage up front, the iovecs point into it
+        mFrameHeaders.resize(numFrames * sizeof(WifiForwardHeader));
+        mFrameIovecs.clear();
+
+        auto frame = reinterpret_cast<struct tpacket3_hdr*>(
+                reinterpret_cast<uint8_t*>(block) +
+                block->hdr.bh1.offset_to_first_pkt);
+        size_t numForwarded = 0;
+        for (uint32_t i = 0; i < numFrames; ++i) {
+            uint8_t* data = reinterpret_cast<uint8_t*>(frame) + frame->tp_mac;
+            uint32_t radioLen = 0;
+            if (getCaptureRadioLength(data, frame->tp_snaplen, frame->tp_len,
+                                      &radioLen)) {
+                void* header = &mFrameHeaders[numForwarded++ *
+                                              sizeof(WifiForwardHeader)];
+                new (header) WifiForwardHeader(frame->tp_snaplen, radioLen);
+                mFrameIovecs.push_back({header, sizeof(WifiForwardHeader)});
+                mFrameIovecs.push_back({data, frame->tp_snaplen});
+            }
+            frame = reinterpret_cast<struct tpacket3_hdr*>(
+                    reinterpret_cast<uint8_t*>(frame) + frame->tp_next_offset);
+        }
 
-    WifiForwardHeader forwardHeader(header->caplen, radioLen);
+        forwardFrames();
 
-    if (!WriteFully(mPipeFd, &forwardHeader, sizeof(forwardHeader))) {
-        LOGE("WifiForwarder failed to write to pipe: %s", strerror(errno));
-        return;
+        // Hand the block back to the kernel only once we're done with it
+        std::atomic_thread_fence(std::memory_order_release);
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        mRingBlock = (mRingBlock + 1) % kRingBlockCount;
     }
+}
 
-    if (!WriteFully(mPipeFd, data, header->caplen)) {
+// Write the frames in mFrameIovecs to the pipe in a single call
+bool WifiForwarder::forwardFrames() {
+    if (mFrameIovecs.empty()) {
+        return true;
+    }
+    if (mPipeFd == -1) {
+        LOGE("WifiForwarder unable to forward data, pipe not open");
+        return false;
+    }
+    if (!WritevFully(mPipeFd, mFrameIovecs.data(), mFrameIovecs.size())) {
         LOGE("WifiForwarder failed to write to pipe: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void WifiForwarder::forwardFromPcap() {
+    struct pcap_pkthdr* header = nullptr;
+    const u_char* data = nullptr;
+    int result = pcap_next_ex(mMonitorPcap, &header, &data);
+    if (result == 0) {
+        // Timeout, nothing to do
+        return;
+    } else if (result < 0) {
+        LOGE("WifiForwarder failed to read from pcap: %s",
+             pcap_geterr(mMonitorPcap));
+        return;
+    }
+    uint32_t radioLen = 0;
+    if (!getCaptureRadioLength(data, header->caplen, header->len, &radioLen)) {
         return;
     }
+
+    mFrameHeaders.resize(sizeof(WifiForwardHeader));
+    new (mFrameHeaders.data()) WifiForwardHeader(header->caplen, radioLen);
+    mFrameIovecs.clear();
+    mFrameIovecs.push_back({mFrameHeaders.data(), sizeof(WifiForwardHeader)});
+    mFrameIovecs.push_back({const_cast<u_char*>(data), header->caplen});
+    forwardFrames();
+}
+
+// Copy |length| bytes starting |offset| bytes into the inject buffer to
+// |dest|, the data may wrap around the end of the buffer.
+void WifiForwarder::copyFromInjectBuffer(size_t offset,
+                                         void* dest,
+                                         size_t length) const {
+    const size_t capacity = mInjectBuffer.size();
+    size_t position = (mInjectHead + offset) % capacity;
+    size_t first = std::min(length, capacity - position);
+    memcpy(dest, mInjectBuffer.data() + position, first);
+    memcpy(static_cast<uint8_t*>(dest) + first,
+           mInjectBuffer.data(), length - first);
+}
+
+// Find the next magic marker at or after |offset| bytes into the inject
+// buffer without moving any data. Returns the offset of the marker or
+// kNoMagic if there is none.
+size_t WifiForwarder::findMagic(size_t offset) const {
+    const uint32_t le32magic = __cpu_to_le32(kWifiForwardMagic);
+    const size_t capacity = mInjectBuffer.size();
+
+    while (offset + sizeof(le32magic) <= mInjectSize) {
+        size_t position = (mInjectHead + offset) % capacity;
+        size_t contiguous = std::min(mInjectSize - offset,
+                                     capacity - position);
+        if (contiguous >= sizeof(le32magic)) {
+            const uint8_t* start = mInjectBuffer.data() + position;
+            auto next = static_cast<const uint8_t*>(
+                    ::memmem(start, contiguous, &le32magic, sizeof(le32magic)));
+            if (next) {
+                return offset + (next - start);
+            }
+            // The last three bytes could be the start of a marker that wraps
+            // around the end of the buffer, check those one at a time.
+            offset += contiguous - (sizeof(le32magic) - 1);
+        } else {
+            uint32_t value = 0;
+            copyFromInjectBuffer(offset, &value, sizeof(value));
+            if (value == le32magic) {
+                return offset;
+            }
+            ++offset;
+        }
+    }
+    return kNoMagic;
 }
 
 void WifiForwarder::injectFromPipe() {
-    size_t start = mMonitorBuffer.size();
-    size_t newSize = start + kForwardBufferIncrement;
-    if (newSize > kForwardBufferMaxSize) {
+    const size_t capacity = mInjectBuffer.size();
+    if (mInjectSize == capacity) {
         // We've exceeded the maximum allowed size, drop everything we have so
         // far and start over. This is most likely caused by some delay in
         // injection or the injection failing in which case keeping old data
         // around isn't going to be very useful.
         LOGE("WifiForwarder ran out of buffer space");
-        newSize = kForwardBufferIncrement;
-        start = 0;
+        mInjectHead = 0;
+        mInjectSize = 0;
     }
-    mMonitorBuffer.resize(newSize);
+
+    // Read into all of the free space, which may wrap around the end
+    size_t tail = (mInjectHead + mInjectSize) % capacity;
+    size_t space = capacity - mInjectSize;
+    size_t first = std::min(space, capacity - tail);
+    struct iovec iov[2] = {
+        { mInjectBuffer.data() + tail, first },
+        { mInjectBuffer.data(), space - first },
+    };
+    int iovCount = space > first ? 2 : 1;
 
     while (true) {
-        int result = ::read(mPipeFd,
-                            mMonitorBuffer.data() + start,
-                            mMonitorBuffer.size() - start);
+        ssize_t result = ::readv(mPipeFd, iov, iovCount);
         if (result < 0) {
             if (errno == EINTR) {
                 continue;
             }
             LOGE("WifiForwarder failed to read to forward buffer: %s",
                  strerror(errno));
-            // Return the buffer to its previous size
-            mMonitorBuffer.resize(start);
             return;
         } else if (result == 0) {
             // Nothing received, nothing to write
-            // Return the buffer to its previous size
-            mMonitorBuffer.resize(start);
             LOGE("WifiForwarder did not receive anything to inject");
             return;
         }
-        // Adjust the buffer size to match everything we recieved
-        mMonitorBuffer.resize(start + static_cast<size_t>(result));
+        mInjectSize += static_cast<size_t>(result);
         break;
     }
 
-    while (mMonitorBuffer.size() >=
+    injectBuffered();
+}
+
+void WifiForwarder::injectBuffered() {
+    const size_t capacity = mInjectBuffer.size();
+    mInjectRetry = Pollable::Timestamp::max();
+
+    // Parse frames in place. Complete frames are queued and injected in
+    // batches, nothing is consumed from the buffer until they have been sent.
+    size_t offset = 0;
+    bool stalled = false;
+    while (mInjectSize - offset >=
            sizeof(WifiForwardHeader) + sizeof(RadioTapHeader)) {
-        auto fwd = reinterpret_cast<WifiForwardHeader*>(mMonitorBuffer.data());
-        if (__le32_to_cpu(fwd->magic) != kWifiForwardMagic) {
+        WifiForwardHeader fwd(0, 0);
+        RadioTapHeader hdr;
+        copyFromInjectBuffer(offset, &fwd, sizeof(fwd));
+        copyFromInjectBuffer(offset + sizeof(fwd), &hdr, sizeof(hdr));
+
+        if (__le32_to_cpu(fwd.magic) != kWifiForwardMagic) {
             // We are not properly aligned, this can happen for the first read
             // if the client or server happens to send something that's in the
             // middle of a stream. Attempt to find the next packet boundary.
             LOGE("WifiForwarder found incorrect magic, finding next magic");
-            uint32_t le32magic = __cpu_to_le32(kWifiForwardMagic);
-            auto next = reinterpret_cast<unsigned char*>(
-                    ::memmem(mMonitorBuffer.data(), mMonitorBuffer.size(),
-                             &le32magic, sizeof(le32magic)));
-            if (next) {
-                // We've found a possible candidate, erase everything before
-                size_t length = next - mMonitorBuffer.data();
-                mMonitorBuffer.erase(mMonitorBuffer.begin(),
-                                     mMonitorBuffer.begin() + length);
+            size_t next = findMagic(offset + 1);
+            if (next != kNoMagic) {
+                // We've found a possible candidate, skip everything before
+                offset = next;
                 continue;
-            } else {
-                // There is no possible candidate, drop everything except the
-                // last three bytes. The last three bytes could possibly be the
-                // start of the next magic without actually triggering the
-                // search above.
-                if (mMonitorBuffer.size() > 3) {
-                    mMonitorBuffer.erase(mMonitorBuffer.begin(),
-                                         mMonitorBuffer.end() - 3);
-                }
-                // In this case there is nothing left to parse so just return
-                // right away.
-                return;
             }
+            // There is no possible candidate, drop everything except the
+            // last three bytes. The last three bytes could possibly be the
+            // start of the next magic without actually triggering the
+            // search above.
+            offset = mInjectSize - 3;
+            break;
         }
         // The length according to the wifi forward header
-        const size_t fullLength = __le32_to_cpu(fwd->fullLength);
-        const size_t payloadLength = fullLength - sizeof(WifiForwardHeader);
-        const size_t radioLength = __le32_to_cpu(fwd->radioLength);
-        // Get the radio tap header, right after the wifi forward header
-        unsigned char* radioTapLocation = mMonitorBuffer.data() + sizeof(*fwd);
-        auto hdr = reinterpret_cast<RadioTapHeader*>(radioTapLocation);
-        const size_t radioHdrLength = __le16_to_cpu(hdr->it_len);
-
-        if (radioLength != radioHdrLength) {
+        const size_t fullLength = __le32_to_cpu(fwd.fullLength);
+        const size_t radioLength = __le32_to_cpu(fwd.radioLength);
+        const size_t radioHdrLength = __le16_to_cpu(hdr.it_len);
+
+        if (radioLength != radioHdrLength ||
+            fullLength < sizeof(WifiForwardHeader) + sizeof(RadioTapHeader) ||
+            fullLength > capacity) {
             LOGE("WifiForwarder radiotap (%u), forwarder (%u) length mismatch",
                  (unsigned)(radioHdrLength), (unsigned)radioLength);
-            // The wifi forward header radio length does not match up with the
-            // radiotap header length. Either this was not an actual packet
-            // boundary or the packet is malformed. Remove a single byte from
-            // the buffer to trigger a new magic marker search.
-            mMonitorBuffer.erase(mMonitorBuffer.begin(),
-                                 mMonitorBuffer.begin() + 1);
+            // The wifi forward header does not match up with the radiotap
+            // header. Either this was not an actual packet boundary or the
+            // packet is malformed. Skip a single byte to trigger a new magic
+            // marker search.
+            ++offset;
             continue;
         }
         // At this point we have verified that the magic marker is present and
@@ -362,42 +657,140 @@ void WifiForwarder::injectFromPipe() {
         // header length. We're now reasonably sure this is actually a valid
         // packet that we can process.
 
-        if (fullLength > mMonitorBuffer.size()) {
+        if (fullLength > mInjectSize - offset) {
             // We have not received enough data yet, wait for more to arrive.
-            return;
+            break;
         }
 
-        if (hdr->it_version != 0) {
+        if (hdr.it_version != 0) {
             // Unknown header version, skip this packet because we don't know
             // how to handle it.
             LOGE("WifiForwarder encountered unknown radiotap version %u",
-                 static_cast<unsigned>(hdr->it_version));
-            mMonitorBuffer.erase(mMonitorBuffer.begin(),
-                                 mMonitorBuffer.begin() + fullLength);
+                 static_cast<unsigned>(hdr.it_version));
+            offset += fullLength;
             continue;
         }
 
-        if (mMonitorPcap) {
-            // A sufficient amount of data has arrived, forward it.
-            int result = pcap_inject(mMonitorPcap, hdr, payloadLength);
+        if (!queueInjection(offset, sizeof(fwd),
+                            fullLength - sizeof(WifiForwardHeader))) {
+            stalled = true;
+            break;
+        }
+        offset += fullLength;
+    }
+    if (!stalled) {
+        stalled = !flushInjections();
+    }
+    if (stalled) {
+        // The socket is full, everything from the first frame that wasn't
+        // sent stays in the buffer until the retry.
+        offset = mInjectOffsets[0];
+        mInjectCount = 0;
+        mInjectRetry = Pollable::Clock::now() + kInjectRetryDelay;
+    }
+
+    mInjectHead = (mInjectHead + offset) % capacity;
+    mInjectSize -= offset;
+}
+
+// Queue the frame |length| bytes long, |skip| bytes into the forwarded frame
+// at |offset| in the inject buffer, for injection. The frame must stay in the
+// buffer until flushInjections. Returns false if a full batch had to be
+// flushed and the socket couldn't take all of it.
+bool WifiForwarder::queueInjection(size_t offset, size_t skip, size_t length) {
+    const size_t capacity = mInjectBuffer.size();
+    size_t position = (mInjectHead + offset + skip) % capacity;
+    size_t first = std::min(length, capacity - position);
+
+    struct iovec* iov = &mInjectIovecs[mInjectCount * 2];
+    iov[0].iov_base = mInjectBuffer.data() + position;
+    iov[0].iov_len = first;
+    iov[1].iov_base = mInjectBuffer.data();
+    iov[1].iov_len = length - first;
+
+    struct mmsghdr& message = mInjectMessages[mInjectCount];
+    memset(&message, 0, sizeof(message));
+    message.msg_hdr.msg_iov = iov;
+    message.msg_hdr.msg_iovlen = first < length ? 2 : 1;
+    mInjectOffsets[mInjectCount] = offset;
+
+    if (++mInjectCount == mInjectMessages.size()) {
+        return flushInjections();
+    }
+    return true;
+}
+
+// Inject all queued frames. Returns false if the packet socket ran out of
+// space, the frames that were not sent are then moved to the front of the
+// queue so that mInjectOffsets[0] is the offset of the first one.
+bool WifiForwarder::flushInjections() {
+    size_t count = mInjectCount;
+    mInjectCount = 0;
+    if (count == 0) {
+        return true;
+    }
+
+    if (mPacketFd != -1) {
+        size_t sent = 0;
+        while (sent < count) {
+            int result = ::sendmmsg(mPacketFd, &mInjectMessages[sent],
+                                    count - sent, 0);
             if (result < 0) {
-                LOGE("WifiForwarder failed to inject %" PRIu64 " bytes: %s",
-                     static_cast<uint64_t>(payloadLength),
-                     pcap_geterr(mMonitorPcap));
-            } else if (static_cast<size_t>(result) < payloadLength) {
-                LOGE("WifiForwarder only injected %d out of %" PRIu64 " bytes",
-                     result, static_cast<uint64_t>(payloadLength));
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    mInjectCount = count - sent;
+                    std::copy(mInjectOffsets.begin() + sent,
+                              mInjectOffsets.begin() + count,
+                              mInjectOffsets.begin());
+                    return false;
+                }
+                LOGE("WifiForwarder failed to inject %zu frames: %s",
+                     count - sent, strerror(errno));
+                return true;
             }
-        } else {
-            LOGE("WifiForwarder could not forward to monitor, pcap not set up");
+            sent += static_cast<size_t>(result);
         }
-        mMonitorBuffer.erase(mMonitorBuffer.begin(),
-                             mMonitorBuffer.begin() + fullLength);
+        return true;
+    }
+
+    if (!mMonitorPcap) {
+        LOGE("WifiForwarder could not forward to monitor, pcap not set up");
+        return true;
     }
 
+    for (size_t i = 0; i < count; ++i) {
+        const struct msghdr& message = mInjectMessages[i].msg_hdr;
+        const void* data = message.msg_iov[0].iov_base;
+        size_t payloadLength = message.msg_iov[0].iov_len;
+        if (message.msg_iovlen > 1) {
+            // pcap needs the frame in one piece
+            payloadLength += message.msg_iov[1].iov_len;
+            mInjectScratch.resize(payloadLength);
+            memcpy(mInjectScratch.data(), message.msg_iov[0].iov_base,
+                   message.msg_iov[0].iov_len);
+            memcpy(mInjectScratch.data() + message.msg_iov[0].iov_len,
+                   message.msg_iov[1].iov_base, message.msg_iov[1].iov_len);
+            data = mInjectScratch.data();
+        }
+        int result = pcap_inject(mMonitorPcap, data, payloadLength);
+        if (result < 0) {
+            LOGE("WifiForwarder failed to inject %" PRIu64 " bytes: %s",
+                 static_cast<uint64_t>(payloadLength),
+                 pcap_geterr(mMonitorPcap));
+        } else if (static_cast<size_t>(result) < payloadLength) {
+            LOGE("WifiForwarder only injected %d out of %" PRIu64 " bytes",
+                 result, static_cast<uint64_t>(payloadLength));
+        }
+    }
+    return true;
 }
 
 void WifiForwarder::cleanup() {
+    mInjectCount = 0;
+    mInjectRetry = Pollable::Timestamp::max();
+    closeRing();
     if (mMonitorPcap) {
         pcap_close(mMonitorPcap);
         mMonitorPcap = nullptr;
@@ -420,7 +813,11 @@ bool WifiForwarder::onClose(int /*fd*/, int* status) {
 }
 
 bool WifiForwarder::onTimeout(int* status) {
-    if (mPipeFd == -1 && mMonitorPcap == nullptr) {
+    if (mPipeFd != -1 && mInjectRetry != Pollable::Timestamp::max()) {
+        injectBuffered();
+        return true;
+    }
+    if (mPipeFd == -1 && mMonitorPcap == nullptr && mPacketFd == -1) {
         Result res = init();
         if (!res) {
             *status = 1;
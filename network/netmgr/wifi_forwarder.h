@@ -22,6 +22,11 @@
 
 #include <string>
 #include <unordered_set>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 struct Ieee80211Header;
 struct pcap;
@@ -41,13 +46,53 @@ public:
     bool onClose(int fd, int* status) override;
     bool onTimeout(int* status) override;
 private:
+    Result openPcap();
+    Result openRing();
+    void closeRing();
+    bool getCaptureRadioLength(const uint8_t* data,
+                               uint32_t captureLength,
+                               uint32_t packetLength,
+                               uint32_t* radioLength) const;
     void forwardFromPcap();
+    void forwardFromRing();
+    bool forwardFrames();
     void injectFromPipe();
+    void injectBuffered();
+    void copyFromInjectBuffer(size_t offset, void* dest, size_t length) const;
+    size_t findMagic(size_t offset) const;
+    bool queueInjection(size_t offset, size_t skip, size_t length);
+    bool flushInjections();
     void cleanup();
 
     std::string mInterfaceName;
     Pollable::Timestamp mDeadline;
-    std::vector<unsigned char> mMonitorBuffer;
     pcap_t* mMonitorPcap;
     int mPipeFd;
+
+    // A TPACKET_V3 receive ring on the monitor interface. When it can be set
+    // up it replaces pcap for both capture and injection.
+    int mPacketFd;
+    uint8_t* mRing;
+    size_t mRingSize;
+    unsigned int mRingBlock;
+    // Frames of the current block waiting to be written to the pipe, each as
+    // a WifiForwardHeader, stored in mFrameHeaders, followed by the captured
+    // data in the ring.
+    std::vector<unsigned char> mFrameHeaders;
+    std::vector<struct iovec> mFrameIovecs;
+
+    // Data read from the pipe, a circular buffer of mInjectSize bytes
+    // starting at mInjectHead. Frames are parsed and injected from it in
+    // place, in batches of up to mInjectMessages.size() frames.
+    std::vector<unsigned char> mInjectBuffer;
+    size_t mInjectHead;
+    size_t mInjectSize;
+    std::vector<struct mmsghdr> mInjectMessages;
+    std::vector<struct iovec> mInjectIovecs;
+    // The offset in the inject buffer of each queued forwarded frame
+    std::vector<size_t> mInjectOffsets;
+    size_t mInjectCount;
+    // When to retry injecting after the packet socket was full, max if not
+    Pollable::Timestamp mInjectRetry;
+    std::vector<unsigned char> mInjectScratch;
 };
@@ -8,8 +8,10 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES:= \
     reference-ril.c \
     atchannel.c \
+    at_cache.c \
     if_monitor.cpp \
     misc.c \
+    at_prefix.c \
     at_tok.c
 
 LOCAL_SHARED_LIBRARIES := \
@@ -43,3 +45,39 @@ LOCAL_SHARED_LIBRARIES += \
 LOCAL_CFLAGS += -DRIL_SHLIB
 LOCAL_MODULE:= libgoldfish-ril
 include $(BUILD_SHARED_LIBRARY)
+
+# A host stand-in for the emulator's modem, to run reference-ril against
+include $(CLEAR_VARS)
+LOCAL_MODULE := goldfish-modem-simulator
+LOCAL_SRC_FILES := modem_simulator.c
+LOCAL_CFLAGS := -D_GNU_SOURCE -Wall -Wextra -Werror
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+# Runs reference-ril against the modem simulator through a stub libril and
+# reports request latency and throughput
+include $(CLEAR_VARS)
+LOCAL_MODULE := goldfish-ril-harness
+LOCAL_SRC_FILES := \
+    ril_harness.c \
+    reference-ril.c \
+    atchannel.c \
+    at_cache.c \
+    if_monitor.cpp \
+    misc.c \
+    at_prefix.c \
+    at_tok.c
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include hardware/ril/include
+LOCAL_SHARED_LIBRARIES := liblog libcutils libutils
+LOCAL_CFLAGS := -D_GNU_SOURCE -DRIL_SHLIB
+LOCAL_CFLAGS += -Wall -Wextra -Wno-unused-variable -Wno-unused-function -Werror
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
+
+# Compares the response prefix trie with the strStartsWith chains it replaced
+include $(CLEAR_VARS)
+LOCAL_MODULE := goldfish-at-prefix-benchmark
+LOCAL_SRC_FILES := at_prefix_benchmark.c at_prefix.c misc.c
+LOCAL_CFLAGS := -Wall -Wextra -Werror
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,294 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "at_cache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_TAG "AT"
+#include <utils/Log.h>
+
+typedef struct {
+    ATResponse *p_response;       /* NULL if nothing is cached */
+    long long updatedMsec;
+    unsigned generation;          /* bumped whenever the entry changes */
+    int refreshPending;
+} ATCacheState;
+
+static pthread_mutex_t s_cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static const ATCacheEntry *s_cacheEntries;
+static size_t s_cacheCount;
+static ATCacheRefreshScheduler s_cacheScheduler;
+static ATCacheState s_cacheState[AT_CACHE_MAX_ENTRIES];
+
+static long long nowMsec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* returns a deep copy of |p_response| that at_response_free() can free */
+static ATResponse *copyResponse(const ATResponse *p_response)
+{
+    ATResponse *p_copy;
+    ATLine *p_line;
+    ATLine **pp_tail;
+
+    p_copy = (ATResponse *)calloc(1, sizeof(ATResponse));
+    if (p_copy == NULL) return NULL;
+
+    p_copy->success = p_response->success;
+
+    if (p_response->finalResponse != NULL) {
+        p_copy->finalResponse = strdup(p_response->finalResponse);
+        if (p_copy->finalResponse == NULL) goto error;
+    }
+
+    pp_tail = &p_copy->p_intermediates;
+    for (p_line = p_response->p_intermediates; p_line != NULL;
+            p_line = p_line->p_next) {
+        ATLine *p_new = (ATLine *)calloc(1, sizeof(ATLine));
+
+        if (p_new == NULL) goto error;
+        *pp_tail = p_new;
+        pp_tail = &p_new->p_next;
+
+        p_new->line = strdup(p_line->line);
+        if (p_new->line == NULL) goto error;
+    }
+
+    return p_copy;
+error:
+    at_response_free(p_copy);
+    return NULL;
+}
+
+static int queryModem(int id, ATResponse **pp_outResponse)
+{
+    const ATCacheEntry *p_entry = &s_cacheEntries[id];
+
+    switch (p_entry->type) {
+        case SINGLELINE:
+            return at_send_command_singleline(p_entry->command,
+                    p_entry->responsePrefix, pp_outResponse);
+        case MULTILINE:
+            return at_send_command_multiline(p_entry->command,
+                    p_entry->responsePrefix, pp_outResponse);
+        case NUMERIC:
+            return at_send_command_numeric(p_entry->command, pp_outResponse);
+        default:
+            return at_send_command(p_entry->command, pp_outResponse);
+    }
+}
+
+/* takes ownership of |p_response|; call with s_cacheMutex held */
+static void storeResponse_nolock(int id, ATResponse *p_response)
+{
+    ATCacheState *p_state = &s_cacheState[id];
+
+    at_response_free(p_state->p_response);
+    p_state->p_response = p_response;
+    p_state->updatedMsec = nowMsec();
+    p_state->generation++;
+}
+
+static int isValidId(int id)
+{
+    return id >= 0 && (size_t)id < s_cacheCount;
+}
+
+static void refreshEntry(void *param)
+{
+    int id = (int)(intptr_t)param;
+    ATResponse *p_response = NULL;
+    ATResponse *p_copy = NULL;
+    unsigned generation;
+    int err;
+
+    pthread_mutex_lock(&s_cacheMutex);
+    generation = s_cacheState[id].generation;
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    err = queryModem(id, &p_response);
+    if (err == 0 && p_response->success) {
+        p_copy = copyResponse(p_response);
+    }
+    at_response_free(p_response);
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    s_cacheState[id].refreshPending = 0;
+
+    /* an unsolicited update or an invalidation that raced with the query
+       wins, since it may be newer than what we just read */
+    if (s_cacheState[id].generation == generation) {
+        if (p_copy == NULL) {
+            /* don't keep serving a response the modem no longer gives */
+            RLOGD("refresh of '%s' failed", s_cacheEntries[id].command);
+            at_response_free(s_cacheState[id].p_response);
+            s_cacheState[id].p_response = NULL;
+            s_cacheState[id].generation++;
+        } else {
+            storeResponse_nolock(id, p_copy);
+            p_copy = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    at_response_free(p_copy);
+}
+
+void at_cache_init(const ATCacheEntry *p_entries, size_t count,
+                   ATCacheRefreshScheduler scheduler)
+{
+    size_t i;
+
+    if (count > AT_CACHE_MAX_ENTRIES) {
+        RLOGE("at_cache_init: %zu entries, only %d are cached",
+              count, AT_CACHE_MAX_ENTRIES);
+        count = AT_CACHE_MAX_ENTRIES;
+    }
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    for (i = 0; i < AT_CACHE_MAX_ENTRIES; i++) {
+        at_response_free(s_cacheState[i].p_response);
+        memset(&s_cacheState[i], 0, sizeof(s_cacheState[i]));
+    }
+
+    s_cacheEntries = p_entries;
+    s_cacheCount = count;
+    s_cacheScheduler = scheduler;
+
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+int at_cache_send_command(int id, ATResponse **pp_outResponse)
+{
+    ATCacheState *p_state;
+    ATResponse *p_response = NULL;
+    ATResponse *p_copy = NULL;
+    unsigned generation;
+    int scheduleRefresh = 0;
+    int err;
+
+    *pp_outResponse = NULL;
+
+    if (!isValidId(id)) {
+        return AT_ERROR_GENERIC;
+    }
+
+    p_state = &s_cacheState[id];
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    if (p_state->p_response != NULL) {
+        p_copy = copyResponse(p_state->p_response);
+
+        if (p_copy != NULL && !p_state->refreshPending
+                && s_cacheScheduler != NULL
+                && nowMsec() - p_state->updatedMsec
+                    >= s_cacheEntries[id].maxAgeMsec) {
+            p_state->refreshPending = 1;
+            scheduleRefresh = 1;
+        }
+    }
+    generation = p_state->generation;
+
+    pthread_mutex_unlock(&s_cacheMutex);
+
+    if (p_copy != NULL) {
+        if (scheduleRefresh) {
+            s_cacheScheduler(refreshEntry, (void *)(intptr_t)id);
+        }
+        *pp_outResponse = p_copy;
+        return 0;
+    }
+
+    err = queryModem(id, &p_response);
+
+    if (err == 0 && p_response->success) {
+        p_copy = copyResponse(p_response);
+
+        pthread_mutex_lock(&s_cacheMutex);
+        if (p_copy != NULL && p_state->generation == generation) {
+            storeResponse_nolock(id, p_copy);
+            p_copy = NULL;
+        }
+        pthread_mutex_unlock(&s_cacheMutex);
+
+        at_response_free(p_copy);
+    }
+
+    *pp_outResponse = p_response;
+    return err;
+}
+
+void at_cache_update(int id, const char *line)
+{
+    ATResponse *p_response;
+
+    if (!isValidId(id)) return;
+
+    p_response = (ATResponse *)calloc(1, sizeof(ATResponse));
+    if (p_response == NULL) return;
+
+    p_response->success = 1;
+    p_response->finalResponse = strdup("OK");
+    p_response->p_intermediates = (ATLine *)calloc(1, sizeof(ATLine));
+
+    if (p_response->finalResponse == NULL
+            || p_response->p_intermediates == NULL
+            || (p_response->p_intermediates->line = strdup(line)) == NULL) {
+        at_response_free(p_response);
+        at_cache_invalidate(id);
+        return;
+    }
+
+    pthread_mutex_lock(&s_cacheMutex);
+    storeResponse_nolock(id, p_response);
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+void at_cache_invalidate(int id)
+{
+    if (!isValidId(id)) return;
+
+    pthread_mutex_lock(&s_cacheMutex);
+
+    at_response_free(s_cacheState[id].p_response);
+    s_cacheState[id].p_response = NULL;
+    s_cacheState[id].generation++;
+
+    pthread_mutex_unlock(&s_cacheMutex);
+}
+
+void at_cache_invalidate_all()
+{
+    size_t i;
+
+    for (i = 0; i < s_cacheCount; i++) {
+        at_cache_invalidate((int)i);
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef AT_CACHE_H
+#define AT_CACHE_H 1
+
+#include <stddef.h>
+
+#include "atchannel.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AT_CACHE_MAX_ENTRIES 16
+
+/** a query whose successful response may be served from the cache */
+typedef struct {
+    const char *command;
+    ATCommandType type;
+    const char *responsePrefix;   /* for SINGLELINE and MULTILINE */
+    long long maxAgeMsec;         /* older responses are refreshed */
+} ATCacheEntry;
+
+/**
+ * Called when a stale response has been served and should be refreshed.
+ * |refresh| issues AT commands, so it must be run on a thread that may do so
+ * (never the reader thread), eg via RIL_requestTimedCallback().
+ */
+typedef void (*ATCacheRefreshScheduler)(void (*refresh)(void *), void *param);
+
+/* |p_entries| must stay valid; the index of an entry is its id */
+void at_cache_init(const ATCacheEntry *p_entries, size_t count,
+                   ATCacheRefreshScheduler scheduler);
+
+/**
+ * Like at_send_command_singleline() and friends for the entry |id|, but
+ * returns a copy of the cached response when there is one. A stale response
+ * is still returned and a refresh is scheduled in the background.
+ * The caller owns *pp_outResponse and frees it with at_response_free()
+ */
+int at_cache_send_command(int id, ATResponse **pp_outResponse);
+
+/**
+ * Replaces the response of |id| with a successful response whose only
+ * intermediate line is |line|, eg from an unsolicited notification.
+ * May be called from the reader thread.
+ */
+void at_cache_update(int id, const char *line);
+
+/* drop the response of |id|; the next read queries the modem.
+   May be called from the reader thread. */
+void at_cache_invalidate(int id);
+void at_cache_invalidate_all();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*AT_CACHE_H*/
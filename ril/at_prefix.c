@@ -0,0 +1,92 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "at_prefix.h"
+
+#include <string.h>
+
+/* node 0 is the root, it matches the empty string */
+
+static int findChild(const ATPrefixTrie *p_trie, int node, char c)
+{
+    int child;
+
+    for (child = p_trie->nodes[node].child; child != 0;
+            child = p_trie->nodes[child].sibling) {
+        if (p_trie->nodes[child].c == c) {
+            return child;
+        }
+    }
+
+    return 0;
+}
+
+int at_prefix_trie_init(ATPrefixTrie *p_trie,
+                        const ATPrefix *p_prefixes, size_t count)
+{
+    size_t i;
+    const char *p;
+
+    memset(p_trie, 0, sizeof(*p_trie));
+    p_trie->nodes[0].id = -1;
+    p_trie->count = 1;
+
+    for (i = 0; i < count; i++) {
+        int node = 0;
+
+        for (p = p_prefixes[i].prefix; *p != '\0'; p++) {
+            int child = findChild(p_trie, node, *p);
+
+            if (child == 0) {
+                if (p_trie->count == AT_PREFIX_MAX_NODES) {
+                    return -1;
+                }
+                child = p_trie->count++;
+                p_trie->nodes[child].c = *p;
+                p_trie->nodes[child].id = -1;
+                p_trie->nodes[child].sibling = p_trie->nodes[node].child;
+                p_trie->nodes[node].child = child;
+            }
+            node = child;
+        }
+
+        /* the first of two identical prefixes wins */
+        if (p_trie->nodes[node].id < 0) {
+            p_trie->nodes[node].id = p_prefixes[i].id;
+        }
+    }
+
+    return 0;
+}
+
+int at_prefix_match(const ATPrefixTrie *p_trie, const char *line)
+{
+    int node = 0;
+    int id = -1;
+
+    for ( ; *line != '\0'; line++) {
+        node = findChild(p_trie, node, *line);
+
+        if (node == 0) {
+            break;
+        }
+        if (p_trie->nodes[node].id >= 0) {
+            id = p_trie->nodes[node].id;
+        }
+    }
+
+    return id;
+}
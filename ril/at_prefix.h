@@ -0,0 +1,69 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AT_PREFIX_H
+#define AT_PREFIX_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AT_PREFIX_MAX_NODES 256
+
+/** a response prefix and the value to return when a line starts with it */
+typedef struct {
+    const char *prefix;
+    int id;
+} ATPrefix;
+
+typedef struct {
+    char c;
+    int16_t id;          /* -1 if no prefix ends here */
+    int16_t child;       /* first child node, 0 if none */
+    int16_t sibling;     /* next node with the same parent, 0 if none */
+} ATPrefixNode;
+
+/**
+ * A trie of response prefixes, used to classify a line with a single
+ * walk over its first characters instead of one comparison per prefix.
+ * Build it once with at_prefix_trie_init() before matching from any thread.
+ *
+ * The trie is built at run time from the prefix tables rather than
+ * generated at compile time. Building one takes a few microseconds once
+ * per process and matching walks the same nodes either way, so a
+ * generator step in the build would not gain anything.
+ * at_prefix_benchmark.c measures both.
+ */
+typedef struct {
+    ATPrefixNode nodes[AT_PREFIX_MAX_NODES];
+    int count;
+} ATPrefixTrie;
+
+/* returns 0 on success, -1 if the prefixes do not fit in the trie */
+int at_prefix_trie_init(ATPrefixTrie *p_trie,
+                        const ATPrefix *p_prefixes, size_t count);
+
+/* returns the id of the longest prefix |line| starts with, -1 if none */
+int at_prefix_match(const ATPrefixTrie *p_trie, const char *line);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*AT_PREFIX_H*/
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2018, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Compares at_prefix_match() against the strStartsWith() chains it
+ * replaced, for the final response prefixes of atchannel and the
+ * unsolicited prefixes of reference-ril. Run as
+ *
+ *   goldfish-at-prefix-benchmark [iterations]
+ *
+ * The prefix tables are copies of the ones in atchannel.c and
+ * reference-ril.c, keep them in sync.
+ */
+#include "at_prefix.h"
+#include "misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_ELEMS(x) (sizeof(x)/sizeof((x)[0]))
+
+#define DEFAULT_ITERATIONS 1000000
+
+static const ATPrefix s_responsePrefixes[] = {
+    { "OK", 0 },
+    { "CONNECT", 0 },
+    { "ERROR", 1 },
+    { "+CMS ERROR:", 1 },
+    { "+CME ERROR:", 1 },
+    { "NO CARRIER", 1 },
+    { "NO ANSWER", 1 },
+    { "NO DIALTONE", 1 },
+    { "+CMT:", 2 },
+    { "+CDS:", 2 },
+    { "+CBM:", 2 },
+};
+
+static const ATPrefix s_unsolPrefixes[] = {
+    { "%CTZV:", 0 },
+    { "+CRING:", 1 },
+    { "RING", 1 },
+    { "NO CARRIER", 1 },
+    { "+CCWA", 1 },
+    { "+CREG:", 2 },
+    { "+CGREG:", 2 },
+    { "+CSQ:", 3 },
+    { "+CMT:", 4 },
+    { "+CDS:", 5 },
+    { "+CGEV:", 6 },
+    { "+CTEC: ", 7 },
+    { "+CCSS: ", 8 },
+    { "+WSOS: ", 9 },
+    { "+WPRL: ", 10 },
+    { "+CFUN: 0", 11 },
+    { "+CPIN:", 12 },
+};
+
+/* what the reader sees under SMS and cell info stress */
+static const char *s_lines[] = {
+    "OK",
+    "+CSQ: 20,99,-1,-1,-1,-1,-1,20,90,10,300,2147483647,2147483647",
+    "+CREG: 2,1,\"00c3\",\"00001234\"",
+    "+CGREG: 2,1,\"00c3\",\"00001234\",\"0e\"",
+    "+CMT: ,24",
+    "+CMGS: 12",
+    "+COPS: 0,0,\"Android\"",
+    "%CTZV: 18/10/17,10:00:00-32,0",
+    "+CME ERROR: 10",
+    "RING",
+};
+
+/* the id of the first prefix |line| starts with, the way the chains did */
+static int matchLinear(const ATPrefix *p_prefixes, size_t count,
+                       const char *line)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (strStartsWith(line, p_prefixes[i].prefix)) {
+            return p_prefixes[i].id;
+        }
+    }
+    return -1;
+}
+
+static double nowNsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int run(const char *name, const ATPrefix *p_prefixes, size_t count,
+               long iterations)
+{
+    ATPrefixTrie trie;
+    volatile int sink = 0;
+    double start, linear, trieTime;
+    long i;
+    size_t j;
+
+    start = nowNsec();
+    if (at_prefix_trie_init(&trie, p_prefixes, count) < 0) {
+        fprintf(stderr, "%s: prefixes do not fit in the trie\n", name);
+        return -1;
+    }
+    printf("%-12s trie built in %.0f ns, %d nodes\n", name,
+           nowNsec() - start, trie.count);
+
+    for (j = 0; j < NUM_ELEMS(s_lines); j++) {
+        if (matchLinear(p_prefixes, count, s_lines[j])
+                != at_prefix_match(&trie, s_lines[j])) {
+            fprintf(stderr, "%s: mismatch for '%s'\n", name, s_lines[j]);
+            return -1;
+        }
+    }
+
+    start = nowNsec();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < NUM_ELEMS(s_lines); j++) {
+            sink += matchLinear(p_prefixes, count, s_lines[j]);
+        }
+    }
+    linear = nowNsec() - start;
+
+    start = nowNsec();
+    for (i = 0; i < iterations; i++) {
+        for (j = 0; j < NUM_ELEMS(s_lines); j++) {
+            sink += at_prefix_match(&trie, s_lines[j]);
+        }
+    }
+    trieTime = nowNsec() - start;
+
+    printf("%-12s strStartsWith %.2f ns/line, trie %.2f ns/line\n", name,
+           linear / (iterations * NUM_ELEMS(s_lines)),
+           trieTime / (iterations * NUM_ELEMS(s_lines)));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = DEFAULT_ITERATIONS;
+
+    if (argc > 1) {
+        iterations = strtol(argv[1], NULL, 10);
+        if (iterations <= 0) {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (run("final", s_responsePrefixes, NUM_ELEMS(s_responsePrefixes),
+            iterations) < 0
+            || run("unsolicited", s_unsolPrefixes, NUM_ELEMS(s_unsolPrefixes),
+                   iterations) < 0) {
+        return 1;
+    }
+    return 0;
+}
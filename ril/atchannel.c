@@ -16,6 +16,7 @@
 */
 
 #include "atchannel.h"
+#include "at_prefix.h"
 #include "at_tok.h"
 
 #include <stdio.h>
@@ -26,6 +27,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/cdefs.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
@@ -36,6 +38,12 @@
 
 #include "misc.h"
 
+/* __unused comes from bionic's <sys/cdefs.h>, glibc has no such macro when
+ * this is built for the host by goldfish-ril-harness */
+#ifndef __unused
+#define __unused __attribute__((__unused__))
+#endif
+
 
 #define NUM_ELEMS(x) (sizeof(x)/sizeof((x)[0]))
 
@@ -47,10 +55,29 @@ static pthread_t s_tid_reader;
 static int s_fd = -1;    /* fd of the AT channel */
 static ATUnsolHandler s_unsolHandler;
 
-/* for input buffering */
+/*
+ * for input buffering
+ *
+ * Input is read into a ring. Positions are absolute byte counts, taken
+ * modulo AT_RING_SIZE to index the ring: bytes in [s_ringHead, s_ringScan)
+ * belong to lines handed out by readline() and not yet released, bytes in
+ * [s_ringScan, s_ringTail) are still to be parsed. Lines are returned in
+ * place; only a line that wraps around the end of the ring is copied out.
+ */
+
+#define AT_RING_SIZE (4 * MAX_AT_RESPONSE)
+#define AT_MAX_HELD_LINES 2     /* an SMS unsolicited and its PDU */
+
+static char s_ATRing[AT_RING_SIZE];
+static size_t s_ringHead;
+static size_t s_ringScan;
+static size_t s_ringSearch;     /* where the search for the next EOL resumes */
+static size_t s_ringTail;
+static size_t s_ringHeldEnd;    /* the end of the last line handed out */
 
-static char s_ATBuffer[MAX_AT_RESPONSE+1];
-static char *s_ATBufferCur = s_ATBuffer;
+/* copies of lines wrapping around the end of the ring */
+static char s_ATWrapped[AT_MAX_HELD_LINES][MAX_AT_RESPONSE+1];
+static int s_ATHeldLines;
 
 #if AT_DEBUG
 void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
@@ -63,27 +90,40 @@ void  AT_DUMP(const char*  prefix, const char*  buff, int  len)
 
 /*
  * There is one reader thread |s_tid_reader| and potentially multiple writer
- * threads. |s_commandmutex| and |s_commandcond| are used to maintain the
- * condition that the writer thread will not read from |sp_response| until the
- * reader thread has signaled itself is finished, etc. |s_writeMutex| is used to
- * prevent multiple writer threads from calling at_send_command_full_nolock
- * function at the same time.
+ * threads. Commands are written back to back and queued in |s_commandHead|,
+ * the modem answers them in order so every final response completes the
+ * command at the head of the queue. |s_commandmutex| protects the queue and
+ * |s_commandcond| is broadcast whenever a command completes or leaves the
+ * queue. |s_writeMutex| is held by at_handshake() to keep other writers off
+ * the channel while it resynchronizes with the modem.
  */
 
 static pthread_mutex_t s_commandmutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t s_commandcond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t s_writeMutex = PTHREAD_MUTEX_INITIALIZER;
 
-static ATCommandType s_type;
-static const char *s_responsePrefix = NULL;
-static const char *s_smsPDU = NULL;
-static ATResponse *sp_response = NULL;
+/** a command written to the channel and waiting for its final response */
+typedef struct ATCommand {
+    struct ATCommand *p_next;
+    ATCommandType type;
+    const char *responsePrefix;
+    const char *smsPDU;          /* sent on the "> " prompt, NULL once sent */
+    ATResponse *p_response;
+    int done;                    /* final response received */
+    int abandoned;               /* timed out, freed when its response comes */
+    int hasDeadline;
+    struct timespec deadline;
+} ATCommand;
+
+static ATCommand *s_commandHead = NULL;
+static ATCommand *s_commandTail = NULL;
 
 static void (*s_onTimeout)(void) = NULL;
 static void (*s_onReaderClosed)(void) = NULL;
 static int s_readerClosed;
 
 static void onReaderClosed();
+static void freeAbandonedCommand(ATCommand *p_cmd);
 static int writeCtrlZ (const char *s);
 static int writeline (const char *s);
 
@@ -118,8 +158,8 @@ static void sleepMsec(long long msec)
 
 
 
-/** add an intermediate response to sp_response*/
-static void addIntermediate(const char *line)
+/** add an intermediate response to p_response */
+static void addIntermediate(ATResponse *p_response, const char *line)
 {
     ATLine *p_new;
 
@@ -130,67 +170,64 @@ static void addIntermediate(const char *line)
     /* note: this adds to the head of the list, so the list
        will be in reverse order of lines received. the order is flipped
        again before passing on to the command issuer */
-    p_new->p_next = sp_response->p_intermediates;
-    sp_response->p_intermediates = p_new;
+    p_new->p_next = p_response->p_intermediates;
+    p_response->p_intermediates = p_new;
 }
 
 
+/* classes of the lines recognized by the reader thread */
+enum {
+    FINAL_RESPONSE_SUCCESS,
+    FINAL_RESPONSE_ERROR,
+    SMS_UNSOLICITED,
+};
+
 /**
- * returns 1 if line is a final response indicating error
- * See 27.007 annex B
+ * See 27.007 annex B for the final responses
  * WARNING: NO CARRIER and others are sometimes unsolicited
+ *
+ * SMS unsolicited are the first line in (what will be) a two-line
+ * SMS unsolicited response
  */
-static const char * s_finalResponsesError[] = {
-    "ERROR",
-    "+CMS ERROR:",
-    "+CME ERROR:",
-    "NO CARRIER", /* sometimes! */
-    "NO ANSWER",
-    "NO DIALTONE",
+static const ATPrefix s_responsePrefixes[] = {
+    { "OK", FINAL_RESPONSE_SUCCESS },
+    { "CONNECT", FINAL_RESPONSE_SUCCESS }, /* some stacks start up data on
+                                              another channel */
+    { "ERROR", FINAL_RESPONSE_ERROR },
+    { "+CMS ERROR:", FINAL_RESPONSE_ERROR },
+    { "+CME ERROR:", FINAL_RESPONSE_ERROR },
+    { "NO CARRIER", FINAL_RESPONSE_ERROR }, /* sometimes! */
+    { "NO ANSWER", FINAL_RESPONSE_ERROR },
+    { "NO DIALTONE", FINAL_RESPONSE_ERROR },
+    { "+CMT:", SMS_UNSOLICITED },
+    { "+CDS:", SMS_UNSOLICITED },
+    { "+CBM:", SMS_UNSOLICITED },
 };
-static int isFinalResponseError(const char *line)
-{
-    size_t i;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesError) ; i++) {
-        if (strStartsWith(line, s_finalResponsesError[i])) {
-            return 1;
-        }
-    }
+static ATPrefixTrie s_responseTrie;
+static pthread_once_t s_responseTrieOnce = PTHREAD_ONCE_INIT;
 
-    return 0;
+static void initResponseTrie()
+{
+    at_prefix_trie_init(&s_responseTrie, s_responsePrefixes,
+                        NUM_ELEMS(s_responsePrefixes));
 }
 
-/**
- * returns 1 if line is a final response indicating success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
- */
-static const char * s_finalResponsesSuccess[] = {
-    "OK",
-    "CONNECT"       /* some stacks start up data on another channel */
-};
-static int isFinalResponseSuccess(const char *line)
+/** returns one of the classes above, or -1 for any other line */
+static int classifyLine(const char *line)
 {
-    size_t i;
-
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesSuccess) ; i++) {
-        if (strStartsWith(line, s_finalResponsesSuccess[i])) {
-            return 1;
-        }
-    }
-
-    return 0;
+    return at_prefix_match(&s_responseTrie, line);
 }
 
 /**
  * returns 1 if line is a final response, either  error or success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
  */
 static int isFinalResponse(const char *line)
 {
-    return isFinalResponseSuccess(line) || isFinalResponseError(line);
+    int lineClass = classifyLine(line);
+
+    return lineClass == FINAL_RESPONSE_SUCCESS
+            || lineClass == FINAL_RESPONSE_ERROR;
 }
 
 
@@ -198,31 +235,33 @@ static int isFinalResponse(const char *line)
  * returns 1 if line is the first line in (what will be) a two-line
  * SMS unsolicited response
  */
-static const char * s_smsUnsoliciteds[] = {
-    "+CMT:",
-    "+CDS:",
-    "+CBM:"
-};
 static int isSMSUnsolicited(const char *line)
 {
-    size_t i;
-
-    for (i = 0 ; i < NUM_ELEMS(s_smsUnsoliciteds) ; i++) {
-        if (strStartsWith(line, s_smsUnsoliciteds[i])) {
-            return 1;
-        }
-    }
-
-    return 0;
+    return classifyLine(line) == SMS_UNSOLICITED;
 }
 
 
-/** assumes s_commandmutex is held */
-static void handleFinalResponse(const char *line)
+/** assumes s_commandmutex is held and the command queue is not empty */
+static void handleFinalResponse(const char *line, int success)
 {
-    sp_response->finalResponse = strdup(line);
+    ATCommand *p_cmd = s_commandHead;
+
+    s_commandHead = p_cmd->p_next;
+    if (s_commandHead == NULL) {
+        s_commandTail = NULL;
+    }
+
+    if (p_cmd->abandoned) {
+        /* the late answer to a timed out command, nobody is waiting for it */
+        freeAbandonedCommand(p_cmd);
+        return;
+    }
+
+    p_cmd->p_response->success = success;
+    p_cmd->p_response->finalResponse = strdup(line);
+    p_cmd->done = 1;
 
-    pthread_cond_signal(&s_commandcond);
+    pthread_cond_broadcast(&s_commandcond);
 }
 
 static void handleUnsolicited(const char *line)
@@ -234,31 +273,40 @@ static void handleUnsolicited(const char *line)
 
 static void processLine(const char *line)
 {
+    ATCommand *p_cmd;
+    int lineClass = classifyLine(line);
+
     pthread_mutex_lock(&s_commandmutex);
 
-    if (sp_response == NULL) {
+    /* responses come in the order the commands were written */
+    p_cmd = s_commandHead;
+
+    if (p_cmd == NULL) {
         /* no command pending */
         handleUnsolicited(line);
-    } else if (isFinalResponseSuccess(line)) {
-        sp_response->success = 1;
-        handleFinalResponse(line);
-    } else if (isFinalResponseError(line)) {
-        sp_response->success = 0;
-        handleFinalResponse(line);
-    } else if (s_smsPDU != NULL && 0 == strcmp(line, "> ")) {
+    } else if (lineClass == FINAL_RESPONSE_SUCCESS) {
+        handleFinalResponse(line, 1);
+    } else if (lineClass == FINAL_RESPONSE_ERROR) {
+        handleFinalResponse(line, 0);
+    } else if (p_cmd->smsPDU != NULL && 0 == strcmp(line, "> ")) {
         // See eg. TS 27.005 4.3
         // Commands like AT+CMGS have a "> " prompt
-        writeCtrlZ(s_smsPDU);
-        s_smsPDU = NULL;
-    } else switch (s_type) {
+        writeCtrlZ(p_cmd->smsPDU);
+        if (p_cmd->abandoned) {
+            free((char *) p_cmd->smsPDU);
+        }
+        p_cmd->smsPDU = NULL;
+        /* writers held back by the prompt may go on */
+        pthread_cond_broadcast(&s_commandcond);
+    } else switch (p_cmd->type) {
         case NO_RESULT:
             handleUnsolicited(line);
             break;
         case NUMERIC:
-            if (sp_response->p_intermediates == NULL
+            if (p_cmd->p_response->p_intermediates == NULL
                 && isdigit(line[0])
             ) {
-                addIntermediate(line);
+                addIntermediate(p_cmd->p_response, line);
             } else {
                 /* either we already have an intermediate response or
                    the line doesn't begin with a digit */
@@ -266,25 +314,25 @@ static void processLine(const char *line)
             }
             break;
         case SINGLELINE:
-            if (sp_response->p_intermediates == NULL
-                && strStartsWith (line, s_responsePrefix)
+            if (p_cmd->p_response->p_intermediates == NULL
+                && strStartsWith (line, p_cmd->responsePrefix)
             ) {
-                addIntermediate(line);
+                addIntermediate(p_cmd->p_response, line);
             } else {
                 /* we already have an intermediate response */
                 handleUnsolicited(line);
             }
             break;
         case MULTILINE:
-            if (strStartsWith (line, s_responsePrefix)) {
-                addIntermediate(line);
+            if (strStartsWith (line, p_cmd->responsePrefix)) {
+                addIntermediate(p_cmd->p_response, line);
             } else {
                 handleUnsolicited(line);
             }
         break;
 
         default: /* this should never be reached */
-            RLOGE("Unsupported AT command type %d\n", s_type);
+            RLOGE("Unsupported AT command type %d\n", p_cmd->type);
             handleUnsolicited(line);
         break;
     }
@@ -293,31 +341,48 @@ static void processLine(const char *line)
 }
 
 
+static char ringAt(size_t pos)
+{
+    return s_ATRing[pos % AT_RING_SIZE];
+}
+
 /**
- * Returns a pointer to the end of the next line
- * special-cases the "> " SMS prompt
- *
- * returns NULL if there is no complete line
+ * Returns the position of the first \r or \n in [from, to)
+ * or |to| if there is none
  */
-static char * findNextEOL(char *cur)
+static size_t findNextEOL(size_t from, size_t to)
 {
-    if (cur[0] == '>' && cur[1] == ' ' && cur[2] == '\0') {
-        /* SMS prompt character...not \r terminated */
-        return cur+2;
-    }
+    while (from < to) {
+        size_t offset = from % AT_RING_SIZE;
+        size_t len = to - from;
+        const char *p_seg = s_ATRing + offset;
+        const char *p_cr, *p_lf;
+
+        if (len > AT_RING_SIZE - offset) {
+            len = AT_RING_SIZE - offset;
+        }
 
-    // Find next newline
-    while (*cur != '\0' && *cur != '\r' && *cur != '\n') cur++;
+        p_cr = memchr(p_seg, '\r', len);
+        p_lf = memchr(p_seg, '\n', p_cr != NULL ? (size_t)(p_cr - p_seg) : len);
 
-    return *cur == '\0' ? NULL : cur;
-}
+        if (p_lf != NULL) {
+            return from + (p_lf - p_seg);
+        }
+        if (p_cr != NULL) {
+            return from + (p_cr - p_seg);
+        }
+        from += len;
+    }
 
+    return to;
+}
 
 /**
  * Reads a line from the AT channel, returns NULL on timeout.
  * Assumes it has exclusive read access to the FD
  *
- * This line is valid only until the next call to readline
+ * The line stays valid until releaseLines() is called, so that up to
+ * AT_MAX_HELD_LINES lines may be used at the same time.
  *
  * This function exists because as of writing, android libc does not
  * have buffered stdio.
@@ -326,68 +391,70 @@ static char * findNextEOL(char *cur)
 static const char *readline()
 {
     ssize_t count;
-
-    char *p_read = NULL;
-    char *p_eol = NULL;
+    size_t eol, offset, len, room;
     char *ret;
 
-    /* this is a little odd. I use *s_ATBufferCur == 0 to
-     * mean "buffer consumed completely". If it points to a character, than
-     * the buffer continues until a \0
-     */
-    if (*s_ATBufferCur == '\0') {
-        /* empty buffer */
-        s_ATBufferCur = s_ATBuffer;
-        *s_ATBufferCur = '\0';
-        p_read = s_ATBuffer;
-    } else {   /* *s_ATBufferCur != '\0' */
-        /* there's data in the buffer from the last read */
-
+    for (;;) {
         // skip over leading newlines
-        while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-            s_ATBufferCur++;
-
-        p_eol = findNextEOL(s_ATBufferCur);
-
-        if (p_eol == NULL) {
-            /* a partial line. move it up and prepare to read more */
-            size_t len;
+        while (s_ringScan < s_ringTail
+                && (ringAt(s_ringScan) == '\r' || ringAt(s_ringScan) == '\n')) {
+            s_ringScan++;
+        }
+        if (s_ringSearch < s_ringScan) {
+            s_ringSearch = s_ringScan;
+        }
 
-            len = strlen(s_ATBufferCur);
+        if (s_ringTail - s_ringScan == 2
+                && ringAt(s_ringScan) == '>' && ringAt(s_ringScan + 1) == ' ') {
+            /* SMS prompt character...not \r terminated */
+            s_ringScan = s_ringSearch = s_ringTail;
+            RLOGD("AT< > \n");
+            return "> ";
+        }
 
-            memmove(s_ATBuffer, s_ATBufferCur, len + 1);
-            p_read = s_ATBuffer + len;
-            s_ATBufferCur = s_ATBuffer;
+        eol = findNextEOL(s_ringSearch, s_ringTail);
+        if (eol < s_ringTail && eol - s_ringScan <= MAX_AT_RESPONSE) {
+            break;
         }
-        /* Otherwise, (p_eol !- NULL) there is a complete line  */
-        /* that will be returned the while () loop below        */
-    }
+        if (eol < s_ringTail) {
+            RLOGE("ERROR: Input line exceeded buffer\n");
+            s_ringScan = s_ringSearch = eol + 1;
+            continue;
+        }
+        /* don't look at these bytes again */
+        s_ringSearch = s_ringTail;
 
-    while (p_eol == NULL) {
-        if (0 == MAX_AT_RESPONSE - (p_read - s_ATBuffer)) {
+        if (s_ringTail - s_ringScan >= MAX_AT_RESPONSE) {
             RLOGE("ERROR: Input line exceeded buffer\n");
-            /* ditch buffer and start over again */
-            s_ATBufferCur = s_ATBuffer;
-            *s_ATBufferCur = '\0';
-            p_read = s_ATBuffer;
+            /* ditch the partial line and start over again */
+            s_ringScan = s_ringSearch = s_ringTail;
+        }
+        if (s_ATHeldLines == 0) {
+            /* no line in use, the whole ring is free */
+            s_ringHead = s_ringScan;
+        } else if (s_ringTail - s_ringHead == AT_RING_SIZE) {
+            /* the held lines, input skipped since and a partial line fill
+             * the ring, reading now would look like EOF */
+            RLOGE("ERROR: Input line exceeded buffer\n");
+            /* ditch everything after the held lines and start over again */
+            s_ringScan = s_ringSearch = s_ringTail = s_ringHeldEnd;
+            continue;
+        }
+
+        offset = s_ringTail % AT_RING_SIZE;
+        room = AT_RING_SIZE - (s_ringTail - s_ringHead);
+        if (room > AT_RING_SIZE - offset) {
+            room = AT_RING_SIZE - offset;
         }
 
         do {
-            count = read(s_fd, p_read,
-                            MAX_AT_RESPONSE - (p_read - s_ATBuffer));
+            count = read(s_fd, s_ATRing + offset, room);
         } while (count < 0 && errno == EINTR);
 
         if (count > 0) {
-            AT_DUMP( "<< ", p_read, count );
+            AT_DUMP( "<< ", s_ATRing + offset, count );
 
-            p_read[count] = '\0';
-
-            // skip over leading newlines
-            while (*s_ATBufferCur == '\r' || *s_ATBufferCur == '\n')
-                s_ATBufferCur++;
-
-            p_eol = findNextEOL(s_ATBufferCur);
-            p_read += count;
+            s_ringTail += count;
         } else if (count <= 0) {
             /* read error encountered or EOF reached */
             if(count == 0) {
@@ -399,17 +466,38 @@ static const char *readline()
         }
     }
 
-    /* a full line in the buffer. Place a \0 over the \r and return */
+    /* a full line in the ring. Place a \0 over the \r and return */
+
+    offset = s_ringScan % AT_RING_SIZE;
+    len = eol - s_ringScan;
+
+    if (offset + len < AT_RING_SIZE) {
+        ret = s_ATRing + offset;
+        ret[len] = '\0';
+    } else {
+        /* the line wraps around the end of the ring */
+        size_t first = AT_RING_SIZE - offset;
+
+        ret = s_ATWrapped[s_ATHeldLines % AT_MAX_HELD_LINES];
+        memcpy(ret, s_ATRing + offset, first);
+        memcpy(ret + first, s_ATRing, len - first);
+        ret[len] = '\0';
+    }
+    s_ATHeldLines++;
 
-    ret = s_ATBufferCur;
-    *p_eol = '\0';
-    s_ATBufferCur = p_eol + 1; /* this will always be <= p_read,    */
-                              /* and there will be a \0 at *p_read */
+    s_ringScan = s_ringSearch = s_ringHeldEnd = eol + 1;
 
     RLOGD("AT< %s\n", ret);
     return ret;
 }
 
+/** Gives back the space of all the lines returned by readline() */
+static void releaseLines()
+{
+    s_ringHead = s_ringScan;
+    s_ATHeldLines = 0;
+}
+
 
 static void onReaderClosed()
 {
@@ -419,7 +507,7 @@ static void onReaderClosed()
 
         s_readerClosed = 1;
 
-        pthread_cond_signal(&s_commandcond);
+        pthread_cond_broadcast(&s_commandcond);
 
         pthread_mutex_unlock(&s_commandmutex);
 
@@ -440,27 +528,24 @@ static void *readerLoop(void *arg __unused)
         }
 
         if(isSMSUnsolicited(line)) {
-            char *line1;
             const char *line2;
 
-            // The scope of string returned by 'readline()' is valid only
-            // till next call to 'readline()' hence making a copy of line
-            // before calling readline again.
-            line1 = strdup(line);
+            // 'line' stays valid until releaseLines(), no need to copy it
+            // before reading the PDU
             line2 = readline();
 
             if (line2 == NULL) {
-                free(line1);
                 break;
             }
 
             if (s_unsolHandler != NULL) {
-                s_unsolHandler (line1, line2);
+                s_unsolHandler (line, line2);
             }
-            free(line1);
         } else {
             processLine(line);
         }
+
+        releaseLines();
     }
 
     onReaderClosed();
@@ -554,17 +639,6 @@ static int writeCtrlZ (const char *s)
     return 0;
 }
 
-static void clearPendingCommand()
-{
-    if (sp_response != NULL) {
-        at_response_free(sp_response);
-    }
-
-    sp_response = NULL;
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-}
-
 
 /**
  * Starts AT handler on stream "fd'
@@ -580,9 +654,22 @@ int at_open(int fd, ATUnsolHandler h)
     s_unsolHandler = h;
     s_readerClosed = 0;
 
-    s_responsePrefix = NULL;
-    s_smsPDU = NULL;
-    sp_response = NULL;
+    s_ringHead = s_ringScan = s_ringSearch = s_ringTail = 0;
+    s_ATHeldLines = 0;
+
+    pthread_once(&s_responseTrieOnce, initResponseTrie);
+
+    /* commands that timed out on the previous channel are never answered */
+    while (s_commandHead != NULL) {
+        ATCommand *p_cmd = s_commandHead;
+
+        s_commandHead = p_cmd->p_next;
+        if (p_cmd->abandoned) {
+            freeAbandonedCommand(p_cmd);
+        }
+    }
+    s_commandHead = NULL;
+    s_commandTail = NULL;
 
     pthread_attr_init (&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
@@ -610,7 +697,7 @@ void at_close()
 
     s_readerClosed = 1;
 
-    pthread_cond_signal(&s_commandcond);
+    pthread_cond_broadcast(&s_commandcond);
 
     pthread_mutex_unlock(&s_commandmutex);
 
@@ -663,73 +750,196 @@ static void reverseIntermediates(ATResponse *p_response)
     }
 }
 
+/** assumes s_commandmutex is held. Unlinks a command that has not completed */
+static void removeCommand(ATCommand *p_cmd)
+{
+    ATCommand **pp_cur = &s_commandHead;
+    ATCommand *p_prev = NULL;
+
+    while (*pp_cur != NULL && *pp_cur != p_cmd) {
+        p_prev = *pp_cur;
+        pp_cur = &(*pp_cur)->p_next;
+    }
+
+    if (*pp_cur == NULL) {
+        return;
+    }
+
+    *pp_cur = p_cmd->p_next;
+    if (s_commandTail == p_cmd) {
+        s_commandTail = p_prev;
+    }
+
+    /* a writer may have been waiting behind this command's SMS prompt */
+    pthread_cond_broadcast(&s_commandcond);
+}
+
+static void freeAbandonedCommand(ATCommand *p_cmd)
+{
+    free((char *) p_cmd->responsePrefix);
+    free((char *) p_cmd->smsPDU);
+    at_response_free(p_cmd->p_response);
+    free(p_cmd);
+}
+
 /**
- * Internal send_command implementation
- * Doesn't lock or call the timeout callback
+ * assumes s_commandmutex is held. Replaces a command that timed out with a
+ * copy that stays queued until the modem answers it, so that its late final
+ * response does not complete the command queued behind it. The copy owns its
+ * strings since the caller's may go away
+ */
+static void abandonCommand(ATCommand *p_cmd)
+{
+    ATCommand **pp_cur = &s_commandHead;
+    ATCommand *p_copy;
+
+    while (*pp_cur != NULL && *pp_cur != p_cmd) {
+        pp_cur = &(*pp_cur)->p_next;
+    }
+
+    if (*pp_cur == NULL) {
+        at_response_free(p_cmd->p_response);
+        return;
+    }
+
+    p_copy = (ATCommand *) malloc(sizeof(ATCommand));
+    if (p_copy == NULL) {
+        /* out of sync with the modem until the timeout handler resets it */
+        removeCommand(p_cmd);
+        at_response_free(p_cmd->p_response);
+        return;
+    }
+
+    *p_copy = *p_cmd;
+    p_copy->abandoned = 1;
+    p_copy->hasDeadline = 0;
+    p_copy->responsePrefix = p_cmd->responsePrefix != NULL
+            ? strdup(p_cmd->responsePrefix) : NULL;
+    p_copy->smsPDU = p_cmd->smsPDU != NULL ? strdup(p_cmd->smsPDU) : NULL;
+    if (p_cmd->responsePrefix != NULL && p_copy->responsePrefix == NULL) {
+        /* without a prefix its intermediate lines are passed on as unsolicited */
+        p_copy->type = NO_RESULT;
+    }
+
+    *pp_cur = p_copy;
+    if (s_commandTail == p_cmd) {
+        s_commandTail = p_copy;
+    }
+}
+
+/**
+ * Writes a command to the channel and queues it until its final response
+ * Assumes s_commandmutex is held
  *
  * timeoutMsec == 0 means infinite timeout
  */
-
-static int at_send_command_full_nolock (const char *command, ATCommandType type,
-                    const char *responsePrefix, const char *smspdu,
-                    long long timeoutMsec, ATResponse **pp_outResponse)
+static int queueCommand_nolock (ATCommand *p_cmd, const char *command,
+                    ATCommandType type, const char *responsePrefix,
+                    const char *smspdu, long long timeoutMsec)
 {
-    int err = 0;
-    struct timespec ts;
+    int err;
 
-    if(sp_response != NULL) {
-        err = AT_ERROR_COMMAND_PENDING;
-        goto error;
+    /* nothing may be written between an SMS command and its PDU */
+    while (s_commandTail != NULL && s_commandTail->smsPDU != NULL
+            && s_readerClosed == 0) {
+        pthread_cond_wait(&s_commandcond, &s_commandmutex);
     }
 
     err = writeline (command);
 
     if (err < 0) {
-        goto error;
+        return err;
     }
 
-    s_type = type;
-    s_responsePrefix = responsePrefix;
-    s_smsPDU = smspdu;
-    sp_response = at_response_new();
+    memset(p_cmd, 0, sizeof(*p_cmd));
+    p_cmd->type = type;
+    p_cmd->responsePrefix = responsePrefix;
+    p_cmd->smsPDU = smspdu;
+    p_cmd->p_response = at_response_new();
 
     if (timeoutMsec != 0) {
-        setTimespecRelative(&ts, timeoutMsec);
+        p_cmd->hasDeadline = 1;
+        setTimespecRelative(&p_cmd->deadline, timeoutMsec);
+    }
+
+    if (s_commandTail == NULL) {
+        s_commandHead = p_cmd;
+    } else {
+        s_commandTail->p_next = p_cmd;
     }
+    s_commandTail = p_cmd;
+
+    return 0;
+}
+
+/**
+ * Waits for the final response of a queued command
+ * Assumes s_commandmutex is held. The command is out of the queue on return
+ */
+static int waitCommand_nolock (ATCommand *p_cmd, ATResponse **pp_outResponse)
+{
+    int err = 0;
 
-    while (sp_response->finalResponse == NULL && s_readerClosed == 0) {
-        if (timeoutMsec != 0) {
-            err = pthread_cond_timedwait(&s_commandcond, &s_commandmutex, &ts);
+    while (!p_cmd->done && s_readerClosed == 0) {
+        if (p_cmd->hasDeadline) {
+            err = pthread_cond_timedwait(&s_commandcond, &s_commandmutex,
+                                         &p_cmd->deadline);
         } else {
             err = pthread_cond_wait(&s_commandcond, &s_commandmutex);
         }
 
         if (err == ETIMEDOUT) {
-            err = AT_ERROR_TIMEOUT;
-            goto error;
+            break;
         }
     }
 
+    if (!p_cmd->done) {
+        if (s_readerClosed > 0) {
+            removeCommand(p_cmd);
+            at_response_free(p_cmd->p_response);
+            return AT_ERROR_CHANNEL_CLOSED;
+        }
+        abandonCommand(p_cmd);
+        return AT_ERROR_TIMEOUT;
+    }
+
     if (pp_outResponse == NULL) {
-        at_response_free(sp_response);
+        at_response_free(p_cmd->p_response);
     } else {
         /* line reader stores intermediate responses in reverse order */
-        reverseIntermediates(sp_response);
-        *pp_outResponse = sp_response;
+        reverseIntermediates(p_cmd->p_response);
+        *pp_outResponse = p_cmd->p_response;
     }
 
-    sp_response = NULL;
-
     if(s_readerClosed > 0) {
-        err = AT_ERROR_CHANNEL_CLOSED;
-        goto error;
+        return AT_ERROR_CHANNEL_CLOSED;
     }
 
-    err = 0;
-error:
-    clearPendingCommand();
+    return 0;
+}
 
-    return err;
+/**
+ * Internal send_command implementation
+ * Doesn't lock or call the timeout callback
+ *
+ * timeoutMsec == 0 means infinite timeout
+ */
+
+static int at_send_command_full_nolock (const char *command, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, ATResponse **pp_outResponse)
+{
+    int err;
+    ATCommand cmd;
+
+    err = queueCommand_nolock(&cmd, command, type, responsePrefix,
+                              smspdu, timeoutMsec);
+
+    if (err < 0) {
+        return err;
+    }
+
+    return waitCommand_nolock(&cmd, pp_outResponse);
 }
 
 /**
@@ -743,6 +953,7 @@ static int at_send_command_full (const char *command, ATCommandType type,
 {
     int err;
     bool inEmulator;
+    ATCommand cmd;
 
     if (0 != pthread_equal(s_tid_reader, pthread_self())) {
         /* cannot be called from reader thread */
@@ -754,15 +965,20 @@ static int at_send_command_full (const char *command, ATCommandType type,
     }
     pthread_mutex_lock(&s_commandmutex);
 
-    err = at_send_command_full_nolock(command, type,
-                    responsePrefix, smspdu,
-                    timeoutMsec, pp_outResponse);
+    err = queueCommand_nolock(&cmd, command, type, responsePrefix,
+                              smspdu, timeoutMsec);
 
-    pthread_mutex_unlock(&s_commandmutex);
+    /* other writers may queue their commands behind this one */
     if (inEmulator) {
         pthread_mutex_unlock(&s_writeMutex);
     }
 
+    if (err == 0) {
+        err = waitCommand_nolock(&cmd, pp_outResponse);
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+
     if (err == AT_ERROR_TIMEOUT && s_onTimeout != NULL) {
         s_onTimeout();
     }
@@ -770,6 +986,88 @@ static int at_send_command_full (const char *command, ATCommandType type,
     return err;
 }
 
+/**
+ * Writes all the commands back to back, then waits for their responses.
+ * Each command gets its own error code and response in |p_commands|
+ *
+ * returns 0 if every command completed, the first AT_ERROR_* otherwise
+ */
+int at_send_command_batch (ATBatchCommand *p_commands, size_t count)
+{
+    int err = 0;
+    bool inEmulator;
+    bool timedOut = false;
+    size_t i, sent;
+    ATCommand *p_cmds;
+
+    if (0 != pthread_equal(s_tid_reader, pthread_self())) {
+        /* cannot be called from reader thread */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    p_cmds = (ATCommand *) calloc(count, sizeof(ATCommand));
+    if (p_cmds == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    inEmulator = isInEmulator();
+    if (inEmulator) {
+        pthread_mutex_lock(&s_writeMutex);
+    }
+    pthread_mutex_lock(&s_commandmutex);
+
+    for (sent = 0; sent < count; sent++) {
+        ATBatchCommand *p_batch = &p_commands[sent];
+
+        p_batch->p_response = NULL;
+        p_batch->err = queueCommand_nolock(&p_cmds[sent], p_batch->command,
+                            p_batch->type, p_batch->responsePrefix, NULL,
+                            p_batch->timeoutMsec);
+        if (p_batch->err < 0) {
+            break;
+        }
+    }
+
+    if (inEmulator) {
+        pthread_mutex_unlock(&s_writeMutex);
+    }
+
+    for (i = 0; i < count; i++) {
+        ATBatchCommand *p_batch = &p_commands[i];
+
+        if (i < sent) {
+            p_batch->err = waitCommand_nolock(&p_cmds[i], &p_batch->p_response);
+        } else if (i > sent) {
+            p_batch->err = AT_ERROR_GENERIC;
+        }
+
+        if (p_batch->err == 0 && p_batch->p_response->success > 0
+            && p_batch->p_response->p_intermediates == NULL
+            && (p_batch->type == NUMERIC || p_batch->type == SINGLELINE)
+        ) {
+            /* successful command must have an intermediate response */
+            at_response_free(p_batch->p_response);
+            p_batch->p_response = NULL;
+            p_batch->err = AT_ERROR_INVALID_RESPONSE;
+        }
+
+        timedOut |= (p_batch->err == AT_ERROR_TIMEOUT);
+        if (err == 0 && p_batch->err < 0) {
+            err = p_batch->err;
+        }
+    }
+
+    pthread_mutex_unlock(&s_commandmutex);
+
+    free(p_cmds);
+
+    if (timedOut && s_onTimeout != NULL) {
+        s_onTimeout();
+    }
+
+    return err;
+}
+
 
 /**
  * Issue a single normal AT command with no intermediate response expected
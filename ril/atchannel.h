@@ -18,6 +18,8 @@
 #ifndef ATCHANNEL_H
 #define ATCHANNEL_H 1
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -99,6 +101,21 @@ int at_send_command_multiline (const char *command,
                                  ATResponse **pp_outResponse);
 
 
+/** one command of a batch, see at_send_command_batch() */
+typedef struct {
+    const char *command;          /* in: should not include \r */
+    ATCommandType type;           /* in: SMS commands may not be batched */
+    const char *responsePrefix;   /* in: for SINGLELINE and MULTILINE */
+    long long timeoutMsec;        /* in: 0 means infinite timeout */
+    int err;                      /* out: 0 or AT_ERROR_* */
+    ATResponse *p_response;       /* out: free with at_response_free() */
+} ATBatchCommand;
+
+/* Writes all the commands without waiting for each response in turn, then
+   waits for all of them. Returns 0 if every command completed, or the
+   first error; check each command's err and p_response either way */
+int at_send_command_batch (ATBatchCommand *p_commands, size_t count);
+
 int at_handshake();
 
 int at_send_command (const char *command, ATResponse **pp_outResponse);
@@ -24,12 +24,15 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <mutex>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #define LOG_TAG "RIL-IFMON"
@@ -37,6 +40,12 @@
 
 static const size_t kReadBufferSize = 32768;
 
+// Address changes that arrive within this many milliseconds of the first
+// unreported change are reported together, one callback per interface. The
+// kernel sends one message per address, so bringing up an interface with
+// several IPv6 addresses would otherwise cause a burst of callbacks.
+static const int kCoalesceWindowMs = 100;
+
 static const size_t kControlServer = 0;
 static const size_t kControlClient = 1;
 
@@ -66,9 +75,36 @@ bool operator==(const struct ifAddress& left, const struct ifAddress& right) {
            memcmp(&left.addr, &right.addr, addrLength(left.family)) == 0;
 }
 
+// Orders addresses consistently with operator== so that the address list of
+// an interface can be kept sorted and searched with a binary search.
+static bool addressLess(const struct ifAddress& left,
+                        const struct ifAddress& right) {
+    if (left.family != right.family) {
+        return left.family < right.family;
+    }
+    return memcmp(&left.addr, &right.addr, addrLength(left.family)) < 0;
+}
+
+static bool sameAddresses(const std::vector<ifAddress>& left,
+                          const std::vector<ifAddress>& right) {
+    // Both lists are sorted so equal sets are also equal sequences. Compare
+    // prefix lengths too, a changed prefix is worth reporting.
+    return left.size() == right.size() &&
+           std::equal(left.begin(), left.end(), right.begin(),
+                      [](const ifAddress& l, const ifAddress& r) {
+                          return l == r && l.prefix == r.prefix;
+                      });
+}
+
+static int64_t nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 class InterfaceMonitor {
 public:
-    InterfaceMonitor() : mSocketFd(-1) {
+    InterfaceMonitor() : mFlushDeadlineMs(-1), mSocketFd(-1) {
         mControlSocket[kControlServer] = -1;
         mControlSocket[kControlClient] = -1;
     }
@@ -166,7 +202,12 @@ public:
         fds[1].events = POLLIN;
         fds[1].fd = mSocketFd;
         while (true) {
-            int status = ::poll(fds.data(), fds.size(), -1);
+            int timeout = -1;
+            if (mFlushDeadlineMs >= 0) {
+                timeout = static_cast<int>(
+                        std::max<int64_t>(mFlushDeadlineMs - nowMs(), 0));
+            }
+            int status = ::poll(fds.data(), fds.size(), timeout);
             if (status < 0) {
                 if (errno == EINTR) {
                     // Interrupted, just keep going
@@ -176,7 +217,8 @@ public:
                 RLOGE("Polling failed: %s", strerror(errno));
                 break;
             } else if (status == 0) {
-                // Timeout
+                // The coalescing window is over, report what changed
+                flushChanges();
                 continue;
             }
 
@@ -192,6 +234,10 @@ public:
                 }
             } else if (fds[1].revents & POLLIN) {
                 onReadAvailable();
+                if (mFlushDeadlineMs >= 0 && nowMs() >= mFlushDeadlineMs) {
+                    // Keep reporting even if messages never stop arriving
+                    flushChanges();
+                }
             }
         }
         ::write(mControlSocket[kControlServer], kMonitorAckCommand, 1);
@@ -251,7 +297,7 @@ private:
                         RLOGE("Received message type %d", (int)hdr->nlmsg_type);
                         break;
                 }
-                NLMSG_NEXT(hdr, length);
+                hdr = NLMSG_NEXT(hdr, length);
             }
         }
     }
@@ -262,6 +308,7 @@ private:
         }
 
         auto msg = reinterpret_cast<const struct ifaddrmsg*>(NLMSG_DATA(hdr));
+        // Kept sorted with addressLess
         std::vector<ifAddress>& ifAddrs = mAddresses[msg->ifa_index];
 
         auto attr = reinterpret_cast<const struct rtattr*>(IFA_RTA(msg));
@@ -287,12 +334,18 @@ private:
                 continue;
             }
 
-            auto it = std::find(ifAddrs.begin(), ifAddrs.end(), addr);
-            if (hdr->nlmsg_type == RTM_NEWADDR && it == ifAddrs.end()) {
+            auto it = std::lower_bound(ifAddrs.begin(), ifAddrs.end(), addr,
+                                       addressLess);
+            bool exists = it != ifAddrs.end() && *it == addr;
+            if (hdr->nlmsg_type == RTM_NEWADDR && !exists) {
                 // New address does not exist, add it
-                ifAddrs.push_back(addr);
+                ifAddrs.insert(it, addr);
+                somethingChanged = true;
+            } else if (hdr->nlmsg_type == RTM_NEWADDR &&
+                       it->prefix != addr.prefix) {
+                it->prefix = addr.prefix;
                 somethingChanged = true;
-            } else if (hdr->nlmsg_type == RTM_DELADDR && it != ifAddrs.end()) {
+            } else if (hdr->nlmsg_type == RTM_DELADDR && exists) {
                 // Address was removed and it exists, remove it
                 ifAddrs.erase(it);
                 somethingChanged = true;
@@ -300,14 +353,36 @@ private:
         }
 
         if (somethingChanged) {
-            mOnAddressChangeCallback(msg->ifa_index,
-                                     ifAddrs.data(),
-                                     ifAddrs.size());
+            mChangedInterfaces.insert(msg->ifa_index);
+            if (mFlushDeadlineMs < 0) {
+                mFlushDeadlineMs = nowMs() + kCoalesceWindowMs;
+            }
+        }
+    }
+
+    // Report every interface whose address list differs from what was last
+    // reported for it. Changes that cancelled out in the window, such as an
+    // address that was added and removed again, are not reported at all.
+    void flushChanges() {
+        mFlushDeadlineMs = -1;
+
+        for (unsigned int ifIndex : mChangedInterfaces) {
+            std::vector<ifAddress>& ifAddrs = mAddresses[ifIndex];
+            std::vector<ifAddress>& reported = mReportedAddresses[ifIndex];
+            if (sameAddresses(ifAddrs, reported)) {
+                continue;
+            }
+            reported = ifAddrs;
+            mOnAddressChangeCallback(ifIndex, ifAddrs.data(), ifAddrs.size());
         }
+        mChangedInterfaces.clear();
     }
 
     ifMonitorCallback mOnAddressChangeCallback;
     std::unordered_map<unsigned int, std::vector<ifAddress>> mAddresses;
+    std::unordered_map<unsigned int, std::vector<ifAddress>> mReportedAddresses;
+    std::unordered_set<unsigned int> mChangedInterfaces;
+    int64_t mFlushDeadlineMs;
     std::unique_ptr<std::thread> mThread;
     std::mutex mThreadMutex;
     int mSocketFd;
@@ -14,7 +14,9 @@
 ** See the License for the specific language governing permissions and
 ** limitations under the License.
 */
+#ifdef __BIONIC__
 #include <sys/system_properties.h>
+#endif
 
 #include "misc.h"
 /** returns 1 if line starts with prefix, 0 if it does not */
@@ -31,10 +33,15 @@ int strStartsWith(const char *line, const char *prefix)
 
 // Returns true iff running this process in an emulator VM
 bool isInEmulator(void) {
+#ifdef __BIONIC__
   static int inQemu = -1;
   if (inQemu < 0) {
       char propValue[PROP_VALUE_MAX];
       inQemu = (__system_property_get("ro.kernel.qemu", propValue) != 0);
   }
   return inQemu == 1;
+#else
+  // Host builds such as goldfish-ril-harness never run in the emulator
+  return false;
+#endif
 }
@@ -0,0 +1,826 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program is a stand-in for the emulator's GSM modem, so that
+ * reference-ril can be run and profiled without the emulator, eg:
+ *
+ *   goldfish-modem-simulator -p 5556 -f script.txt
+ *   reference-ril ... -p 5556
+ *
+ * It implements the subset of the AT command set reference-ril uses,
+ * with enough state (radio power, calls, PDP context, operator format)
+ * to keep the RIL consistent. Every line typed on stdin is sent to the
+ * client as an unsolicited response.
+ *
+ * The optional script file contains one directive per line:
+ *
+ *   latency <msec>                  delay every response by <msec>
+ *   latency <prefix> <msec>         delay responses to commands starting
+ *                                   with <prefix> by <msec>
+ *   unsol <msec> <line>             send <line> <msec> after the previous
+ *                                   unsolicited line (or the connection)
+ *   repeat <count> <msec> <line>    send <line> <count> times, <msec> apart
+ *
+ * Lines starting with '#' are ignored.
+ */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Default port number */
+#define  DEFAULT_PORT  5556
+
+#define  MAX_LINE        4096
+#define  MAX_LATENCIES   32
+#define  MAX_EVENTS      1024
+#define  MAX_PENDING     256
+#define  MAX_CALLS       7
+
+/* Try to execute x, looping around EINTR errors. */
+#undef TEMP_FAILURE_RETRY
+#define TEMP_FAILURE_RETRY(exp) ({         \
+    typeof (exp) _rc;                      \
+    do {                                   \
+        _rc = (exp);                       \
+    } while (_rc == -1 && errno == EINTR); \
+    _rc; })
+
+#define TFR TEMP_FAILURE_RETRY
+
+typedef struct {
+    char prefix[32];
+    long msec;
+} Latency;
+
+/* an unsolicited line from the script */
+typedef struct {
+    long delay;
+    int count;
+    char *line;
+} Event;
+
+/* a response that is waiting for its latency to expire */
+typedef struct {
+    long long due;
+    char *text;
+} Pending;
+
+typedef struct {
+    int active;
+    int state;      /* +CLCC state: 0 active, 1 held, 2 dialing, 4 incoming */
+    int isMT;
+    char number[32];
+} Call;
+
+static Latency    s_latencies[MAX_LATENCIES];
+static int        s_latencyCount;
+static long       s_defaultLatency;
+
+static Event      s_events[MAX_EVENTS];
+static int        s_eventCount;
+static int        s_nextEvent;
+static int        s_nextEventSent;
+static long long  s_nextEventDue;
+
+static Pending    s_pending[MAX_PENDING];
+static int        s_pendingHead;
+static int        s_pendingCount;
+
+/* modem state */
+static int        s_radioOn;
+static int        s_copsFormat;
+static int        s_pdpActive;
+static char       s_apn[64] = "android";
+static char       s_pdpType[16] = "IP";
+static Call       s_calls[MAX_CALLS];
+static int        s_messageRef;
+static int        s_smsIndex;
+
+/* set while the client is sending an SMS PDU after a "> " prompt */
+static enum { PDU_NONE, PDU_SEND, PDU_WRITE } s_pduMode;
+
+static long long
+now_ms(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+socket_loopback_server( int port, int type )
+{
+    struct sockaddr_in  addr;
+    int                 sock, on = 1;
+
+    sock = socket(AF_INET, type, 0);
+    if (sock < 0)
+        return -1;
+
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(sock, 1) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int
+socket_unix_server( const char* path, int type )
+{
+    struct sockaddr_un  addr;
+    int                 sock;
+
+    sock = socket(AF_UNIX, type, 0);
+    if (sock < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(addr.sun_path);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(sock, 1) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void
+write_all( int fd, const char* data, size_t len )
+{
+    while (len > 0) {
+        ssize_t  n = TFR(write(fd, data, len));
+        if (n <= 0) {
+            perror("write");
+            return;
+        }
+        data += n;
+        len  -= n;
+    }
+}
+
+/** SCRIPT
+ **/
+
+static char*
+skip_space( char* p )
+{
+    while (*p && isspace((unsigned char)*p))
+        p++;
+    return p;
+}
+
+static char*
+next_word( char** p_cur )
+{
+    char*  p = skip_space(*p_cur);
+    char*  word = p;
+
+    while (*p && !isspace((unsigned char)*p))
+        p++;
+    if (*p)
+        *p++ = 0;
+    *p_cur = skip_space(p);
+    return word;
+}
+
+static int
+add_event( long delay, int count, const char* line )
+{
+    if (s_eventCount == MAX_EVENTS || count <= 0 || *line == 0)
+        return -1;
+
+    s_events[s_eventCount].delay = delay;
+    s_events[s_eventCount].count = count;
+    s_events[s_eventCount].line  = strdup(line);
+    s_eventCount++;
+    return 0;
+}
+
+static int
+load_script( const char* path )
+{
+    FILE*  f = fopen(path, "r");
+    char   buf[MAX_LINE];
+    int    lineno = 0;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        char*  p = buf;
+        char*  cmd;
+        size_t len = strlen(buf);
+
+        lineno++;
+        while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r'))
+            buf[--len] = 0;
+
+        p = skip_space(p);
+        if (*p == 0 || *p == '#')
+            continue;
+
+        cmd = next_word(&p);
+
+        if (!strcmp(cmd, "latency")) {
+            char*  first = next_word(&p);
+
+            if (*p == 0) {
+                s_defaultLatency = atol(first);
+            } else if (s_latencyCount < MAX_LATENCIES) {
+                Latency*  l = &s_latencies[s_latencyCount++];
+                snprintf(l->prefix, sizeof(l->prefix), "%s", first);
+                l->msec = atol(next_word(&p));
+            }
+        } else if (!strcmp(cmd, "unsol")) {
+            long  delay = atol(next_word(&p));
+            if (add_event(delay, 1, p) < 0)
+                goto bad;
+        } else if (!strcmp(cmd, "repeat")) {
+            int   count = atoi(next_word(&p));
+            long  delay = atol(next_word(&p));
+            if (add_event(delay, count, p) < 0)
+                goto bad;
+        } else {
+            goto bad;
+        }
+        continue;
+    bad:
+        fprintf(stderr, "%s:%d: invalid directive\n", path, lineno);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static long
+latency_for( const char* command )
+{
+    int  nn;
+
+    for (nn = 0; nn < s_latencyCount; nn++) {
+        if (!strncmp(command, s_latencies[nn].prefix,
+                     strlen(s_latencies[nn].prefix)))
+            return s_latencies[nn].msec;
+    }
+    return s_defaultLatency;
+}
+
+/** RESPONSES
+ **/
+
+/* queue |text| to be sent |latency| msec from now, after anything
+ * already queued so responses never overtake each other */
+static void
+queue_response( int fd, long latency, const char* text )
+{
+    long long  due = now_ms() + latency;
+    int        tail;
+
+    if (s_pendingCount > 0) {
+        int  last = (s_pendingHead + s_pendingCount - 1) % MAX_PENDING;
+        if (s_pending[last].due > due)
+            due = s_pending[last].due;
+    }
+
+    if (latency <= 0 && s_pendingCount == 0) {
+        write_all(fd, text, strlen(text));
+        return;
+    }
+
+    if (s_pendingCount == MAX_PENDING) {
+        fprintf(stderr, "too many pending responses, dropping one\n");
+        return;
+    }
+
+    tail = (s_pendingHead + s_pendingCount) % MAX_PENDING;
+    s_pending[tail].due  = due;
+    s_pending[tail].text = strdup(text);
+    s_pendingCount++;
+}
+
+static void
+flush_responses( int fd )
+{
+    long long  now = now_ms();
+
+    while (s_pendingCount > 0 && s_pending[s_pendingHead].due <= now) {
+        Pending*  p = &s_pending[s_pendingHead];
+
+        if (fd >= 0)
+            write_all(fd, p->text, strlen(p->text));
+        free(p->text);
+        s_pendingHead = (s_pendingHead + 1) % MAX_PENDING;
+        s_pendingCount--;
+    }
+}
+
+static void
+drop_responses( void )
+{
+    while (s_pendingCount > 0) {
+        free(s_pending[s_pendingHead].text);
+        s_pendingHead = (s_pendingHead + 1) % MAX_PENDING;
+        s_pendingCount--;
+    }
+}
+
+static void
+append( char* out, size_t size, const char* fmt, ... )
+    __attribute__((format(printf, 3, 4)));
+
+static void
+append( char* out, size_t size, const char* fmt, ... )
+{
+    size_t   len = strlen(out);
+    va_list  args;
+
+    if (len >= size)
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(out + len, size - len, fmt, args);
+    va_end(args);
+}
+
+static int
+starts_with( const char* s, const char* prefix )
+{
+    return !strncmp(s, prefix, strlen(prefix));
+}
+
+static Call*
+add_call( const char* number, int isMT, int state )
+{
+    int  nn;
+
+    for (nn = 0; nn < MAX_CALLS; nn++) {
+        Call*  c = &s_calls[nn];
+        if (!c->active) {
+            c->active = 1;
+            c->isMT   = isMT;
+            c->state  = state;
+            snprintf(c->number, sizeof(c->number), "%s", number);
+            return c;
+        }
+    }
+    return NULL;
+}
+
+static void
+hangup_calls( int which )
+{
+    int  nn;
+
+    for (nn = 0; nn < MAX_CALLS; nn++) {
+        if (which < 0 || nn + 1 == which)
+            s_calls[nn].active = 0;
+    }
+}
+
+/* handles a single command (without the "AT" prefix for the chained
+ * forms), appending intermediate responses to |out|.
+ * returns 0 for OK, -1 for ERROR and 1 if the response is already final */
+static int
+handle_command( const char* cmd, char* out, size_t size )
+{
+    if (*cmd == 0 || !strcmp(cmd, "E0Q0V1") || starts_with(cmd, "E") ||
+        starts_with(cmd, "S0="))
+        return 0;
+
+    if (!strcmp(cmd, "+CFUN?")) {
+        append(out, size, "\r\n+CFUN: %d\r\n", s_radioOn);
+        return 0;
+    }
+    if (starts_with(cmd, "+CFUN=")) {
+        s_radioOn = atoi(cmd + 6) != 0;
+        if (!s_radioOn) {
+            hangup_calls(-1);
+            s_pdpActive = 0;
+        }
+        return 0;
+    }
+    if (!strcmp(cmd, "+CPIN?")) {
+        append(out, size, "\r\n+CPIN: READY\r\n");
+        return 0;
+    }
+    if (!strcmp(cmd, "+CSQ")) {
+        /* GW, CDMA, EVDO, LTE and TD-SCDMA signal strength */
+        append(out, size, "\r\n+CSQ: %d,99,-1,-1,-1,-1,-1,"
+               "%d,90,10,300,2147483647,2147483647\r\n",
+               s_radioOn ? 20 : 99, s_radioOn ? 20 : 99);
+        return 0;
+    }
+    if (!strcmp(cmd, "+CREG?")) {
+        append(out, size, "\r\n+CREG: 2,%d,\"00c3\",\"00001234\"\r\n",
+               s_radioOn ? 1 : 0);
+        return 0;
+    }
+    if (!strcmp(cmd, "+CGREG?")) {
+        append(out, size, "\r\n+CGREG: 2,%d,\"00c3\",\"00001234\",\"0e\"\r\n",
+               s_radioOn ? 1 : 0);
+        return 0;
+    }
+    if (starts_with(cmd, "+COPS=3,")) {
+        s_copsFormat = atoi(cmd + 8);
+        return 0;
+    }
+    if (!strcmp(cmd, "+COPS?")) {
+        static const char* const names[3] = { "Android", "Android", "310260" };
+
+        if (!s_radioOn)
+            append(out, size, "\r\n+COPS: 0\r\n");
+        else
+            append(out, size, "\r\n+COPS: 0,%d,\"%s\"\r\n", s_copsFormat,
+                   names[s_copsFormat >= 0 && s_copsFormat < 3 ? s_copsFormat : 0]);
+        return 0;
+    }
+    if (!strcmp(cmd, "+CGSN")) {
+        append(out, size, "\r\n000000000000000\r\n");
+        return 0;
+    }
+    if (!strcmp(cmd, "+CIMI")) {
+        append(out, size, "\r\n310260000000000\r\n");
+        return 0;
+    }
+    if (!strcmp(cmd, "+CSMS=1")) {
+        append(out, size, "\r\n+CSMS: 1,1,1\r\n");
+        return 0;
+    }
+    if (starts_with(cmd, "+CGDCONT=1,")) {
+        /* +CGDCONT=1,"<type>","<apn>",,0,0 */
+        sscanf(cmd + 11, "\"%15[^\"]\",\"%63[^\"]\"", s_pdpType, s_apn);
+        return 0;
+    }
+    if (!strcmp(cmd, "+CGDCONT?")) {
+        append(out, size, "\r\n+CGDCONT: 1,\"%s\",\"%s\",\"10.0.2.15\",0,0\r\n",
+               s_pdpType, s_apn);
+        return 0;
+    }
+    if (!strcmp(cmd, "+CGACT?")) {
+        append(out, size, "\r\n+CGACT: 1,%d\r\n", s_pdpActive);
+        return 0;
+    }
+    if (starts_with(cmd, "+CGACT=")) {
+        s_pdpActive = atoi(cmd + 7) != 0;
+        return 0;
+    }
+    if (!strcmp(cmd, "D*99***1#")) {
+        if (!s_radioOn)
+            return -1;
+        s_pdpActive = 1;
+        return 0;
+    }
+    if (cmd[0] == 'D') {
+        char  number[32];
+
+        if (!s_radioOn || sscanf(cmd + 1, "%31[^;]", number) != 1)
+            return -1;
+        return add_call(number, 0, 0) ? 0 : -1;
+    }
+    if (!strcmp(cmd, "A")) {
+        int  nn;
+        for (nn = 0; nn < MAX_CALLS; nn++) {
+            if (s_calls[nn].active && s_calls[nn].state == 4)
+                s_calls[nn].state = 0;
+        }
+        return 0;
+    }
+    if (!strcmp(cmd, "H") || !strcmp(cmd, "+CHLD=0")) {
+        hangup_calls(-1);
+        return 0;
+    }
+    if (starts_with(cmd, "+CHLD=1")) {
+        hangup_calls(cmd[7] ? atoi(cmd + 7) : -1);
+        return 0;
+    }
+    if (starts_with(cmd, "+CHLD=")) {
+        return 0;
+    }
+    if (!strcmp(cmd, "+CLCC")) {
+        int  nn;
+        for (nn = 0; nn < MAX_CALLS; nn++) {
+            Call*  c = &s_calls[nn];
+            if (c->active)
+                append(out, size, "\r\n+CLCC: %d,%d,%d,0,0,\"%s\",129",
+                       nn + 1, c->isMT, c->state, c->number);
+        }
+        if (out[0])
+            append(out, size, "\r\n");
+        return 0;
+    }
+    if (starts_with(cmd, "+CMGS=")) {
+        s_pduMode = PDU_SEND;
+        append(out, size, "\r\n> ");
+        return 1;
+    }
+    if (starts_with(cmd, "+CMGW=")) {
+        s_pduMode = PDU_WRITE;
+        append(out, size, "\r\n> ");
+        return 1;
+    }
+
+    /* queries we don't know about fail, everything else succeeds */
+    if (strchr(cmd, '?') != NULL || starts_with(cmd, "+CRSM") ||
+        starts_with(cmd, "+CSIM") || starts_with(cmd, "+CCHO") ||
+        starts_with(cmd, "+CGLA") || starts_with(cmd, "+CTEC"))
+        return -1;
+
+    return 0;
+}
+
+/* handles a complete line from the client. Chained commands such as
+ * AT+COPS=3,0;+COPS? get a single final response */
+static void
+handle_line( int fd, char* line )
+{
+    char   out[MAX_LINE];
+    char*  cmd;
+    char*  next;
+    int    ret = 0;
+
+    out[0] = 0;
+
+    if (strncasecmp(line, "AT", 2) != 0) {
+        queue_response(fd, s_defaultLatency, "\r\nERROR\r\n");
+        return;
+    }
+
+    for (cmd = line + 2; cmd != NULL && ret == 0; cmd = next) {
+        /* ATD<number>; keeps its ';' */
+        if (cmd[0] == 'D') {
+            next = NULL;
+        } else {
+            next = strchr(cmd, ';');
+            if (next)
+                *next++ = 0;
+        }
+        ret = handle_command(cmd, out, sizeof(out));
+    }
+
+    if (ret == 0)
+        append(out, sizeof(out), "\r\nOK\r\n");
+    else if (ret < 0)
+        append(out, sizeof(out), "\r\nERROR\r\n");
+
+    queue_response(fd, latency_for(line), out);
+}
+
+/* handles an SMS PDU terminated by ctrl-Z */
+static void
+handle_pdu( int fd )
+{
+    char  out[64];
+
+    if (s_pduMode == PDU_SEND)
+        snprintf(out, sizeof(out), "\r\n+CMGS: %d\r\nOK\r\n",
+                 ++s_messageRef & 0xff);
+    else
+        snprintf(out, sizeof(out), "\r\n+CMGW: %d\r\nOK\r\n", ++s_smsIndex);
+
+    s_pduMode = PDU_NONE;
+    queue_response(fd, latency_for("AT+CMGS"), out);
+}
+
+/* sends |line| to the client as an unsolicited response */
+static void
+send_unsolicited( int fd, const char* line )
+{
+    char  out[MAX_LINE];
+
+    snprintf(out, sizeof(out), "\r\n%s\r\n", line);
+    write_all(fd, out, strlen(out));
+}
+
+static void
+send_due_events( int fd )
+{
+    long long  now = now_ms();
+
+    while (s_nextEvent < s_eventCount && s_nextEventDue <= now) {
+        Event*  e = &s_events[s_nextEvent];
+
+        send_unsolicited(fd, e->line);
+
+        if (++s_nextEventSent == e->count) {
+            s_nextEvent++;
+            s_nextEventSent = 0;
+        }
+        if (s_nextEvent < s_eventCount)
+            s_nextEventDue += s_events[s_nextEvent].delay;
+    }
+}
+
+/* serves a single client until it disconnects */
+static void
+serve_client( int fd )
+{
+    char    line[MAX_LINE];
+    size_t  len = 0;
+    int     stdin_open = 1;
+    char    input[MAX_LINE];
+    size_t  input_len = 0;
+
+    s_nextEvent     = 0;
+    s_nextEventSent = 0;
+    s_pduMode       = PDU_NONE;
+    if (s_eventCount > 0)
+        s_nextEventDue = now_ms() + s_events[0].delay;
+
+    for (;;) {
+        struct pollfd  fds[2];
+        char           buf[MAX_LINE];
+        int            timeout = -1;
+        long long      now = now_ms();
+        int            nfds = 1;
+        ssize_t        n, nn;
+
+        if (s_pendingCount > 0) {
+            long long  wait = s_pending[s_pendingHead].due - now;
+            timeout = wait < 0 ? 0 : (int)wait;
+        }
+        if (s_nextEvent < s_eventCount) {
+            long long  wait = s_nextEventDue - now;
+            if (wait < 0)
+                wait = 0;
+            if (timeout < 0 || wait < timeout)
+                timeout = (int)wait;
+        }
+
+        fds[0].fd     = fd;
+        fds[0].events = POLLIN;
+        if (stdin_open) {
+            fds[1].fd     = 0;
+            fds[1].events = POLLIN;
+            nfds = 2;
+        }
+
+        if (TFR(poll(fds, nfds, timeout)) < 0) {
+            perror("poll");
+            break;
+        }
+
+        flush_responses(fd);
+        send_due_events(fd);
+
+        if (nfds > 1 && (fds[1].revents & (POLLIN | POLLHUP))) {
+            n = TFR(read(0, input + input_len, sizeof(input) - input_len - 1));
+            if (n <= 0) {
+                stdin_open = 0;
+            } else {
+                char*  start = input;
+                char*  eol;
+
+                input_len += n;
+                input[input_len] = 0;
+                while ((eol = strchr(start, '\n')) != NULL) {
+                    *eol = 0;
+                    if (eol > start && eol[-1] == '\r')
+                        eol[-1] = 0;
+                    if (*start)
+                        send_unsolicited(fd, start);
+                    start = eol + 1;
+                }
+                input_len -= start - input;
+                memmove(input, start, input_len);
+                if (input_len == sizeof(input) - 1)
+                    input_len = 0;
+            }
+        }
+
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        n = TFR(read(fd, buf, sizeof(buf)));
+        if (n <= 0)
+            break;
+
+        for (nn = 0; nn < n; nn++) {
+            char  c = buf[nn];
+
+            if (s_pduMode != PDU_NONE) {
+                /* the PDU is ended by ctrl-Z, or cancelled by ESC */
+                if (c == 0x1a) {
+                    handle_pdu(fd);
+                    len = 0;
+                } else if (c == 0x1b) {
+                    s_pduMode = PDU_NONE;
+                    len = 0;
+                }
+                continue;
+            }
+
+            if (c == '\r' || c == '\n') {
+                line[len] = 0;
+                if (len > 0)
+                    handle_line(fd, line);
+                len = 0;
+            } else if (len < sizeof(line) - 1) {
+                line[len++] = c;
+            }
+        }
+    }
+
+    drop_responses();
+}
+
+static void
+usage( const char* progname )
+{
+    fprintf(stderr,
+            "usage: %s [-p <tcp port>] [-s <unix socket path>] "
+            "[-l <latency msec>] [-f <script>]\n", progname);
+    exit(1);
+}
+
+int main( int argc, char** argv )
+{
+    int          port = DEFAULT_PORT;
+    const char*  path = NULL;
+    int          server, opt;
+
+    while ((opt = getopt(argc, argv, "p:s:l:f:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 's':
+                path = optarg;
+                break;
+            case 'l':
+                s_defaultLatency = atol(optarg);
+                break;
+            case 'f':
+                if (load_script(optarg) < 0)
+                    return 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (path != NULL)
+        server = socket_unix_server(path, SOCK_STREAM);
+    else
+        server = socket_loopback_server(port, SOCK_STREAM);
+
+    if (server < 0) {
+        perror("could not create server socket");
+        return 1;
+    }
+
+    if (path != NULL)
+        printf("modem simulator listening on %s\n", path);
+    else
+        printf("modem simulator listening on port %d\n", port);
+
+    for (;;) {
+        int  client = TFR(accept(server, NULL, NULL));
+
+        if (client < 0) {
+            perror("accept");
+            return 1;
+        }
+        printf("client connected\n");
+        serve_client(client);
+        close(client);
+        printf("client disconnected\n");
+    }
+}
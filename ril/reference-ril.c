@@ -30,6 +30,8 @@
 #include <pthread.h>
 #include <alloca.h>
 #include "atchannel.h"
+#include "at_cache.h"
+#include "at_prefix.h"
 #include "at_tok.h"
 #include "misc.h"
 #include <getopt.h>
@@ -50,6 +52,12 @@
 #define LOG_TAG "RIL"
 #include <utils/Log.h>
 
+/* __unused comes from bionic's <sys/cdefs.h>, glibc has no such macro when
+ * this is built for the host by goldfish-ril-harness */
+#ifndef __unused
+#define __unused __attribute__((__unused__))
+#endif
+
 static void *noopRemoveWarning( void *a ) { return a; }
 #define RIL_UNUSED_PARM(a) noopRemoveWarning((void *)&(a));
 
@@ -284,6 +292,38 @@ static int query_ctec(ModemInfo *mdm, int *current, int32_t *preferred);
 static int parse_technology_response(const char *response, int *current, int32_t *preferred);
 static int techFromModemType(int mdmtype);
 
+/* modem state served from the AT response cache, see at_cache.h */
+enum {
+    CACHE_SIGNAL_STRENGTH,
+    CACHE_VOICE_REGISTRATION,
+    CACHE_DATA_REGISTRATION,
+    CACHE_OPERATOR,
+    CACHE_PDP_CONTEXT_STATE,
+    CACHE_PDP_CONTEXTS,
+    CACHE_SIM_STATUS,
+};
+
+/* Entries are kept up to date by unsolicited responses or invalidated when
+ * a request changes them, so the ages only bound how long a state change the
+ * modem doesn't report can go unnoticed.
+ */
+static const ATCacheEntry s_cacheEntries[] = {
+    [CACHE_SIGNAL_STRENGTH] = { "AT+CSQ", SINGLELINE, "+CSQ:", 10000 },
+    [CACHE_VOICE_REGISTRATION] = { "AT+CREG?", SINGLELINE, "+CREG:", 30000 },
+    [CACHE_DATA_REGISTRATION] = { "AT+CGREG?", SINGLELINE, "+CGREG:", 30000 },
+    [CACHE_OPERATOR] = {
+        "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
+        MULTILINE, "+COPS:", 30000 },
+    [CACHE_PDP_CONTEXT_STATE] = { "AT+CGACT?", MULTILINE, "+CGACT:", 30000 },
+    [CACHE_PDP_CONTEXTS] = { "AT+CGDCONT?", MULTILINE, "+CGDCONT:", 30000 },
+    [CACHE_SIM_STATUS] = { "AT+CPIN?", SINGLELINE, "+CPIN:", 30000 },
+};
+
+static void scheduleCacheRefresh(void (*refresh)(void *), void *param)
+{
+    RIL_requestTimedCallback(refresh, param, NULL);
+}
+
 static int clccStateToRILState(int state, RIL_CallState *p_state)
 
 {
@@ -534,6 +574,8 @@ static void requestOrSendDataCallList(RIL_Token *t);
 
 static void onDataCallListChanged(void *param __unused)
 {
+    at_cache_invalidate(CACHE_PDP_CONTEXT_STATE);
+    at_cache_invalidate(CACHE_PDP_CONTEXTS);
     requestOrSendDataCallList(NULL);
 }
 
@@ -619,7 +661,7 @@ static void requestOrSendDataCallList(RIL_Token *t)
     bool hasWifi = hasWifiCapability();
     const char* radioInterfaceName = getRadioInterfaceName(hasWifi);
 
-    err = at_send_command_multiline ("AT+CGACT?", "+CGACT:", &p_response);
+    err = at_cache_send_command(CACHE_PDP_CONTEXT_STATE, &p_response);
     if (err != 0 || p_response->success == 0) {
         if (t != NULL)
             RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
@@ -673,7 +715,7 @@ static void requestOrSendDataCallList(RIL_Token *t)
 
     at_response_free(p_response);
 
-    err = at_send_command_multiline ("AT+CGDCONT?", "+CGDCONT:", &p_response);
+    err = at_cache_send_command(CACHE_PDP_CONTEXTS, &p_response);
     if (err != 0 || p_response->success == 0) {
         if (t != NULL)
             RIL_onRequestComplete(*t, RIL_E_GENERIC_FAILURE, NULL, 0);
@@ -854,6 +896,7 @@ static void setNetworkSelectionAutomatic(RIL_Token t)
     }
 
     err = at_send_command("AT+COPS=0", &p_response);
+    at_cache_invalidate(CACHE_OPERATOR);
 
     if (err < 0 || p_response == NULL || p_response->success == 0) {
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
@@ -1130,7 +1173,7 @@ static void requestSignalStrength(void *data __unused, size_t datalen __unused,
 
     memset(response, 0, sizeof(response));
 
-    err = at_send_command_singleline("AT+CSQ", "+CSQ:", &p_response);
+    err = at_cache_send_command(CACHE_SIGNAL_STRENGTH, &p_response);
 
     if (err < 0 || p_response->success == 0) {
         RIL_onRequestComplete(t, RIL_E_GENERIC_FAILURE, NULL, 0);
@@ -1584,8 +1627,7 @@ static void requestRegistrationState(int request, void *data __unused,
     int *registration;
     char **responseStr = NULL;
     ATResponse *p_response = NULL;
-    const char *cmd;
-    const char *prefix;
+    int cacheId;
     char *line;
     int i = 0, j, numElements = 0;
     int count = 3;
@@ -1593,19 +1635,17 @@ static void requestRegistrationState(int request, void *data __unused,
 
     RLOGD("requestRegistrationState");
     if (request == RIL_REQUEST_VOICE_REGISTRATION_STATE) {
-        cmd = "AT+CREG?";
-        prefix = "+CREG:";
+        cacheId = CACHE_VOICE_REGISTRATION;
         numElements = REG_STATE_LEN;
     } else if (request == RIL_REQUEST_DATA_REGISTRATION_STATE) {
-        cmd = "AT+CGREG?";
-        prefix = "+CGREG:";
+        cacheId = CACHE_DATA_REGISTRATION;
         numElements = REG_DATA_STATE_LEN;
     } else {
         assert(0);
         goto error;
     }
 
-    err = at_send_command_singleline(cmd, prefix, &p_response);
+    err = at_cache_send_command(cacheId, &p_response);
 
     if (err != 0) goto error;
 
@@ -1703,9 +1743,7 @@ static void requestOperator(void *data __unused, size_t datalen __unused, RIL_To
 
     ATResponse *p_response = NULL;
 
-    err = at_send_command_multiline(
-        "AT+COPS=3,0;+COPS?;+COPS=3,1;+COPS?;+COPS=3,2;+COPS?",
-        "+COPS:", &p_response);
+    err = at_cache_send_command(CACHE_OPERATOR, &p_response);
 
     /* we expect 3 lines here:
      * +COPS: 0,0,"T - Mobile"
@@ -2142,6 +2180,9 @@ static void requestSetupDataCall(void *data, size_t datalen, RIL_Token t)
         // Start data on PDP context 1
         err = at_send_command("ATD*99***1#", &p_response);
 
+        at_cache_invalidate(CACHE_PDP_CONTEXT_STATE);
+        at_cache_invalidate(CACHE_PDP_CONTEXTS);
+
         if (err < 0 || p_response->success == 0) {
             goto error;
         }
@@ -2259,6 +2300,7 @@ static void  requestEnterSimPin(void*  data, size_t  datalen, RIL_Token  t)
 
     err = at_send_command_singleline(cmd, "+CPIN:", &p_response);
     free(cmd);
+    at_cache_invalidate(CACHE_SIM_STATUS);
 
     if (err < 0 || p_response->success == 0) {
 error:
@@ -3094,6 +3136,9 @@ setRadioState(RIL_RadioState newState)
 
     /* do these outside of the mutex */
     if (sState != oldState) {
+        // most of the cached modem state depends on the radio state
+        at_cache_invalidate_all();
+
         RIL_onUnsolicitedResponse (RIL_UNSOL_RESPONSE_RADIO_STATE_CHANGED,
                                     NULL, 0);
         // Sim state can change as result of radio state change
@@ -3199,7 +3244,7 @@ getSIMStatus()
     char *cpinResult;
 
     RLOGD("getSIMStatus(). sState: %d",sState);
-    err = at_send_command_singleline("AT+CPIN?", "+CPIN:", &p_response);
+    err = at_cache_send_command(CACHE_SIM_STATUS, &p_response);
 
     if (err != 0) {
         ret = SIM_NOT_READY;
@@ -3409,6 +3454,9 @@ static void pollSIMState (void *param __unused)
         return;
     }
 
+    // we're waiting for the SIM to change state, don't trust the cache
+    at_cache_invalidate(CACHE_SIM_STATUS);
+
     switch(getSIMStatus()) {
         case SIM_ABSENT:
         case SIM_PIN:
@@ -3633,7 +3681,7 @@ static void probeForModemMode(ModemInfo *info)
 static void initializeCallback(void *param __unused)
 {
     ATResponse *p_response = NULL;
-    int err;
+    size_t i;
 
     setRadioState (RADIO_STATE_OFF);
 
@@ -3643,55 +3691,66 @@ static void initializeCallback(void *param __unused)
     /* note: we don't check errors here. Everything important will
        be handled in onATTimeout and onATReaderClosed */
 
-    /*  atchannel is tolerant of echo but it must */
-    /*  have verbose result codes */
-    at_send_command("ATE0Q0V1", NULL);
+    /* none of these depend on the previous ones, so they are written
+       back to back and the modem answers them in one go */
+    ATBatchCommand init[] = {
+        /*  atchannel is tolerant of echo but it must */
+        /*  have verbose result codes */
+        { "ATE0Q0V1", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  No auto-answer */
-    at_send_command("ATS0=0", NULL);
+        /*  No auto-answer */
+        { "ATS0=0", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  Extended errors */
-    at_send_command("AT+CMEE=1", NULL);
+        /*  Extended errors */
+        { "AT+CMEE=1", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  Network registration events */
-    err = at_send_command("AT+CREG=2", &p_response);
+        /*  Network registration events */
+        { "AT+CREG=2", NO_RESULT, NULL, 0, 0, NULL },
 
-    /* some handsets -- in tethered mode -- don't support CREG=2 */
-    if (err < 0 || p_response->success == 0) {
-        at_send_command("AT+CREG=1", NULL);
-    }
+        /*  GPRS registration events */
+        { "AT+CGREG=1", NO_RESULT, NULL, 0, 0, NULL },
 
-    at_response_free(p_response);
+        /*  Call Waiting notifications */
+        { "AT+CCWA=1", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  GPRS registration events */
-    at_send_command("AT+CGREG=1", NULL);
+        /*  Alternating voice/data off */
+        { "AT+CMOD=0", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  Call Waiting notifications */
-    at_send_command("AT+CCWA=1", NULL);
+        /*  Not muted */
+        { "AT+CMUT=0", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  Alternating voice/data off */
-    at_send_command("AT+CMOD=0", NULL);
+        /*  +CSSU unsolicited supp service notifications */
+        { "AT+CSSN=0,1", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  Not muted */
-    at_send_command("AT+CMUT=0", NULL);
+        /*  no connected line identification */
+        { "AT+COLP=0", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  +CSSU unsolicited supp service notifications */
-    at_send_command("AT+CSSN=0,1", NULL);
+        /*  HEX character set */
+        { "AT+CSCS=\"HEX\"", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  no connected line identification */
-    at_send_command("AT+COLP=0", NULL);
+        /*  USSD unsolicited */
+        { "AT+CUSD=1", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  HEX character set */
-    at_send_command("AT+CSCS=\"HEX\"", NULL);
+        /*  Enable +CGEV GPRS event notifications, but don't buffer */
+        { "AT+CGEREP=1,0", NO_RESULT, NULL, 0, 0, NULL },
 
-    /*  USSD unsolicited */
-    at_send_command("AT+CUSD=1", NULL);
+        /*  SMS PDU mode */
+        { "AT+CMGF=0", NO_RESULT, NULL, 0, 0, NULL },
+    };
+    const size_t initCount = sizeof(init) / sizeof(init[0]);
+    const size_t cregIndex = 3;
 
-    /*  Enable +CGEV GPRS event notifications, but don't buffer */
-    at_send_command("AT+CGEREP=1,0", NULL);
+    at_send_command_batch(init, initCount);
 
-    /*  SMS PDU mode */
-    at_send_command("AT+CMGF=0", NULL);
+    /* some handsets -- in tethered mode -- don't support CREG=2 */
+    p_response = init[cregIndex].p_response;
+    if (init[cregIndex].err < 0 || p_response->success == 0) {
+        at_send_command("AT+CREG=1", NULL);
+    }
+
+    for (i = 0; i < initCount; i++) {
+        at_response_free(init[i].p_response);
+    }
 
 #ifdef USE_TI_COMMANDS
 
@@ -3732,6 +3791,53 @@ static void sendUnsolImsNetworkStateChanged()
             NULL, 0);
 }
 
+/* unsolicited responses handled by onUnsolicited() */
+enum {
+    UNSOL_NITZ,
+    UNSOL_CALL_STATE,
+    UNSOL_NETWORK_STATE,
+    UNSOL_SIGNAL_STRENGTH,
+    UNSOL_NEW_SMS,
+    UNSOL_SMS_STATUS_REPORT,
+    UNSOL_DATA_CALL_LIST,
+#ifdef WORKAROUND_FAKE_CGEV
+    UNSOL_FAKE_CGEV,
+#endif /* WORKAROUND_FAKE_CGEV */
+    UNSOL_TECHNOLOGY,
+    UNSOL_SUBSCRIPTION_SOURCE,
+    UNSOL_EMERGENCY_CALLBACK,
+    UNSOL_PRL,
+    UNSOL_RADIO_OFF,
+    UNSOL_SIM_STATUS,
+};
+
+static const ATPrefix s_unsolPrefixes[] = {
+    { "%CTZV:", UNSOL_NITZ },
+    { "+CRING:", UNSOL_CALL_STATE },
+    { "RING", UNSOL_CALL_STATE },
+    { "NO CARRIER", UNSOL_CALL_STATE },
+    { "+CCWA", UNSOL_CALL_STATE },
+    { "+CREG:", UNSOL_NETWORK_STATE },
+    { "+CGREG:", UNSOL_NETWORK_STATE },
+    { "+CSQ:", UNSOL_SIGNAL_STRENGTH },
+    { "+CMT:", UNSOL_NEW_SMS },
+    { "+CDS:", UNSOL_SMS_STATUS_REPORT },
+    { "+CGEV:", UNSOL_DATA_CALL_LIST },
+#ifdef WORKAROUND_FAKE_CGEV
+    { "+CME ERROR: 150", UNSOL_FAKE_CGEV },
+#endif /* WORKAROUND_FAKE_CGEV */
+    { "+CTEC: ", UNSOL_TECHNOLOGY },
+    { "+CCSS: ", UNSOL_SUBSCRIPTION_SOURCE },
+    { "+WSOS: ", UNSOL_EMERGENCY_CALLBACK },
+    { "+WPRL: ", UNSOL_PRL },
+    { "+CFUN: 0", UNSOL_RADIO_OFF },
+    /* the SIM was removed, inserted or unlocked, eg "+CPIN: NOT INSERTED" */
+    { "+CPIN:", UNSOL_SIM_STATUS },
+};
+
+/* built by mainLoop() before the AT channel is opened */
+static ATPrefixTrie s_unsolTrie;
+
 /**
  * Called by atchannel when an unsolicited line appears
  * This is called on atchannel's reader thread. AT commands may
@@ -3741,6 +3847,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 {
     char *line = NULL, *p;
     int err;
+    int unsolId;
 
     /* Ignore unsolicited responses until we're initialized.
      * This is OK because the RIL library will poll for initial state
@@ -3749,7 +3856,9 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
         return;
     }
 
-    if (strStartsWith(s, "%CTZV:")) {
+    unsolId = at_prefix_match(&s_unsolTrie, s);
+
+    if (unsolId == UNSOL_NITZ) {
         /* TI specific -- NITZ time */
         char *response;
 
@@ -3766,35 +3875,37 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
                 response, strlen(response) + 1);
         }
         free(line);
-    } else if (strStartsWith(s,"+CRING:")
-                || strStartsWith(s,"RING")
-                || strStartsWith(s,"NO CARRIER")
-                || strStartsWith(s,"+CCWA")
-    ) {
+    } else if (unsolId == UNSOL_CALL_STATE) {
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_CALL_STATE_CHANGED,
             NULL, 0);
 #ifdef WORKAROUND_FAKE_CGEV
         RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL); //TODO use new function
 #endif /* WORKAROUND_FAKE_CGEV */
-    } else if (strStartsWith(s,"+CREG:")
-                || strStartsWith(s,"+CGREG:")
-    ) {
+    } else if (unsolId == UNSOL_NETWORK_STATE) {
+        at_cache_invalidate(CACHE_VOICE_REGISTRATION);
+        at_cache_invalidate(CACHE_DATA_REGISTRATION);
+        at_cache_invalidate(CACHE_OPERATOR);
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_VOICE_NETWORK_STATE_CHANGED,
             NULL, 0);
 #ifdef WORKAROUND_FAKE_CGEV
         RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
 #endif /* WORKAROUND_FAKE_CGEV */
-    } else if (strStartsWith(s, "+CMT:")) {
+    } else if (unsolId == UNSOL_SIGNAL_STRENGTH) {
+        /* same format as the AT+CSQ response */
+        at_cache_update(CACHE_SIGNAL_STRENGTH, s);
+    } else if (unsolId == UNSOL_NEW_SMS) {
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_NEW_SMS,
             sms_pdu, strlen(sms_pdu));
-    } else if (strStartsWith(s, "+CDS:")) {
+    } else if (unsolId == UNSOL_SMS_STATUS_REPORT) {
         RIL_onUnsolicitedResponse (
             RIL_UNSOL_RESPONSE_NEW_SMS_STATUS_REPORT,
             sms_pdu, strlen(sms_pdu));
-    } else if (strStartsWith(s, "+CGEV:")) {
+    } else if (unsolId == UNSOL_DATA_CALL_LIST) {
+        at_cache_invalidate(CACHE_PDP_CONTEXT_STATE);
+        at_cache_invalidate(CACHE_PDP_CONTEXTS);
         /* Really, we can ignore NW CLASS and ME CLASS events here,
          * but right now we don't since extranous
          * RIL_UNSOL_DATA_CALL_LIST_CHANGED calls are tolerated
@@ -3802,10 +3913,10 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
         /* can't issue AT commands here -- call on main thread */
         RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
 #ifdef WORKAROUND_FAKE_CGEV
-    } else if (strStartsWith(s, "+CME ERROR: 150")) {
+    } else if (unsolId == UNSOL_FAKE_CGEV) {
         RIL_requestTimedCallback (onDataCallListChanged, NULL, NULL);
 #endif /* WORKAROUND_FAKE_CGEV */
-    } else if (strStartsWith(s, "+CTEC: ")) {
+    } else if (unsolId == UNSOL_TECHNOLOGY) {
         int tech, mask;
         switch (parse_technology_response(s, &tech, NULL))
         {
@@ -3823,7 +3934,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
                 }
                 break;
         }
-    } else if (strStartsWith(s, "+CCSS: ")) {
+    } else if (unsolId == UNSOL_SUBSCRIPTION_SOURCE) {
         int source = 0;
         line = p = strdup(s);
         if (!line) {
@@ -3842,7 +3953,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
         SSOURCE(sMdmInfo) = source;
         RIL_onUnsolicitedResponse(RIL_UNSOL_CDMA_SUBSCRIPTION_SOURCE_CHANGED,
                                   &source, sizeof(source));
-    } else if (strStartsWith(s, "+WSOS: ")) {
+    } else if (unsolId == UNSOL_EMERGENCY_CALLBACK) {
         char state = 0;
         int unsol;
         line = p = strdup(s);
@@ -3866,7 +3977,7 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
 
         RIL_onUnsolicitedResponse(unsol, NULL, 0);
 
-    } else if (strStartsWith(s, "+WPRL: ")) {
+    } else if (unsolId == UNSOL_PRL) {
         int version = -1;
         line = p = strdup(s);
         if (!line) {
@@ -3885,8 +3996,12 @@ static void onUnsolicited (const char *s, const char *sms_pdu)
         }
         free(line);
         RIL_onUnsolicitedResponse(RIL_UNSOL_CDMA_PRL_CHANGED, &version, sizeof(version));
-    } else if (strStartsWith(s, "+CFUN: 0")) {
+    } else if (unsolId == UNSOL_RADIO_OFF) {
         setRadioState(RADIO_STATE_OFF);
+    } else if (unsolId == UNSOL_SIM_STATUS) {
+        at_cache_invalidate(CACHE_SIM_STATUS);
+        RIL_onUnsolicitedResponse(RIL_UNSOL_RESPONSE_SIM_STATUS_CHANGED,
+                                  NULL, 0);
     }
 }
 
@@ -3998,6 +4113,11 @@ mainLoop(void *param __unused)
     struct ifMonitor* monitor = ifMonitorCreate();
 
     AT_DUMP("== ", "entering mainLoop()", -1 );
+    at_prefix_trie_init(&s_unsolTrie, s_unsolPrefixes,
+                        sizeof(s_unsolPrefixes) / sizeof(s_unsolPrefixes[0]));
+    at_cache_init(s_cacheEntries,
+                  sizeof(s_cacheEntries) / sizeof(s_cacheEntries[0]),
+                  scheduleCacheRefresh);
     at_set_on_reader_closed(onATReaderClosed);
     at_set_on_timeout(onATTimeout);
 
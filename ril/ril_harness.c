@@ -0,0 +1,514 @@
+/*
+** Copyright 2018, The Android Open Source Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/* This program links reference-ril against a stub libril and measures
+ * request latency and throughput against goldfish-modem-simulator, eg:
+ *
+ *   goldfish-modem-simulator -p 5556 -f script.txt &
+ *   goldfish-ril-harness -n 500 -- -p 5556
+ *
+ * Everything after "--" is passed to RIL_Init. Like libril, requests and
+ * timed callbacks are run one at a time on a single event thread. The
+ * scenarios are:
+ *
+ *   calls      dial, list the current calls and hang up
+ *   sms        a burst of SMS all queued at once
+ *   data       set up and deactivate a data call. This needs an eth0
+ *              interface the harness is allowed to bring up, for example
+ *              in a network namespace, otherwise the requests fail
+ *   cellinfo   a burst of cell info and signal strength requests, run it
+ *              with a script that repeats +CREG/+CSQ unsolicited lines to
+ *              measure a cell info storm
+ *
+ * For each scenario the harness prints the number of requests and
+ * failures, the latency from queueing a request to its completion, the
+ * throughput and the number of unsolicited responses received meanwhile.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <telephony/librilutils.h>
+
+#include "ril.h"
+
+#define  DEFAULT_COUNT       100
+#define  RADIO_WAIT_SECONDS  30
+
+/* a request or a timed callback waiting for the event thread */
+typedef struct Event {
+    struct Event *p_next;
+    struct timespec due;
+    /* set for timed callbacks */
+    RIL_TimedCallback callback;
+    void *param;
+    /* set for requests */
+    struct Request *p_request;
+} Event;
+
+typedef struct Request {
+    int request;
+    void *data;
+    size_t datalen;
+    struct timespec queued;
+    struct timespec completed;
+    RIL_Errno err;
+    int done;
+} Request;
+
+static const RIL_RadioFunctions *s_callbacks;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when an event is queued */
+static pthread_cond_t s_eventCond = PTHREAD_COND_INITIALIZER;
+/* signaled when a request completes */
+static pthread_cond_t s_doneCond = PTHREAD_COND_INITIALIZER;
+static Event *s_events = NULL;
+static unsigned long s_unsolicited;
+
+static void nowTimespec(struct timespec *p_ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, p_ts);
+}
+
+static double msecBetween(const struct timespec *p_from,
+                          const struct timespec *p_to)
+{
+    return (p_to->tv_sec - p_from->tv_sec) * 1000.0
+            + (p_to->tv_nsec - p_from->tv_nsec) / 1000000.0;
+}
+
+static int timespecBefore(const struct timespec *p_a,
+                          const struct timespec *p_b)
+{
+    return p_a->tv_sec < p_b->tv_sec
+            || (p_a->tv_sec == p_b->tv_sec && p_a->tv_nsec < p_b->tv_nsec);
+}
+
+/** assumes s_mutex is held. Keeps the queue sorted by due time */
+static void queueEvent_nolock(Event *p_event)
+{
+    Event **pp_cur = &s_events;
+
+    while (*pp_cur != NULL && !timespecBefore(&p_event->due, &(*pp_cur)->due)) {
+        pp_cur = &(*pp_cur)->p_next;
+    }
+    p_event->p_next = *pp_cur;
+    *pp_cur = p_event;
+
+    pthread_cond_broadcast(&s_eventCond);
+}
+
+static void *eventLoop(void *arg __attribute__((unused)))
+{
+    pthread_mutex_lock(&s_mutex);
+    for (;;) {
+        Event *p_event;
+        struct timespec now;
+
+        if (s_events == NULL) {
+            pthread_cond_wait(&s_eventCond, &s_mutex);
+            continue;
+        }
+
+        nowTimespec(&now);
+        if (timespecBefore(&now, &s_events->due)) {
+            /* the condition uses CLOCK_MONOTONIC, see main() */
+            pthread_cond_timedwait(&s_eventCond, &s_mutex, &s_events->due);
+            continue;
+        }
+
+        p_event = s_events;
+        s_events = p_event->p_next;
+        pthread_mutex_unlock(&s_mutex);
+
+        if (p_event->p_request != NULL) {
+            Request *p_request = p_event->p_request;
+            s_callbacks->onRequest(p_request->request, p_request->data,
+                                   p_request->datalen, p_request);
+        } else {
+            p_event->callback(p_event->param);
+        }
+        free(p_event);
+
+        pthread_mutex_lock(&s_mutex);
+    }
+    return NULL;
+}
+
+/* The RIL_Env callbacks and the librilutils functions reference-ril uses,
+ * in place of libril */
+
+uint64_t ril_nano_time()
+{
+    struct timespec now;
+
+    nowTimespec(&now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void onRequestComplete(RIL_Token t, RIL_Errno e,
+                              void *response __attribute__((unused)),
+                              size_t responselen __attribute__((unused)))
+{
+    Request *p_request = (Request *) t;
+
+    pthread_mutex_lock(&s_mutex);
+    nowTimespec(&p_request->completed);
+    p_request->err = e;
+    p_request->done = 1;
+    pthread_cond_broadcast(&s_doneCond);
+    pthread_mutex_unlock(&s_mutex);
+}
+
+static void onUnsolicitedResponse(int unsolResponse __attribute__((unused)),
+                                  const void *data __attribute__((unused)),
+                                  size_t datalen __attribute__((unused)))
+{
+    pthread_mutex_lock(&s_mutex);
+    s_unsolicited++;
+    pthread_mutex_unlock(&s_mutex);
+}
+
+static void requestTimedCallback(RIL_TimedCallback callback, void *param,
+                                 const struct timeval *relativeTime)
+{
+    Event *p_event = (Event *) calloc(1, sizeof(Event));
+
+    if (p_event == NULL) {
+        fprintf(stderr, "out of memory for timed callback\n");
+        return;
+    }
+    p_event->callback = callback;
+    p_event->param = param;
+    nowTimespec(&p_event->due);
+    if (relativeTime != NULL) {
+        p_event->due.tv_sec += relativeTime->tv_sec;
+        p_event->due.tv_nsec += relativeTime->tv_usec * 1000L;
+        if (p_event->due.tv_nsec >= 1000000000L) {
+            p_event->due.tv_sec++;
+            p_event->due.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&s_mutex);
+    queueEvent_nolock(p_event);
+    pthread_mutex_unlock(&s_mutex);
+}
+
+static void onRequestAck(RIL_Token t __attribute__((unused)))
+{
+}
+
+static const struct RIL_Env s_rilEnv = {
+    onRequestComplete,
+    onUnsolicitedResponse,
+    requestTimedCallback,
+    onRequestAck
+};
+
+/* Requests and statistics */
+
+static void submitRequest(Request *p_request, int request,
+                          void *data, size_t datalen)
+{
+    Event *p_event = (Event *) calloc(1, sizeof(Event));
+
+    if (p_event == NULL) {
+        fprintf(stderr, "out of memory for request\n");
+        exit(1);
+    }
+
+    memset(p_request, 0, sizeof(*p_request));
+    p_request->request = request;
+    p_request->data = data;
+    p_request->datalen = datalen;
+    nowTimespec(&p_request->queued);
+
+    p_event->p_request = p_request;
+    p_event->due = p_request->queued;
+
+    pthread_mutex_lock(&s_mutex);
+    queueEvent_nolock(p_event);
+    pthread_mutex_unlock(&s_mutex);
+}
+
+static void waitRequests(Request *p_requests, size_t count)
+{
+    size_t i;
+
+    pthread_mutex_lock(&s_mutex);
+    for (i = 0; i < count; i++) {
+        while (!p_requests[i].done) {
+            pthread_cond_wait(&s_doneCond, &s_mutex);
+        }
+    }
+    pthread_mutex_unlock(&s_mutex);
+}
+
+static RIL_Errno sendRequest(int request, void *data, size_t datalen)
+{
+    Request r;
+
+    submitRequest(&r, request, data, datalen);
+    waitRequests(&r, 1);
+    return r.err;
+}
+
+static int compareDouble(const void *p_a, const void *p_b)
+{
+    double a = *(const double *) p_a;
+    double b = *(const double *) p_b;
+
+    return a < b ? -1 : a > b;
+}
+
+static unsigned long unsolicitedCount(void)
+{
+    unsigned long count;
+
+    pthread_mutex_lock(&s_mutex);
+    count = s_unsolicited;
+    pthread_mutex_unlock(&s_mutex);
+    return count;
+}
+
+static void report(const char *name, const Request *p_requests, size_t count,
+                   const struct timespec *p_start, unsigned long unsolicited)
+{
+    struct timespec end;
+    double *latencies;
+    double total = 0;
+    double elapsed;
+    size_t i, failed = 0;
+
+    nowTimespec(&end);
+    elapsed = msecBetween(p_start, &end);
+
+    latencies = (double *) malloc(count * sizeof(double));
+    if (latencies == NULL || count == 0) {
+        free(latencies);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        latencies[i] = msecBetween(&p_requests[i].queued,
+                                   &p_requests[i].completed);
+        total += latencies[i];
+        if (p_requests[i].err != RIL_E_SUCCESS) {
+            failed++;
+        }
+    }
+    qsort(latencies, count, sizeof(double), compareDouble);
+
+    printf("%-9s %6zu requests %5zu failed  latency ms: "
+           "mean %.3f p50 %.3f p99 %.3f max %.3f  %.1f req/s  %lu unsol\n",
+           name, count, failed, total / count, latencies[count / 2],
+           latencies[(count * 99) / 100], latencies[count - 1],
+           elapsed > 0 ? count * 1000.0 / elapsed : 0.0,
+           unsolicitedCount() - unsolicited);
+    fflush(stdout);
+
+    free(latencies);
+}
+
+/* Scenarios */
+
+static void runCalls(size_t count)
+{
+    Request *p_requests = (Request *) calloc(count * 3, sizeof(Request));
+    RIL_Dial dial;
+    int index = 1;
+    struct timespec start;
+    unsigned long unsolicited = unsolicitedCount();
+    size_t i;
+
+    memset(&dial, 0, sizeof(dial));
+    dial.address = "5551234";
+
+    nowTimespec(&start);
+    for (i = 0; i < count; i++) {
+        Request *p_cur = &p_requests[i * 3];
+
+        submitRequest(&p_cur[0], RIL_REQUEST_DIAL, &dial, sizeof(dial));
+        waitRequests(&p_cur[0], 1);
+        submitRequest(&p_cur[1], RIL_REQUEST_GET_CURRENT_CALLS, NULL, 0);
+        waitRequests(&p_cur[1], 1);
+        submitRequest(&p_cur[2], RIL_REQUEST_HANGUP, &index, sizeof(index));
+        waitRequests(&p_cur[2], 1);
+    }
+    report("calls", p_requests, count * 3, &start, unsolicited);
+    free(p_requests);
+}
+
+static void runSms(size_t count)
+{
+    /* a 3GPP SUBMIT to 5551234 */
+    static const char *s_sms[2] = {
+        NULL, "01000b915155214300f000000cc8329bfd06dddf72363904"
+    };
+    Request *p_requests = (Request *) calloc(count, sizeof(Request));
+    struct timespec start;
+    unsigned long unsolicited = unsolicitedCount();
+    size_t i;
+
+    nowTimespec(&start);
+    for (i = 0; i < count; i++) {
+        submitRequest(&p_requests[i], RIL_REQUEST_SEND_SMS,
+                      (void *) s_sms, sizeof(s_sms));
+    }
+    waitRequests(p_requests, count);
+    report("sms", p_requests, count, &start, unsolicited);
+    free(p_requests);
+}
+
+static void runData(size_t count)
+{
+    static const char *s_setup[7] = {
+        "14", "0", "internet", NULL, NULL, "0", "IP"
+    };
+    static const char *s_deactivate[2] = { "1", "0" };
+    Request *p_requests = (Request *) calloc(count * 2, sizeof(Request));
+    struct timespec start;
+    unsigned long unsolicited = unsolicitedCount();
+    size_t i;
+
+    nowTimespec(&start);
+    for (i = 0; i < count; i++) {
+        Request *p_cur = &p_requests[i * 2];
+
+        submitRequest(&p_cur[0], RIL_REQUEST_SETUP_DATA_CALL,
+                      (void *) s_setup, sizeof(s_setup));
+        waitRequests(&p_cur[0], 1);
+        submitRequest(&p_cur[1], RIL_REQUEST_DEACTIVATE_DATA_CALL,
+                      (void *) s_deactivate, sizeof(s_deactivate));
+        waitRequests(&p_cur[1], 1);
+    }
+    report("data", p_requests, count * 2, &start, unsolicited);
+    free(p_requests);
+}
+
+static void runCellInfo(size_t count)
+{
+    Request *p_requests = (Request *) calloc(count * 2, sizeof(Request));
+    struct timespec start;
+    unsigned long unsolicited = unsolicitedCount();
+    size_t i;
+
+    nowTimespec(&start);
+    for (i = 0; i < count; i++) {
+        submitRequest(&p_requests[i * 2], RIL_REQUEST_GET_CELL_INFO_LIST,
+                      NULL, 0);
+        submitRequest(&p_requests[i * 2 + 1], RIL_REQUEST_SIGNAL_STRENGTH,
+                      NULL, 0);
+    }
+    waitRequests(p_requests, count * 2);
+    report("cellinfo", p_requests, count * 2, &start, unsolicited);
+    free(p_requests);
+}
+
+static int waitForRadioState(RIL_RadioState state)
+{
+    int tries;
+
+    for (tries = 0; tries < RADIO_WAIT_SECONDS * 10; tries++) {
+        if (s_callbacks->onStateRequest() == state) {
+            return 0;
+        }
+        usleep(100000);
+    }
+    return -1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-n count] [-t calls,sms,data,cellinfo] "
+            "-- <reference-ril arguments>\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = DEFAULT_COUNT;
+    const char *tests = "calls,sms,data,cellinfo";
+    int on = 1;
+    int opt;
+    pthread_t tid;
+    pthread_condattr_t attr;
+    char **rilArgv;
+    int rilArgc;
+
+    while (-1 != (opt = getopt(argc, argv, "n:t:"))) {
+        switch (opt) {
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                if (count == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                tests = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    /* reference-ril parses its own arguments with getopt */
+    rilArgc = argc - optind + 1;
+    rilArgv = argv + optind - 1;
+    rilArgv[0] = argv[0];
+    optind = 1;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s_eventCond, &attr);
+
+    s_callbacks = RIL_Init(&s_rilEnv, rilArgc, rilArgv);
+    if (s_callbacks == NULL) {
+        fprintf(stderr, "RIL_Init failed\n");
+        return 1;
+    }
+    pthread_create(&tid, NULL, eventLoop, NULL);
+
+    /* initializeCallback leaves the radio off once the modem is set up */
+    if (waitForRadioState(RADIO_STATE_OFF) < 0) {
+        fprintf(stderr, "modem did not initialize\n");
+        return 1;
+    }
+    if (sendRequest(RIL_REQUEST_RADIO_POWER, &on, sizeof(on)) != RIL_E_SUCCESS
+            || waitForRadioState(RADIO_STATE_ON) < 0) {
+        fprintf(stderr, "unable to turn the radio on\n");
+        return 1;
+    }
+
+    if (strstr(tests, "calls") != NULL) {
+        runCalls(count);
+    }
+    if (strstr(tests, "sms") != NULL) {
+        runSms(count);
+    }
+    if (strstr(tests, "data") != NULL) {
+        runData(count);
+    }
+    if (strstr(tests, "cellinfo") != NULL) {
+        runCellInfo(count);
+    }
+    return 0;
+}
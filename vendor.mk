@@ -44,6 +44,8 @@ PRODUCT_PACKAGES += \
     gatekeeper.ranchu \
     gps.goldfish \
     gps.ranchu \
+    flp.goldfish \
+    flp.ranchu \
     fingerprint.goldfish \
     audio.primary.goldfish \
     audio.primary.goldfish_legacy \
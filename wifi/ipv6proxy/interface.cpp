@@ -17,13 +17,44 @@
 #include "interface.h"
 
 #include <errno.h>
+#include <linux/filter.h>
 #include <linux/if_ether.h>
 #include <net/if.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip6.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/ioctl.h>
 
 #include "log.h"
 
+// Offsets into a packet received on the IP socket, the packet starts with the
+// IPv6 header.
+static const uint32_t kNextHeaderOffset = offsetof(struct ip6_hdr, ip6_nxt);
+static const uint32_t kIcmpTypeOffset =
+    sizeof(struct ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_type);
+static const uint32_t kIcmpCodeOffset =
+    sizeof(struct ip6_hdr) + offsetof(struct icmp6_hdr, icmp6_code);
+
+// Only accept the packets the proxy could be interested in, ICMPv6 directly
+// following the IPv6 header with a code of zero and a type that is one of
+// router solicitation, router advertisement, neighbor solicitation or
+// neighbor advertisement. Everything else is dropped in the kernel instead of
+// waking up the proxy. Packet::Packet still does the full validation.
+static const struct sock_filter kNdpFilter[] = {
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, kNextHeaderOffset),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMPV6, 0, 6),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, kIcmpCodeOffset),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 4),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, kIcmpTypeOffset),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, ND_ROUTER_SOLICIT, 0, 2),
+    BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, ND_NEIGHBOR_ADVERT, 1, 0),
+    // Accept the entire packet
+    BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+    // Drop the packet
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
 Interface::Interface(const std::string& name) : mName(name) {
 }
 
@@ -133,6 +164,15 @@ bool Interface::configureIpSocket() {
         return false;
     }
 
+    // Attach the filter before binding so that no unwanted packets are
+    // queued on the socket.
+    res = mIpSocket.attachFilter(kNdpFilter,
+                                 sizeof(kNdpFilter) / sizeof(kNdpFilter[0]));
+    if (!res) {
+        loge("Error attaching socket filter: %s\n", res.c_str());
+        return false;
+    }
+
     res = mIpSocket.bind(mLinkAddr);
     if (!res) {
         loge("Error binding socket: %s\n", res.c_str());
@@ -141,3 +181,28 @@ bool Interface::configureIpSocket() {
     return true;
 }
 
+void Interface::queueIcmp(const struct in6_addr* source,
+                          const struct in6_addr& destination,
+                          const void* data,
+                          size_t size) {
+    if (mQueuedIcmp == mIcmpQueue.size()) {
+        mIcmpQueue.emplace_back();
+    }
+    OutgoingPacket& packet = mIcmpQueue[mQueuedIcmp++];
+    packet.destination = destination;
+    packet.spoofSource = source != nullptr;
+    if (source) {
+        packet.source = *source;
+    }
+    auto bytes = static_cast<const char*>(data);
+    packet.data.assign(bytes, bytes + size);
+}
+
+Result Interface::flushIcmp() {
+    if (mQueuedIcmp == 0) {
+        return Result::success();
+    }
+    Result res = mIcmpSocket.sendBatch(mIcmpQueue.data(), mQueuedIcmp);
+    mQueuedIcmp = 0;
+    return res;
+}
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "address.h"
 #include "socket.h"
@@ -39,6 +40,16 @@ public:
     Socket& icmpSocket() { return mIcmpSocket; }
     const Address& linkAddr() const { return mLinkAddr; }
 
+    // Queue an ICMPv6 message of |size| bytes to be sent to |destination| on
+    // this interface. If |source| is not null it's used as the source address
+    // of the message. The data is copied so it may be modified afterwards.
+    void queueIcmp(const struct in6_addr* source,
+                   const struct in6_addr& destination,
+                   const void* data,
+                   size_t size);
+    // Send all queued ICMPv6 messages.
+    Result flushIcmp();
+
 private:
     bool setAllMulti();
     bool resolveAddresses();
@@ -50,5 +61,9 @@ private:
     Socket mIpSocket;
     Socket mIcmpSocket;
     Address mLinkAddr;
+    // Messages queued by queueIcmp. Only the first |mQueuedIcmp| entries are
+    // in use, the rest are kept around so their buffers can be reused.
+    std::vector<OutgoingPacket> mIcmpQueue;
+    size_t mQueuedIcmp = 0;
 };
 
@@ -19,8 +19,11 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <linux/if_packet.h>
-#include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <utility>
 
 #include <cutils/properties.h>
 
@@ -33,6 +36,10 @@
 static const uint8_t kNodePrefixLength = 128;
 static const size_t kLinkAddressSize = 6;
 static const size_t kRecursiveDnsOptHeaderSize = 8;
+// The most messages received on one interface in a single system call
+static const size_t kMaxReceiveBatch = 16;
+// The most events handled per wakeup
+static const int kMaxEvents = 16;
 
 // Rewrite the link address of a neighbor discovery option to the link address
 // of |interface|. This can be either a source or target link address as
@@ -112,58 +119,91 @@ int Proxy::run() {
         }
     }
 
-    // Create list of FDs to poll, we're only looking for input (POLLIN)
-    std::vector<pollfd> fds(mInnerIfs.size() + 1);
-    fds[0].fd = mOuterIf.ipSocket().get();
-    fds[0].events = POLLIN;
-    for (size_t i = 0; i < mInnerIfs.size(); ++i) {
-        fds[i + 1].fd = mInnerIfs[i].ipSocket().get();
-        fds[i + 1].events = POLLIN;
+    // The set of sockets to wait for never changes, set it up once. Each
+    // event carries a pointer to the interface the socket belongs to, or to
+    // the router for the router's netlink socket.
+    int epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) {
+        loge("Unable to create epoll instance: %s\n", strerror(errno));
+        return 1;
+    }
+    std::vector<std::pair<int, void*>> pollables;
+    pollables.emplace_back(mOuterIf.ipSocket().get(), &mOuterIf);
+    for (auto& inner : mInnerIfs) {
+        pollables.emplace_back(inner.ipSocket().get(), &inner);
+    }
+    pollables.emplace_back(mRouter.fd(), &mRouter);
+    for (const auto& pollable : pollables) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = pollable.second;
+        if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, pollable.first, &event) != 0) {
+            loge("Unable to add socket to epoll: %s\n", strerror(errno));
+            ::close(epollFd);
+            return 1;
+        }
     }
 
-    Message message;
-    while (status >= 0) {
-        status = ::ppoll(fds.data(), fds.size(), nullptr, &originalMask);
-        if (status > 0) {
-            // Something available to read
-            for (const struct pollfd& fd : fds) {
-                if (receiveIfPossible(fd, mOuterIf.ipSocket(), &message)) {
-                    // Received a message on the outer interface
-                    handleOuterMessage(message);
-                } else {
-                    for (auto& inner : mInnerIfs) {
-                        if (receiveIfPossible(fd, inner.ipSocket(), &message)) {
-                            // Received a message on the inner interface
-                            handleInnerMessage(inner, message);
-                        }
-                    }
-                }
+    std::vector<Message> messages(kMaxReceiveBatch);
+    struct epoll_event events[kMaxEvents];
+    for (;;) {
+        int count = ::epoll_pwait(epollFd, events, kMaxEvents, -1,
+                                  &originalMask);
+        if (count < 0) {
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == &mRouter) {
+                mRouter.receiveAcks();
+            } else {
+                auto interface = static_cast<Interface*>(events[i].data.ptr);
+                receive(*interface, messages.data(), messages.size());
             }
         }
+        flushForwarded();
+        // Send any routes and neighbors added while handling the messages in
+        // a single batch.
+        mRouter.flush();
     }
     loge("Polling failed: %s\n", strerror(errno));
+    ::close(epollFd);
     return 1;
 }
 
-bool Proxy::receiveIfPossible(const pollfd& fd,
-                              Socket& socket,
-                              Message* message) {
-    // Check if it's actually the socket we're interested in
-    if (fd.fd != socket.get()) {
-        return false;
+void Proxy::receive(Interface& interface, Message* messages, size_t count) {
+    // Sockets are polled with level triggering, anything that doesn't fit in
+    // this batch will be received on the next iteration.
+    size_t received = 0;
+    Result res = interface.ipSocket().receiveBatch(messages, count, &received);
+    if (!res) {
+        loge("Error receiving on socket: %s\n", res.c_str());
+        return;
     }
-    // Check if there is something to read on this socket
-    if ((fd.revents & POLLIN) == 0) {
-        return false;
+    for (size_t i = 0; i < received; ++i) {
+        if (&interface == &mOuterIf) {
+            // Received a message on the outer interface
+            handleOuterMessage(messages[i]);
+        } else {
+            // Received a message on the inner interface
+            handleInnerMessage(interface, messages[i]);
+        }
     }
+}
 
-    // Receive the message and place the data in the message parameter
-    Result res = socket.receive(message);
+void Proxy::flushForwarded() {
+    Result res = mOuterIf.flushIcmp();
     if (!res) {
-        loge("Error receiving on socket: %s\n", res.c_str());
-        return false;
+        loge("Failed to forward packets to %s: %s\n",
+             mOuterIf.name().c_str(), res.c_str());
+    }
+    for (auto& inner : mInnerIfs) {
+        res = inner.flushIcmp();
+        if (!res) {
+            loge("Failed to forward packets to %s: %s\n",
+                 inner.name().c_str(), res.c_str());
+        }
     }
-    return true;
 }
 
 void Proxy::handleOuterMessage(Message& message) {
@@ -225,24 +265,18 @@ void Proxy::forward(const Interface& from,
         rewriteLinkAddressOption(packet, to, ND_OPT_SOURCE_LINKADDR);
     }
 
-    Result res = Result::success();
     if (options & kSpoofSource) {
         // Spoof the source of the packet so that it appears to originate from
         // the same source that we see.
-        res = to.icmpSocket().sendFrom(packet.ip()->ip6_src,
-                                       packet.ip()->ip6_dst,
-                                       packet.icmp(),
-                                       packet.icmpSize());
+        to.queueIcmp(&packet.ip()->ip6_src,
+                     packet.ip()->ip6_dst,
+                     packet.icmp(),
+                     packet.icmpSize());
     } else {
-        res = to.icmpSocket().sendTo(packet.ip()->ip6_dst,
-                                     packet.icmp(),
-                                     packet.icmpSize());
-    }
-    if (!res) {
-        loge("Failed to forward %s from %s to %s: %s\n",
-             packet.description().c_str(),
-             from.name().c_str(), to.name().c_str(),
-             res.c_str());
+        to.queueIcmp(nullptr,
+                     packet.ip()->ip6_dst,
+                     packet.icmp(),
+                     packet.icmpSize());
     }
 
     if (options & kAddRoute) {
@@ -21,10 +21,8 @@
 #include "interface.h"
 #include "router.h"
 
-struct pollfd;
 class Message;
 class Packet;
-class Socket;
 
 class Proxy {
 public:
@@ -51,7 +49,10 @@ private:
         kSetDefaultGateway = (1 << 4)
     };
 
-    bool receiveIfPossible(const pollfd&, Socket& socket, Message* message);
+    // Receive a batch of messages on |interface| and handle them
+    void receive(Interface& interface, Message* messages, size_t count);
+    // Send everything that was forwarded while handling received messages
+    void flushForwarded();
 
     void handleOuterMessage(Message& message);
     void handleInnerMessage(const Interface& inner, Message& message);
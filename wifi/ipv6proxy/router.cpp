@@ -16,12 +16,30 @@
 
 #include "router.h"
 
+#include <errno.h>
 #include <linux/rtnetlink.h>
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
 
 #include "address.h"
 #include "log.h"
+#include "message.h"
+
+// How often to send installed routes and neighbors to the kernel again even
+// though they're cached. This restores entries that were removed by someone
+// else or by the kernel itself, for example when an interface went down.
+static const uint64_t kRefreshIntervalMs = 60 * 1000;
+// Send queued requests once there is this much data, even if flush hasn't
+// been called yet.
+static const size_t kMaxPendingSize = 8192;
+
+static uint64_t monotonicMillis() {
+    struct timespec time = { 0, 0 };
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return static_cast<uint64_t>(time.tv_sec) * 1000u +
+           static_cast<uint64_t>(time.tv_nsec / 1000000u);
+}
 
 template<class Request>
 static void addRouterAttribute(Request& r,
@@ -49,11 +67,26 @@ bool Router::init() {
         loge("Unable to open netlink socket: %s\n", res.c_str());
         return false;
     }
+    // Bind so that acknowledgements can be received, the kernel picks the
+    // port ID.
+    struct sockaddr_nl netlinkAddress;
+    memset(&netlinkAddress, 0, sizeof(netlinkAddress));
+    netlinkAddress.nl_family = AF_NETLINK;
+    res = mSocket.bind(Address(netlinkAddress));
+    if (!res) {
+        loge("Unable to bind netlink socket: %s\n", res.c_str());
+        return false;
+    }
     return true;
 }
 
 bool Router::addNeighbor(const struct in6_addr& address,
                          unsigned int interfaceIndex) {
+    Key key = { address, interfaceIndex };
+    if (isCached(&mNeighbors, key, interfaceIndex)) {
+        return true;
+    }
+
     struct Request {
         struct nlmsghdr hdr;
         struct ndmsg msg;
@@ -66,7 +99,7 @@ bool Router::addNeighbor(const struct in6_addr& address,
     // Set up a request to create a new neighbor
     request.hdr.nlmsg_len = msgLen;
     request.hdr.nlmsg_type = RTM_NEWNEIGH;
-    request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE;
+    request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE;
 
     // The neighbor is a permanent IPv6 proxy
     request.msg.ndm_family = AF_INET6;
@@ -76,12 +109,17 @@ bool Router::addNeighbor(const struct in6_addr& address,
 
     addRouterAttribute(request, NDA_DST, &address, sizeof(address));
 
-    return sendNetlinkMessage(&request, request.hdr.nlmsg_len);
+    return queueNetlinkMessage(&request.hdr, &mNeighbors, key);
 }
 
 bool Router::addRoute(const struct in6_addr& address,
                       uint8_t bits,
                       uint32_t ifaceIndex) {
+    Key key = { address, bits };
+    if (isCached(&mRoutes, key, ifaceIndex)) {
+        return true;
+    }
+
     struct Request {
         struct nlmsghdr hdr;
         struct rtmsg msg;
@@ -90,10 +128,11 @@ bool Router::addRoute(const struct in6_addr& address,
 
     memset(&request, 0, sizeof(request));
 
-    // Set up a request to create a new route
+    // Set up a request to create a new route, or move an existing one to a
+    // different interface.
     request.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(request.msg));
     request.hdr.nlmsg_type = RTM_NEWROUTE;
-    request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE;
+    request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE;
 
     request.msg.rtm_family = AF_INET6;
     request.msg.rtm_dst_len = bits;
@@ -105,7 +144,7 @@ bool Router::addRoute(const struct in6_addr& address,
     addRouterAttribute(request, RTA_DST, &address, sizeof(address));
     addRouterAttribute(request, RTA_OIF, &ifaceIndex, sizeof(ifaceIndex));
 
-    return sendNetlinkMessage(&request, request.hdr.nlmsg_len);
+    return queueNetlinkMessage(&request.hdr, &mRoutes, key);
 }
 
 bool Router::setDefaultGateway(const struct in6_addr& address,
@@ -137,7 +176,109 @@ bool Router::setDefaultGateway(const struct in6_addr& address,
     addRouterAttribute(request, RTA_OIF, &ifaceIndex, sizeof(ifaceIndex));
     addRouterAttribute(request, RTA_SRC, &anyAddress, sizeof(anyAddress));
 
-    return sendNetlinkMessage(&request, request.hdr.nlmsg_len);
+    // Router advertisements are infrequent, the default gateway is not cached
+    return queueNetlinkMessage(&request.hdr, nullptr, Key{ address, 0 });
+}
+
+void Router::flush() {
+    if (mPending.empty()) {
+        return;
+    }
+    if (!sendNetlinkMessage(mPending.data(), mPending.size())) {
+        // None of the requests will be acknowledged, make sure they are
+        // retried the next time they're needed.
+        dropAwaitingAcks();
+    }
+    mPending.clear();
+}
+
+void Router::receiveAcks() {
+    Message message;
+    Result res = mSocket.receive(&message);
+    if (!res) {
+        // Logging may change errno
+        int error = errno;
+        loge("Unable to receive on netlink socket: %s\n", res.c_str());
+        if (error == ENOBUFS) {
+            // Acknowledgements were lost, we can't tell which requests failed
+            dropAwaitingAcks();
+        }
+        return;
+    }
+
+    auto header = reinterpret_cast<const struct nlmsghdr*>(message.data());
+    int length = static_cast<int>(message.size());
+    for (; NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+        if (header->nlmsg_type != NLMSG_ERROR) {
+            continue;
+        }
+        auto awaiting = mAwaitingAcks.find(header->nlmsg_seq);
+        if (awaiting == mAwaitingAcks.end()) {
+            continue;
+        }
+        auto ack = reinterpret_cast<const struct nlmsgerr*>(NLMSG_DATA(header));
+        if (header->nlmsg_len >= NLMSG_LENGTH(sizeof(*ack)) && ack->error != 0) {
+            loge("Failed to install %s: %s\n",
+                 addrToStr(awaiting->second.key.address).c_str(),
+                 strerror(-ack->error));
+            forget(awaiting->first, awaiting->second);
+        }
+        mAwaitingAcks.erase(awaiting);
+    }
+}
+
+bool Router::isCached(Cache* cache, const Key& key, uint32_t interfaceIndex) {
+    uint64_t now = monotonicMillis();
+    auto entry = cache->find(key);
+    if (entry != cache->end() &&
+        entry->second.interfaceIndex == interfaceIndex &&
+        now < entry->second.refreshAt) {
+        return true;
+    }
+    (*cache)[key] = Entry{ interfaceIndex, now + kRefreshIntervalMs, 0 };
+    return false;
+}
+
+bool Router::queueNetlinkMessage(struct nlmsghdr* header,
+                                 Cache* cache,
+                                 const Key& key) {
+    size_t size = NLMSG_ALIGN(header->nlmsg_len);
+    if (mPending.size() + size > kMaxPendingSize) {
+        flush();
+    }
+    header->nlmsg_flags |= NLM_F_ACK;
+    header->nlmsg_seq = ++mSequence;
+    mAwaitingAcks[header->nlmsg_seq] = AwaitingAck{ cache, key };
+    if (cache) {
+        auto entry = cache->find(key);
+        if (entry != cache->end()) {
+            entry->second.sequence = header->nlmsg_seq;
+        }
+    }
+
+    // Messages in a datagram must start on an aligned boundary, the padding
+    // is part of the request buffer so it's safe to copy.
+    auto data = reinterpret_cast<const char*>(header);
+    mPending.insert(mPending.end(), data, data + size);
+    return true;
+}
+
+void Router::dropAwaitingAcks() {
+    for (const auto& awaiting : mAwaitingAcks) {
+        forget(awaiting.first, awaiting.second);
+    }
+    mAwaitingAcks.clear();
+}
+
+void Router::forget(uint32_t sequence, const AwaitingAck& awaiting) {
+    if (awaiting.cache == nullptr) {
+        return;
+    }
+    auto entry = awaiting.cache->find(awaiting.key);
+    // A later request may have refreshed the entry since, its own ack decides
+    if (entry != awaiting.cache->end() && entry->second.sequence == sequence) {
+        awaiting.cache->erase(entry);
+    }
 }
 
 bool Router::sendNetlinkMessage(const void* data, size_t size) {
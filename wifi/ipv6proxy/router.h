@@ -16,17 +16,38 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 
 #include <netinet/in.h>
 
+#include <map>
+#include <unordered_map>
+#include <vector>
+
 #include "socket.h"
 
+struct nlmsghdr;
+
+// Installs routes and neighbor proxy entries in the kernel over netlink.
+//
+// Neighbor discovery traffic tends to ask for the same routes and neighbors
+// over and over. The router remembers what it has installed and only sends
+// requests for entries that are new, have changed or have not been refreshed
+// in a while. Requests are not sent right away, they are queued and sent
+// together in a single netlink datagram by flush(). The kernel acknowledges
+// each request and the acknowledgements are read when the socket becomes
+// readable, a failed request is removed from the cache so that it's retried
+// the next time it's needed.
 class Router {
 public:
     // Initialize the router, this has to be called before any other methods can
     // be called. It only needs to be called once.
     bool init();
 
+    // The netlink socket, poll this for input and call receiveAcks when there
+    // is something to read.
+    int fd() const { return mSocket.get(); }
+
     // Indicate that |address| is a neighbor to this node and that it is
     // accessible on the interface with index |interfaceIndex|.
     bool addNeighbor(const struct in6_addr& address, uint32_t interfaceIndex);
@@ -43,10 +64,67 @@ public:
     // address.
     bool setDefaultGateway(const struct in6_addr& address,
                            unsigned int interfaceIndex);
+
+    // Send all queued requests to the kernel. Call this once per iteration of
+    // the poll loop, after all received packets have been handled.
+    void flush();
+
+    // Read acknowledgements for previously sent requests and forget about
+    // entries that the kernel refused to install.
+    void receiveAcks();
+
 private:
+    // Identifies a cached entry. For routes |value| is the prefix length and
+    // for neighbors it's the interface index.
+    struct Key {
+        struct in6_addr address;
+        uint32_t value;
+
+        bool operator<(const Key& other) const {
+            int diff = memcmp(&address, &other.address, sizeof(address));
+            return diff < 0 || (diff == 0 && value < other.value);
+        }
+    };
+    struct Entry {
+        uint32_t interfaceIndex;
+        // When the entry should be sent to the kernel again, in milliseconds
+        // on the monotonic clock.
+        uint64_t refreshAt;
+        // The sequence number of the last request sent for the entry
+        uint32_t sequence;
+    };
+    using Cache = std::map<Key, Entry>;
+
+    // Returns true if |key| is cached for |interfaceIndex| and doesn't need to
+    // be refreshed. Otherwise updates the cache and returns false.
+    bool isCached(Cache* cache, const Key& key, uint32_t interfaceIndex);
+    // Queue a request, |cache| and |key| identify the entry it installs so
+    // that it can be removed from the cache if the request fails. |cache| is
+    // null for requests that are not cached.
+    bool queueNetlinkMessage(struct nlmsghdr* header,
+                             Cache* cache,
+                             const Key& key);
     bool sendNetlinkMessage(const void* data, size_t size);
+    // Forget about every request that hasn't been acknowledged yet, removing
+    // its entry from the cache.
+    void dropAwaitingAcks();
+
+    struct AwaitingAck {
+        Cache* cache;
+        Key key;
+    };
+    // Remove the entry that the request with |sequence| installs from the
+    // cache, unless a later request has been queued for it.
+    void forget(uint32_t sequence, const AwaitingAck& awaiting);
 
     // Netlink socket for setting up neighbors and routes
     Socket mSocket;
+    Cache mRoutes;
+    Cache mNeighbors;
+    // Requests waiting to be sent by flush
+    std::vector<char> mPending;
+    // Requests that have been queued or sent but not acknowledged, by
+    // sequence number
+    std::unordered_map<uint32_t, AwaitingAck> mAwaitingAcks;
+    uint32_t mSequence = 0;
 };
-
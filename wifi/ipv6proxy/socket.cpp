@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <string.h>
 
+#include <linux/filter.h>
 #include <linux/in6.h>
 #include <net/ethernet.h>
 #include <netinet/in.h>
@@ -26,9 +27,14 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "address.h"
 #include "message.h"
 
+// The largest number of packets sent or received in one system call
+static const size_t kMaxBatchSize = 32;
+
 Socket::Socket() : mState(State::New), mSocket(-1) {
 }
 
@@ -110,6 +116,20 @@ Result Socket::setTransparent(bool transparent) {
     return res == -1 ? Result::error(strerror(errno)) : Result::success();
 }
 
+Result Socket::attachFilter(const struct sock_filter* filter, size_t count) {
+    if (mState != State::Open) {
+        return Result::error("attempting to set option in invalid state");
+    }
+    struct sock_fprog program;
+    program.len = static_cast<unsigned short>(count);
+    // The kernel copies the program, it won't be modified
+    program.filter = const_cast<struct sock_filter*>(filter);
+    int res = ::setsockopt(mSocket, SOL_SOCKET, SO_ATTACH_FILTER,
+                           &program, sizeof(program));
+
+    return res == -1 ? Result::error(strerror(errno)) : Result::success();
+}
+
 Result Socket::bind(const Address& address) {
     if (mState != State::Open) {
         return Result::error("bind called on socket in invalid state");
@@ -172,6 +192,42 @@ Result Socket::receiveFrom(Message* receivingMessage, Address* from) {
     return Result::success();
 }
 
+Result Socket::receiveBatch(Message* receivingMessages,
+                            size_t count,
+                            size_t* received) {
+    if (receivingMessages == nullptr || received == nullptr) {
+        return Result::error("No receivingMessages provided");
+    }
+    if (mState != State::Bound) {
+        return Result::error("Attempt to receive on a socket that isn't bound");
+    }
+    *received = 0;
+    count = std::min(count, kMaxBatchSize);
+
+    struct iovec iovs[kMaxBatchSize];
+    struct mmsghdr headers[kMaxBatchSize];
+    memset(headers, 0, sizeof(headers[0]) * count);
+    for (size_t i = 0; i < count; ++i) {
+        iovs[i].iov_base = receivingMessages[i].data();
+        iovs[i].iov_len = receivingMessages[i].capacity();
+        headers[i].msg_hdr.msg_iov = &iovs[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int res = ::recvmmsg(mSocket, headers, count, MSG_DONTWAIT, nullptr);
+    if (res < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return Result::success();
+        }
+        return Result::error(strerror(errno));
+    }
+    for (int i = 0; i < res; ++i) {
+        receivingMessages[i].setSize(headers[i].msg_len);
+    }
+    *received = static_cast<size_t>(res);
+    return Result::success();
+}
+
 Result Socket::send(const void* data, size_t size) {
     if (mState != State::Bound && mState != State::Open) {
         return Result::error("Attempt to send on a socket in invalid state");
@@ -255,6 +311,65 @@ Result Socket::sendFrom(const struct in6_addr& fromAddress,
     return Result::success();
 }
 
+Result Socket::sendBatch(const OutgoingPacket* packets, size_t count) {
+    if (mState != State::Bound && mState != State::Open) {
+        return Result::error("Attempt to send on a socket in invalid state");
+    }
+
+    struct Storage {
+        struct sockaddr_in6 destination;
+        struct iovec iov;
+        char control[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+    } storage[kMaxBatchSize];
+    struct mmsghdr headers[kMaxBatchSize];
+
+    int lastError = 0;
+    while (count > 0) {
+        size_t batch = std::min(count, kMaxBatchSize);
+        memset(storage, 0, sizeof(storage[0]) * batch);
+        memset(headers, 0, sizeof(headers[0]) * batch);
+        for (size_t i = 0; i < batch; ++i) {
+            const OutgoingPacket& packet = packets[i];
+            struct msghdr& header = headers[i].msg_hdr;
+
+            storage[i].destination.sin6_family = AF_INET6;
+            storage[i].destination.sin6_addr = packet.destination;
+            header.msg_name = &storage[i].destination;
+            header.msg_namelen = sizeof(storage[i].destination);
+
+            storage[i].iov.iov_base = const_cast<char*>(packet.data.data());
+            storage[i].iov.iov_len = packet.data.size();
+            header.msg_iov = &storage[i].iov;
+            header.msg_iovlen = 1;
+
+            if (packet.spoofSource) {
+                header.msg_control = storage[i].control;
+                header.msg_controllen = sizeof(storage[i].control);
+                struct cmsghdr* controlHeader = CMSG_FIRSTHDR(&header);
+                controlHeader->cmsg_level = IPPROTO_IPV6;
+                controlHeader->cmsg_type = IPV6_PKTINFO;
+                controlHeader->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+                auto packetInfo = reinterpret_cast<struct in6_pktinfo*>(
+                        CMSG_DATA(controlHeader));
+                packetInfo->ipi6_addr = packet.source;
+            }
+        }
+
+        int sent = ::sendmmsg(mSocket, headers, batch, 0);
+        if (sent <= 0) {
+            // The first packet could not be sent, skip it and keep going
+            lastError = errno;
+            sent = 1;
+        }
+        packets += sent;
+        count -= sent;
+    }
+    if (lastError != 0) {
+        return Result::error(strerror(lastError));
+    }
+    return Result::success();
+}
+
 Result Socket::sendFrom(const in6_addr& fromAddress,
                         const in6_addr& destination,
                         const void* data,
@@ -21,9 +21,21 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 class Address;
 class Message;
+struct sock_filter;
+
+// A packet waiting to be sent by Socket::sendBatch
+struct OutgoingPacket {
+    struct in6_addr destination;
+    // The source address to use if |spoofSource| is true, otherwise the
+    // source address is picked by the system.
+    struct in6_addr source;
+    bool spoofSource;
+    std::vector<char> data;
+};
 
 class Socket {
 public:
@@ -84,6 +96,10 @@ public:
     // address.
     Result setTransparent(bool transparent);
 
+    // Attach a classic BPF program of |count| instructions to the socket.
+    // Only packets accepted by the program are received.
+    Result attachFilter(const struct sock_filter* filter, size_t count);
+
     /** Binding **/
 
     Result bind(const Address& address);
@@ -92,6 +108,12 @@ public:
 
     Result receive(Message* receivingMessage);
     Result receiveFrom(Message* receivingMessage, Address* from);
+    // Receive up to |count| packets into |receivingMessages| in a single
+    // system call without waiting. The number of packets received is stored
+    // in |received|, this is zero if nothing was available.
+    Result receiveBatch(Message* receivingMessages,
+                        size_t count,
+                        size_t* received);
 
     Result send(const void* data, size_t size);
 
@@ -136,6 +158,10 @@ public:
                         data,
                         size);
     }
+    // Send |count| |packets| to their IPv6 destinations using as few system
+    // calls as possible. A packet that can't be sent doesn't prevent the
+    // remaining packets from being sent but an error is returned.
+    Result sendBatch(const OutgoingPacket* packets, size_t count);
 
 private:
     // No copy construction or assignment allowed, support move semantics only
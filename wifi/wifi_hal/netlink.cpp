@@ -25,11 +25,38 @@
 #include <linux/netlink.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <thread>
+
 static const size_t kControlRead = 0;
 static const size_t kControlWrite = 1;
 
+// The size of each receive buffer. Multipart replies are split by the kernel
+// into datagrams that fit the receiver's buffer, up to 32KiB.
+static const size_t kReceiveBufferSize = 32 * 1024;
+// The number of datagrams received per system call
+static const size_t kReceiveBatchSize = 8;
+
+// The kernel answers route requests right away, a request without a reply
+// after this long lost it and its handler slot can be reused.
+static const int64_t kReplyTimeoutMs = 5000;
+
+// Handler slot states. A free slot can be claimed by a sender. A ready slot
+// holds a handler that's waiting for replies. A slot is busy while one thread
+// is reading or modifying it, other threads spin until it's free or ready
+// again.
+static const uint32_t kSlotFree = 0;
+static const uint32_t kSlotBusy = 1;
+static const uint32_t kSlotReady = 2;
+
+static int64_t nowMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
 static void closeIfOpen(int* fd) {
     if (*fd != -1) {
         ::close(*fd);
@@ -39,9 +66,15 @@ static void closeIfOpen(int* fd) {
 
 Netlink::Netlink()
     : mNextSequenceNumber(1)
-    , mSocket(-1) {
+    , mSocket(-1)
+    , mSending(false) {
     mControlPipe[kControlRead] = -1;
     mControlPipe[kControlWrite] = -1;
+    for (auto& slot : mHandlers) {
+        slot.state.store(kSlotFree, std::memory_order_relaxed);
+        slot.sequence = 0;
+        slot.sentMs = 0;
+    }
 }
 
 Netlink::~Netlink() {
@@ -79,6 +112,7 @@ bool Netlink::init() {
         return false;
     }
 
+    mReceiveBuffer.resize(kReceiveBufferSize * kReceiveBatchSize);
     return true;
 }
 
@@ -120,7 +154,7 @@ bool Netlink::eventLoop() {
                 continue;
             }
             if (fd.fd == mSocket) {
-                readNetlinkMessage(fd.fd);
+                readNetlinkMessages(fd.fd);
             } else if (fd.fd == mControlPipe[kControlRead]) {
                 if (readControlMessage()) {
                     // Make a copy of the stop handler while holding the lock
@@ -154,74 +188,150 @@ uint32_t Netlink::getSequenceNumber() {
 
 bool Netlink::sendMessage(const NetlinkMessage& message,
                           ReplyHandler handler) {
-    // Keep lock the entire time so that we can safely erase the handler
-    // without worrying about another call to sendAsync adding a handler that
-    // shouldn't be deleted.
-    std::unique_lock<std::mutex> lock(mHandlersMutex);
+    uint32_t sequence = message.sequence();
     // Register handler before sending in case the read thread picks up the
     // response between the send thread sending and registering the handler.
-    mHandlers[message.sequence()] = handler;
-    for (;;) {
-        int bytesSent = ::send(mSocket, message.data(), message.size(), 0);
-        if (bytesSent > 0 && static_cast<size_t>(bytesSent) == message.size()) {
-            return true;
-        }
-        if (bytesSent < 0 && errno == EINTR) {
-            // We need to try again, keep the mutex locked
-            continue;
-        }
-        // It's a failure, remove the handler and unlock the mutex
-        mHandlers.erase(message.sequence());
-        lock.unlock();
+    if (!addHandler(sequence, std::move(handler))) {
+        ALOGE("Too many netlink requests waiting for replies, not sending "
+              "sequence %u", sequence);
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(mSendMutex);
+    if (!mSendBatch) {
+        mSendBatch = std::make_shared<SendBatch>();
+    }
+    std::shared_ptr<SendBatch> batch = mSendBatch;
+    batch->data.insert(batch->data.end(),
+                       message.data(), message.data() + message.size());
+    batch->sequences.push_back(sequence);
+
+    // If another thread is sending wait for it, whatever is queued in the
+    // meantime is sent together once it's done. Either that batch includes
+    // this message or this thread gets to send it.
+    while (mSending && !batch->done) {
+        mSendCondition.wait(lock);
+    }
+    if (batch->done) {
+        return batch->success;
+    }
 
+    mSending = true;
+    mSendBatch.reset();
+    lock.unlock();
+
+    // All messages go out in a single datagram, the kernel processes them
+    // one by one.
+    int bytesSent;
+    do {
+        bytesSent = ::send(mSocket, batch->data.data(), batch->data.size(), 0);
+    } while (bytesSent < 0 && errno == EINTR);
+    bool success = bytesSent >= 0 &&
+                   static_cast<size_t>(bytesSent) == batch->data.size();
+    if (!success) {
         if (bytesSent < 0) {
-            ALOGE("Failed to send netlink message: %s", strerror(errno));
+            ALOGE("Failed to send %zu netlink messages: %s",
+                  batch->sequences.size(), strerror(errno));
+        }
+        // None of these will get a reply, remove their handlers
+        for (uint32_t failed : batch->sequences) {
+            takeHandler(failed, true);
         }
-        return false;
     }
+
+    lock.lock();
+    batch->done = true;
+    batch->success = success;
+    mSending = false;
+    lock.unlock();
+    mSendCondition.notify_all();
+    return success;
 }
 
-bool Netlink::readNetlinkMessage(int fd) {
-    char buffer[8 * 1024];
+bool Netlink::readNetlinkMessages(int fd) {
+    struct iovec iovs[kReceiveBatchSize];
+    struct mmsghdr headers[kReceiveBatchSize];
     for (;;) {
-        int bytesReceived = ::recv(fd, buffer, sizeof(buffer), 0);
-        if (bytesReceived < 0) {
+        memset(headers, 0, sizeof(headers));
+        for (size_t i = 0; i < kReceiveBatchSize; ++i) {
+            iovs[i].iov_base = &mReceiveBuffer[i * kReceiveBufferSize];
+            iovs[i].iov_len = kReceiveBufferSize;
+            headers[i].msg_hdr.msg_iov = &iovs[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+        // Keep receiving until there is nothing left. Reading part of a
+        // multipart reply makes the kernel queue the next part right away so
+        // this drains an entire dump in one go.
+        int received = ::recvmmsg(fd, headers, kReceiveBatchSize,
+                                  MSG_DONTWAIT, nullptr);
+        if (received < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            ALOGE("recv failed to receive on netlink socket: %s",
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno == ENOBUFS) {
+                // The socket buffer overflowed and messages were dropped,
+                // any request could have lost its reply. The socket keeps
+                // working, so drop the handlers and keep reading.
+                ALOGE("netlink socket overflowed, dropping reply handlers");
+                clearHandlers();
+                continue;
+            }
+            ALOGE("recvmmsg failed to receive on netlink socket: %s",
                   strerror(errno));
             return false;
         }
-        char* data = buffer;
-        char* end = data + bytesReceived;
-        while (data < end) {
-            if (data + sizeof(nlmsghdr) > end) {
-                ALOGE("received invalid netlink message, too small for header");
-                return false;
-            }
-            auto header = reinterpret_cast<nlmsghdr*>(data);
-            if (data + header->nlmsg_len > end) {
-                ALOGE("received invalid netlink message, too small for data");
-                return false;
-            }
-
-            if (header->nlmsg_type == NLMSG_ERROR) {
-                if (data + NLMSG_HDRLEN + sizeof(nlmsgerr) <= end) {
-                    auto err = reinterpret_cast<nlmsgerr*>(NLMSG_DATA(header));
-                    ALOGE("Receive netlink error message: %s, sequence %u",
-                          strerror(-err->error), header->nlmsg_seq);
-                } else {
-                    ALOGE("Received netlink error code but no error message");
-                }
-                return false;
+        for (int i = 0; i < received; ++i) {
+            if (headers[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                ALOGE("received truncated netlink message");
+                continue;
             }
+            handleMessages(static_cast<const char*>(iovs[i].iov_base),
+                           headers[i].msg_len);
+        }
+        if (static_cast<size_t>(received) < kReceiveBatchSize) {
+            return true;
+        }
+    }
+}
 
-            notifyHandler(data, header->nlmsg_len);
+void Netlink::handleMessages(const char* data, size_t size) {
+    const char* end = data + size;
+    while (data < end) {
+        if (data + sizeof(nlmsghdr) > end) {
+            ALOGE("received invalid netlink message, too small for header");
+            return;
+        }
+        auto header = reinterpret_cast<const nlmsghdr*>(data);
+        if (header->nlmsg_len < sizeof(nlmsghdr) ||
+            data + header->nlmsg_len > end) {
+            ALOGE("received invalid netlink message, too small for data");
+            return;
+        }
 
-            data += header->nlmsg_len;
+        if (header->nlmsg_type == NLMSG_ERROR) {
+            if (data + NLMSG_HDRLEN + sizeof(nlmsgerr) <= end) {
+                auto err = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(header));
+                ALOGE("Receive netlink error message: %s, sequence %u",
+                      strerror(-err->error), header->nlmsg_seq);
+            } else {
+                ALOGE("Received netlink error code but no error message");
+            }
+            // There will be no reply to this request
+            takeHandler(header->nlmsg_seq, true);
+        } else if (header->nlmsg_type == NLMSG_DONE) {
+            // The end of a multipart reply
+            takeHandler(header->nlmsg_seq, true);
+        } else {
+            // Parts of a multipart reply keep the handler around until the
+            // final NLMSG_DONE message.
+            bool lastReply = (header->nlmsg_flags & NLM_F_MULTI) == 0;
+            notifyHandler(data, header->nlmsg_len, lastReply);
         }
-        return true;
+
+        data += NLMSG_ALIGN(header->nlmsg_len);
     }
 }
 
@@ -245,21 +355,95 @@ bool Netlink::readControlMessage() {
 }
 
 
-void Netlink::notifyHandler(const char* data, size_t size) {
+void Netlink::notifyHandler(const char* data, size_t size, bool lastReply) {
     NetlinkMessage message(data, size);
 
-    ReplyHandler replyHandler;
-    {
-        std::unique_lock<std::mutex> lock(mHandlersMutex);
-        auto handler = mHandlers.find(message.sequence());
-        if (handler == mHandlers.end()) {
-            // No handler found, ignore message
-            return;
+    ReplyHandler replyHandler = takeHandler(message.sequence(), lastReply);
+    if (!replyHandler) {
+        // No handler found, ignore message
+        return;
+    }
+    replyHandler(message);
+}
+
+bool Netlink::addHandler(uint32_t sequence, ReplyHandler handler) {
+    HandlerSlot& slot = mHandlers[sequence % kHandlerSlots];
+    for (;;) {
+        uint32_t state = kSlotFree;
+        if (slot.state.compare_exchange_weak(state, kSlotBusy,
+                                             std::memory_order_acquire)) {
+            break;
         }
-        replyHandler = handler->second;
-        mHandlers.erase(handler);
+        if (state == kSlotReady) {
+            // The request kHandlerSlots requests ago still holds the slot,
+            // take it over only if that request's reply is overdue.
+            if (!slot.state.compare_exchange_weak(state, kSlotBusy,
+                                                  std::memory_order_acquire)) {
+                continue;
+            }
+            int64_t now = nowMs();
+            if (now - slot.sentMs < kReplyTimeoutMs) {
+                slot.state.store(kSlotReady, std::memory_order_release);
+                return false;
+            }
+            ALOGW("No reply to netlink sequence %u after %lld ms, dropping it",
+                  slot.sequence,
+                  static_cast<long long>(now - slot.sentMs));
+            break;
+        }
+        std::this_thread::yield();
     }
+    slot.sequence = sequence;
+    slot.sentMs = nowMs();
+    slot.handler = std::move(handler);
+    slot.state.store(kSlotReady, std::memory_order_release);
+    return true;
+}
 
-    replyHandler(message);
+Netlink::ReplyHandler Netlink::takeHandler(uint32_t sequence, bool remove) {
+    HandlerSlot& slot = mHandlers[sequence % kHandlerSlots];
+    for (;;) {
+        uint32_t state = kSlotReady;
+        if (slot.state.compare_exchange_weak(state, kSlotBusy,
+                                             std::memory_order_acquire)) {
+            break;
+        }
+        if (state == kSlotFree) {
+            return ReplyHandler();
+        }
+        std::this_thread::yield();
+    }
+    if (slot.sequence != sequence) {
+        // The slot belongs to another request
+        slot.state.store(kSlotReady, std::memory_order_release);
+        return ReplyHandler();
+    }
+    ReplyHandler handler;
+    if (remove) {
+        handler = std::move(slot.handler);
+        slot.handler = nullptr;
+        slot.state.store(kSlotFree, std::memory_order_release);
+    } else {
+        handler = slot.handler;
+        slot.state.store(kSlotReady, std::memory_order_release);
+    }
+    return handler;
 }
 
+void Netlink::clearHandlers() {
+    for (auto& slot : mHandlers) {
+        for (;;) {
+            uint32_t state = kSlotReady;
+            if (slot.state.compare_exchange_weak(state, kSlotBusy,
+                                                 std::memory_order_acquire)) {
+                slot.handler = nullptr;
+                slot.state.store(kSlotFree, std::memory_order_release);
+                break;
+            }
+            if (state == kSlotFree) {
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+}
@@ -16,11 +16,14 @@
 
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <condition_variable>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <stdint.h>
-#include <unordered_map>
+#include <vector>
 
 class NetlinkMessage;
 
@@ -38,22 +41,68 @@ public:
 
     uint32_t getSequenceNumber();
 
+    // Send |message| and call |handler| from the event loop for each reply.
+    // Messages sent from several threads at the same time are combined and
+    // sent to the kernel together. Returns false if the message could not be
+    // sent, in that case |handler| is never called.
     bool sendMessage(const NetlinkMessage& message, ReplyHandler handler);
 private:
     Netlink(const Netlink&) = delete;
     Netlink& operator=(const Netlink&) = delete;
 
-    bool readNetlinkMessage(int fd);
+    bool readNetlinkMessages(int fd);
     bool readControlMessage();
 
-    void notifyHandler(const char* data, size_t size);
+    void handleMessages(const char* data, size_t size);
+    void notifyHandler(const char* data, size_t size, bool lastReply);
+
+    // Store |handler| for replies to |sequence|. A request that still holds
+    // the slot for |sequence| is dropped if its reply is overdue. Returns
+    // false if the slot is taken by a request that can still get a reply.
+    bool addHandler(uint32_t sequence, ReplyHandler handler);
+    // Get the handler for replies to |sequence|. If |remove| is true the
+    // handler is also removed, no more replies are expected. Returns an empty
+    // handler if there is none.
+    ReplyHandler takeHandler(uint32_t sequence, bool remove);
+    // Remove all handlers, used when replies may have been lost.
+    void clearHandlers();
+
+    // A reply handler slot. Replies are looked up on the event loop thread
+    // while requests are sent from other threads. Each slot is guarded by a
+    // spin lock in its atomic state instead of one mutex for all of them, so
+    // the two sides only wait for each other when they use the same slot.
+    struct HandlerSlot {
+        std::atomic<uint32_t> state;
+        uint32_t sequence;
+        // When the request was sent, in CLOCK_MONOTONIC milliseconds
+        int64_t sentMs;
+        ReplyHandler handler;
+    };
+    // The number of requests that can wait for a reply at the same time.
+    // Sequence numbers map to slots by their value modulo this.
+    static const size_t kHandlerSlots = 64;
 
     std::atomic<uint32_t> mNextSequenceNumber;
     int mSocket;
     int mControlPipe[2];
-    // Map sequence number to reply handler
-    std::unordered_map<uint32_t, ReplyHandler> mHandlers;
-    std::mutex mHandlersMutex;
+    std::array<HandlerSlot, kHandlerSlots> mHandlers;
+    // Messages sent together and the result of sending them, shared by all
+    // the threads that queued a message in it.
+    struct SendBatch {
+        std::vector<uint8_t> data;
+        std::vector<uint32_t> sequences;
+        bool done = false;
+        bool success = false;
+    };
+    // Messages queued while another thread is sending. When that thread is
+    // done one of the waiting threads sends the whole batch and the others
+    // wait for its result.
+    std::mutex mSendMutex;
+    std::condition_variable mSendCondition;
+    std::shared_ptr<SendBatch> mSendBatch;
+    bool mSending;
+    // Receive buffers for recvmmsg, allocated once in init
+    std::vector<char> mReceiveBuffer;
     std::mutex mStopHandlerMutex;
     StopHandler mStopHandler;
 };